@@ -145,6 +145,8 @@ void print_cpuinfo(void)
 	else
 		printk("Invariant TSC not present\n");
 	cpuid(0x07, 0x0, &eax, &ebx, &ecx, &edx);
+	if (ebx & (1 << 19))
+		cpu_set_feat(CPU_FEAT_X86_ADX);
 	if (ebx & 0x00000001) {
 		printk("FS/GS Base RD/W supported\n");
 		cpu_set_feat(CPU_FEAT_X86_FSGSBASE);
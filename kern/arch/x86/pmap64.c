@@ -530,6 +530,81 @@ int env_user_mem_walk(struct proc *p, void *start, size_t len,
 	                   trampoline_cb, &local_tp);
 }
 
+/* Like env_user_mem_walk(), but only runs callback on the jumbo PTEs in
+ * [start, start + len), mapped or not.  For now, these are PML2 (JPGSIZE)
+ * jumbos, and only when a VMR asked for them with MAP_JUMBO. */
+int env_user_jumbo_walk(struct proc *p, void *start, size_t len,
+                        mem_walk_callback_t callback, void *arg)
+{
+	struct tramp_package {
+		struct proc *p;
+		mem_walk_callback_t cb;
+		void *cb_arg;
+	};
+	int trampoline_cb(kpte_t *kpte, uintptr_t kva, int shift, bool visited_subs,
+	                  void *data)
+	{
+		struct tramp_package *tp = (struct tramp_package*)data;
+
+		if ((shift != JPGSHIFT) || !kpte_is_jumbo(kpte))
+			return 0;
+		return tp->cb(tp->p, kpte, (void*)kva, tp->cb_arg);
+	}
+
+	struct tramp_package local_tp;
+	local_tp.p = p;
+	local_tp.cb = callback;
+	local_tp.cb_arg = arg;
+	return pml_for_each(pgdir_get_kpt(p->env_pgdir), (uintptr_t)start, len,
+	                   trampoline_cb, &local_tp);
+}
+
+/* Maps a JPGSIZE jumbo page at va -> pa, both of which must be JPGSIZE aligned.
+ * Returns -EEXIST if there's already a jumbo mapped at va and -EBUSY if va
+ * already has a page table for regular pages.  We don't free an empty page
+ * table to make room: other cores could have it in their paging-structure
+ * caches, and we'd need a shootdown first.  Hold the process's pte_lock. */
+int pgdir_map_jumbo(pgdir_t pgdir, uintptr_t va, physaddr_t pa, int perm)
+{
+	kpte_t *kpte;
+
+	assert(!JPGOFF(va) && !JPGOFF(pa));
+	kpte = pml_walk(pgdir_get_kpt(pgdir), va, PG_WALK_CREATE | JPGSHIFT);
+	if (!kpte)
+		return -ENOMEM;
+	if (kpte_is_jumbo(kpte))
+		return -EEXIST;
+	if (kpte_is_present(kpte))
+		return -EBUSY;
+	pte_write(kpte, pa, perm | PTE_PS);
+	return 0;
+}
+
+/* If va is mapped by a jumbo, replaces the jumbo with a page table of regular
+ * PTEs for the same memory, keeping the jumbo's settings.  Returns TRUE if we
+ * split a jumbo.  The TLB may still hold the jumbo translation, which is
+ * harmless since the mapping hasn't changed.  Hold the process's pte_lock. */
+bool pgdir_split_jumbo(pgdir_t pgdir, uintptr_t va)
+{
+	kpte_t *kpte, *new_pml;
+	physaddr_t pa;
+	int settings;
+
+	kpte = pml_walk(pgdir_get_kpt(pgdir), va, JPGSHIFT);
+	if (!kpte || !kpte_is_jumbo(kpte))
+		return FALSE;
+	pa = kpte_get_paddr(kpte);
+	/* PTE_PS in a PML1 PTE is the PAT bit */
+	settings = kpte_get_settings(kpte) & ~PTE_PS;
+	new_pml = kpages_zalloc(2 * PGSIZE, MEM_WAIT);
+	for (int i = 0; i < NPTENTRIES; i++)
+		pte_write(&new_pml[i], pa + i * PGSIZE, settings);
+	/* Same intermediate perms as __pml_walk() */
+	*kpte = PADDR(new_pml) | PTE_P | PTE_U | PTE_W;
+	*kpte_to_epte(kpte) = (PADDR(new_pml) + PGSIZE) | EPTE_R | EPTE_X | EPTE_W;
+	return TRUE;
+}
+
 /* Frees (decrefs) all pages of the process's page table, including the page
  * directory.  Does not free the memory that is actually mapped. */
 void env_pagetable_free(struct proc *p)
@@ -268,6 +268,12 @@ typedef struct x86_pgdir {
 /* This is used in places (procinfo) meaning "size of smallest jumbo page" */
 #define PTSIZE PML2_PTE_REACH
 
+/* The jumbo pages used to back user memory (MAP_JUMBO) */
+#define JPGSHIFT		PML2_SHIFT
+#define JPGSIZE			PML2_PTE_REACH
+#define JPGOFF(la)		((uintptr_t)(la) & (JPGSIZE - 1))
+#define NR_PGS_PER_JPG	(JPGSIZE / PGSIZE)
+
 /* Page table/directory entry flags. */
 
 /* Some things to be careful of:  Global and PAT only apply to the last PTE in
@@ -9,6 +9,7 @@
 #include <string.h>
 #include <ns.h>
 #include <acpi.h>
+#include <page_alloc.h>
 #include <arch/arch.h>
 #include <arch/apic.h>
 #include <arch/topology.h>
@@ -93,6 +94,56 @@ static int find_numa_domain(int apic_id)
 	return -1;
 }
 
+/* Maps a raw SRAT proximity domain to the numa_id that adjust_ids() gave the
+ * domain's cores, which is what the page allocator gets from core_list.
+ * Memory-only domains get the ids after the last one with cores, in the order
+ * we first see them. */
+static int srat_dom_to_numa_id(int dom, int *memonly_doms, int *nr_memonly)
+{
+	int os_coreid;
+
+	for (int i = 0; i < srat->nchildren; i++) {
+		struct Srat *temp = srat->children[i]->tbl;
+
+		if (temp == NULL || temp->type != SRlapic || temp->lapic.dom != dom)
+			continue;
+		if (temp->lapic.apic > max_apic_id)
+			continue;
+		os_coreid = os_coreid_lookup[temp->lapic.apic];
+		if (os_coreid != -1)
+			return core_list[os_coreid].numa_id;
+	}
+	for (int i = 0; i < *nr_memonly; i++) {
+		if (memonly_doms[i] == dom)
+			return num_numa + i;
+	}
+	if (*nr_memonly == MAX_NUMA_NODES)
+		return -1;
+	memonly_doms[*nr_memonly] = dom;
+	return num_numa + (*nr_memonly)++;
+}
+
+/* Hands the SRAT's memory affinity ranges to the page allocator.  Must run
+ * after the core_list's numa_ids are set. */
+static void set_numa_mem_ranges(void)
+{
+	int memonly_doms[MAX_NUMA_NODES];
+	int nr_memonly = 0;
+
+	if (srat == NULL)
+		return;
+
+	for (int i = 0; i < srat->nchildren; i++) {
+		struct Srat *temp = srat->children[i]->tbl;
+
+		if (temp != NULL && temp->type == SRmem && temp->mem.len)
+			numa_add_mem_range(srat_dom_to_numa_id(temp->mem.dom,
+			                                       memonly_doms, &nr_memonly),
+			                   temp->mem.addr,
+			                   temp->mem.addr + temp->mem.len);
+	}
+}
+
 /* Figure out the maximum number of cores we actually have and set it in our
  * cpu_topology_info struct. */
 static void set_num_cores(void)
@@ -359,10 +410,12 @@ void topology_init(void)
 	/* BIOSes are not strictly required to put NUMA information
 	 * into the ACPI table. If there is no information the safest
 	 * thing to do is assume it's a non-NUMA system, i.e. flat. */
-	if (cpu_bits && get_num_numa())
+	if (cpu_bits && get_num_numa()) {
 		build_topology(core_bits, cpu_bits);
-	else
+		set_numa_mem_ranges();
+	} else {
 		build_flat_topology();
+	}
 }
 
 void print_cpu_topology()
@@ -406,8 +406,13 @@ static int etheroq(struct ether *ether, struct block *bp)
 
 	ether->outpackets++;
 
-	if (!(ether->feat & NETF_SG))
-		bp = linearizeblock(bp);
+	if (!(ether->feat & NETF_SG)) {
+		/* if we're checksumming in software anyway, do it as we copy */
+		if (bp->flag & BCKSUM_FLAGS & ~ether->feat)
+			bp = linearizeblock_csum(bp);
+		else
+			bp = linearizeblock(bp);
+	}
 	ptclcsum_finalize(bp, ether->feat);
 	/*
 	 * Check if the packet has to be placed back onto the input queue,
@@ -13,6 +13,7 @@
 #include <error.h>
 #include <syscall.h>
 #include <sys/queue.h>
+#include <page_alloc.h>
 
 struct dev mem_devtab;
 
@@ -27,6 +28,7 @@ enum {
 	Qslab_stats,
 	Qfree,
 	Qkmemstat,
+	Qnuma,
 };
 
 static struct dirtab mem_dir[] = {
@@ -35,6 +37,7 @@ static struct dirtab mem_dir[] = {
 	{"slab_stats", {Qslab_stats, 0, QTFILE}, 0, 0444},
 	{"free", {Qfree, 0, QTFILE}, 0, 0444},
 	{"kmemstat", {Qkmemstat, 0, QTFILE}, 0, 0444},
+	{"numa", {Qnuma, 0, QTFILE}, 0, 0444},
 };
 
 static struct chan *mem_attach(char *spec)
@@ -215,7 +218,13 @@ static size_t fetch_slab_stats(struct kmem_cache *kc, struct sized_alloc *sza,
 	                  "Nr empty mags: %d\n", kc->depot.nr_empty);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  "Nr non-empty mags: %d\n", kc->depot.nr_not_empty);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Working set: empty [%d, %d], non-empty [%d, %d]\n",
+	                  kc->depot.min_empty, kc->depot.max_empty,
+	                  kc->depot.min_not_empty, kc->depot.max_not_empty);
 	spin_unlock_irqsave(&kc->depot.lock);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Reclaimed: %llu\n", kc->nr_reclaimed_bytes);
 	return sofar;
 }
 
@@ -262,6 +271,46 @@ static struct sized_alloc *build_free(void)
 	return sza;
 }
 
+/* Per-node memory.  Used is what the node's arena has handed out, and free is
+ * the rest of the node's memory, though some of that may have been allocated
+ * from kpages_arena, before or without NUMA. */
+static struct sized_alloc *build_numa(void)
+{
+	struct sized_alloc *sza;
+	struct numa_node *nn;
+	size_t sofar = 0;
+	size_t amt_used;
+
+	sza = sized_kzmalloc(100 + 300 * MAX_NUMA_NODES, MEM_WAIT);
+	if (!nr_numa_nodes) {
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "No NUMA arenas\n");
+		return sza;
+	}
+	for (int i = 0; i < nr_numa_nodes; i++) {
+		nn = &numa_nodes[i];
+		if (!nn->kpages)
+			continue;
+		amt_used = arena_amt_total(nn->kpages) - arena_amt_free(nn->kpages);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "Node %d\n", i);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "\tTotal Memory : %15llu\n", nn->amt_present);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "\tUsed Memory  : %15llu\n", amt_used);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "\tFree Memory  : %15llu\n",
+		                  nn->amt_present - amt_used);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "\tLocal allocs : %15llu\n", nn->nr_local_allocs);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "\tRemote allocs: %15llu\n", nn->nr_remote_allocs);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "\tFallbacks    : %15llu\n", nn->nr_fallbacks);
+	}
+	return sza;
+}
+
 #define KMEMSTAT_NAME			30
 #define KMEMSTAT_OBJSIZE		8
 #define KMEMSTAT_TOTAL			15
@@ -390,6 +439,9 @@ static struct chan *mem_open(struct chan *c, int omode)
 	case Qkmemstat:
 		c->synth_buf = build_kmemstat();
 		break;
+	case Qnuma:
+		c->synth_buf = build_numa();
+		break;
 	}
 	c->mode = openmode(omode);
 	c->flag |= COPEN;
@@ -406,6 +458,7 @@ static void mem_close(struct chan *c)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qnuma:
 		kfree(c->synth_buf);
 		break;
 	}
@@ -423,6 +476,7 @@ static long mem_read(struct chan *c, void *ubuf, long n, int64_t offset)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qnuma:
 		sza = c->synth_buf;
 		return readmem(offset, ubuf, n, sza->buf, sza->size);
 	default:
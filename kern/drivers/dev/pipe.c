@@ -401,6 +401,7 @@ static long pipewrite(struct chan *c, void *va, long n, int64_t ignored)
 	ERRSTACK(1);
 	Pipe *p;
 	struct cmdbuf *cb;
+	struct event_queue *ev_q;
 
 	p = c->aux;
 
@@ -418,6 +419,15 @@ static long pipewrite(struct chan *c, void *va, long n, int64_t ignored)
 				q_toggle_qcoalesce(p->q[0], TRUE);
 				q_toggle_qmsg(p->q[1], TRUE);
 				q_toggle_qcoalesce(p->q[1], TRUE);
+			} else if (strcmp(cb->f[0], "zerocopy") == 0) {
+				if (cb->nf < 2)
+					error(EFAIL, "zerocopy needs an event_queue or 'off'");
+				if (strcmp(cb->f[1], "off") == 0)
+					ev_q = NULL;
+				else
+					ev_q = (struct event_queue*)strtoul(cb->f[1], 0, 0);
+				q_zerocopy(p->q[0], ev_q);
+				q_zerocopy(p->q[1], ev_q);
 			} else {
 				error(EFAIL, "unknown control request");
 			}
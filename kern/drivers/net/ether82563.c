@@ -506,6 +506,7 @@ enum {
 	 */
 	Ntd = 32,					/* power of two >= 8 */
 	Nrd = 128,	/* power of two >= 8 */
+	Nrdbulk = 16,	/* rx buffers allocated at a time by replenish */
 	Rbalign = 16,
 	Slop = 32,	/* for vlan headers, crcs, etc. */
 };
@@ -1111,27 +1112,38 @@ static void i82563transmit(struct ether *edev)
 static void i82563replenish(struct ctlr *ctlr)
 {
 	struct rd *rd;
-	int rdt;
-	struct block *bp;
+	int rdt, i, nr_want, nr_got;
+	struct block *bps[Nrdbulk];
 
 	rdt = ctlr->rdt;
 	while (NEXT_RING(rdt, Nrd) != ctlr->rdh) {
-		rd = &ctlr->rdba[rdt];
-		if (ctlr->rb[rdt] != NULL) {
+		/* Count the empty slots we can fill with one bulk alloc */
+		nr_want = 0;
+		for (i = rdt; NEXT_RING(i, Nrd) != ctlr->rdh && nr_want < Nrdbulk;
+		     i = NEXT_RING(i, Nrd)) {
+			if (ctlr->rb[i] != NULL)
+				break;
+			nr_want++;
+		}
+		if (!nr_want) {
 			printd("#l%d: 82563: rx overrun\n", ctlr->edev->ctlrno);
 			break;
 		}
-		bp = block_alloc(ctlr->rbsz + Slop + Rbalign, MEM_ATOMIC);
-		if (bp == NULL) {
+		nr_got = block_alloc_bulk(bps, nr_want, ctlr->rbsz + Slop + Rbalign,
+		                          MEM_ATOMIC);
+		for (i = 0; i < nr_got; i++) {
+			rd = &ctlr->rdba[rdt];
+			ctlr->rb[rdt] = bps[i];
+			rd->addr[0] = paddr_low32(bps[i]->rp);
+			rd->addr[1] = paddr_high32(bps[i]->rp);
+			rd->status = 0;
+			ctlr->rdfree++;
+			rdt = NEXT_RING(rdt, Nrd);
+		}
+		if (nr_got < nr_want) {
 			warn_once("OOM, trying to survive");
 			break;
 		}
-		ctlr->rb[rdt] = bp;
-		rd->addr[0] = paddr_low32(bp->rp);
-		rd->addr[1] = paddr_high32(bp->rp);
-		rd->status = 0;
-		ctlr->rdfree++;
-		rdt = NEXT_RING(rdt, Nrd);
 	}
 	if (ctlr->rdt != rdt) {
 		ctlr->rdt = rdt;
@@ -602,6 +602,7 @@ static void dump_packet(struct mlx4_en_priv *priv,
 static void recv_packet(struct mlx4_en_priv *priv,
 			struct mlx4_en_rx_desc *rx_desc,
 			struct mlx4_en_rx_alloc *frags,
+			struct mlx4_cqe *cqe,
 			unsigned int length)
 {
 	struct block *block;
@@ -620,6 +621,12 @@ static void recv_packet(struct mlx4_en_priv *priv,
 	memcpy(block->wp, va, length);
 	block->wp += length;
 
+	/* With more than one ring, the QP does RSS and reports the hash. */
+	if (priv->rx_ring_num > 1) {
+		block->rx_hash = be32_to_cpu(cqe->immed_rss_invalid);
+		block->flag |= Brxhash;
+	}
+
 	etheriq(priv->dev, block, 1 /* fromwire */);
 }
 
@@ -934,7 +941,7 @@ int mlx4_en_process_rx_cq(struct ether *dev, struct mlx4_en_cq *cq,
 		printd("length %d ring %p bytes %d packets %d ip_summed %d\n",
 		       length, ring, ring->bytes, ring->packets, ip_summed);
 		//dump_packet(priv, rx_desc, frags, length);
-		recv_packet(priv, rx_desc, frags, length);
+		recv_packet(priv, rx_desc, frags, cqe, length);
 		goto next;
 
 #if 0 // AKAROS_PORT
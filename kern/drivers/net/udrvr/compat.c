@@ -118,6 +118,9 @@ int get_user_page(struct proc *p, unsigned long uvastart, int write, int force,
 		pte_write(pte, page2pa(pp), prot);
 	} else {
 		pp = pa2page(pte_get_paddr(pte));
+		/* A MAP_JUMBO mapping, find our page within the jumbo */
+		if (pte_is_jumbo(pte))
+			pp += (JPGOFF(uvastart) >> PGSHIFT);
 
 		/* __vmr_free_pgs() refcnt's pagemap pages differently */
 		if (atomic_read(&pp->pg_flags) & PG_PAGEMAP) {
@@ -63,6 +63,7 @@
 #include <ros/common.h>
 #include <sys/queue.h>
 #include <kthread.h>
+#include <rbtree.h>
 
 /* These structures allow code to defer work for a certain amount of time.
  * Timer chains (like off a per-core timer) are made of lists/trees of these. */
@@ -74,23 +75,26 @@ struct alarm_waiter {
 		                  struct hw_trapframe *hw_tf);
 	};
 	void						*data;
-	TAILQ_ENTRY(alarm_waiter)	next;
+	struct rb_node				node;
 	bool						on_tchain;
 	bool						irq_ok;
 	bool						holds_tchain_lock;
 	bool						rkm_pending;
 	struct cond_var				rkm_cv;
 };
-TAILQ_HEAD(awaiters_tailq, alarm_waiter);		/* ideally not a LL */
-
 typedef void (*alarm_handler)(struct alarm_waiter *waiter);
 
 /* One of these per alarm source, such as a per-core timer.  All tchains come
  * with a lock, even if its rarely needed (like the pcpu tchains).
- * set_interrupt() is a method for setting the interrupt source. */
+ * set_interrupt() is a method for setting the interrupt source.
+ *
+ * The waiters are in an rbtree sorted by wake_up_time, with ties in the order
+ * they were set.  We cache the leftmost node, since that's what the interrupt
+ * handler wants. */
 struct timer_chain {
 	spinlock_t					lock;
-	struct awaiters_tailq		waiters;
+	struct rb_root				waiters;
+	struct rb_node				*leftmost;
 	uint64_t					earliest_time;
 	uint64_t					latest_time;
 	void (*set_interrupt)(struct timer_chain *);
@@ -42,6 +42,10 @@ BSD_LIST_HEAD(btag_list, btag);
 /* 64 is the most powers of two we can express with 64 bits. */
 #define ARENA_NR_FREE_LISTS		64
 #define ARENA_NAME_SZ			32
+/* Base arenas poke the slab reclaimer below 1/32 free, and won't poke again
+ * until they've been back above 1/8 free. */
+#define ARENA_LOW_WATER_SHIFT	5
+#define ARENA_HIGH_WATER_SHIFT	3
 
 /* Forward declarations of import lists */
 struct arena;
@@ -56,6 +60,7 @@ struct arena {
 	spinlock_t					lock;
 	uint8_t						import_scale;
 	bool						is_base;
+	bool						low_water;		/* poked, not back to high */
 	size_t						quantum;
 	size_t						qcache_max;
 	struct kmem_cache			*qcaches;
@@ -15,11 +15,25 @@
 #include <syscall.h>
 #include <error.h>
 
-extern struct proc_list arsc_proc_list;
-extern spinlock_t arsc_proc_lock;
+#include <rendez.h>
+
+/* One per dedicated ARSC core.  The stats are only written by the server. */
+struct arsc_server {
+	spinlock_t					lock;
+	struct proc_list			procs;
+	int							nr_procs;
+	struct rendez				rv;
+	int							coreid;
+	uint64_t					nr_polls;		/* passes over all procs */
+	uint64_t					nr_busy_polls;	/* passes that found work */
+	uint64_t					nr_ring_polls;	/* rings that had work */
+	uint64_t					nr_calls;
+	uint64_t					nr_sleeps;
+	uint64_t					depth_sum;
+	uint64_t					max_depth;
+};
 
 syscall_sring_t* sys_init_arsc(struct proc* p);
 intreg_t syscall_async(struct proc* p, syscall_req_t *syscall);
-void arsc_server(uint32_t srcid, long a0, long a1, long a2);
-
-static intreg_t process_generic_syscalls(struct proc* p, size_t max);
+void arsc_server_init(int nr);
+void print_arsc_stats(void);
@@ -11,6 +11,7 @@
 #include <slab.h>
 #include <pagemap.h>
 #include <kthread.h>
+#include <sys/queue.h>
 
 /* All block IO is done assuming a certain size sector, which is the smallest
  * possible unit of transfer between the kernel and the block layer.  This can
@@ -20,8 +21,47 @@
 #define SECTOR_SZ_LOG 9
 #define SECTOR_SZ (1 << SECTOR_SZ_LOG)
 
+struct block_device;
+struct block_request;
+TAILQ_HEAD(breq_tailq, block_request);
+
+/* Request queue for a block device.  Submitted requests go to the elevator,
+ * which picks the order they are dispatched to the driver.  At most
+ * max_inflight requests are out at the driver at a time (e.g. the number of NCQ
+ * tags); the rest wait in the elevator.
+ *
+ * The histograms are log2 buckets: depth_hist[i] counts submissions that saw
+ * [2^i, 2^(i+1)) requests in the queue (including themselves), lat_hist[i]
+ * counts requests that took [2^i, 2^(i+1)) usec from submit to completion. */
+#define BDEV_NR_HIST_BUCKETS 16
+struct bdev_queue {
+	spinlock_t					lock;
+	struct breq_tailq			reqs;				/* owned by the elevator */
+	struct bdev_elevator		*elevator;
+	unsigned int				nr_queued;
+	unsigned int				nr_inflight;
+	unsigned int				max_inflight;
+	bool						dispatching;
+	uint64_t					nr_reqs;
+	uint64_t					nr_merges;			/* BHs merged into another */
+	uint64_t					depth_hist[BDEV_NR_HIST_BUCKETS];
+	uint64_t					lat_hist[BDEV_NR_HIST_BUCKETS];
+};
+
+/* Elevators (IO schedulers).  add_req puts a request on q->reqs, next_req takes
+ * the next one to dispatch off.  Both are called with the queue lock held. */
+struct bdev_elevator {
+	char						*name;
+	void (*add_req)(struct bdev_queue *q, struct block_request *breq);
+	struct block_request *(*next_req)(struct bdev_queue *q);
+};
+
 /* Every block device is represented by one of these, with custom methods, as
- * applicable for the type of device.  Subject to massive changes. */
+ * applicable for the type of device.  Subject to massive changes.
+ *
+ * b_submit starts the IO for a request.  The driver calls
+ * bdev_complete_request() when it is done, which can be from within b_submit
+ * (e.g. RAM disks) or from an IRQ. */
 #define BDEV_INLINE_NAME 10
 struct block_device {
 	int							b_id;
@@ -31,10 +71,8 @@ struct block_device {
 	struct page_map				b_pm;
 	void						*b_data;			/* dev-specific use */
 	char						b_name[BDEV_INLINE_NAME];
-	// TODO: list or something of buffer heads (?)
-	// list of outstanding requests
-	// io scheduler
-	// callbacks for completion
+	struct bdev_queue			b_queue;
+	int (*b_submit)(struct block_device *bdev, struct block_request *breq);
 };
 
 /* So far, only NEEDS_ZEROED is used */
@@ -74,7 +112,6 @@ void bdev_put_buffer(struct buffer_head *bh);
  * another array of BH pointers if you want more.  The BHs do not need to be
  * linked or otherwise associated with a page mapping. */
 #define NR_INLINE_BH (PGSIZE >> SECTOR_SZ_LOG)
-struct block_request;
 struct block_request {
 	unsigned int				flags;
 	void						(*callback)(struct block_request *breq);
@@ -83,6 +120,10 @@ struct block_request {
 	struct buffer_head			**bhs;				/* BHs describing the IOs */
 	unsigned int				nr_bhs;
 	struct buffer_head			*local_bhs[NR_INLINE_BH];
+	/* Used by the block layer */
+	TAILQ_ENTRY(block_request)	link;
+	unsigned long				sector;				/* of the first BH */
+	uint64_t					submit_tsc;
 };
 struct kmem_cache *breq_kcache;	/* for the block requests */
 
@@ -93,6 +134,14 @@ struct kmem_cache *breq_kcache;	/* for the block requests */
 void block_init(void);
 struct block_device *get_bdev(char *path);
 void free_bhs(struct page *page);
+void bdev_init_queue(struct block_device *bdev,
+                     int (*submit)(struct block_device *, struct block_request *),
+                     unsigned int max_inflight);
 int bdev_submit_request(struct block_device *bdev, struct block_request *breq);
+void bdev_complete_request(struct block_device *bdev,
+                           struct block_request *breq);
+int breq_next_segment(struct block_request *breq, int idx,
+                      unsigned long *sector, void **buf,
+                      unsigned int *nr_sector);
 void generic_breq_done(struct block_request *breq);
 void sleep_on_breq(struct block_request *breq);
@@ -13,3 +13,5 @@
 #include <process.h>
 
 void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg);
+void send_ceq_msgs(struct ceq *ceq, struct proc *p, struct event_msg *msgs,
+                   size_t nr);
@@ -0,0 +1,22 @@
+deps_config := \
+	kern/src/ktest/Kconfig.userspace \
+	kern/src/ktest/Kconfig.net \
+	kern/src/ktest/Kconfig.postboot \
+	kern/src/ktest/Kconfig.kernel \
+	kern/src/ktest/Kconfig \
+	kern/lib/Kconfig \
+	kern/drivers/dev/Kconfig \
+	kern/drivers/net/Kconfig \
+	kern/drivers/Kconfig \
+	kern/src/net/Kconfig \
+	kern/arch/x86/Kconfig \
+	Kconfig
+
+include/config/auto.conf: \
+	$(deps_config)
+
+ifneq "$(ARCH)" "x86"
+include/config/auto.conf: FORCE
+endif
+
+$(deps_config): ;
@@ -11,6 +11,8 @@
 #include <arch/topology.h>
 #if defined(CONFIG_COREALLOC_FCFS)
   #include <corealloc_fcfs.h>
+#elif defined(CONFIG_COREALLOC_PACKED)
+  #include <corealloc_packed.h>
 #endif
 
 /* Initialize any data assocaited with doing core allocation. */
@@ -72,6 +74,10 @@ void print_proc_coreprov(struct proc *p);
 /* Print the processes attached to each provisioned core. */
 void print_coreprov_map(void);
 
+/* Print how well p's allocated cores are packed: how many sockets and NUMA
+ * nodes they span, and how many share a physical core. */
+void print_proc_core_placement(struct proc *p);
+
 static inline struct proc *get_alloc_proc(uint32_t pcoreid)
 {
 	extern struct sched_pcore *all_pcores;
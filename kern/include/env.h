@@ -83,7 +83,11 @@ struct proc {
 	spinlock_t vmr_lock;		/* Protects VMR tree (mem mgmt) */
 	spinlock_t pte_lock;		/* Protects page tables (mem mgmt) */
 	struct vmr_tailq vm_regions;
+	struct rb_root vm_root;		/* same VMRs as vm_regions, for lookups */
+	struct vm_region *vmr_hint[NR_VMR_HINTS];
 	int vmr_history;
+	unsigned long nr_jumbo_maps;	/* jumbos mapped for MAP_JUMBO VMRs */
+	unsigned long nr_jumbo_fallbacks;	/* MAP_JUMBO maps that got a page */
 
 	// Per process info and data pages
  	procinfo_t *procinfo;       // KVA of per-process shared info table (RO)
@@ -136,6 +140,7 @@ void	env_pagetable_free(env_t* e);
 
 typedef int (*mem_walk_callback_t)(env_t* e, pte_t pte, void* va, void* arg);
 int		env_user_mem_walk(env_t* e, void* start, size_t len, mem_walk_callback_t callback, void* arg);
+int		env_user_jumbo_walk(env_t* e, void* start, size_t len, mem_walk_callback_t callback, void* arg);
 
 static inline void set_traced_proc(struct proc *p, bool traced)
 {
@@ -0,0 +1,21 @@
+/*
+ *
+ * Automatically generated file; DO NOT EDIT.
+ * Akaros/x86 Kernel Configuration
+ *
+ */
+#define CONFIG_KFS 1
+#define CONFIG_X86 1
+#define CONFIG_ZLIB_INFLATE 1
+#define CONFIG_COREALLOC_FCFS 1
+#define CONFIG_REGRESS 1
+#define CONFIG_NETWORKING 1
+#define CONFIG_KFS_CPIO_BIN ""
+#define CONFIG_KFS_PATHS "kern/kfs"
+#define CONFIG_ZLIB_DEFLATE 1
+#define CONFIG_DEVVARS 1
+#define CONFIG_X86_64 1
+#define CONFIG_BLOCK_EXTRAS 1
+#define CONFIG_NOMTRRS 1
+#define CONFIG_64BIT 1
+#define CONFIG_LARGE_KSTACKS 1
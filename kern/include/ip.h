@@ -77,6 +77,23 @@ enum {
  *  one per conversation directory
  */
 struct Proto;
+enum {
+	IPmatchexact = 0,	/* match on 4 tuple */
+	IPmatchany,	/* *!* */
+	IPmatchport,	/* *!port */
+	IPmatchaddr,	/* addr!* */
+	IPmatchpa,	/* addr!port */
+};
+
+/* a conv's entry in its proto's Ipht */
+struct Iphash {
+	struct Iphash *next;
+	struct conv *c;
+	int match;
+	bool hashed;
+	uint32_t hv;				/* hash of the tuple when added */
+};
+
 struct conv {
 	qlock_t qlock;
 
@@ -131,6 +148,8 @@ struct conv {
 
 	struct route *r;			/* last route used */
 	uint32_t rgen;				/* routetable generation for *r */
+
+	struct Iphash ht;			/* entry in the proto's Ipht */
 };
 
 struct Ipifc;
@@ -173,7 +192,11 @@ struct medium {
 	/* v6 address generation */
 	void (*pref2addr) (uint8_t * pref, uint8_t * ea);
 
+	/* medium specific statistics, appended to ipifc's stats */
+	int (*stats) (struct Ipifc * ifc, char *buf, int len);
+
 	int unbindonclose;			/* if non-zero, unbind on last close */
+	int gso;					/* bwrite segments v4 Btso blocks itself */
 };
 
 /* logical interface associated with a physical one */
@@ -262,32 +285,40 @@ struct Ipmulti {
 };
 
 /*
- *  hash table for 2 ip addresses + 2 ports
+ *  hash tables for 2 ip addresses + 2 ports.
+ *
+ *  connected conversations go in a resizable table hashed on the full 4-tuple,
+ *  announced ones in a fixed listen table hashed on the local port.  lookups
+ *  take no locks: the entries live in the convs (which are never freed),
+ *  replaced tables are kept around, and readers retry if a writer ran.
+ *
+ *  a zeroed Ipht is ready to use.
  */
 enum {
-	Nipht = 521,				/* convenient prime */
-
-	IPmatchexact = 0,	/* match on 4 tuple */
-	IPmatchany,	/* *!* */
-	IPmatchport,	/* *!port */
-	IPmatchaddr,	/* addr!* */
-	IPmatchpa,	/* addr!port */
+	Niphtmin = 512,				/* initial size of the exact table */
+	Niphtmax = 1 << 20,			/* it won't grow past this */
+	Niplisten = 521,			/* convenient prime */
 };
-struct Iphash {
-	struct Iphash *next;
-	struct conv *c;
-	int match;
+
+struct Iphtab {
+	struct Iphtab *retired;		/* smaller tables we replaced */
+	uint32_t mask;
+	struct Iphash *tab[];
 };
 
-struct Iphash;
 struct Ipht {
-	spinlock_t lock;
-	struct Iphash *tab[Nipht];
+	seqlock_t seq;				/* writers lock, readers check the ctr */
+	struct Iphtab *exact;
+	unsigned int nr_exact;
+	unsigned int nr_listen;
+	unsigned int nr_grow;
+	struct Iphash *listen[Niplisten];
 };
 void iphtadd(struct Ipht *, struct conv *);
 void iphtrem(struct Ipht *, struct conv *);
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 					  uint16_t dp);
+char *iphtstats(struct Ipht *ht, char *p, char *e);
 void dump_ipht(struct Ipht *ht);
 
 /*
@@ -652,6 +683,19 @@ extern void ipifc_trace_block(struct Ipifc *ifc, struct block *bp);
 extern long ipselftabread(struct Fs *, char *a, uint32_t offset, int n);
 extern void ipsendra6(struct Fs *f, int on);
 
+/*
+ *  software receive offload: merges in-order TCP segments of one flow into a
+ *  single block, using extra_data, before they go up the stack.  one per input
+ *  context (e.g. an rxq), not locked, and used with the ifc rlocked.
+ */
+struct ipgro {
+	struct block *head;			/* the merged packet, or 0 */
+	uint32_t next_seq;			/* seq of the next in-order segment */
+	uint16_t seg_len;			/* payload length of each segment */
+	uint16_t nr_segs;
+	uint64_t start;				/* tsc when head arrived */
+};
+
 /*
  *  ip.c
  */
@@ -670,7 +714,21 @@ extern int ipoput4(struct Fs *,
 extern int ipoput6(struct Fs *,
 				   struct block *, int unused_int, int, int, struct conv *);
 extern int ipstats(struct Fs *, char *unused_char_p_t, int);
+extern void ipgro_receive(struct Fs *f, struct Ipifc *ifc, struct ipgro *gro,
+                          struct block *bp);
+extern void ipgro_flush(struct Fs *f, struct Ipifc *ifc, struct ipgro *gro);
+struct tcp_cc_sim;
+extern struct tcp_cc_sim *tcp_cc_sim_alloc(char *cc_name, uint32_t mss,
+                                           uint32_t rtt_ms);
+extern void tcp_cc_sim_free(struct tcp_cc_sim *sim);
+extern uint64_t tcp_cc_sim_sendable(struct tcp_cc_sim *sim, uint64_t in_flight,
+                                    bool pacing);
+extern void tcp_cc_sim_ack(struct tcp_cc_sim *sim, uint32_t acked,
+                           uint64_t now);
+extern void tcp_cc_sim_loss(struct tcp_cc_sim *sim);
+extern void tcp_cc_sim_set_rtt(struct tcp_cc_sim *sim, uint32_t rtt_ms);
 extern uint16_t ptclbsum(uint8_t * unused_uint8_p_t, int);
+extern uint16_t ptclbsum_copy(uint8_t *dst, uint8_t *src, int len);
 extern uint16_t ptclcsum(struct block *, int unused_int, int);
 extern void ip_init(struct Fs *);
 extern void update_mtucache(uint8_t * unused_uint8_p_t, uint32_t);
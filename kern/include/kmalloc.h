@@ -10,6 +10,8 @@
 #include <ros/common.h>
 #include <kref.h>
 
+struct kmem_cache;
+
 #define NUM_KMALLOC_CACHES 6
 #define KMALLOC_ALIGNMENT 16
 #define KMALLOC_SMALLEST (sizeof(struct kmalloc_tag) << 1)
@@ -17,6 +19,9 @@
 
 void kmalloc_init(void);
 void *kmalloc(size_t size, int flags);
+void *kmalloc_from_cache(struct kmem_cache *kc, int flags);
+size_t kmalloc_from_cache_bulk(struct kmem_cache *kc, void **bufs, size_t nr,
+                               int flags);
 void *kmalloc_array(size_t nmemb, size_t size, int flags);
 void *kzmalloc(size_t size, int flags);
 void *kmalloc_align(size_t size, int flags, size_t align);
@@ -34,6 +39,13 @@ void *debug_canary;
 #define MEM_ERROR				(1 << 3)
 #define MEM_FLAGS (MEM_ATOMIC | MEM_WAIT | MEM_ERROR)
 
+/* Ask for memory from a specific NUMA node, instead of the caller's node.  Only
+ * page allocations (kpages_alloc() and big kmallocs) honor this.  If the node is
+ * out of memory, we'll still fall back to other nodes. */
+#define MEM_NODE_SHIFT			16
+#define MEM_NODE_MASK			(0xff << MEM_NODE_SHIFT)
+#define MEM_NODE(n)				((((n) + 1) & 0xff) << MEM_NODE_SHIFT)
+
 /* Kmalloc tag flags looks like this:
  *
  * +--------------28---------------+-----4------+
@@ -12,9 +12,11 @@
 #include <atomic.h>
 #include <sys/queue.h>
 #include <slab.h>
+#include <rbtree.h>
 
 struct file;
 struct proc;								/* preprocessor games */
+struct page;
 
 /* Basic structure defining a region of a process's virtual memory.  Note we
  * don't refcnt these.  Either they are in the TAILQ/tree, or they should be
@@ -23,6 +25,7 @@ struct proc;								/* preprocessor games */
  * VMRs. */
 struct vm_region {
 	TAILQ_ENTRY(vm_region)		vm_link;
+	struct rb_node				vm_rb;		/* in p->vm_root, keyed by vm_base */
 	TAILQ_ENTRY(vm_region)		vm_pm_link;
 	struct proc					*vm_proc;	/* owning process, for now */
 	uintptr_t					vm_base;
@@ -34,6 +37,10 @@ struct vm_region {
 };
 TAILQ_HEAD(vmr_tailq, vm_region);			/* Declares 'struct vmr_tailq' */
 
+/* Each proc caches the last VMR found by find_vmr(), one slot per core (modulo
+ * the number of slots).  Protected by the vmr_lock, like the rest of the VMRs. */
+#define NR_VMR_HINTS 8
+
 /* VM Region Management Functions.  For now, these just maintain themselves -
  * anything related to mapping needs to be done by the caller. */
 void vmr_init(void);
@@ -68,6 +75,7 @@ int munmap(struct proc *p, uintptr_t addr, size_t len);
 int handle_page_fault(struct proc *p, uintptr_t va, int prot);
 int handle_page_fault_nofile(struct proc *p, uintptr_t va, int prot);
 unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs);
+int pin_user_pages(struct proc *p, void *uva, size_t len, struct page **pages);
 
 /* These assume the mm_lock is held already */
 int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot);
@@ -364,6 +364,7 @@ enum {
 	Btcpck = (1 << NS_TCPCK_SHIFT),	/* tcp checksum */
 	Bpktck = (1 << NS_PKTCK_SHIFT),	/* packet checksum */
 	Btso = (1 << NS_TSO_SHIFT),	/* TSO */
+	Brxhash = (1 << 8),	/* rx_hash holds the NIC's RSS hash */
 };
 #define BCKSUM_FLAGS (Bipck|Budpck|Btcpck|Bpktck|Btso)
 
@@ -372,6 +373,8 @@ struct extra_bdata {
 	/* using u32s for packing reasons.  this means no extras > 4GB */
 	uint32_t off;
 	uint32_t len;
+	/* base is kmalloc'd, unless we hold this ref on it.  See ebd_put(). */
+	struct kref *ref;
 };
 
 struct block {
@@ -388,6 +391,7 @@ struct block {
 	uint16_t checksum_offset;		/* off from checksum_start to store csum */
 	uint16_t mss;               /* TCP MSS for TSO */
 	uint16_t transport_header_end;	/* off from start to headers end */
+	uint32_t rx_hash;			/* flow hash from the NIC, if Brxhash */
 	/* might want something to track the next free extra_data slot */
 	size_t extra_len;
 	unsigned int nr_extra_bufs;
@@ -653,10 +657,17 @@ struct cname *addelem(struct cname *, char *unused_char_p_t);
 void addprog(struct proc *);
 void addrootfile(char *unused_char_p_t, uint8_t * unused_uint8_p_t, uint32_t);
 struct block *adjustblock(struct block *, int);
+void block_alloc_init(void);
 struct block *block_alloc(size_t, int);
+size_t block_alloc_bulk(struct block **blocks, size_t nr, size_t size,
+                        int mem_flags);
 int block_add_extd(struct block *b, unsigned int nr_bufs, int mem_flags);
 int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
                        uint32_t len, int mem_flags);
+int block_append_extra_ref(struct block *b, uintptr_t base, uint32_t off,
+                           uint32_t len, struct kref *ref, int mem_flags);
+void ebd_get(struct extra_bdata *ebd);
+void ebd_put(struct extra_bdata *ebd);
 int anyhigher(void);
 int anyready(void);
 void _assert(char *unused_char_p_t);
@@ -685,6 +696,7 @@ int cmount(struct chan *, struct chan *, int unused_int, char *unused_char_p_t);
 void cnameclose(struct cname *);
 struct block *concatblock(struct block *);
 struct block *linearizeblock(struct block *b);
+struct block *linearizeblock_csum(struct block *b);
 void confinit(void);
 void cons_add_char(char c);
 void copen(struct chan *);
@@ -841,6 +853,7 @@ int qlen(struct queue *);
 size_t q_bytes_read(struct queue *q);
 void qdropoverflow(struct queue *, bool);
 void q_toggle_qmsg(struct queue *q, bool onoff);
+void q_zerocopy(struct queue *q, struct event_queue *ev_q);
 void q_toggle_qcoalesce(struct queue *q, bool onoff);
 struct queue *qopen(int unused_int, int, void (*)(void *), void *);
 ssize_t qpass(struct queue *, struct block *);
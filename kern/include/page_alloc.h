@@ -32,6 +32,7 @@ typedef BSD_LIST_ENTRY(page) page_list_entry_t;
 #define PG_BUFFER		0x008	/* is a buffer page, has BHs */
 #define PG_PAGEMAP		0x010	/* belongs to a page map */
 #define PG_REMOVAL		0x020	/* Working flag for page map removal */
+#define PG_JUMBO		0x040	/* part of a jumbo, see jumbo_page_alloc() */
 
 /* TODO: this struct is not protected from concurrent operations in some
  * functions.  If you want to lock on it, use the spinlock in the semaphore.
@@ -49,14 +50,42 @@ struct page {
 	uint64_t				gpa;		/* physical address in guest */
 
 	bool						pg_is_free;	/* TODO: will remove */
+	uint8_t						pg_numa_src;	/* 1 + node of its arena, or 0 */
+	atomic_t					pg_jumbo_refs;	/* jumbo head: PTEs using it */
+	atomic_t					pg_pins;	/* IO pointing at it, page_pin() */
 };
 
+/* Set in pg_pins when the page was freed while pinned.  The last unpin frees. */
+#define PG_PINS_ORPHAN			(1L << 31)
+
+/* NUMA nodes, each with its own kpages arena.  A node's arena imports from the
+ * base arena, restricted to the node's physical memory ranges (from the SRAT).
+ * Memory that isn't in any node's range is only reachable via kpages_arena. */
+#define MAX_NUMA_NODES			8
+#define MAX_NUMA_RANGES			8
+struct numa_node {
+	struct arena				*kpages;
+	int							nr_ranges;
+	struct {
+		physaddr_t				start;
+		physaddr_t				end;
+	} ranges[MAX_NUMA_RANGES];
+	size_t						amt_present;
+	uint64_t					nr_local_allocs;
+	uint64_t					nr_remote_allocs;	/* for another node */
+	uint64_t					nr_fallbacks;	/* wanted this node, got another */
+};
+extern struct numa_node numa_nodes[MAX_NUMA_NODES];
+extern int nr_numa_nodes;
+
 /******** Externally visible global variables ************/
 extern spinlock_t page_list_lock;
 extern page_list_t page_free_list;
 
 /*************** Functional Interface *******************/
 void base_arena_init(struct multiboot_info *mbi);
+void numa_add_mem_range(int node, physaddr_t start, physaddr_t end);
+void numa_arenas_init(void);
 
 error_t upage_alloc(struct proc *p, page_t **page, bool zero);
 error_t kpage_alloc(page_t **page);
@@ -73,6 +102,11 @@ void *get_cont_pages(size_t order, int flags);
 void free_cont_pages(void *buf, size_t order);
 
 void page_decref(page_t *page);
+void page_pin(struct page *page);
+void page_unpin(struct page *page);
+
+struct page *jumbo_page_alloc(void);
+void jumbo_page_split(struct page *head);
 
 int page_is_free(size_t ppn);
 void lock_page(struct page *page);
@@ -56,14 +56,21 @@ struct page_map_operations {
 	direct_io: bypass the page cache */
 };
 
+/* Radix tree tags for PM pages.  DIRTY tracks pages with PG_DIRTY set (set via
+ * pm_page_dirty()), and WRITEBACK marks pages with writepage() in flight. */
+#define PM_TAG_DIRTY			0
+#define PM_TAG_WRITEBACK		1
+
 /* Page cache functions */
 void pm_init(struct page_map *pm, struct page_map_operations *op, void *host);
 int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp);
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp);
 void pm_put_page(struct page *page);
+void pm_page_dirty(struct page *page);
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr);
 int pm_remove_contig(struct page_map *pm, unsigned long index,
                      unsigned long nr_pgs);
+int pm_writeback_pages(struct page_map *pm);
 void print_page_map_info(struct page_map *pm);
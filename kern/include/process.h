@@ -73,9 +73,6 @@ struct process_set {
 	struct proc **procs;
 };
 
-/* Can use a htable iterator to iterate through all active procs */
-extern struct hashtable *pid_hash;
-extern spinlock_t pid_hash_lock;
 
 /* Initialization */
 void proc_init(void);
@@ -87,6 +84,7 @@ void proc_init_procinfo(struct proc* p);
 void proc_init_procdata(struct proc* p);
 
 /* Process management: */
+void pid_for_each(void (*func)(struct proc *p, void *arg), void *arg);
 struct proc *pid_nth(unsigned int n);
 error_t proc_alloc(struct proc **pp, struct proc *parent, int flags);
 void __proc_ready(struct proc *p);
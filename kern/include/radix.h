@@ -9,22 +9,28 @@
  * handle more items.  It won't allow the insertion of existing keys, and it
  * can fail due to lack of memory.
  *
- * There are some utility functions, probably unimplemented til we need them,
- * that will make the tree have enough memory for future calls.
+ * radix_grow() and radix_preload() will make the tree have enough memory for
+ * future calls.
  *
- * You can also store a tag along with the void* for a given item, and do
- * lookups based on those tags.  Or you will be able to, once it is
- * implemented. */
+ * You can also store tags along with the void* for a given item, and do
+ * lookups based on those tags.  An interior node's tag bit for a slot is set
+ * if any item below that slot has the tag, so tagged lookups skip untagged
+ * subtrees. */
 
 #pragma once
 
 #define LOG_RNODE_SLOTS 6
 #define NR_RNODE_SLOTS (1 << LOG_RNODE_SLOTS)
+#define RADIX_NR_TAGS 2
+/* Enough levels to cover every unsigned long key */
+#define RADIX_MAX_DEPTH ((sizeof(unsigned long) * 8 + LOG_RNODE_SLOTS - 1) / \
+                         LOG_RNODE_SLOTS)
 
 #include <ros/common.h>
 
 struct radix_node {
 	void						*items[NR_RNODE_SLOTS];
+	uint64_t					tags[RADIX_NR_TAGS];	/* bit per slot */
 	unsigned int				num_items;
 	bool						leaf;
 	struct radix_node			*parent;
@@ -51,6 +57,9 @@ void *radix_lookup(struct radix_tree *tree, unsigned long key);
 void **radix_lookup_slot(struct radix_tree *tree, unsigned long key);
 int radix_gang_lookup(struct radix_tree *tree, void **results,
                       unsigned long first, unsigned int max_items);
+int radix_gang_lookup_slot(struct radix_tree *tree, void ***slots,
+                           unsigned long *keys, unsigned long first,
+                           unsigned int max_items);
 
 /* Memory management */
 int radix_grow(struct radix_tree *tree, unsigned long max);
@@ -63,6 +72,9 @@ int radix_tag_get(struct radix_tree *tree, unsigned long key, int tag);
 int radix_tree_tagged(struct radix_tree *tree, int tag);
 int radix_tag_gang_lookup(struct radix_tree *tree, void **results,
                           unsigned long first, unsigned int max_items, int tag);
+int radix_tag_gang_lookup_slot(struct radix_tree *tree, void ***slots,
+                               unsigned long *keys, unsigned long first,
+                               unsigned int max_items, int tag);
 
 /* Debugging */
 void print_radix_tree(struct radix_tree *tree);
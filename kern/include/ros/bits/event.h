@@ -34,6 +34,7 @@
 #define EV_SYSCALL				10
 #define EV_CHECK_MSGS			11
 #define EV_POSIX_SIGNAL			12
+#define EV_ZEROCOPY				13	/* buf arg3, len arg4 reusable; arg1 copied */
 #define NR_EVENT_TYPES			25 /* keep me last (and 1 > the last one) */
 
 /* Will probably have dynamic notifications later */
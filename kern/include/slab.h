@@ -45,6 +45,7 @@
 /* Cache creation flags: */
 #define KMC_NOTOUCH				0x0001	/* Can't use source/object's memory */
 #define KMC_QCACHE				0x0002	/* Cache is an arena's qcache */
+#define KMC_TYPESAFE			0x0004	/* Freed objs stay objs of this type */
 #define __KMC_USE_BUFCTL		0x1000	/* Internal use */
 
 struct kmem_magazine {
@@ -71,6 +72,11 @@ struct kmem_depot {
 	unsigned int				nr_not_empty;
 	unsigned int				busy_count;
 	uint64_t					busy_start;
+	/* Working set: the range of nr_(not_)empty since the last reclaim */
+	unsigned int				min_empty;
+	unsigned int				max_empty;
+	unsigned int				min_not_empty;
+	unsigned int				max_not_empty;
 };
 
 struct kmem_slab;
@@ -117,6 +123,7 @@ struct kmem_cache {
 	void *priv;
 	unsigned long nr_cur_alloc;
 	unsigned long nr_direct_allocs_ever;
+	size_t nr_reclaimed_bytes;
 	struct hash_helper hh;
 	struct kmem_bufctl_list *alloc_hash;
 	struct kmem_bufctl_list static_hash[HASH_INIT_SZ];
@@ -136,10 +143,15 @@ struct kmem_cache *kmem_cache_create(const char *name, size_t obj_size,
 void kmem_cache_destroy(struct kmem_cache *cp);
 /* Front end: clients of caches use these */
 void *kmem_cache_alloc(struct kmem_cache *cp, int flags);
+size_t kmem_cache_alloc_bulk(struct kmem_cache *kc, void **objs, size_t nr,
+                             int flags);
 void kmem_cache_free(struct kmem_cache *cp, void *buf);
 /* Back end: internal functions */
 void kmem_cache_init(void);
-void kmem_cache_reap(struct kmem_cache *cp);
+size_t kmem_cache_reap(struct kmem_cache *cp);
+size_t kmem_cache_reclaim(struct kmem_cache *kc, bool all);
+void kmem_reclaim_init(void);
+void kmem_reclaim_poke(void);
 unsigned int kmc_nr_pcpu_caches(void);
 /* Low-level interface for initializing a cache. */
 void __kmem_cache_create(struct kmem_cache *kc, const char *name,
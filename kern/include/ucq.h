@@ -11,3 +11,5 @@
 #include <process.h>
 
 void send_ucq_msg(struct ucq *ucq, struct proc *p, struct event_msg *msg);
+void send_ucq_msgs(struct ucq *ucq, struct proc *p, struct event_msg *msgs,
+                   size_t nr);
@@ -275,6 +275,22 @@ struct dentry_operations {
 #define SEEK_CUR   1   /* Seek from current position.  */
 #define SEEK_END   2   /* Seek from end of file.  */
 
+/* Readahead window sizes, in pages */
+#define FILE_RA_INIT_PGS			4
+#define FILE_RA_MAX_PGS				32
+
+/* Per-file readahead state.  The window is [start, start + size), and once the
+ * reader gets within async_size pages of its end, we read the next window.  It
+ * is updated without a lock; racing readers just make the guesses worse. */
+struct file_ra_state {
+	unsigned long				start;
+	unsigned long				size;
+	unsigned long				async_size;
+	unsigned long				prev_idx;		/* last page the reader used */
+	unsigned long				nr_hits;		/* pages found in the PM */
+	unsigned long				nr_misses;		/* pages we had to wait on */
+};
+
 /* File: represents a file opened by a process. */
 struct file {
 	TAILQ_ENTRY(file)			f_list;			/* list of all files */
@@ -292,6 +308,7 @@ struct file {
 	spinlock_t					f_ep_lock;
 	void						*f_privdata;	/* tty/socket driver hook */
 	struct page_map				*f_mapping;		/* page cache mapping */
+	struct file_ra_state		f_ra;
 
 	/* Ghetto appserver support */
 	int fd; // all it contains is an appserver fd (for pid 0, aka kernel)
@@ -484,8 +501,11 @@ ssize_t generic_file_read(struct file *file, char *buf, size_t count,
                           off64_t *offset);
 ssize_t generic_file_write(struct file *file, const char *buf, size_t count,
                            off64_t *offset);
+int generic_file_fsync(struct file *file, struct dentry *dentry, int datasync);
 ssize_t generic_dir_read(struct file *file, char *u_buf, size_t count,
                          off64_t *offset);
+void file_readahead(struct file *file, unsigned long idx,
+                    unsigned long nr_pgs);
 struct file *alloc_file(void);
 struct file *do_file_open(char *path, int flags, int mode);
 int do_symlink(char *path, const char *symname, int mode);
@@ -19,19 +19,26 @@
 #include <stdio.h>
 #include <smp.h>
 #include <kmalloc.h>
+#include <rbtree.h>
 
-/* Helper, resets the earliest/latest times, based on the elements of the list.
- * If the list is empty, we set the times to be the 12345 poison time.  Since
- * the list is empty, the alarm shouldn't be going off. */
+#define awaiter_of(rb) rb_entry(rb, struct alarm_waiter, node)
+
+static bool __remove_awaiter(struct timer_chain *tchain,
+                             struct alarm_waiter *waiter);
+
+/* Helper, resets the earliest/latest times, based on the elements of the tree.
+ * If the tree is empty, we set the times to be the 12345 poison time.  Since
+ * the tree is empty, the alarm shouldn't be going off.  Callers must have
+ * already updated tchain->leftmost. */
 static void reset_tchain_times(struct timer_chain *tchain)
 {
-	if (TAILQ_EMPTY(&tchain->waiters)) {
+	if (!tchain->leftmost) {
 		tchain->earliest_time = ALARM_POISON_TIME;
 		tchain->latest_time = ALARM_POISON_TIME;
 	} else {
-		tchain->earliest_time = TAILQ_FIRST(&tchain->waiters)->wake_up_time;
+		tchain->earliest_time = awaiter_of(tchain->leftmost)->wake_up_time;
 		tchain->latest_time =
-		        TAILQ_LAST(&tchain->waiters, awaiters_tailq)->wake_up_time;
+		        awaiter_of(rb_last(&tchain->waiters))->wake_up_time;
 	}
 }
 
@@ -40,7 +47,8 @@ void init_timer_chain(struct timer_chain *tchain,
                       void (*set_interrupt)(struct timer_chain *))
 {
 	spinlock_init_irqsave(&tchain->lock);
-	TAILQ_INIT(&tchain->waiters);
+	tchain->waiters = RB_ROOT;
+	tchain->leftmost = NULL;
 	tchain->set_interrupt = set_interrupt;
 	reset_tchain_times(tchain);
 }
@@ -106,7 +114,7 @@ void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep)
 static void reset_tchain_interrupt(struct timer_chain *tchain)
 {
 	assert(!irq_is_enabled());
-	if (TAILQ_EMPTY(&tchain->waiters)) {
+	if (!tchain->leftmost) {
 		/* Turn it off */
 		printd("Turning alarm off\n");
 		tchain->set_interrupt(tchain);
@@ -154,34 +162,33 @@ static void wake_awaiter(struct alarm_waiter *waiter,
  * everyone whose time is up.  Called from IRQ context. */
 void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf)
 {
-	struct alarm_waiter *i, *temp;
+	struct alarm_waiter *i;
+	struct rb_node *node;
 	uint64_t now = read_tsc();
-	bool changed_list = FALSE;
+
 	/* why do we disable irqs here?  the lock is irqsave, but we (think we) know
 	 * the timer IRQ for this tchain won't fire again.  disabling irqs is nice
 	 * for the lock debugger.  i don't want to disable the debugger completely,
 	 * and we can't make the debugger ignore irq context code either in the
 	 * general case.  it might be nice for handlers to have IRQs disabled too.*/
 	spin_lock_irqsave(&tchain->lock);
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
+	/* Like the old list walk, we grab the next node before waking, so that a
+	 * handler that rearms for a time in the past lands behind us. */
+	node = tchain->leftmost;
+	while (node) {
+		i = awaiter_of(node);
 		printd("Trying to wake up %p who is due at %llu and now is %llu\n",
 		       i, i->wake_up_time, now);
 		/* TODO: Could also do something in cases where we're close to now */
-		if (i->wake_up_time <= now) {
-			changed_list = TRUE;
-			i->on_tchain = FALSE;
-			TAILQ_REMOVE(&tchain->waiters, i, next);
-			cmb();	/* enforce waking after removal */
-			/* Don't touch the waiter after waking it, since it could be in use
-			 * on another core (and the waiter can be clobbered as the kthread
-			 * unwinds its stack).  Or it could be kfreed */
-			wake_awaiter(i, hw_tf);
-		} else {
+		if (i->wake_up_time > now)
 			break;
-		}
-	}
-	if (changed_list) {
-		reset_tchain_times(tchain);
+		node = rb_next(node);
+		__remove_awaiter(tchain, i);
+		cmb();	/* enforce waking after removal */
+		/* Don't touch the waiter after waking it, since it could be in use
+		 * on another core (and the waiter can be clobbered as the kthread
+		 * unwinds its stack).  Or it could be kfreed */
+		wake_awaiter(i, hw_tf);
 	}
 	/* Need to reset the interrupt no matter what */
 	reset_tchain_interrupt(tchain);
@@ -193,45 +200,37 @@ void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf)
 static bool __insert_awaiter(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *i, *temp;
+	struct rb_node **link = &tchain->waiters.rb_node;
+	struct rb_node *parent = NULL;
+	bool leftmost = TRUE, rightmost = TRUE;
+
 	/* This will fail if you don't set a time */
 	assert(waiter->wake_up_time != ALARM_POISON_TIME);
 	assert(!waiter->on_tchain);
 	waiter->on_tchain = TRUE;
-	/* Either the list is empty, or not. */
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = waiter->wake_up_time;
-		tchain->latest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Need to turn on the timer interrupt later */
-		return TRUE;
+	/* Ties go to the right, so alarms with the same time fire in the order
+	 * they were set. */
+	while (*link) {
+		parent = *link;
+		if (waiter->wake_up_time < awaiter_of(parent)->wake_up_time) {
+			link = &parent->rb_left;
+			rightmost = FALSE;
+		} else {
+			link = &parent->rb_right;
+			leftmost = FALSE;
+		}
 	}
-	/* If not, either we're first, last, or in the middle.  Reset the interrupt
-	 * and adjust the tchain's times accordingly. */
-	if (waiter->wake_up_time < tchain->earliest_time) {
+	rb_link_node(&waiter->node, parent, link);
+	rb_insert_color(&waiter->node, &tchain->waiters);
+	if (rightmost)
+		tchain->latest_time = waiter->wake_up_time;
+	if (leftmost) {
+		tchain->leftmost = &waiter->node;
 		tchain->earliest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
 		/* Changed the first entry; we'll need to reset the interrupt later */
 		return TRUE;
 	}
-	/* If there is a tie for last, the newer one will really go last.  We need
-	 * to handle equality here since the loop later won't catch it. */
-	if (waiter->wake_up_time >= tchain->latest_time) {
-		tchain->latest_time = waiter->wake_up_time;
-		/* Proactively put it at the end if we know we're last */
-		TAILQ_INSERT_TAIL(&tchain->waiters, waiter, next);
-		return FALSE;
-	}
-	/* Insert before the first one you are earlier than.  This won't scale well
-	 * (TODO) if we have a lot of inserts.  The proactive insert_tail up above
-	 * will help a bit. */
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		if (waiter->wake_up_time < i->wake_up_time) {
-			TAILQ_INSERT_BEFORE(i, waiter, next);
-			return FALSE;
-		}
-	}
-	panic("Could not find a spot for awaiter %p\n", waiter);
+	return FALSE;
 }
 
 static void __set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
@@ -278,20 +277,22 @@ void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
 static bool __remove_awaiter(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *temp;
+	struct rb_node *temp, *next = rb_next(&waiter->node);
 	bool reset_int = FALSE;		/* whether or not to reset the interrupt */
 	/* Need to make sure earliest and latest are set, in case we're mucking with
 	 * the first and/or last element of the chain. */
-	if (TAILQ_FIRST(&tchain->waiters) == waiter) {
-		temp = TAILQ_NEXT(waiter, next);
-		tchain->earliest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
+	if (tchain->leftmost == &waiter->node) {
+		tchain->leftmost = next;
+		tchain->earliest_time = next ? awaiter_of(next)->wake_up_time
+		                             : ALARM_POISON_TIME;
 		reset_int = TRUE;		/* we'll need to reset the timer later */
 	}
-	if (TAILQ_LAST(&tchain->waiters, awaiters_tailq) == waiter) {
-		temp = TAILQ_PREV(waiter, awaiters_tailq, next);
-		tchain->latest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
+	if (!next) {
+		temp = rb_prev(&waiter->node);
+		tchain->latest_time = temp ? awaiter_of(temp)->wake_up_time
+		                           : ALARM_POISON_TIME;
 	}
-	TAILQ_REMOVE(&tchain->waiters, waiter, next);
+	rb_erase(&waiter->node, &tchain->waiters);
 	waiter->on_tchain = FALSE;
 	return reset_int;
 }
@@ -430,7 +431,7 @@ void set_pcpu_alarm_interrupt(struct timer_chain *tchain)
 		send_ipi(rem_pcpui - &per_cpu_info[0], IdtLAPIC_TIMER);
 		return;
 	}
-	time = TAILQ_EMPTY(&tchain->waiters) ? 0 : tchain->earliest_time;
+	time = tchain->leftmost ? tchain->earliest_time : 0;
 	if (time) {
 		/* Arm the alarm.  For times in the past, we just need to make sure it
 		 * goes off. */
@@ -454,12 +455,15 @@ void set_pcpu_alarm_interrupt(struct timer_chain *tchain)
 void print_chain(struct timer_chain *tchain)
 {
 	struct alarm_waiter *i;
+	struct rb_node *node;
+
 	spin_lock_irqsave(&tchain->lock);
 	printk("Chain %p is%s empty, early: %llu latest: %llu\n", tchain,
-	       TAILQ_EMPTY(&tchain->waiters) ? "" : " not",
+	       tchain->leftmost ? " not" : "",
 	       tchain->earliest_time,
 	       tchain->latest_time);
-	TAILQ_FOREACH(i, &tchain->waiters, next) {
+	for (node = tchain->leftmost; node; node = rb_next(node)) {
+		i = awaiter_of(node);
 		uintptr_t f;
 		char *f_name;
 
@@ -49,8 +49,9 @@
  *   help us get out of OOM.  So we might block when we're at low-mem, not at 0.
  *   We probably should have a sorted list of desired amounts, and unblockers
  *   poke the CV if the first waiter is likely to succeed.
- * - Reclaim: have a ktask that sleeps on a rendez.  We poke it, even from IRQ
- *   context.  It qlocks arenas_and_slabs_lock, then does the reclaim.
+ * - Reclaim: base arenas poke the slab reclaim ktask when they fall below
+ *   their low-water mark.  Arenas with sources don't hang on to free spans, so
+ *   there's nothing for them to reclaim yet.
  *
  * FAQ:
  * - Does allocating memory from an arena require it to take a btag?  Yes -
@@ -140,6 +141,7 @@ static void arena_init(struct arena *arena, char *name, size_t quantum,
 	spinlock_init_irqsave(&arena->lock);
 	arena->import_scale = 0;
 	arena->is_base = FALSE;
+	arena->low_water = FALSE;
 	if (qcache_max % quantum)
 		panic("Arena %s, qcache_max %p must be a multiple of quantum %p",
 		      name, qcache_max, quantum);
@@ -661,6 +663,27 @@ void *arena_add(struct arena *arena, void *base, size_t size, int flags)
 	return __arena_add(arena, base, size, flags);
 }
 
+/* Base arenas are low on memory once less than 1/2^ARENA_LOW_WATER_SHIFT of
+ * their segments are free.  We poke the reclaimer once when we cross that, and
+ * not again until we've been back above the high-water mark, so steady
+ * pressure doesn't keep flushing the depots.  Racy; it's just a hint. */
+static void check_low_water(struct arena *arena)
+{
+	size_t amt_free;
+
+	if (!arena->is_base)
+		return;
+	amt_free = arena_amt_free(arena);
+	if (amt_free < arena->amt_total_segs >> ARENA_LOW_WATER_SHIFT) {
+		if (!arena->low_water) {
+			arena->low_water = TRUE;
+			kmem_reclaim_poke();
+		}
+	} else if (amt_free >= arena->amt_total_segs >> ARENA_HIGH_WATER_SHIFT) {
+		arena->low_water = FALSE;
+	}
+}
+
 /* Attempt to get more resources, either from a source or by blocking.  Returns
  * TRUE if we got something.  FALSE on failure (e.g. MEM_ATOMIC). */
 static bool get_more_resources(struct arena *arena, size_t size, int flags)
@@ -681,6 +704,9 @@ static bool get_more_resources(struct arena *arena, size_t size, int flags)
 			return FALSE;
 		}
 	} else {
+		/* Failures from alignment, constraints, or fragmentation aren't a
+		 * shortage, so only poke if we're actually low. */
+		check_low_water(arena);
 		/* TODO: allow blocking */
 		if (!(flags & MEM_ATOMIC))
 			panic("OOM!");
@@ -715,8 +741,10 @@ void *arena_alloc(struct arena *arena, size_t size, int flags)
 	}
 	while (1) {
 		ret = alloc_from_arena(arena, size, flags);
-		if (ret)
+		if (ret) {
+			check_low_water(arena);
 			return ret;
+		}
 		/* This is a little nasty.  We asked our source for enough, but it may
 		 * be a bestfit sized chunk, not an instant fit.  Since we already
 		 * failed once, we can just downgrade to BESTFIT, which will likely find
@@ -828,8 +856,9 @@ static void *__xalloc_min_max(struct arena *arena, size_t size,
                               uintptr_t minaddr, uintptr_t maxaddr)
 {
 	struct rb_node *node = arena->all_segs.rb_node;
+	struct rb_node *prev;
 	struct btag *bt;
-	uintptr_t try;
+	uintptr_t try, start;
 
 	/* Find the first bt >= minaddr */
 	while (node) {
@@ -841,12 +870,24 @@ static void *__xalloc_min_max(struct arena *arena, size_t size,
 		else
 			node = node->rb_right;
 	}
+	/* The BT before that one (or the last BT, if none are >= minaddr) might
+	 * straddle minaddr, and we can use the part above minaddr. */
+	prev = node ? rb_prev(node) : rb_last(&arena->all_segs);
+	if (prev) {
+		bt = container_of(prev, struct btag, all_link);
+		if (bt->start + bt->size > minaddr)
+			node = prev;
+	}
 	/* Now we're probably at the first start point (or there's no node).  Just
 	 * scan from here. */
 	for (/* node set */; node; node = rb_next(node)) {
 		bt = container_of(node, struct btag, all_link);
-		try = __find_sufficient(bt->start, bt->size, size, align, phase,
-		                        nocross);
+		/* all_segs also has the allocated segments and spans */
+		if (bt->status != BTAG_FREE)
+			continue;
+		start = MAX(bt->start, minaddr);
+		try = __find_sufficient(start, bt->size - (start - bt->start), size,
+		                        align, phase, nocross);
 		if (!try)
 			continue;
 		if (maxaddr && (try + size > maxaddr))
@@ -1000,8 +1041,10 @@ void *arena_xalloc(struct arena *arena, size_t size, size_t align, size_t phase,
 	while (1) {
 		ret = xalloc_from_arena(arena, size, align, phase, nocross, minaddr,
 		                        maxaddr, flags);
-		if (ret)
+		if (ret) {
+			check_low_water(arena);
 			return ret;
+		}
 		/* We checked earlier than no two of these overflow, so I think we don't
 		 * need to worry about multiple overflows. */
 		req_size = size + align + phase;
@@ -1,4 +1,21 @@
-/* See COPYRIGHT for copyright information. */
+/* See COPYRIGHT for copyright information.
+ *
+ * Asynchronous remote syscalls (ARSC).  A process maps a syscall ring with
+ * sys_init_arsc(), then pushes requests onto it without trapping.  A kernel
+ * server, running on a core taken out of the idle pool, polls the rings of its
+ * registered processes and runs their syscalls.  Completion goes through the
+ * usual finish_sysc() path (SC_DONE, and an EV_SYSCALL to the sysc's ev_q if
+ * the process asked for SC_UEVENT), and we push a response onto the ring.
+ *
+ * Each server owns a set of processes, so every ring has a single consumer.
+ * Processes are assigned to servers round-robin when they register.  When
+ * there is nothing to do, a server spins for a little while, then backs off,
+ * sleeping for exponentially longer periods until work shows up again.
+ *
+ * Syscalls run synchronously in the server's kthread.  One that blocks (e.g. a
+ * read on an empty pipe) stalls the server, and every other process it owns,
+ * until it returns.  ARSC is meant for short, non-blocking syscalls; anything
+ * that might block should be trapped as usual. */
 
 #include <ros/common.h>
 #include <ros/ring_syscall.h>
@@ -15,11 +32,22 @@
 #include <smp.h>
 #include <arsc_server.h>
 #include <kref.h>
+#include <kthread.h>
+#include <rendez.h>
+#include <schedule.h>
 
+/* How long we poll an idle server before sleeping, and the bounds on how long
+ * we sleep for once we are idle. */
+#define ARSC_SPIN_USEC				100
+#define ARSC_MIN_SLEEP_USEC			10
+#define ARSC_MAX_SLEEP_USEC			10000
 
+static struct arsc_server *arsc_servers;
+static int nr_arsc_servers;
+static atomic_t arsc_next_server;
 
-struct proc_list arsc_proc_list = TAILQ_HEAD_INITIALIZER(arsc_proc_list);
-spinlock_t arsc_proc_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+static intreg_t process_generic_syscalls(struct arsc_server *srv,
+                                         struct proc *p, size_t max);
 
 intreg_t inline syscall_async(struct proc *p, syscall_req_t *call)
 {
@@ -30,12 +58,24 @@ intreg_t inline syscall_async(struct proc *p, syscall_req_t *call)
 
 syscall_sring_t* sys_init_arsc(struct proc *p)
 {
-	kref_get(&p->p_kref, 1);		/* we're storing an external ref here */
+	struct arsc_server *srv;
 	syscall_sring_t* sring;
 	void * va;
+
+	if (!nr_arsc_servers) {
+		set_errno(ENOSYS);
+		return NULL;
+	}
+	/* Each ring has one consumer; a second registration would give it two */
+	if (p->syscallbackring.sring) {
+		set_errno(EBUSY);
+		return NULL;
+	}
 	// TODO: need to pin this page in the future when swapping happens
 	va = do_mmap(p,MMAP_LOWEST_VA, SYSCALLRINGSIZE, PROT_READ | PROT_WRITE,
 	             MAP_ANONYMOUS | MAP_POPULATE | MAP_PRIVATE, NULL, 0);
+	if (va == MAP_FAILED)
+		return NULL;
 	pte_t pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
 	assert(pte_walk_okay(pte));
 	sring = (syscall_sring_t*) KADDR(pte_get_paddr(pte));
@@ -49,76 +89,178 @@ syscall_sring_t* sys_init_arsc(struct proc *p)
 	               sring,
 	               SYSCALLRINGSIZE);
 
-	spin_lock_irqsave(&arsc_proc_lock);
-	TAILQ_INSERT_TAIL(&arsc_proc_list, p, proc_arsc_link);
-	spin_unlock_irqsave(&arsc_proc_lock);
+	srv = &arsc_servers[(unsigned int)atomic_fetch_and_add(&arsc_next_server, 1)
+	                    % nr_arsc_servers];
+	proc_incref(p, 1);		/* we're storing an external ref here */
+	spin_lock_irqsave(&srv->lock);
+	TAILQ_INSERT_TAIL(&srv->procs, p, proc_arsc_link);
+	srv->nr_procs++;
+	spin_unlock_irqsave(&srv->lock);
+	rendez_wakeup(&srv->rv);
 	return (syscall_sring_t*)va;
 }
 
-void arsc_server(uint32_t srcid, long a0, long a1, long a2)
+static int arsc_has_procs(void *arg)
+{
+	struct arsc_server *srv = arg;
+
+	return READ_ONCE(srv->nr_procs);
+}
+
+/* Makes one pass over the server's processes, returning the number of syscalls
+ * we ran.  We rotate each proc to the tail and hold a ref while we work on it,
+ * so we can drop the lock while running its syscalls. */
+static size_t arsc_poll_procs(struct arsc_server *srv)
+{
+	struct proc *p;
+	size_t count = 0;
+	int nr_procs;
+
+	spin_lock_irqsave(&srv->lock);
+	nr_procs = srv->nr_procs;
+	spin_unlock_irqsave(&srv->lock);
+	for (int i = 0; i < nr_procs; i++) {
+		spin_lock_irqsave(&srv->lock);
+		p = TAILQ_FIRST(&srv->procs);
+		if (!p) {
+			spin_unlock_irqsave(&srv->lock);
+			break;
+		}
+		TAILQ_REMOVE(&srv->procs, p, proc_arsc_link);
+		/* Probably want to try to process a dying process's syscalls, so we
+		 * keep our ref until after we run them. */
+		if (proc_is_dying(p)) {
+			srv->nr_procs--;
+		} else {
+			TAILQ_INSERT_TAIL(&srv->procs, p, proc_arsc_link);
+			proc_incref(p, 1);
+		}
+		spin_unlock_irqsave(&srv->lock);
+		count += process_generic_syscalls(srv, p, MAX_ASRC_BATCH);
+		/* Drops either our temporary ref or the list's ref */
+		proc_decref(p);
+	}
+	return count;
+}
+
+static void arsc_server(uint32_t srcid, long a0, long a1, long a2)
 {
-	struct proc *p = NULL;
-	TAILQ_INIT(&arsc_proc_list);
+	struct arsc_server *srv = (struct arsc_server*)a0;
+	uint64_t idle_start = read_tsc();
+	uint64_t sleep_usec = 0;
+
 	while (1) {
-		while (TAILQ_EMPTY(&arsc_proc_list))
+		if (!arsc_has_procs(srv)) {
+			srv->nr_sleeps++;
+			rendez_sleep(&srv->rv, arsc_has_procs, srv);
+			idle_start = read_tsc();
+			sleep_usec = 0;
+		}
+		srv->nr_polls++;
+		if (arsc_poll_procs(srv)) {
+			srv->nr_busy_polls++;
+			idle_start = read_tsc();
+			sleep_usec = 0;
+			continue;
+		}
+		if (tsc2usec(read_tsc() - idle_start) < ARSC_SPIN_USEC) {
 			cpu_relax();
+			continue;
+		}
+		sleep_usec = sleep_usec ? MIN(sleep_usec * 2, ARSC_MAX_SLEEP_USEC)
+		                        : ARSC_MIN_SLEEP_USEC;
+		srv->nr_sleeps++;
+		kthread_usleep(sleep_usec);
+	}
+}
+
+/* Takes nr cores out of the idle pool and starts a server on each of them. */
+void arsc_server_init(int nr)
+{
+	struct arsc_server *srv;
+	int coreid;
 
-		TAILQ_FOREACH(p, &arsc_proc_list, proc_arsc_link) {
-			/* Probably want to try to process a dying process's syscalls.  If
-			 * not, just move it to an else case */
-			process_generic_syscalls (p, MAX_ASRC_BATCH);
-			if (proc_is_dying(p)) {
-				TAILQ_REMOVE(&arsc_proc_list, p, proc_arsc_link);
-				proc_decref(p);
-				/* Need to break out, so the TAILQ_FOREACH doesn't flip out.
-				 * It's not fair, but we're not dealing with that yet anyway */
-				break;
-			}
+	arsc_servers = kzmalloc(sizeof(struct arsc_server) * nr, MEM_WAIT);
+	for (int i = 0; i < nr; i++) {
+		coreid = get_any_idle_core();
+		if (coreid < 0) {
+			printk("Out of idle cores, only %d ARSC servers\n", i);
+			break;
 		}
+		srv = &arsc_servers[i];
+		spinlock_init_irqsave(&srv->lock);
+		TAILQ_INIT(&srv->procs);
+		rendez_init(&srv->rv);
+		srv->coreid = coreid;
+		nr_arsc_servers++;
+		send_kernel_message(coreid, arsc_server, (long)srv, 0, 0,
+		                    KMSG_ROUTINE);
+		printk("Using core %d for ARSC server %d\n", coreid, i);
+	}
+}
+
+void print_arsc_stats(void)
+{
+	struct arsc_server *srv;
+
+	if (!nr_arsc_servers) {
+		printk("No ARSC servers\n");
+		return;
+	}
+	for (int i = 0; i < nr_arsc_servers; i++) {
+		srv = &arsc_servers[i];
+		printk("ARSC server %d, core %d, %d procs\n", i, srv->coreid,
+		       srv->nr_procs);
+		printk("\tPolls: %llu, busy: %llu (%llu%%)\n", srv->nr_polls,
+		       srv->nr_busy_polls,
+		       srv->nr_polls ? srv->nr_busy_polls * 100 / srv->nr_polls : 0);
+		printk("\tSleeps: %llu\n", srv->nr_sleeps);
+		printk("\tSyscalls: %llu, ring polls: %llu\n", srv->nr_calls,
+		       srv->nr_ring_polls);
+		printk("\tQueue depth: avg %llu, max %llu\n",
+		       srv->nr_ring_polls ? srv->depth_sum / srv->nr_ring_polls : 0,
+		       srv->max_depth);
 	}
 }
 
-static intreg_t process_generic_syscalls(struct proc *p, size_t max)
+static intreg_t process_generic_syscalls(struct arsc_server *srv,
+                                         struct proc *p, size_t max)
 {
 	size_t count = 0;
 	syscall_back_ring_t* sysbr = &p->syscallbackring;
-	struct per_cpu_info* pcpui = &per_cpu_info[core_id()];
 	uintptr_t old_proc;
+	RING_IDX depth;
+
 	// looking at a process not initialized to perform arsc.
-	if (sysbr == NULL)
+	if (!sysbr->sring)
 		return count;
 	/* Bail out if there is nothing to do */
-	if (!RING_HAS_UNCONSUMED_REQUESTS(sysbr))
+	depth = RING_HAS_UNCONSUMED_REQUESTS(sysbr);
+	if (!depth)
 		return 0;
+	rmb();	/* read the requests after reading req_prod */
+	srv->nr_ring_polls++;
+	srv->depth_sum += depth;
+	srv->max_depth = MAX(srv->max_depth, depth);
 	/* Switch to the address space of the process, so we can handle their
 	 * pointers, etc. */
 	old_proc = switch_to(p);
 	// max is the most we'll process.  max = 0 means do as many as possible
-	// TODO: check for initialization of the ring.
 	while (RING_HAS_UNCONSUMED_REQUESTS(sysbr) && ((!max)||(count < max)) ) {
 		// ASSUME: one queue per process
 		count++;
-		//printk("DEBUG PRE: sring->req_prod: %d, sring->rsp_prod: %d\n",
-		//	   sysbr->sring->req_prod, sysbr->sring->rsp_prod);
-		// might want to think about 0-ing this out, if we aren't
-		// going to explicitly fill in all fields
-		syscall_rsp_t rsp;
 		// this assumes we get our answer immediately for the syscall.
 		syscall_req_t* req = RING_GET_REQUEST(sysbr, ++sysbr->req_cons);
 
-		pcpui->cur_kthread->sysc = req->sc;
 		run_local_syscall(req->sc); // TODO: blocking call will block arcs as well.
 
 		// need to keep the slot in the ring buffer if it is blocked
 		(sysbr->rsp_prod_pvt)++;
 		req->status = RES_ready;
 		RING_PUSH_RESPONSES(sysbr);
-
-		//printk("DEBUG POST: sring->req_prod: %d, sring->rsp_prod: %d\n",
-		//	   sysbr->sring->req_prod, sysbr->sring->rsp_prod);
 	}
 	/* switch back to whatever context we were in before */
 	switch_back(p, old_proc);
+	srv->nr_calls += count;
 	return (intreg_t)count;
 }
-
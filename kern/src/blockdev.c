@@ -10,14 +10,18 @@
 #include <slab.h>
 #include <page_alloc.h>
 #include <pmap.h>
-/* These two are needed for the fake interrupt */
-#include <alarm.h>
+#include <time.h>
+#include <umem.h>
 #include <smp.h>
 
 struct file_operations block_f_op;
+struct file_operations block_stats_f_op;
 struct page_map_operations block_pm_op;
 struct kmem_cache *breq_kcache;
 
+static int ramdisk_submit(struct block_device *bdev,
+                          struct block_request *breq);
+
 void block_init(void)
 {
 	breq_kcache = kmem_cache_create("block_reqs",
@@ -43,6 +47,7 @@ void block_init(void)
 	pm_init(&ram_bd->b_pm, &block_pm_op, ram_bd);
 	ram_bd->b_data = _binary_mnt_ext2fs_img_start;
 	strlcpy(ram_bd->b_name, "RAMDISK", BDEV_INLINE_NAME);
+	bdev_init_queue(ram_bd, ramdisk_submit, 1);
 	/* Connect it to the file system */
 	struct file *ram_bf = make_device("/dev_vfs/ramdisk", S_IRUSR | S_IWUSR,
 	                                  __S_IFBLK, &block_f_op);
@@ -50,6 +55,12 @@ void block_init(void)
 	ram_bf->f_dentry->d_inode->i_mapping = &ram_bd->b_pm;
 	ram_bf->f_dentry->d_inode->i_bdev = ram_bd;	/* this holds the bd kref */
 	kref_put(&ram_bf->f_kref);
+	/* Queue stats, read-only */
+	ram_bf = make_device("/dev_vfs/ramdisk_stats", S_IRUSR, __S_IFCHR,
+	                     &block_stats_f_op);
+	kref_get(&ram_bd->b_kref, 1);
+	ram_bf->f_dentry->d_inode->i_bdev = ram_bd;
+	kref_put(&ram_bf->f_kref);
 	#endif /* CONFIG_EXT2FS */
 }
 
@@ -83,14 +94,96 @@ void free_bhs(struct page *page)
 	page->pg_private = 0;		/* catch bugs */
 }
 
-/* This ultimately will handle the actual request processing, all the way down
- * to the driver, and will deal with blocking.  For now, we just fulfill the
- * request right away (RAM based block devs). */
+/* Sector elevator: keeps the queue sorted by sector, so requests that pile up
+ * while the driver is busy go out in one sweep across the disk.  Ties stay
+ * FIFO. */
+static void sector_add_req(struct bdev_queue *q, struct block_request *breq)
+{
+	struct block_request *i;
+
+	TAILQ_FOREACH_REVERSE(i, &q->reqs, breq_tailq, link) {
+		if (i->sector <= breq->sector) {
+			TAILQ_INSERT_AFTER(&q->reqs, i, breq, link);
+			return;
+		}
+	}
+	TAILQ_INSERT_HEAD(&q->reqs, breq, link);
+}
+
+static struct block_request *sector_next_req(struct bdev_queue *q)
+{
+	struct block_request *breq = TAILQ_FIRST(&q->reqs);
+
+	if (breq)
+		TAILQ_REMOVE(&q->reqs, breq, link);
+	return breq;
+}
+
+static struct bdev_elevator bdev_sector_elevator = {
+	.name = "sector",
+	.add_req = sector_add_req,
+	.next_req = sector_next_req,
+};
+
+/* Sets up the request queue for bdev.  submit is the driver's method to start
+ * an IO, and max_inflight is how many requests the driver can have outstanding
+ * at once. */
+void bdev_init_queue(struct block_device *bdev,
+                     int (*submit)(struct block_device *, struct block_request *),
+                     unsigned int max_inflight)
+{
+	struct bdev_queue *q = &bdev->b_queue;
+
+	memset(q, 0, sizeof(struct bdev_queue));
+	spinlock_init_irqsave(&q->lock);
+	TAILQ_INIT(&q->reqs);
+	q->elevator = &bdev_sector_elevator;
+	q->max_inflight = MAX(max_inflight, 1);
+	bdev->b_submit = submit;
+}
+
+static unsigned int bdev_hist_bucket(uint64_t val)
+{
+	return MIN(LOG2_DOWN(val), BDEV_NR_HIST_BUCKETS - 1);
+}
+
+/* Hands requests to the driver, til we're empty or the driver is full.  Only
+ * one core dispatches at a time; anyone else who shows up just leaves the work
+ * for the dispatcher, who rechecks the queue before leaving.  Drivers can
+ * complete requests from within b_submit, which will call back in here. */
+static void __bdev_dispatch(struct block_device *bdev)
+{
+	struct bdev_queue *q = &bdev->b_queue;
+	struct block_request *breq;
+
+	spin_lock_irqsave(&q->lock);
+	if (q->dispatching) {
+		spin_unlock_irqsave(&q->lock);
+		return;
+	}
+	q->dispatching = TRUE;
+	while (q->nr_inflight < q->max_inflight) {
+		breq = q->elevator->next_req(q);
+		if (!breq)
+			break;
+		q->nr_queued--;
+		q->nr_inflight++;
+		spin_unlock_irqsave(&q->lock);
+		bdev->b_submit(bdev, breq);
+		spin_lock_irqsave(&q->lock);
+	}
+	q->dispatching = FALSE;
+	spin_unlock_irqsave(&q->lock);
+}
+
+/* Submits a request to bdev's queue.  The request's callback runs when the IO
+ * is done, possibly before this returns. */
 int bdev_submit_request(struct block_device *bdev, struct block_request *breq)
 {
-	void *src, *dst;
+	struct bdev_queue *q = &bdev->b_queue;
 	unsigned long first_sector;
 	unsigned int nr_sector;
+	unsigned int nr_merges = 0;
 
 	for (int i = 0; i < breq->nr_bhs; i++) {
 		first_sector = breq->bhs[i]->bh_sector;
@@ -100,46 +193,100 @@ int bdev_submit_request(struct block_device *bdev, struct block_request *breq)
 			warn("Exceeding the num sectors!");
 			return -1;
 		}
-		if (breq->flags & BREQ_READ) {
-			dst = breq->bhs[i]->bh_buffer;
-			src = bdev->b_data + (first_sector << SECTOR_SZ_LOG);
-		} else if (breq->flags & BREQ_WRITE) {
-			dst = bdev->b_data + (first_sector << SECTOR_SZ_LOG);
-			src = breq->bhs[i]->bh_buffer;
-		} else {
-			panic("Need a request type!\n");
-		}
-		memcpy(dst, src, nr_sector << SECTOR_SZ_LOG);
+		/* will breq_next_segment() merge this BH with the previous one? */
+		if (i && (first_sector == breq->bhs[i - 1]->bh_sector +
+		                          breq->bhs[i - 1]->bh_nr_sector) &&
+		    (breq->bhs[i]->bh_buffer == breq->bhs[i - 1]->bh_buffer +
+		         (breq->bhs[i - 1]->bh_nr_sector << SECTOR_SZ_LOG)))
+			nr_merges++;
+	}
+	if (!(breq->flags & (BREQ_READ | BREQ_WRITE)))
+		panic("Need a request type!\n");
+	breq->sector = breq->nr_bhs ? breq->bhs[0]->bh_sector : 0;
+	breq->submit_tsc = read_tsc();
+	spin_lock_irqsave(&q->lock);
+	q->elevator->add_req(q, breq);
+	q->nr_queued++;
+	q->nr_reqs++;
+	q->nr_merges += nr_merges;
+	q->depth_hist[bdev_hist_bucket(q->nr_queued + q->nr_inflight)]++;
+	spin_unlock_irqsave(&q->lock);
+	__bdev_dispatch(bdev);
+	return 0;
+}
+
+/* Drivers call this when they finish a request.  Safe to call from IRQ
+ * context. */
+void bdev_complete_request(struct block_device *bdev,
+                           struct block_request *breq)
+{
+	struct bdev_queue *q = &bdev->b_queue;
+	uint64_t usec = tsc2usec(read_tsc() - breq->submit_tsc);
+
+	spin_lock_irqsave(&q->lock);
+	q->nr_inflight--;
+	q->lat_hist[bdev_hist_bucket(usec)]++;
+	spin_unlock_irqsave(&q->lock);
+	if (breq->callback)
+		breq->callback(breq);
+	/* breq is gone now; there might be room for more */
+	__bdev_dispatch(bdev);
+}
+
+/* Helper for drivers, merges adjacent BHs into one segment.  Pass in the index
+ * of the first BH of the segment (start with 0).  Returns the index of the next
+ * segment, or 0 if there are no more segments.  BHs merge when both their
+ * sectors and their buffers are contiguous. */
+int breq_next_segment(struct block_request *breq, int idx,
+                      unsigned long *sector, void **buf,
+                      unsigned int *nr_sector)
+{
+	struct buffer_head *bh;
+
+	if (idx >= breq->nr_bhs)
+		return 0;
+	bh = breq->bhs[idx];
+	*sector = bh->bh_sector;
+	*buf = bh->bh_buffer;
+	*nr_sector = bh->bh_nr_sector;
+	for (idx++; idx < breq->nr_bhs; idx++) {
+		bh = breq->bhs[idx];
+		if ((bh->bh_sector != *sector + *nr_sector) ||
+		    (bh->bh_buffer != *buf + (*nr_sector << SECTOR_SZ_LOG)))
+			break;
+		*nr_sector += bh->bh_nr_sector;
 	}
-	/* Faking the device interrupt with an alarm */
-	void breq_handler(struct alarm_waiter *waiter)
-	{
-		/* In the future, we'll need to figure out which breq this was in
-		 * response to */
-		struct block_request *breq = (struct block_request*)waiter->data;
-		if (breq->callback)
-			breq->callback(breq);
-		kfree(waiter);
+	return idx;
+}
+
+/* RAM disk driver: the data is right there, so we complete immediately. */
+static int ramdisk_submit(struct block_device *bdev,
+                          struct block_request *breq)
+{
+	unsigned long sector;
+	unsigned int nr_sector;
+	void *buf, *disk;
+	int idx = 0, next;
+
+	while ((next = breq_next_segment(breq, idx, &sector, &buf, &nr_sector))) {
+		disk = bdev->b_data + (sector << SECTOR_SZ_LOG);
+		if (breq->flags & BREQ_READ)
+			memcpy(buf, disk, nr_sector << SECTOR_SZ_LOG);
+		else
+			memcpy(disk, buf, nr_sector << SECTOR_SZ_LOG);
+		idx = next;
 	}
-	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
-	struct alarm_waiter *waiter = kmalloc(sizeof(struct alarm_waiter), 0);
-	init_awaiter(waiter, breq_handler);
-	/* Stitch things up, so we know how to find things later */
-	waiter->data = breq;
-	/* Set for 5ms. */
-	set_awaiter_rel(waiter, 5000);
-	set_alarm(tchain, waiter);
+	bdev_complete_request(bdev, breq);
 	return 0;
 }
 
-/* Helper method, unblocks someone blocked on sleep_on_breq(). */
+/* Helper method, unblocks someone blocked on sleep_on_breq().  The request
+ * might complete before they sleep, in which case they won't block. */
 void generic_breq_done(struct block_request *breq)
 {
 	int8_t irq_state = 0;
-	if (!sem_up_irqsave(&breq->sem, &irq_state)) {
-		/* This shouldn't happen anymore.  Let brho know if it does. */
-		warn("[kernel] no one waiting on breq %p", breq);
-	}
+
+	sem_up_irqsave(&breq->sem, &irq_state);
 }
 
 /* Helper, pairs with generic_breq_done().  Note we sleep here on a semaphore
@@ -271,7 +418,7 @@ void bdev_dirty_buffer(struct buffer_head *bh)
 	struct page *page = bh->bh_page;
 	/* TODO: race on flag modification */
 	bh->bh_flags |= BH_DIRTY;
-	atomic_or(&page->pg_flags, PG_DIRTY);
+	pm_page_dirty(page);
 }
 
 /* Decrefs the buffer from bdev_get_buffer().  Call this when you no longer
@@ -287,6 +434,43 @@ struct page_map_operations block_pm_op = {
 	block_readpage,
 };
 
+/* Reads the queue stats of the file's bdev, as text. */
+static ssize_t block_stats_read(struct file *file, char *buf, size_t count,
+                                off64_t *offset)
+{
+	struct block_device *bdev = file->f_dentry->d_inode->i_bdev;
+	struct bdev_queue *q = &bdev->b_queue;
+	size_t bufsz = 2048, len = 0, copy_amt;
+	char *kbuf;
+
+	kbuf = kmalloc(bufsz, MEM_WAIT);
+	spin_lock_irqsave(&q->lock);
+	len += snprintf(kbuf + len, bufsz - len,
+	                "%s: elevator %s, queued %u, inflight %u/%u\n",
+	                bdev->b_name, q->elevator->name, q->nr_queued,
+	                q->nr_inflight, q->max_inflight);
+	len += snprintf(kbuf + len, bufsz - len, "requests %llu, merges %llu\n",
+	                q->nr_reqs, q->nr_merges);
+	len += snprintf(kbuf + len, bufsz - len, "depth (log2)   latency (log2 usec)\n");
+	for (int i = 0; i < BDEV_NR_HIST_BUCKETS; i++)
+		len += snprintf(kbuf + len, bufsz - len, "%2d: %10llu  %10llu\n", i,
+		                q->depth_hist[i], q->lat_hist[i]);
+	spin_unlock_irqsave(&q->lock);
+	if (*offset >= len) {
+		kfree(kbuf);
+		return 0;
+	}
+	copy_amt = MIN(count, len - *offset);
+	/* TODO: (KFOP) same as generic_file_read() */
+	if (!is_ktask(per_cpu_info[core_id()].cur_kthread))
+		memcpy_to_user(current, buf, kbuf + *offset, copy_amt);
+	else
+		memcpy(buf, kbuf + *offset, copy_amt);
+	*offset += copy_amt;
+	kfree(kbuf);
+	return copy_amt;
+}
+
 /* Block device file ops: for now, we don't let you do much of anything */
 struct file_operations block_f_op = {
 	dev_c_llseek,
@@ -304,3 +488,20 @@ struct file_operations block_f_op = {
 	kfs_sendpage,
 	kfs_check_flags,
 };
+
+struct file_operations block_stats_f_op = {
+	dev_c_llseek,
+	block_stats_read,
+	0,
+	kfs_readdir,	/* this will fail gracefully */
+	dev_mmap,
+	kfs_open,
+	kfs_flush,
+	kfs_release,
+	0,	/* fsync - makes no sense */
+	kfs_poll,
+	0,	/* readv */
+	0,	/* writev */
+	kfs_sendpage,
+	kfs_check_flags,
+};
@@ -14,6 +14,9 @@
 #include <stdio.h>
 #include <umem.h>
 
+/* Max nr of event indexes we post to the ring at once */
+#define CEQ_SEND_BATCH			32
+
 static void error_addr(struct ceq *ceq, struct proc *p, void *addr)
 {
 	printk("[kernel] Invalid ceq (%p) bad addr %p for proc %d\n", ceq,
@@ -31,20 +34,18 @@ static void ceq_update_max_event(struct ceq *ceq, unsigned int new_max)
 	} while (!atomic_cas(&ceq->max_event_ever, old_max, new_max));
 }
 
-void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
+/* Helper: updates msg's event in the ceq.  Returns TRUE if the caller needs to
+ * post the event's index to the ring, FALSE if the consumer will see it
+ * anyway (or on error). */
+static bool ceq_update_event(struct ceq *ceq, struct proc *p,
+                             struct event_msg *msg)
 {
 	struct ceq_event *ceq_ev;
-	int32_t *ring_slot;
-	unsigned long my_slot;
-	int loops = 0;
-	#define NR_RING_TRIES 10
 
-	/* should have been checked by the kernel func that called us */
-	assert(is_user_rwaddr(ceq, sizeof(struct ceq)));
 	if (msg->ev_type >= ceq->nr_events) {
 		printk("[kernel] CEQ %p too small.  Wanted %d, had %d\n", ceq,
 		       msg->ev_type, ceq->nr_events);
-		return;
+		return FALSE;
 	}
 	ceq_update_max_event(ceq, msg->ev_type);
 	/* ACCESS_ONCE, prevent the compiler from rereading ceq->events later, and
@@ -52,7 +53,7 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 	ceq_ev = &(ACCESS_ONCE(ceq->events))[msg->ev_type];
 	if (!is_user_rwaddr(ceq_ev, sizeof(struct ceq_event))) {
 		error_addr(ceq, p, ceq);
-		return;
+		return FALSE;
 	}
 	/* ideally, we'd like the blob to be posted after the coal, so that the
 	 * 'reason' for the blob is present when the blob is.  but we can't
@@ -71,7 +72,7 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 			break;
 		default:
 			printk("[kernel] CEQ %p invalid op %d\n", ceq, ceq->operation);
-			return;
+			return FALSE;
 	}
 	/* write before checking if we need to post (covered by the atomic) */
 	if (ceq_ev->idx_posted) {
@@ -80,12 +81,27 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 		 * codes or something from send_*_msg, then we can tell the kernel to
 		 * not bother with INDIRS/IPIs/etc.  This is unnecessary now since
 		 * INDIRs are throttled */
-		return;
+		return FALSE;
 	}
 	/* at this point, we need to make sure the cons looks at our entry.  it may
 	 * have already done so while we were mucking around, but 'poking' them to
 	 * look again can't hurt */
 	ceq_ev->idx_posted = TRUE;
+	return TRUE;
+}
+
+/* Helper: posts the nr event indexes in idxs to the ring, reserving all of the
+ * ring slots with a single CAS. */
+static void ceq_post_idxs(struct ceq *ceq, struct proc *p, int32_t *idxs,
+                          unsigned int nr)
+{
+	int32_t *ring_slot;
+	unsigned long my_slot;
+	int loops = 0;
+	#define NR_RING_TRIES 10
+
+	if (!nr)
+		return;
 	/* idx_posted write happens before the writes posting it.  the following
 	 * atomic provides the cpu mb() */
 	cmb();
@@ -102,12 +118,15 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 	 * okay to have two producers on the same slot, since there'd only be one
 	 * consumer.  Theoretically, you could have a producer delayed a long time
 	 * that just clobbers an index at some point in the future, or leaves an
-	 * index in the non-init state (-1).  It's a mess. */
+	 * index in the non-init state (-1).  It's a mess.
+	 *
+	 * If there isn't room for all of them, we overflow, same as if there
+	 * wasn't room for one: the consumer will scan the events array. */
 	do {
 		cmb();	/* reread the indices */
 		my_slot = atomic_read(&ceq->prod_idx);
-		if (__ring_full(ceq->ring_sz, my_slot,
-		                atomic_read(&ceq->cons_pub_idx))) {
+		if (__ring_nr_empty(ceq->ring_sz, my_slot,
+		                    atomic_read(&ceq->cons_pub_idx)) < nr) {
 			ceq->ring_overflowed = TRUE;
 			return;
 		}
@@ -115,18 +134,51 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 			ceq->ring_overflowed = TRUE;
 			return;
 		}
-	} while (!atomic_cas(&ceq->prod_idx, my_slot, my_slot + 1));
-	/* ring_slot is a user pointer, calculated by ring, my_slot, and sz */
-	ring_slot = &(ACCESS_ONCE(ceq->ring))[my_slot & (ceq->ring_sz - 1)];
-	if (!is_user_rwaddr(ring_slot, sizeof(int32_t))) {
-		/* This is a serious user error.  We're just bailing out, and any
-		 * consumers might be spinning waiting on us to produce.  Probably not
-		 * though, since the ring slot is bad memory. */
-		error_addr(ceq, p, ring_slot);
-		return;
+	} while (!atomic_cas(&ceq->prod_idx, my_slot, my_slot + nr));
+	for (unsigned int i = 0; i < nr; i++, my_slot++) {
+		/* ring_slot is a user pointer, calculated by ring, my_slot, and sz */
+		ring_slot = &(ACCESS_ONCE(ceq->ring))[my_slot & (ceq->ring_sz - 1)];
+		if (!is_user_rwaddr(ring_slot, sizeof(int32_t))) {
+			/* This is a serious user error.  We're just bailing out, and any
+			 * consumers might be spinning waiting on us to produce.  Probably
+			 * not though, since the ring slot is bad memory. */
+			error_addr(ceq, p, ring_slot);
+			return;
+		}
+		/* At this point, we have a valid slot */
+		*ring_slot = idxs[i];
+	}
+}
+
+void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
+{
+	int32_t idx = msg->ev_type;
+
+	/* should have been checked by the kernel func that called us */
+	assert(is_user_rwaddr(ceq, sizeof(struct ceq)));
+	if (ceq_update_event(ceq, p, msg))
+		ceq_post_idxs(ceq, p, &idx, 1);
+}
+
+/* Sends nr msgs to the ceq.  The events coalesce as usual, and the indexes that
+ * need posting are posted in batches, one ring reservation per batch. */
+void send_ceq_msgs(struct ceq *ceq, struct proc *p, struct event_msg *msgs,
+                   size_t nr)
+{
+	int32_t idxs[CEQ_SEND_BATCH];
+	unsigned int nr_idxs = 0;
+
+	assert(is_user_rwaddr(ceq, sizeof(struct ceq)));
+	for (size_t i = 0; i < nr; i++) {
+		if (!ceq_update_event(ceq, p, &msgs[i]))
+			continue;
+		idxs[nr_idxs++] = msgs[i].ev_type;
+		if (nr_idxs == CEQ_SEND_BATCH) {
+			ceq_post_idxs(ceq, p, idxs, nr_idxs);
+			nr_idxs = 0;
+		}
 	}
-	/* At this point, we have a valid slot */
-	*ring_slot = msg->ev_type;
+	ceq_post_idxs(ceq, p, idxs, nr_idxs);
 }
 
 void ceq_dumper(int pid, struct event_queue *ev_q)
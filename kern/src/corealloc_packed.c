@@ -0,0 +1,350 @@
+/* See LICENSE for details.
+ *
+ * Topology-aware core allocation.  Instead of handing out idle cores in
+ * whatever order they sit on the idle list, we try to keep an MCP's cores
+ * together: on a socket (shared L3) it already has cores on, else on a NUMA
+ * node it already has cores on.  Within that, we prefer cores whose SMT
+ * sibling is idle, so a process gets whole physical cores before it starts
+ * doubling up on hyperthreads.  A process with no cores yet starts on the
+ * socket with the most idle cores, leaving it the most room to grow.
+ *
+ * Everything here runs under the ksched's lock.  The scratch counters are
+ * global and rebuilt on each call, which is fine since only one caller can be
+ * in here at a time. */
+
+#include <arch/topology.h>
+#include <sys/queue.h>
+#include <env.h>
+#include <corerequest.h>
+#include <kmalloc.h>
+#include <string.h>
+
+/* The pcores in the system. (array gets alloced in init()).  */
+struct sched_pcore *all_pcores;
+
+/* TAILQ of all unallocated, idle (CG) cores */
+struct sched_pcore_tailq idlecores = TAILQ_HEAD_INITIALIZER(idlecores);
+
+/* Per-group counters for __find_best_core_to_alloc(), indexed by the topology
+ * indices in struct sched_pcore.  Each is num_cores long. */
+static int *sock_mine, *numa_mine, *sock_idle, *cpu_busy;
+
+/* Set by __next_core_to_alloc() to override the policy once. */
+static int next_alloc_hint = -1;
+
+/* Returns the pcoreid of the first core that matches pcoreid's topology at the
+ * given level.  level 0 is the NUMA node, 1 the socket, 2 the physical cpu. */
+static int __topo_group_leader(int pcoreid, int level)
+{
+	struct core_info *me = &cpu_topology_info.core_list[pcoreid];
+	struct core_info *ci;
+
+	for (int i = 0; i < pcoreid; i++) {
+		ci = &cpu_topology_info.core_list[i];
+		if (ci->numa_id != me->numa_id)
+			continue;
+		if (level >= 1 && ci->socket_id != me->socket_id)
+			continue;
+		if (level >= 2 && ci->cpu_id != me->cpu_id)
+			continue;
+		return i;
+	}
+	return pcoreid;
+}
+
+static void __spc_make_idle(struct sched_pcore *spc)
+{
+	TAILQ_INSERT_TAIL(&idlecores, spc, alloc_next);
+	spc->idle = TRUE;
+}
+
+static void __spc_make_busy(struct sched_pcore *spc)
+{
+	TAILQ_REMOVE(&idlecores, spc, alloc_next);
+	spc->idle = FALSE;
+}
+
+/* Initialize any data assocaited with doing core allocation. */
+void corealloc_init(void)
+{
+	struct sched_pcore *spc;
+	int *scratch;
+
+	/* Allocate all of our pcores. */
+	all_pcores = kzmalloc(sizeof(struct sched_pcore) * num_cores, MEM_WAIT);
+	scratch = kzmalloc(sizeof(int) * num_cores * 4, MEM_WAIT);
+	sock_mine = scratch;
+	numa_mine = scratch + num_cores;
+	sock_idle = scratch + num_cores * 2;
+	cpu_busy = scratch + num_cores * 3;
+	for (int i = 0; i < num_cores; i++) {
+		spc = pcoreid2spc(i);
+		spc->numa_idx = __topo_group_leader(i, 0);
+		spc->socket_idx = __topo_group_leader(i, 1);
+		spc->cpu_idx = __topo_group_leader(i, 2);
+	}
+	/* init the idlecore list.  if they turned off hyperthreading, give them the
+	 * odds from 1..max-1.  otherwise, give them everything by 0 (default mgmt
+	 * core).  TODO: (CG/LL) better LL/CG mgmt */
+#ifndef CONFIG_DISABLE_SMT
+	for (int i = 0; i < num_cores; i++)
+		if (!is_ll_core(i))
+			__spc_make_idle(pcoreid2spc(i));
+#else
+	assert(!(num_cores % 2));
+	for (int i = 1; i < num_cores; i += 2)
+		if (!is_ll_core(i))
+			__spc_make_idle(pcoreid2spc(i));
+#endif /* CONFIG_DISABLE_SMT */
+}
+
+/* Initialize any data associated with allocating cores to a process. */
+void corealloc_proc_init(struct proc *p)
+{
+	TAILQ_INIT(&p->ksched_data.crd.prov_alloc_me);
+	TAILQ_INIT(&p->ksched_data.crd.prov_not_alloc_me);
+}
+
+/* Rebuilds the scratch counters: how many of p's cores are on each socket and
+ * node, how many idle cores each socket has, and how many busy threads each
+ * physical core has.  Cores that are never idle (the LL core, or the odd
+ * cores with SMT disabled) count as busy. */
+static void __count_topology(struct proc *p)
+{
+	struct sched_pcore *spc;
+
+	memset(sock_mine, 0, sizeof(int) * num_cores * 4);
+	for (int i = 0; i < num_cores; i++) {
+		spc = pcoreid2spc(i);
+		if (p && spc->alloc_proc == p) {
+			sock_mine[spc->socket_idx]++;
+			numa_mine[spc->numa_idx]++;
+		}
+		if (spc->idle)
+			sock_idle[spc->socket_idx]++;
+		else
+			cpu_busy[spc->cpu_idx]++;
+	}
+}
+
+/* Returns TRUE if a is a better core for p than b.  In order, we want: a core
+ * not provisioned to someone else, a socket p is already on, a physical core
+ * with no busy sibling, a NUMA node p is already on, then whichever socket p
+ * has the most cores on or, for a new placement, has the most idle cores. */
+static bool __better_core(struct proc *p, struct sched_pcore *a,
+                          struct sched_pcore *b)
+{
+	int a_val, b_val;
+
+	if (!b)
+		return TRUE;
+	a_val = !a->prov_proc || a->prov_proc == p;
+	b_val = !b->prov_proc || b->prov_proc == p;
+	if (a_val != b_val)
+		return a_val > b_val;
+	a_val = !!sock_mine[a->socket_idx];
+	b_val = !!sock_mine[b->socket_idx];
+	if (a_val != b_val)
+		return a_val > b_val;
+	a_val = !cpu_busy[a->cpu_idx];
+	b_val = !cpu_busy[b->cpu_idx];
+	if (a_val != b_val)
+		return a_val > b_val;
+	a_val = !!numa_mine[a->numa_idx];
+	b_val = !!numa_mine[b->numa_idx];
+	if (a_val != b_val)
+		return a_val > b_val;
+	a_val = sock_mine[a->socket_idx];
+	b_val = sock_mine[b->socket_idx];
+	if (a_val != b_val)
+		return a_val > b_val;
+	return sock_idle[a->socket_idx] > sock_idle[b->socket_idx];
+}
+
+/* Find the best core to allocate to a process as dictated by the core
+ * allocation algorithm. This code assumes that the scheduler that uses it
+ * holds a lock for the duration of the call. */
+uint32_t __find_best_core_to_alloc(struct proc *p)
+{
+	struct sched_pcore *spc_i, *best = NULL;
+
+	spc_i = TAILQ_FIRST(&p->ksched_data.crd.prov_not_alloc_me);
+	if (spc_i)
+		return spc2pcoreid(spc_i);
+	if (next_alloc_hint >= 0) {
+		spc_i = pcoreid2spc(next_alloc_hint);
+		next_alloc_hint = -1;
+		if (spc_i->idle)
+			return spc2pcoreid(spc_i);
+	}
+	if (TAILQ_EMPTY(&idlecores))
+		return -1;
+	__count_topology(p);
+	TAILQ_FOREACH(spc_i, &idlecores, alloc_next) {
+		if (__better_core(p, spc_i, best))
+			best = spc_i;
+	}
+	return spc2pcoreid(best);
+}
+
+/* Track the pcore properly when it is allocated to p. This code assumes that
+ * the scheduler that uses it holds a lock for the duration of the call. */
+void __track_core_alloc(struct proc *p, uint32_t pcoreid)
+{
+	struct sched_pcore *spc;
+
+	assert(pcoreid < num_cores);	/* catch bugs */
+	spc = pcoreid2spc(pcoreid);
+	assert(spc->alloc_proc != p);	/* corruption or double-alloc */
+	spc->alloc_proc = p;
+	/* if the pcore is prov to them and now allocated, move lists */
+	if (spc->prov_proc == p) {
+		TAILQ_REMOVE(&p->ksched_data.crd.prov_not_alloc_me, spc, prov_next);
+		TAILQ_INSERT_TAIL(&p->ksched_data.crd.prov_alloc_me, spc, prov_next);
+	}
+	/* Actually allocate the core, removing it from the idle core list. */
+	__spc_make_busy(spc);
+}
+
+/* Track the pcore properly when it is deallocated from p. This code assumes
+ * that the scheduler that uses it holds a lock for the duration of the call.
+ * */
+void __track_core_dealloc(struct proc *p, uint32_t pcoreid)
+{
+	struct sched_pcore *spc;
+
+	assert(pcoreid < num_cores);	/* catch bugs */
+	spc = pcoreid2spc(pcoreid);
+	spc->alloc_proc = 0;
+	/* if the pcore is prov to them and now deallocated, move lists */
+	if (spc->prov_proc == p) {
+		TAILQ_REMOVE(&p->ksched_data.crd.prov_alloc_me, spc, prov_next);
+		/* this is the victim list, which can be sorted so that we pick the
+		 * right victim (sort by alloc_proc reverse priority, etc).  In this
+		 * case, the core isn't alloc'd by anyone, so it should be the first
+		 * victim. */
+		TAILQ_INSERT_HEAD(&p->ksched_data.crd.prov_not_alloc_me, spc,
+		                  prov_next);
+	}
+	/* Actually dealloc the core, putting it back on the idle core list. */
+	__spc_make_idle(spc);
+}
+
+/* Bulk interface for __track_core_dealloc */
+void __track_core_dealloc_bulk(struct proc *p, uint32_t *pc_arr,
+                               uint32_t nr_cores)
+{
+	for (int i = 0; i < nr_cores; i++)
+		__track_core_dealloc(p, pc_arr[i]);
+}
+
+/* Get an idle core from our pcore list and return its core_id. Don't
+ * consider the chosen core in the future when handing out cores to a
+ * process. This code assumes that the scheduler that uses it holds a lock
+ * for the duration of the call. This will not give out provisioned cores.
+ *
+ * These cores usually go to kernel services, so we'd rather take a core whose
+ * sibling is already busy than break up a whole physical core an MCP could
+ * use. */
+int __get_any_idle_core(void)
+{
+	struct sched_pcore *spc, *pick = NULL;
+
+	__count_topology(NULL);
+	TAILQ_FOREACH(spc, &idlecores, alloc_next) {
+		/* Don't take cores that are provisioned to a process */
+		if (spc->prov_proc)
+			continue;
+		if (!pick)
+			pick = spc;
+		if (cpu_busy[spc->cpu_idx]) {
+			pick = spc;
+			break;
+		}
+	}
+	if (!pick)
+		return -1;
+	assert(!pick->alloc_proc);
+	__spc_make_busy(pick);
+	return spc2pcoreid(pick);
+}
+
+/* Same as __get_any_idle_core() except for a specific core id. */
+int __get_specific_idle_core(int coreid)
+{
+	struct sched_pcore *spc = pcoreid2spc(coreid);
+	int ret = -1;
+
+	assert((coreid >= 0) && (coreid < num_cores));
+	if (spc->idle && !spc->prov_proc) {
+		assert(!spc->alloc_proc);
+		__spc_make_busy(spc);
+		ret = coreid;
+	}
+	return ret;
+}
+
+/* Reinsert a core obtained via __get_any_idle_core() or
+ * __get_specific_idle_core() back into the idlecore map. This code assumes
+ * that the scheduler that uses it holds a lock for the duration of the call.
+ * This will not give out provisioned cores. */
+void __put_idle_core(int coreid)
+{
+	struct sched_pcore *spc = pcoreid2spc(coreid);
+
+	assert((coreid >= 0) && (coreid < num_cores));
+	__spc_make_idle(spc);
+}
+
+/* One off function to make 'pcoreid' the next core chosen by the core
+ * allocation algorithm (so long as no provisioned cores are still idle).
+ * This code assumes that the scheduler that uses it holds a lock for the
+ * duration of the call. */
+void __next_core_to_alloc(uint32_t pcoreid)
+{
+	if (pcoreid >= num_cores || !pcoreid2spc(pcoreid)->idle)
+		return;
+	next_alloc_hint = pcoreid;
+	printk("Pcore %d will be given out next (from the idles)\n", pcoreid);
+}
+
+/* One off function to sort the idle core list for debugging in the kernel
+ * monitor.  The list order doesn't affect which core we pick, but it makes
+ * print_idle_core_map() easier to read. This code assumes that the scheduler
+ * that uses it holds a lock for the duration of the call. */
+void __sort_idle_cores(void)
+{
+	struct sched_pcore *spc_i, *spc_j, *temp;
+	struct sched_pcore_tailq sorter = TAILQ_HEAD_INITIALIZER(sorter);
+	bool added;
+
+	TAILQ_CONCAT(&sorter, &idlecores, alloc_next);
+	TAILQ_FOREACH_SAFE(spc_i, &sorter, alloc_next, temp) {
+		TAILQ_REMOVE(&sorter, spc_i, alloc_next);
+		added = FALSE;
+		/* don't need foreach_safe since we break after we muck with the list */
+		TAILQ_FOREACH(spc_j, &idlecores, alloc_next) {
+			if (spc_i < spc_j) {
+				TAILQ_INSERT_BEFORE(spc_j, spc_i, alloc_next);
+				added = TRUE;
+				break;
+			}
+		}
+		if (!added)
+			TAILQ_INSERT_TAIL(&idlecores, spc_i, alloc_next);
+	}
+}
+
+/* Print the map of idle cores that are still allocatable through our core
+ * allocation algorithm. */
+void print_idle_core_map(void)
+{
+	struct sched_pcore *spc_i;
+	/* not locking, so we can look at this without deadlocking. */
+	printk("Idle cores (unlocked!):\n");
+	TAILQ_FOREACH(spc_i, &idlecores, alloc_next)
+		printk("Core %d (numa %d, socket %d, cpu %d), prov to %d (%p)\n",
+		       spc2pcoreid(spc_i), spc_i->numa_idx, spc_i->socket_idx,
+		       spc_i->cpu_idx, spc_i->prov_proc ? spc_i->prov_proc->pid : 0,
+		       spc_i->prov_proc);
+}
@@ -94,3 +94,39 @@ void print_coreprov_map(void)
 		       spc_i->alloc_proc);
 	}
 }
+
+/* Print how well p's allocated cores are packed.  Sockets and nodes are
+ * counted by their first core, so this works with any allocation policy.
+ * Unlocked, like the other debug printers. */
+void print_proc_core_placement(struct proc *p)
+{
+	struct core_info *ci, *cj;
+	int nr_cores = 0, nr_sockets = 0, nr_nodes = 0, nr_smt = 0;
+	bool new_socket, new_node;
+
+	for (int i = 0; i < num_cores; i++) {
+		if (get_alloc_proc(i) != p)
+			continue;
+		ci = &cpu_topology_info.core_list[i];
+		nr_cores++;
+		new_socket = TRUE;
+		new_node = TRUE;
+		for (int j = 0; j < i; j++) {
+			if (get_alloc_proc(j) != p)
+				continue;
+			cj = &cpu_topology_info.core_list[j];
+			if (cj->numa_id != ci->numa_id)
+				continue;
+			new_node = FALSE;
+			if (cj->socket_id != ci->socket_id)
+				continue;
+			new_socket = FALSE;
+			if (cj->cpu_id == ci->cpu_id)
+				nr_smt++;
+		}
+		nr_sockets += new_socket;
+		nr_nodes += new_node;
+	}
+	printk("Placement: %d cores on %d sockets, %d NUMA nodes, %d SMT pairs\n",
+	       nr_cores, nr_sockets, nr_nodes, nr_smt);
+}
@@ -95,6 +95,25 @@ static void post_ev_msg(struct proc *p, struct event_mbox *mbox,
 	}
 }
 
+/* Posts nr messages to the mbox, batching the ring reservations for UCQs and
+ * CEQs.  Same rules as post_ev_msg(). */
+static void post_ev_msgs(struct proc *p, struct event_mbox *mbox,
+                         struct event_msg *msgs, size_t nr, int ev_flags)
+{
+	assert(p);
+	switch (mbox->type) {
+		case (EV_MBOX_UCQ):
+			send_ucq_msgs(&mbox->ucq, p, msgs, nr);
+			break;
+		case (EV_MBOX_CEQ):
+			send_ceq_msgs(&mbox->ceq, p, msgs, nr);
+			break;
+		default:
+			for (size_t i = 0; i < nr; i++)
+				post_ev_msg(p, mbox, &msgs[i], ev_flags);
+	}
+}
+
 /* Helper: use this when sending a message to a VCPD mbox.  It just posts to the
  * ev_mbox and sets notif pending.  Note this uses a userspace address for the
  * VCPD (though not a user's pointer). */
@@ -353,14 +372,10 @@ static void send_indir(struct proc *p, struct event_queue *ev_q,
 	spam_public_msg(p, &local_msg, vcoreid, ev_q->ev_flags);
 }
 
-/* Send an event to ev_q, based on the parameters in ev_q's flag.  We don't
- * accept null ev_qs, since the caller ought to be checking before bothering to
- * make a msg and send it to the event_q.  Vcoreid is who the kernel thinks the
- * message ought to go to (for IPIs).  Appropriate for things like
- * EV_PREEMPT_PENDING, where we tell the affected vcore.  To have the message go
- * where the kernel suggests, set EVENT_VCORE_APPRO(priate). */
-void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
-                uint32_t vcoreid)
+/* Sends nr msgs to ev_q, alerting the vcore (IPI, INDIR, wakeup) once for the
+ * whole batch.  send_event() is the nr == 1 case. */
+static void __send_events(struct proc *p, struct event_queue *ev_q,
+                          struct event_msg *msgs, size_t nr, uint32_t vcoreid)
 {
 	uintptr_t old_proc;
 	struct event_mbox *ev_mbox = 0;
@@ -413,7 +428,10 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 	 * we'll prefer to send it to whatever vcoreid we determined at this point
 	 * (via APPRO or whatever). */
 	if (ev_q->ev_flags & EVENT_SPAM_PUBLIC) {
-		spam_public_msg(p, msg, vcoreid, ev_q->ev_flags);
+		/* Each spammed message finds its own vcore, so there's nothing to
+		 * batch here. */
+		for (size_t i = 0; i < nr; i++)
+			spam_public_msg(p, &msgs[i], vcoreid, ev_q->ev_flags);
 		goto wakeup;
 	}
 	/* We aren't spamming and we know the default vcore, and now we need to
@@ -437,7 +455,10 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 		printk("[kernel] Illegal addr for ev_mbox\n");
 		goto out;
 	}
-	post_ev_msg(p, ev_mbox, msg, ev_q->ev_flags);
+	if (nr == 1)
+		post_ev_msg(p, ev_mbox, msgs, ev_q->ev_flags);
+	else
+		post_ev_msgs(p, ev_mbox, msgs, nr, ev_q->ev_flags);
 	wmb();	/* ensure ev_msg write is before alerting the vcore */
 	/* Prod/alert a vcore with an IPI or INDIR, if desired.  INDIR will also
 	 * call try_notify (IPI) later */
@@ -456,6 +477,29 @@ out:
 	switch_back(p, old_proc);
 }
 
+/* Send an event to ev_q, based on the parameters in ev_q's flag.  We don't
+ * accept null ev_qs, since the caller ought to be checking before bothering to
+ * make a msg and send it to the event_q.  Vcoreid is who the kernel thinks the
+ * message ought to go to (for IPIs).  Appropriate for things like
+ * EV_PREEMPT_PENDING, where we tell the affected vcore.  To have the message go
+ * where the kernel suggests, set EVENT_VCORE_APPRO(priate). */
+void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
+                uint32_t vcoreid)
+{
+	__send_events(p, ev_q, msg, 1, vcoreid);
+}
+
+/* Like send_event(), but for a burst of nr msgs to the same ev_q.  The msgs are
+ * posted with batched slot reservations, and the vcore gets one IPI / INDIR for
+ * the lot, instead of one per message. */
+void send_events(struct proc *p, struct event_queue *ev_q,
+                 struct event_msg *msgs, size_t nr, uint32_t vcoreid)
+{
+	if (!nr)
+		return;
+	__send_events(p, ev_q, msgs, nr, vcoreid);
+}
+
 /* Send an event for the kernel event ev_num.  These are the "one sided" kernel
  * initiated events, that require a lookup of the ev_q in procdata.  This is
  * roughly equivalent to the old "proc_notify()" */
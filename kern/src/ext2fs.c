@@ -733,7 +733,7 @@ int ext2_readpage(struct page_map *pm, struct page *page)
 		} else {
 			memset(bh->bh_buffer, 0, pm->pm_host->i_sb->s_blocksize);
 			bh->bh_flags |= BH_DIRTY;
-			atomic_or(&bh->bh_page->pg_flags, PG_DIRTY);
+			pm_page_dirty(bh->bh_page);
 		}
 	}
 	retval = bdev_submit_request(bdev, breq);
@@ -1400,7 +1400,7 @@ int ext2_release(struct inode *inode, struct file *file)
 /* Flushes the file's dirty contents to disc */
 int ext2_fsync(struct file *file, struct dentry *dentry, int datasync)
 {
-	return -1;
+	return generic_file_fsync(file, dentry, datasync);
 }
 
 /* Traditionally, sleeps until there is file activity.  We probably won't
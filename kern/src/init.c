@@ -143,6 +143,7 @@ void kernel_init(multiboot_info_t *mboot_info)
 	vmap_init();
 	hashtable_init();
 	radix_init();
+	block_alloc_init();
 	acpiinit();
 	topology_init();
 	percpu_init();
@@ -162,6 +163,9 @@ static void __kernel_init_part_deux(void *arg)
 	devfs_init();
 	time_init();
 	arch_init();
+	/* needs core_id(), which works once arch_init() has booted the cores */
+	numa_arenas_init();
+	kmem_reclaim_init();
 	block_init();
 	enable_irq();
 	run_linker_funcs();
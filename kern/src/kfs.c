@@ -663,10 +663,11 @@ int kfs_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
-/* Flushes the file's dirty contents to disc */
+/* Flushes the file's dirty contents to disc.  KFS lives in the page cache, so
+ * there's nothing to write back (see kfs_writepage()). */
 int kfs_fsync(struct file *file, struct dentry *dentry, int datasync)
 {
-	return -1;
+	return 0;
 }
 
 /* Traditionally, sleeps until there is file activity.  We probably won't
@@ -83,6 +83,43 @@ void *kmalloc(size_t size, int flags)
 	return buf + sizeof(struct kmalloc_tag);
 }
 
+static void *__kmalloc_init_cache_tag(struct kmem_cache *kc,
+                                      struct kmalloc_tag *tag)
+{
+	tag->flags = KMALLOC_TAG_CACHE;
+	tag->my_cache = kc;
+	tag->canary = KMALLOC_CANARY;
+	kref_init(&tag->kref, __kfree_release, 1);
+	return (void*)tag + sizeof(struct kmalloc_tag);
+}
+
+/* Allocates a buf from @kc, whose objects have room for a kmalloc_tag in front
+ * of the buf.  The buf is a regular kmalloc buf: kfree it, incref it, etc.
+ * This is for callers with their own size classes, who don't want to round up
+ * to the next kmalloc cache.  Returns 0 on failure. */
+void *kmalloc_from_cache(struct kmem_cache *kc, int flags)
+{
+	struct kmalloc_tag *tag;
+
+	tag = kmem_cache_alloc(kc, flags);
+	if (!tag)
+		return NULL;
+	return __kmalloc_init_cache_tag(kc, tag);
+}
+
+/* Bulk version of kmalloc_from_cache(): fills bufs with up to nr bufs, pulled
+ * from the magazines in one pass.  Returns the number allocated. */
+size_t kmalloc_from_cache_bulk(struct kmem_cache *kc, void **bufs, size_t nr,
+                               int flags)
+{
+	size_t got;
+
+	got = kmem_cache_alloc_bulk(kc, bufs, nr, flags);
+	for (size_t i = 0; i < got; i++)
+		bufs[i] = __kmalloc_init_cache_tag(kc, bufs[i]);
+	return got;
+}
+
 void *kzmalloc(size_t size, int flags)
 {
 	void *v = kmalloc(size, flags);
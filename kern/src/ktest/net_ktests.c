@@ -44,6 +44,106 @@ bool test_ptclbsum(void)
 	return true;
 }
 
+#define CSUM_TEST_BUFSIZE		2048
+
+/* Random-ish bytes, with runs of 0xff to push the carries around */
+static void csum_test_fill(uint8_t *buf, int len)
+{
+	uint32_t x = 0x12345678;
+
+	for (int i = 0; i < len; i++) {
+		x = x * 1103515245 + 12345;
+		buf[i] = (i / 256) % 2 ? 0xff : x >> 16;
+	}
+}
+
+/* Every alignment and a spread of lengths, past the 64 byte chunks that the
+ * fast paths work on. */
+bool test_ptclbsum_long(void)
+{
+	uint8_t *buf = kmalloc(CSUM_TEST_BUFSIZE, MEM_WAIT);
+	uint16_t csum, expected;
+	bool ret = true;
+
+	csum_test_fill(buf, CSUM_TEST_BUFSIZE);
+	for (int i = 0; i < 16 && ret; i++) {
+		for (int len = 0; len < CSUM_TEST_BUFSIZE - 16;
+		     len += len < 300 ? 1 : 37) {
+			csum = ptclbsum(buf + i, len);
+			expected = simplesum(buf + i, len);
+			if (csum != expected) {
+				printk("off %d len %d csum %04x expected %04x\n", i, len,
+				       csum, expected);
+				ret = false;
+				break;
+			}
+		}
+	}
+	kfree(buf);
+	return ret;
+}
+
+bool test_ptclbsum_copy(void)
+{
+	uint8_t *src = kmalloc(CSUM_TEST_BUFSIZE, MEM_WAIT);
+	uint8_t *dst = kmalloc(CSUM_TEST_BUFSIZE, MEM_WAIT);
+	uint16_t csum;
+	bool ret = true;
+
+	csum_test_fill(src, CSUM_TEST_BUFSIZE);
+	for (int i = 0; i < 8 && ret; i++) {
+		for (int len = 0; len < CSUM_TEST_BUFSIZE - 16;
+		     len += len < 300 ? 1 : 37) {
+			/* dst is misaligned differently than src */
+			memset(dst, 0, CSUM_TEST_BUFSIZE);
+			csum = ptclbsum_copy(dst + 7 - i, src + i, len);
+			if (csum != simplesum(src + i, len) ||
+			    memcmp(dst + 7 - i, src + i, len) ||
+			    dst[7 - i + len] != 0) {
+				printk("off %d len %d csum %04x expected %04x\n", i, len,
+				       csum, simplesum(src + i, len));
+				ret = false;
+				break;
+			}
+		}
+	}
+	kfree(src);
+	kfree(dst);
+	return ret;
+}
+
+/* A packet whose payload is spread over odd-sized extra_data buffers gets the
+ * same checksum from linearizeblock_csum as from ptclcsum_finalize. */
+bool test_linearizeblock_csum(void)
+{
+	int sizes[] = {13, 1, 64, 1000, 3, 200};
+	struct block *b, *ref;
+	uint8_t *buf;
+	int start = 20, off = 16;
+
+	b = block_alloc(64, MEM_WAIT);
+	csum_test_fill(b->wp, 40);
+	b->wp += 40;
+	for (int i = 0; i < ARRAY_SIZE(sizes); i++) {
+		buf = kmalloc(sizes[i], MEM_WAIT);
+		csum_test_fill(buf, sizes[i]);
+		KT_ASSERT(!block_append_extra(b, (uintptr_t)buf, 0, sizes[i],
+		                              MEM_WAIT));
+	}
+	b->flag |= Btcpck;
+	b->checksum_start = start;
+	b->checksum_offset = off;
+	ref = copyblock(b, MEM_WAIT);
+	ptclcsum_finalize(ref, 0);
+	b = linearizeblock_csum(b);
+	KT_ASSERT(!b->extra_len && !(b->flag & BCKSUM_FLAGS));
+	KT_ASSERT(BLEN(b) == BLEN(ref));
+	KT_ASSERT(!memcmp(b->rp, ref->rp, BLEN(b)));
+	freeb(b);
+	freeb(ref);
+	return true;
+}
+
 #define CSUM_BENCH_BUFSIZE 4000
 
 bool test_simplesum_bench(void)
@@ -80,10 +180,191 @@ bool test_ptclbsum_bench(void)
 	return true;
 }
 
+/* Sizes for each block class and the edges of the classes, plus one that is
+ * too big for any of them. */
+static size_t block_test_sizes[] = {0, 40, 256, 257, 1514, 2048, 9018, 9792,
+                                    16384};
+
+bool test_block_alloc(void)
+{
+	struct block *b;
+	size_t size;
+
+	for (int i = 0; i < ARRAY_SIZE(block_test_sizes); i++) {
+		size = block_test_sizes[i];
+		b = block_alloc(size, MEM_WAIT);
+		KT_ASSERT(b);
+		KT_ASSERT_M("No header space", b->rp > b->base);
+		KT_ASSERT_M("Not enough room", b->lim - b->wp >= size);
+		KT_ASSERT(BLEN(b) == 0);
+		memset(b->wp, 0xab, size);
+		b->wp += size;
+		checkb(b, "test_block_alloc");
+		/* The stack increfs blocks when extra_data points at their bodies */
+		kmalloc_incref(b);
+		KT_ASSERT(kmalloc_refcnt(b) == 2);
+		KT_ASSERT(freeb(b) == size);
+		kfree(b);
+	}
+	return true;
+}
+
+#define BLOCK_BENCH_NR			256
+#define BLOCK_BENCH_LOOPS		1000
+
+/* The old block_alloc(): a kmalloc for the block, Hdrspc, and alignment slop */
+static void *kmalloc_block(size_t size)
+{
+	return kmalloc(sizeof(struct block) + size + 128 + 31, MEM_WAIT);
+}
+
+/* Returns nsec per alloc/free pair */
+static uint64_t block_bench(size_t size, bool old_path)
+{
+	void **bufs = kmalloc(sizeof(void*) * BLOCK_BENCH_NR, MEM_WAIT);
+	uint64_t start;
+
+	start = read_tsc();
+	for (int i = 0; i < BLOCK_BENCH_LOOPS; i++) {
+		for (int j = 0; j < BLOCK_BENCH_NR; j++)
+			bufs[j] = old_path ? kmalloc_block(size)
+			                   : block_alloc(size, MEM_WAIT);
+		for (int j = 0; j < BLOCK_BENCH_NR; j++) {
+			if (old_path)
+				kfree(bufs[j]);
+			else
+				freeb(bufs[j]);
+		}
+	}
+	start = tsc2nsec(read_tsc() - start);
+	kfree(bufs);
+	return start / (BLOCK_BENCH_NR * BLOCK_BENCH_LOOPS);
+}
+
+bool test_block_alloc_bench(void)
+{
+	size_t sizes[] = {40, 1514, 2048, 9018};
+
+	for (int i = 0; i < ARRAY_SIZE(sizes); i++)
+		printk("Size %5d: block_alloc %4llu nsec, kmalloc %4llu nsec\n",
+		       sizes[i], block_bench(sizes[i], FALSE),
+		       block_bench(sizes[i], TRUE));
+	return true;
+}
+
+#define TCP_CC_SIM_MSS			1460
+
+/* Runs the congestion control algorithm cc_name, with or without pacing, over a
+ * simulated path for msecs ms, and returns the goodput in Mbps (or -1 if there
+ * is no such algorithm).
+ *
+ * The path is a bottleneck of mbps with a buffer of a quarter of the BDP, a
+ * base RTT of rtt_ms, and random loss of loss_ppm per MSS.  We step once per
+ * ms: the ACKs for what left the bottleneck an RTT ago come in, we send what
+ * cwind (and the pacing rate) allow, and anything that overflows the buffer is
+ * dropped.  Lost data comes out of in_flight; we don't bother retransmitting
+ * it, since goodput is all we care about.  We cut cwind at most once per RTT,
+ * and don't grow it in between, like real loss recovery. */
+static long tcp_cc_sim(char *cc_name, bool pacing, unsigned int mbps,
+                       unsigned int rtt_ms, unsigned int loss_ppm,
+                       unsigned int msecs)
+{
+	struct tcp_cc_sim *sim;
+	uint64_t rate = (uint64_t)mbps * 125;	/* bytes per ms */
+	uint64_t qmax = rate * rtt_ms / 4;
+	uint64_t queue = 0, in_flight = 0, delivered = 0, loss_acc = 0;
+	uint64_t acked, sent, lost, nr_lost, drained, recovery_end = 0;
+	uint64_t srtt = rtt_ms;
+	uint64_t *acks;
+
+	if (!rate || !rtt_ms || !msecs)
+		return -1;
+	sim = tcp_cc_sim_alloc(cc_name, TCP_CC_SIM_MSS, rtt_ms);
+	if (!sim)
+		return -1;
+	acks = kzmalloc(sizeof(uint64_t) * (rtt_ms + 1), MEM_WAIT);
+	for (uint64_t now = 1; now <= msecs; now++) {
+		acked = acks[now % (rtt_ms + 1)];
+		acks[now % (rtt_ms + 1)] = 0;
+		in_flight -= acked;
+		delivered += acked;
+		if (acked && now >= recovery_end)
+			tcp_cc_sim_ack(sim, acked, now);
+
+		sent = tcp_cc_sim_sendable(sim, in_flight, pacing);
+		in_flight += sent;
+
+		loss_acc += sent * loss_ppm;
+		nr_lost = loss_acc / (1000000ULL * TCP_CC_SIM_MSS);
+		loss_acc -= nr_lost * 1000000ULL * TCP_CC_SIM_MSS;
+		lost = MIN(nr_lost * TCP_CC_SIM_MSS, sent);
+		queue += sent - lost;
+		drained = MIN(queue, rate);
+		queue -= drained;
+		if (queue > qmax) {
+			lost += queue - qmax;
+			queue = qmax;
+		}
+		if (lost) {
+			in_flight -= lost;
+			if (now >= recovery_end) {
+				tcp_cc_sim_loss(sim);
+				recovery_end = now + srtt;
+			}
+		}
+		acks[(now + rtt_ms) % (rtt_ms + 1)] += drained;
+		srtt = rtt_ms + queue / rate;
+		tcp_cc_sim_set_rtt(sim, srtt);
+	}
+	tcp_cc_sim_free(sim);
+	kfree(acks);
+	return delivered * 8 / 1000 / msecs;
+}
+
+/* Lossy paths, from a LAN to a long fat pipe: mbps, rtt_ms, loss_ppm */
+static unsigned int tcp_cc_bench_paths[][3] = {
+	{1000, 1, 100},
+	{10000, 10, 1},
+	{40000, 20, 1},
+	{40000, 50, 1},
+};
+
+#define TCP_CC_BENCH_MSEC		30000
+
+bool test_tcp_cc_bench(void)
+{
+	unsigned int *path;
+	long reno, cubic, reno_p, cubic_p;
+
+	for (int i = 0; i < ARRAY_SIZE(tcp_cc_bench_paths); i++) {
+		path = tcp_cc_bench_paths[i];
+		reno = tcp_cc_sim("reno", FALSE, path[0], path[1], path[2],
+		                  TCP_CC_BENCH_MSEC);
+		cubic = tcp_cc_sim("cubic", FALSE, path[0], path[1], path[2],
+		                   TCP_CC_BENCH_MSEC);
+		reno_p = tcp_cc_sim("reno", TRUE, path[0], path[1], path[2],
+		                    TCP_CC_BENCH_MSEC);
+		cubic_p = tcp_cc_sim("cubic", TRUE, path[0], path[1], path[2],
+		                     TCP_CC_BENCH_MSEC);
+		printk("%5u Mbps %2u ms %3u ppm: reno %5ld cubic %5ld, paced: reno %5ld cubic %5ld Mbps\n",
+		       path[0], path[1], path[2], reno, cubic, reno_p, cubic_p);
+		KT_ASSERT(reno > 0 && cubic > 0 && reno_p > 0 && cubic_p > 0);
+	}
+	/* The whole point of CUBIC: long fat pipes (the last path) after a loss */
+	KT_ASSERT_M("CUBIC should beat Reno on a long fat pipe", cubic > reno);
+	return true;
+}
+
 static struct ktest ktests[] = {
 	KTEST_REG(ptclbsum,				CONFIG_TEST_ptclbsum),
+	KTEST_REG(ptclbsum_long,		CONFIG_TEST_ptclbsum_long),
+	KTEST_REG(ptclbsum_copy,		CONFIG_TEST_ptclbsum_copy),
+	KTEST_REG(linearizeblock_csum,	CONFIG_TEST_linearizeblock_csum),
 	KTEST_REG(simplesum_bench,		CONFIG_TEST_simplesum_bench),
 	KTEST_REG(ptclbsum_bench,		CONFIG_TEST_ptclbsum_bench),
+	KTEST_REG(block_alloc,			CONFIG_TEST_block_alloc),
+	KTEST_REG(block_alloc_bench,	CONFIG_TEST_block_alloc_bench),
+	KTEST_REG(tcp_cc_bench,			CONFIG_TEST_tcp_cc_bench),
 };
 
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
@@ -866,6 +866,7 @@ bool test_ucq(void)
 		uintptr_t old_proc;
 		struct ucq *ucq = (struct ucq*)USTACKTOP;
 		struct event_msg msg;
+		struct event_msg msgs[50];
 
 		printk("Running the alarm handler!\n");
 		printk("NR msg per page: %d\n", NR_MSG_PER_PAGE);
@@ -904,6 +905,14 @@ bool test_ucq(void)
 			send_ucq_msg(ucq, p, &msg);
 		}
 		printk("nr_pages: %d\n", atomic_read(&ucq->nr_extra_pgs));
+		/* 4: send in batches, some of which will straddle pages */
+		printk("[kernel] #4 \n");
+		for (int i = 0; i < 100; i++) {
+			for (int j = 0; j < ARRAY_SIZE(msgs); j++)
+				msgs[j].ev_type = i * ARRAY_SIZE(msgs) + j;
+			send_ucq_msgs(ucq, p, msgs, ARRAY_SIZE(msgs));
+		}
+		printk("nr_pages: %d\n", atomic_read(&ucq->nr_extra_pgs));
 		/* other things we could do:
 		 *  - concurrent producers / consumers...  ugh.
 		 *  - would require a kmsg to another core, instead of a local alarm
@@ -959,6 +968,8 @@ bool test_vm_regions(void)
 	struct proc pr, *p = &pr;	/* too lazy to even create one */
 	int n = 0;
 	TAILQ_INIT(&p->vm_regions);
+	p->vm_root = RB_ROOT;
+	memset(p->vmr_hint, 0, sizeof(p->vmr_hint));
 
 	struct vmr_summary {
 		uintptr_t base;
@@ -1136,6 +1147,81 @@ bool test_radix_tree(void)
 	return true;
 }
 
+/* Sparse tree over a 1M page file: every 1000th key, with every third item
+ * tagged.  Gang lookups should find exactly those, in order. */
+bool test_radix_gang(void)
+{
+	struct radix_tree real_tree = RADIX_INITIALIZER;
+	struct radix_tree *tree = &real_tree;
+	#define RGANG_NR_KEYS (1 << 20)
+	#define RGANG_STRIDE 1000
+	#define RGANG_BATCH 16
+	void *results[RGANG_BATCH];
+	void **slots[RGANG_BATCH];
+	unsigned long keys[RGANG_BATCH];
+	unsigned long idx, expected;
+	int nr, total;
+
+	for (idx = 0; idx < RGANG_NR_KEYS; idx += RGANG_STRIDE) {
+		KT_ASSERT_M("It should be possible to insert sparsely",
+		            !radix_insert(tree, idx, (void*)(idx + 1), 0));
+		if (!(idx % (3 * RGANG_STRIDE)))
+			radix_tag_set(tree, idx, 0);
+	}
+	KT_ASSERT_M("Tree should be tagged", radix_tree_tagged(tree, 0));
+	KT_ASSERT_M("Tree should not have tag 1", !radix_tree_tagged(tree, 1));
+
+	/* Every item but key 0, in order, starting from an unaligned index */
+	expected = RGANG_STRIDE;
+	total = 0;
+	idx = 1;
+	while ((nr = radix_gang_lookup_slot(tree, slots, keys, idx,
+	                                    RGANG_BATCH))) {
+		for (int i = 0; i < nr; i++) {
+			KT_ASSERT_M("Gang lookup should skip holes", keys[i] == expected);
+			KT_ASSERT_M("Slot should hold the item",
+			            *slots[i] == (void*)(expected + 1));
+			expected += RGANG_STRIDE;
+		}
+		total += nr;
+		idx = keys[nr - 1] + 1;
+	}
+	KT_ASSERT_M("Gang lookup should find every item",
+	            total == RGANG_NR_KEYS / RGANG_STRIDE);
+	nr = radix_gang_lookup(tree, results, 0, RGANG_BATCH);
+	KT_ASSERT(nr == RGANG_BATCH && results[1] == (void*)(RGANG_STRIDE + 1));
+
+	/* Only the tagged items */
+	expected = 0;
+	total = 0;
+	idx = 0;
+	while ((nr = radix_tag_gang_lookup_slot(tree, slots, keys, idx,
+	                                        RGANG_BATCH, 0))) {
+		for (int i = 0; i < nr; i++) {
+			KT_ASSERT_M("Tag lookup should only find tagged items",
+			            keys[i] == expected);
+			KT_ASSERT(radix_tag_get(tree, keys[i], 0));
+			expected += 3 * RGANG_STRIDE;
+		}
+		total += nr;
+		idx = keys[nr - 1] + 1;
+	}
+	KT_ASSERT_M("Tag lookup should find every tagged item",
+	            total == (RGANG_NR_KEYS / RGANG_STRIDE + 2) / 3);
+
+	/* Clearing and deleting both drop tags, all the way up */
+	radix_tag_clear(tree, 0, 0);
+	nr = radix_tag_gang_lookup(tree, results, 0, 1, 0);
+	KT_ASSERT_M("Cleared tag should not be found",
+	            nr == 1 && results[0] == (void*)(3 * RGANG_STRIDE + 1));
+	for (idx = 0; idx < RGANG_NR_KEYS; idx += RGANG_STRIDE)
+		radix_delete(tree, idx);
+	KT_ASSERT_M("Deleting should clear tags", !radix_tree_tagged(tree, 0));
+	KT_ASSERT_M("Tree should be empty",
+	            !radix_gang_lookup(tree, results, 0, RGANG_BATCH));
+	return true;
+}
+
 /* Assorted FS tests, which were hanging around in init.c */
 // TODO: remove all the print statements and try to convert most into assertions
 bool test_random_fs(void)
@@ -1833,6 +1919,97 @@ bool test_alarm(void)
 	return true;
 }
 
+#define NR_SCALE_WAITERS 100000
+
+static struct {
+	int nr_fired;
+	bool fired_in_order;
+} alarm_scale;
+
+static void alarm_scale_no_interrupt(struct timer_chain *tchain)
+{
+}
+
+static void alarm_scale_count_fired(struct alarm_waiter *waiter,
+                                    struct hw_trapframe *hw_tf)
+{
+	/* ties fire in the order they were set */
+	if ((long)waiter->data != alarm_scale.nr_fired)
+		alarm_scale.fired_in_order = FALSE;
+	alarm_scale.nr_fired++;
+}
+
+/* Exercises a private tchain with a lot of waiters, checking the ordering and
+ * timing the inserts and cancels.  The tchain has no interrupt source, so
+ * nothing fires unless we trigger it. */
+bool test_alarm_scale(void)
+{
+	struct timer_chain tchain[1];
+	struct alarm_waiter *waiters, *prev, *i;
+	struct rb_node *node;
+	uint64_t start, t_set, t_unset, min_time = -1, seed = 1, base;
+	int j, idx;
+
+	alarm_scale.nr_fired = 0;
+	alarm_scale.fired_in_order = TRUE;
+	init_timer_chain(tchain, alarm_scale_no_interrupt);
+	waiters = kmalloc(sizeof(struct alarm_waiter) * NR_SCALE_WAITERS, MEM_WAIT);
+	/* Far in the future, with plenty of duplicates */
+	base = read_tsc() + (1ULL << 50);
+	for (j = 0; j < NR_SCALE_WAITERS; j++) {
+		init_awaiter_irq(&waiters[j], alarm_scale_count_fired);
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		set_awaiter_abs(&waiters[j], base + (seed >> 48));
+		min_time = MIN(min_time, waiters[j].wake_up_time);
+	}
+	start = read_tsc();
+	for (j = 0; j < NR_SCALE_WAITERS; j++)
+		set_alarm(tchain, &waiters[j]);
+	t_set = read_tsc() - start;
+	KT_ASSERT(tchain->earliest_time == min_time);
+	prev = NULL;
+	for (node = tchain->leftmost; node; node = rb_next(node)) {
+		i = container_of(node, struct alarm_waiter, node);
+		if (prev) {
+			KT_ASSERT(prev->wake_up_time <= i->wake_up_time);
+			if (prev->wake_up_time == i->wake_up_time)
+				KT_ASSERT(prev < i);
+		}
+		prev = i;
+	}
+	KT_ASSERT(tchain->latest_time == prev->wake_up_time);
+	/* Cancel in a different order than we inserted; 7919 is prime */
+	start = read_tsc();
+	for (j = 0; j < NR_SCALE_WAITERS; j++) {
+		idx = (j * 7919ULL) % NR_SCALE_WAITERS;
+		KT_ASSERT(unset_alarm(tchain, &waiters[idx]));
+	}
+	t_unset = read_tsc() - start;
+	KT_ASSERT(!tchain->leftmost);
+	KT_ASSERT(tchain->earliest_time == ALARM_POISON_TIME);
+	KT_ASSERT(tchain->latest_time == ALARM_POISON_TIME);
+	printk("%d waiters: set %llu usec, unset %llu usec\n", NR_SCALE_WAITERS,
+	       tsc2usec(t_set), tsc2usec(t_unset));
+
+	/* Now fire a few that are all due at the same time */
+	for (j = 0; j < 10; j++) {
+		init_awaiter_irq(&waiters[j], alarm_scale_count_fired);
+		waiters[j].data = (void*)(long)j;
+		set_awaiter_abs(&waiters[j], 1);
+		set_alarm(tchain, &waiters[j]);
+	}
+	init_awaiter_irq(&waiters[j], alarm_scale_count_fired);
+	set_awaiter_abs(&waiters[j], base);
+	set_alarm(tchain, &waiters[j]);
+	__trigger_tchain(tchain, NULL);
+	KT_ASSERT(alarm_scale.nr_fired == 10);
+	KT_ASSERT(alarm_scale.fired_in_order);
+	KT_ASSERT(tchain->earliest_time == base);
+	KT_ASSERT(unset_alarm(tchain, &waiters[j]));
+	kfree(waiters);
+	return true;
+}
+
 bool test_kmalloc_incref(void)
 {
 	/* this test is a bit invasive of the kmalloc internals */
@@ -2087,6 +2264,54 @@ out:
 	return passed;
 }
 
+/* Checks that MAP_JUMBO memory is really mapped with a PML2 jumbo (PTE_PS),
+ * and that unmapping part of it leaves regular PTEs for the rest.  Userspace
+ * can only see that its memory works, not how it is mapped. */
+bool test_mmap_jumbo(void)
+{
+	struct proc *tmp;
+	uintptr_t switch_tmp, jva;
+	int err;
+	static const size_t mmap_size = 3 * JPGSIZE;
+	void *addr;
+	pte_t pte;
+	bool passed = FALSE;
+
+	err = proc_alloc(&tmp, 0, 0);
+	KT_ASSERT_M("Failed to alloc a temp proc", err == 0);
+	__proc_set_state(tmp, PROC_RUNNABLE_S);
+	switch_tmp = switch_to(tmp);
+	addr = mmap(tmp, 0, mmap_size, PROT_READ | PROT_WRITE,
+	            MAP_PRIVATE | MAP_ANONYMOUS | MAP_JUMBO | MAP_POPULATE, -1, 0);
+	if (addr == MAP_FAILED)
+		goto out;
+	/* At least one aligned jumbo fits, wherever the mmap landed */
+	jva = ROUNDUP((uintptr_t)addr, JPGSIZE);
+	spin_lock(&tmp->pte_lock);
+	pte = pgdir_walk(tmp->env_pgdir, (void*)jva, 0);
+	passed = pte_walk_okay(pte) && pte_is_mapped(pte) && pte_is_jumbo(pte);
+	spin_unlock(&tmp->pte_lock);
+	if (!passed) {
+		printk("No jumbo at %p: %lu jumbo maps, %lu fallbacks\n", jva,
+		       tmp->nr_jumbo_maps, tmp->nr_jumbo_fallbacks);
+		goto out_munmap;
+	}
+	/* Punching a hole splits the jumbo into regular pages */
+	munmap(tmp, jva + PGSIZE, PGSIZE);
+	spin_lock(&tmp->pte_lock);
+	pte = pgdir_walk(tmp->env_pgdir, (void*)jva, 0);
+	passed = pte_walk_okay(pte) && pte_is_mapped(pte) && !pte_is_jumbo(pte);
+	pte = pgdir_walk(tmp->env_pgdir, (void*)(jva + PGSIZE), 0);
+	passed &= !pte_walk_okay(pte) || !pte_is_mapped(pte);
+	spin_unlock(&tmp->pte_lock);
+out_munmap:
+	munmap(tmp, (uintptr_t)addr, mmap_size);
+out:
+	switch_back(tmp, switch_tmp);
+	proc_decref(tmp);
+	return passed;
+}
+
 bool test_sort(void)
 {
 	int cmp_longs_asc(const void *p1, const void *p2)
@@ -2193,6 +2418,103 @@ bool test_cmdline_parse(void)
 	return TRUE;
 }
 
+/* Readers on other cores hammer pid2proc() while we create and destroy procs.
+ * A reader must only ever get the proc that has the PID it asked for. */
+#define PID_TEST_NR_PROCS		64
+#define PID_TEST_ROUNDS			50
+#define PID_TEST_MAX_READERS	3
+
+static pid_t pid_test_pids[PID_TEST_NR_PROCS];
+static bool pid_test_stop;
+static atomic_t pid_test_nr_running;
+static atomic_t pid_test_nr_errors;
+
+static void __pid_test_reader(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct proc *p;
+	pid_t pid;
+
+	while (!READ_ONCE(pid_test_stop)) {
+		for (int i = 0; i < PID_TEST_NR_PROCS; i++) {
+			pid = READ_ONCE(pid_test_pids[i]);
+			if (!pid)
+				continue;
+			p = pid2proc(pid);
+			if (!p)
+				continue;
+			if (p->pid != pid)
+				atomic_inc(&pid_test_nr_errors);
+			proc_decref(p);
+		}
+	}
+	atomic_dec(&pid_test_nr_running);
+}
+
+static void __pid_test_free_procs(struct proc **procs, int nr)
+{
+	for (int i = 0; i < nr; i++) {
+		proc_destroy(procs[i]);
+		proc_decref(procs[i]);
+	}
+}
+
+/* Returns with *nr_live set to the procs the caller still has to free, so
+ * that a failed assertion doesn't leak them. */
+static bool __pid_test_rounds(struct proc **procs, int *nr_live)
+{
+	struct proc *p;
+	int err;
+
+	for (int r = 0; r < PID_TEST_ROUNDS; r++) {
+		for (int i = 0; i < PID_TEST_NR_PROCS; i++) {
+			err = proc_alloc(&procs[i], 0, 0);
+			KT_ASSERT_M("Failed to alloc a temp proc", !err);
+			__proc_ready(procs[i]);
+			*nr_live = i + 1;
+			WRITE_ONCE(pid_test_pids[i], procs[i]->pid);
+		}
+		for (int i = 0; i < PID_TEST_NR_PROCS; i++) {
+			p = pid2proc(procs[i]->pid);
+			KT_ASSERT_M("Couldn't find a ready proc", p == procs[i]);
+			proc_decref(p);
+		}
+		/* Leave the PIDs in pid_test_pids, so the readers race with the
+		 * frees and look up PIDs that are gone.  A destroyed proc can still
+		 * be found until its last ref is gone, so we don't check that here;
+		 * the readers only check that they never get the wrong proc. */
+		*nr_live = 0;
+		__pid_test_free_procs(procs, PID_TEST_NR_PROCS);
+	}
+	return TRUE;
+}
+
+bool test_pid_table(void)
+{
+	struct proc *procs[PID_TEST_NR_PROCS];
+	int nr_readers = MIN(num_cores - 1, PID_TEST_MAX_READERS);
+	int nr_live = 0;
+	bool ret;
+
+	pid_test_stop = FALSE;
+	atomic_init(&pid_test_nr_errors, 0);
+	atomic_init(&pid_test_nr_running, nr_readers);
+	for (int i = 0; i < nr_readers; i++)
+		send_kernel_message(i + 1, __pid_test_reader, 0, 0, 0, KMSG_ROUTINE);
+	ret = __pid_test_rounds(procs, &nr_live);
+	/* Always stop the readers, even if a round failed: they'd otherwise spin
+	 * on their cores forever. */
+	WRITE_ONCE(pid_test_stop, TRUE);
+	while (atomic_read(&pid_test_nr_running))
+		cpu_relax();
+	memset(pid_test_pids, 0, sizeof(pid_test_pids));
+	__pid_test_free_procs(procs, nr_live);
+	if (!ret)
+		return FALSE;
+	KT_ASSERT_M("pid2proc returned the wrong proc",
+	            !atomic_read(&pid_test_nr_errors));
+	return TRUE;
+}
+
 static struct ktest ktests[] = {
 #ifdef CONFIG_X86
 	KTEST_REG(ipi_sending,        CONFIG_TEST_ipi_sending),
@@ -2213,6 +2535,7 @@ static struct ktest ktests[] = {
 	KTEST_REG(ucq,                CONFIG_TEST_ucq),
 	KTEST_REG(vm_regions,         CONFIG_TEST_vm_regions),
 	KTEST_REG(radix_tree,         CONFIG_TEST_radix_tree),
+	KTEST_REG(radix_gang,         CONFIG_TEST_radix_gang),
 	KTEST_REG(random_fs,          CONFIG_TEST_random_fs),
 	KTEST_REG(kthreads,           CONFIG_TEST_kthreads),
 	KTEST_REG(kref,               CONFIG_TEST_kref),
@@ -2225,11 +2548,14 @@ static struct ktest ktests[] = {
 	KTEST_REG(rwlock,             CONFIG_TEST_rwlock),
 	KTEST_REG(rv,                 CONFIG_TEST_rv),
 	KTEST_REG(alarm,              CONFIG_TEST_alarm),
+	KTEST_REG(alarm_scale,        CONFIG_TEST_alarm_scale),
 	KTEST_REG(kmalloc_incref,     CONFIG_TEST_kmalloc_incref),
 	KTEST_REG(u16pool,            CONFIG_TEST_u16pool),
 	KTEST_REG(uaccess,            CONFIG_TEST_uaccess),
+	KTEST_REG(mmap_jumbo,         CONFIG_TEST_mmap_jumbo),
 	KTEST_REG(sort,               CONFIG_TEST_sort),
 	KTEST_REG(cmdline_parse,      CONFIG_TEST_cmdline_parse),
+	KTEST_REG(pid_table,          CONFIG_TEST_pid_table),
 };
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
 linker_func_1(register_pb_ktests)
@@ -28,7 +28,8 @@
 
 /* These are the only mmap flags that are saved in the VMR.  If we implement
  * more of the mmap interface, we may need to grow this. */
-#define MAP_PERSIST_FLAGS		(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS)
+#define MAP_PERSIST_FLAGS		(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS |   \
+                                 MAP_JUMBO)
 
 struct kmem_cache *vmr_kcache;
 
@@ -51,12 +52,61 @@ void vmr_init(void)
 				       0, 0, NULL);
 }
 
+/* The VMRs are on both the p->vm_regions list, which is sorted and used for
+ * walking neighbors, and the p->vm_root tree, which is used for lookups.  VMRs
+ * never overlap, and a VMR's vm_base never changes once it is in the tree, so
+ * sorting by vm_base also sorts by vm_end. */
+static void vmr_tree_insert(struct proc *p, struct vm_region *vmr)
+{
+	struct rb_node **link = &p->vm_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct vm_region *vm_i;
+
+	while (*link) {
+		parent = *link;
+		vm_i = container_of(parent, struct vm_region, vm_rb);
+		if (vmr->vm_base < vm_i->vm_base)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&vmr->vm_rb, parent, link);
+	rb_insert_color(&vmr->vm_rb, &p->vm_root);
+}
+
+static void vmr_tree_remove(struct proc *p, struct vm_region *vmr)
+{
+	rb_erase(&vmr->vm_rb, &p->vm_root);
+	for (int i = 0; i < NR_VMR_HINTS; i++) {
+		if (p->vmr_hint[i] == vmr)
+			p->vmr_hint[i] = NULL;
+	}
+}
+
+/* Returns the first VMR that ends after va, which is either the one holding va
+ * or the first one after va. */
+static struct vm_region *__find_first_vmr(struct proc *p, uintptr_t va)
+{
+	struct rb_node *node = p->vm_root.rb_node;
+	struct vm_region *vm_i, *ret = NULL;
+
+	while (node) {
+		vm_i = container_of(node, struct vm_region, vm_rb);
+		if (vm_i->vm_end > va) {
+			ret = vm_i;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+	return ret;
+}
+
 /* For now, the caller will set the prot, flags, file, and offset.  In the
  * future, we may put those in here, to do clever things with merging vm_regions
  * that are the same.
  *
- * TODO: take a look at solari's vmem alloc.  And consider keeping these in a
- * tree of some sort for easier lookups. */
+ * TODO: take a look at solari's vmem alloc. */
 struct vm_region *create_vmr(struct proc *p, uintptr_t va, size_t len)
 {
 	struct vm_region *vmr = 0, *vm_i, *vm_next;
@@ -76,8 +126,16 @@ struct vm_region *create_vmr(struct proc *p, uintptr_t va, size_t len)
 		memset(vmr, 0, sizeof(struct vm_region));
 		vmr->vm_base = va;
 		TAILQ_INSERT_HEAD(&p->vm_regions, vmr, vm_link);
+		vmr_tree_insert(p, vmr);
 	} else {
-		TAILQ_FOREACH(vm_i, &p->vm_regions, vm_link) {
+		/* Every gap before the VMR preceding va ends at or before va, so we
+		 * can start our search there. */
+		vm_next = __find_first_vmr(p, va);
+		vm_i = vm_next ? TAILQ_PREV(vm_next, vmr_tailq, vm_link)
+		               : TAILQ_LAST(&p->vm_regions, vmr_tailq);
+		if (!vm_i)
+			vm_i = vm_next;
+		for (; vm_i; vm_i = TAILQ_NEXT(vm_i, vm_link)) {
 			vm_next = TAILQ_NEXT(vm_i, vm_link);
 			gap_end = vm_next ? vm_next->vm_base : UMAPTOP;
 			/* skip til we get past the 'hint' va */
@@ -96,6 +154,7 @@ struct vm_region *create_vmr(struct proc *p, uintptr_t va, size_t len)
 				else
 					vmr->vm_base = vm_i->vm_end;
 				TAILQ_INSERT_AFTER(&p->vm_regions, vm_i, vmr, vm_link);
+				vmr_tree_insert(p, vmr);
 				break;
 			}
 		}
@@ -110,6 +169,20 @@ struct vm_region *create_vmr(struct proc *p, uintptr_t va, size_t len)
 	return vmr;
 }
 
+/* Helper: if va is in a jumbo, remaps the jumbo with regular pages. */
+static void __split_jumbo(struct proc *p, uintptr_t va)
+{
+	pte_t pte;
+
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
+	if (pte_walk_okay(pte) && pte_is_jumbo(pte)) {
+		jumbo_page_split(pa2page(pte_get_paddr(pte)));
+		pgdir_split_jumbo(p->env_pgdir, va);
+	}
+	spin_unlock(&p->pte_lock);
+}
+
 /* Split a VMR at va, returning the new VMR.  It is set up the same way, with
  * file offsets fixed accordingly.  'va' is the beginning of the new one, and
  * must be page aligned. */
@@ -120,6 +193,10 @@ struct vm_region *split_vmr(struct vm_region *old_vmr, uintptr_t va)
 	assert(!PGOFF(va));
 	if ((old_vmr->vm_base >= va) || (old_vmr->vm_end <= va))
 		return 0;
+	/* Jumbos never cross a VMR boundary, so the VMR walkers can treat them as
+	 * a unit. */
+	if ((old_vmr->vm_flags & MAP_JUMBO) && JPGOFF(va))
+		__split_jumbo(old_vmr->vm_proc, va);
 	new_vmr = kmem_cache_alloc(vmr_kcache, 0);
 	TAILQ_INSERT_AFTER(&old_vmr->vm_proc->vm_regions, old_vmr, new_vmr,
 	                   vm_link);
@@ -127,6 +204,7 @@ struct vm_region *split_vmr(struct vm_region *old_vmr, uintptr_t va)
 	new_vmr->vm_base = va;
 	new_vmr->vm_end = old_vmr->vm_end;
 	old_vmr->vm_end = va;
+	vmr_tree_insert(new_vmr->vm_proc, new_vmr);
 	new_vmr->vm_prot = old_vmr->vm_prot;
 	new_vmr->vm_flags = old_vmr->vm_flags;
 	if (old_vmr->vm_file) {
@@ -212,6 +290,7 @@ void destroy_vmr(struct vm_region *vmr)
 		kref_put(&vmr->vm_file->f_kref);
 	}
 	TAILQ_REMOVE(&vmr->vm_proc->vm_regions, vmr, vm_link);
+	vmr_tree_remove(vmr->vm_proc, vmr);
 	kmem_cache_free(vmr_kcache, vmr);
 }
 
@@ -219,11 +298,16 @@ void destroy_vmr(struct vm_region *vmr)
  * if there is none. */
 struct vm_region *find_vmr(struct proc *p, uintptr_t va)
 {
-	struct vm_region *vmr;
-	/* ugly linear seach */
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
-		if ((vmr->vm_base <= va) && (vmr->vm_end > va))
-			return vmr;
+	struct vm_region **hint = &p->vmr_hint[core_id() % NR_VMR_HINTS];
+	struct vm_region *vmr = *hint;
+
+	/* Faults tend to hit the same VMR over and over */
+	if (vmr && (vmr->vm_base <= va) && (vmr->vm_end > va))
+		return vmr;
+	vmr = __find_first_vmr(p, va);
+	if (vmr && (vmr->vm_base <= va)) {
+		*hint = vmr;
+		return vmr;
 	}
 	return 0;
 }
@@ -232,15 +316,7 @@ struct vm_region *find_vmr(struct proc *p, uintptr_t va)
  * none. */
 struct vm_region *find_first_vmr(struct proc *p, uintptr_t va)
 {
-	struct vm_region *vmr;
-	/* ugly linear seach */
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
-		if ((vmr->vm_base <= va) && (vmr->vm_end > va))
-			return vmr;
-		if (vmr->vm_base > va)
-			return vmr;
-	}
-	return 0;
+	return __find_first_vmr(p, va);
 }
 
 /* Makes sure that no VMRs cross either the start or end of the given region
@@ -250,7 +326,6 @@ void isolate_vmrs(struct proc *p, uintptr_t va, size_t len)
 	struct vm_region *vmr;
 	if ((vmr = find_vmr(p, va)))
 		split_vmr(vmr, va);
-	/* TODO: don't want to do another find (linear search) */
 	if ((vmr = find_vmr(p, va + len)))
 		split_vmr(vmr, va + len);
 }
@@ -267,6 +342,10 @@ void unmap_and_destroy_vmrs(struct proc *p)
 		/* note this CB sets the PTE = 0, regardless of if it was P or not */
 		env_user_mem_walk(p, (void*)vmr_i->vm_base,
 		                  vmr_i->vm_end - vmr_i->vm_base, __vmr_free_pgs, 0);
+		if (vmr_i->vm_flags & MAP_JUMBO)
+			env_user_jumbo_walk(p, (void*)vmr_i->vm_base,
+			                    vmr_i->vm_end - vmr_i->vm_base,
+			                    __vmr_free_pgs, 0);
 	}
 	spin_unlock(&p->pte_lock);
 	/* need the safe style, since destroy_vmr modifies the list.  also, we want
@@ -276,9 +355,44 @@ void unmap_and_destroy_vmrs(struct proc *p)
 	spin_unlock(&p->vmr_lock);
 }
 
+/* Helper: copies a jumbo from p to new_p.  If we can't get a jumbo for new_p,
+ * we copy it into regular pages. */
+static int copy_jumbo(struct proc *p, pte_t pte, void *va, void *arg)
+{
+	struct proc *new_p = (struct proc*)arg;
+	void *src = KADDR(pte_get_paddr(pte));
+	/* PTE_PS is the PAT bit in a regular PTE */
+	int settings = pte_get_settings(pte) & ~PTE_PS;
+	struct page *pp;
+
+	if (pte_is_unmapped(pte))
+		return 0;
+	pp = jumbo_page_alloc();
+	if (pp) {
+		memcpy(page2kva(pp), src, JPGSIZE);
+		if (!pgdir_map_jumbo(new_p->env_pgdir, (uintptr_t)va, page2pa(pp),
+		                     settings)) {
+			new_p->nr_jumbo_maps++;
+			return 0;
+		}
+		page_decref(pp);
+	}
+	new_p->nr_jumbo_fallbacks++;
+	for (int i = 0; i < NR_PGS_PER_JPG; i++) {
+		if (upage_alloc(new_p, &pp, 0))
+			return -ENOMEM;
+		memcpy(page2kva(pp), src + i * PGSIZE, PGSIZE);
+		if (page_insert(new_p->env_pgdir, pp, va + i * PGSIZE, settings)) {
+			page_decref(pp);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
 /* Helper: copies the contents of pages from p to new p.  For pages that aren't
  * present, once we support swapping or CoW, we can do something more
- * intelligent.  0 on success, -ERROR on failure.  Can't handle jumbos. */
+ * intelligent.  0 on success, -ERROR on failure. */
 static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
                       uintptr_t va_end)
 {
@@ -300,7 +414,6 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		/* pages could be !P, but right now that's only for file backed VMRs
 		 * undergoing page removal, which isn't the caller of copy_pages. */
 		if (pte_is_mapped(pte)) {
-			/* TODO: check for jumbos */
 			if (upage_alloc(new_p, &pp, 0))
 				return -ENOMEM;
 			memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), PGSIZE);
@@ -318,8 +431,14 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		}
 		return 0;
 	}
-	return env_user_mem_walk(p, (void*)va_start, va_end - va_start, &copy_page,
-	                         new_p);
+	int ret;
+
+	ret = env_user_mem_walk(p, (void*)va_start, va_end - va_start, &copy_page,
+	                        new_p);
+	if (ret)
+		return ret;
+	return env_user_jumbo_walk(p, (void*)va_start, va_end - va_start,
+	                           &copy_jumbo, new_p);
 }
 
 static int fill_vmr(struct proc *p, struct proc *new_p, struct vm_region *vmr)
@@ -385,29 +504,49 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 				pm_remove_vmr(file2pm(vm_i->vm_file), vmr);
 				kref_put(&vm_i->vm_file->f_kref);
 			}
-			kmem_cache_free(vmr_kcache, vm_i);
+			kmem_cache_free(vmr_kcache, vmr);
 			return ret;
 		}
 		TAILQ_INSERT_TAIL(&new_p->vm_regions, vmr, vm_link);
+		vmr_tree_insert(new_p, vmr);
 	}
 	return 0;
 }
 
+static int __count_jumbo(struct proc *p, pte_t pte, void *va, void *arg)
+{
+	if (pte_is_mapped(pte))
+		(*(unsigned long*)arg)++;
+	return 0;
+}
+
 void print_vmrs(struct proc *p)
 {
 	int count = 0;
 	struct vm_region *vmr;
+	unsigned long nr_jumbos;
+
 	printk("VM Regions for proc %d\n", p->pid);
 	printk("NR:"
 	       "                                     Range:"
 	       "       Prot,"
 	       "      Flags,"
 	       "               File,"
-	       "                Off\n");
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link)
-		printk("%02d: (%p - %p): 0x%08x, 0x%08x, %p, %p\n", count++,
+	       "                Off,"
+	       " Jumbos\n");
+	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
+		nr_jumbos = 0;
+		/* Unlocked, like the rest of this */
+		if (vmr->vm_flags & MAP_JUMBO)
+			env_user_jumbo_walk(p, (void*)vmr->vm_base,
+			                    vmr->vm_end - vmr->vm_base, __count_jumbo,
+			                    &nr_jumbos);
+		printk("%02d: (%p - %p): 0x%08x, 0x%08x, %p, %p, %lu\n", count++,
 		       vmr->vm_base, vmr->vm_end, vmr->vm_prot, vmr->vm_flags,
-		       vmr->vm_file, vmr->vm_foff);
+		       vmr->vm_file, vmr->vm_foff, nr_jumbos);
+	}
+	printk("Jumbo maps: %lu, fallbacks to regular pages: %lu\n",
+	       p->nr_jumbo_maps, p->nr_jumbo_fallbacks);
 }
 
 void enumerate_vmrs(struct proc *p,
@@ -597,14 +736,72 @@ static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
 	return 0;
 }
 
+/* Helper, maps a zeroed jumbo at va, which must be JPGSIZE aligned.  Returns 0
+ * if a jumbo is mapped there (possibly by someone else), or an error if the
+ * caller should use regular pages: either we're out of jumbos (fragmentation)
+ * or va already has regular pages near it. */
+static int map_jumbo_at_addr(struct proc *p, uintptr_t va, int prot)
+{
+	struct page *head;
+	pte_t pte;
+	int ret;
+
+	/* Cheap check before we zero a jumbo: without create, the walk only finds
+	 * a PTE if there's already a jumbo or a page table for regular pages. */
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
+	ret = !pte_walk_okay(pte) ? 0 : pte_is_jumbo(pte) ? -EEXIST : -EBUSY;
+	spin_unlock(&p->pte_lock);
+	if (ret == -EEXIST)
+		return 0;
+	if (ret) {
+		p->nr_jumbo_fallbacks++;
+		return ret;
+	}
+	head = jumbo_page_alloc();
+	if (!head) {
+		p->nr_jumbo_fallbacks++;
+		return -ENOMEM;
+	}
+	memset(page2kva(head), 0, JPGSIZE);
+	spin_lock(&p->pte_lock);
+	ret = pgdir_map_jumbo(p->env_pgdir, va, page2pa(head), prot);
+	spin_unlock(&p->pte_lock);
+	if (ret) {
+		page_decref(head);
+		if (ret == -EEXIST)
+			return 0;
+		p->nr_jumbo_fallbacks++;
+		return ret;
+	}
+	p->nr_jumbo_maps++;
+	return 0;
+}
+
+/* Helper, TRUE if the JPGSIZE chunk around va can be a jumbo in vmr. */
+static bool vmr_jumbo_ok(struct vm_region *vmr, uintptr_t va)
+{
+	uintptr_t jva = ROUNDDOWN(va, JPGSIZE);
+
+	return (vmr->vm_flags & MAP_JUMBO) && !vmr->vm_file &&
+	       (jva >= vmr->vm_base) && (jva + JPGSIZE <= vmr->vm_end);
+}
+
 /* Hold the VMR lock when you call this - it'll assume the entire VA range is
- * mappable, which isn't true if there are concurrent changes to the VMRs. */
+ * mappable, which isn't true if there are concurrent changes to the VMRs.  If
+ * jumbo is set, we'll use jumbos for any aligned JPGSIZE chunks in the range. */
 static int populate_anon_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
-                            int pte_prot)
+                            int pte_prot, bool jumbo)
 {
 	struct page *page;
 	int ret;
 	for (long i = 0; i < nr_pgs; i++) {
+		if (jumbo && !JPGOFF(va + i * PGSIZE) &&
+		    (nr_pgs - i >= NR_PGS_PER_JPG) &&
+		    !map_jumbo_at_addr(p, va + i * PGSIZE, pte_prot)) {
+			i += NR_PGS_PER_JPG - 1;
+			continue;
+		}
 		if (upage_alloc(p, &page, TRUE))
 			return -ENOMEM;
 		/* could imagine doing a memwalk instead of a for loop */
@@ -750,7 +947,8 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 		unsigned long nr_pgs = len >> PGSHIFT;
 		int ret = 0;
 		if (!file) {
-			ret = populate_anon_va(p, addr, nr_pgs, pte_prot);
+			ret = populate_anon_va(p, addr, nr_pgs, pte_prot,
+			                       flags & MAP_JUMBO);
 		} else {
 			/* Note: this will unlock if it blocks.  our refcnt on the file
 			 * keeps the pm alive when we unlock */
@@ -808,8 +1006,7 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 	               (prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : PTE_NONE;
 
 	/* TODO: this is aggressively splitting, when we might not need to if the
-	 * prots are the same as the previous.  Plus, there are three excessive
-	 * scans. */
+	 * prots are the same as the previous. */
 	isolate_vmrs(p, addr, len);
 	vmr = find_first_vmr(p, addr);
 	while (vmr && vmr->vm_base < addr + len) {
@@ -831,6 +1028,9 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 			if (pte_walk_okay(pte) && pte_is_mapped(pte)) {
 				pte_replace_perm(pte, pte_prot);
 				shootdown_needed = TRUE;
+				/* A jumbo is entirely in this VMR; skip the rest of it */
+				if ((vmr->vm_flags & MAP_JUMBO) && pte_is_jumbo(pte))
+					va = ROUNDUP(va + 1, JPGSIZE) - PGSIZE;
 			}
 		}
 		spin_unlock(&p->pte_lock);
@@ -919,8 +1119,6 @@ int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 	struct vm_region *vmr, *next_vmr, *first_vmr;
 	bool shootdown_needed = FALSE;
 
-	/* TODO: this will be a bit slow, since we end up doing three linear
-	 * searches (two in isolate, one in find_first). */
 	isolate_vmrs(p, addr, len);
 	first_vmr = find_first_vmr(p, addr);
 	vmr = first_vmr;
@@ -928,6 +1126,10 @@ int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 	while (vmr && vmr->vm_base < addr + len) {
 		env_user_mem_walk(p, (void*)vmr->vm_base, vmr->vm_end - vmr->vm_base,
 		                  __munmap_mark_not_present, &shootdown_needed);
+		if (vmr->vm_flags & MAP_JUMBO)
+			env_user_jumbo_walk(p, (void*)vmr->vm_base,
+			                    vmr->vm_end - vmr->vm_base,
+			                    __munmap_mark_not_present, &shootdown_needed);
 		vmr = TAILQ_NEXT(vmr, vm_link);
 	}
 	spin_unlock(&p->pte_lock);
@@ -943,6 +1145,9 @@ int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 		spin_lock(&p->pte_lock);	/* changing PTEs */
 		env_user_mem_walk(p, (void*)vmr->vm_base, vmr->vm_end - vmr->vm_base,
 			              __vmr_free_pgs, 0);
+		if (vmr->vm_flags & MAP_JUMBO)
+			env_user_jumbo_walk(p, (void*)vmr->vm_base,
+			                    vmr->vm_end - vmr->vm_base, __vmr_free_pgs, 0);
 		spin_unlock(&p->pte_lock);
 		next_vmr = TAILQ_NEXT(vmr, vm_link);
 		destroy_vmr(vmr);
@@ -951,6 +1156,53 @@ int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 	return 0;
 }
 
+/* Pins the pages backing [uva, uva + len) into pages[], for IO that will point
+ * at them instead of copying.  Only anonymous, private memory that is already
+ * faulted in qualifies.  Returns the number of pages pinned, or 0 if any of the
+ * range doesn't qualify, in which case nothing is pinned and the caller should
+ * copy instead.  Drop the pins with page_unpin().
+ *
+ * We hold the pte_lock while pinning, which is what munmap holds while it
+ * decrefs the pages.  A page unmapped after that is orphaned, not freed. */
+int pin_user_pages(struct proc *p, void *uva, size_t len, struct page **pages)
+{
+	uintptr_t va = ROUNDDOWN((uintptr_t)uva, PGSIZE);
+	uintptr_t end = ROUNDUP((uintptr_t)uva + len, PGSIZE);
+	struct vm_region *vmr = NULL;
+	struct page *page;
+	pte_t pte;
+	int nr_pgs = 0;
+
+	if (!len || !is_user_raddr(uva, len))
+		return 0;
+	spin_lock(&p->vmr_lock);
+	spin_lock(&p->pte_lock);
+	for (; va < end; va += PGSIZE) {
+		if (!vmr || va >= vmr->vm_end) {
+			vmr = find_vmr(p, va);
+			if (!vmr || vmr->vm_file || !(vmr->vm_prot & PROT_READ) ||
+			    (vmr->vm_flags & (MAP_SHARED | MAP_JUMBO)))
+				goto out_none;
+		}
+		pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
+		if (!pte_walk_okay(pte) || !pte_is_present(pte) || pte_is_jumbo(pte))
+			goto out_none;
+		page = pa2page(pte_get_paddr(pte));
+		if (atomic_read(&page->pg_flags) & (PG_JUMBO | PG_PAGEMAP))
+			goto out_none;
+		pages[nr_pgs++] = page;
+	}
+	for (int i = 0; i < nr_pgs; i++)
+		page_pin(pages[i]);
+	spin_unlock(&p->pte_lock);
+	spin_unlock(&p->vmr_lock);
+	return nr_pgs;
+out_none:
+	spin_unlock(&p->pte_lock);
+	spin_unlock(&p->vmr_lock);
+	return 0;
+}
+
 /* Helper - drop the page differently based on where it is from */
 static void __put_page(struct page *page)
 {
@@ -1027,6 +1279,7 @@ static int __hpf(struct proc *p, uintptr_t va, int prot, bool file_ok)
 	struct vm_region *vmr;
 	struct page *a_page;
 	unsigned int f_idx;	/* index of the missing page in the file */
+	int pte_prot;
 	int ret = 0;
 	bool first = TRUE;
 	va = ROUNDDOWN(va,PGSIZE);
@@ -1045,8 +1298,13 @@ refault:
 		ret = -EPERM;
 		goto out;
 	}
+	pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
+	           (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	if (!vmr->vm_file) {
-		/* No file - just want anonymous memory */
+		/* No file - just want anonymous memory, ideally a whole jumbo */
+		if (vmr_jumbo_ok(vmr, va) &&
+		    !map_jumbo_at_addr(p, ROUNDDOWN(va, JPGSIZE), pte_prot))
+			goto out;
 		if (upage_alloc(p, &a_page, TRUE)) {
 			ret = -ENOMEM;
 			goto out;
@@ -1077,10 +1335,14 @@ refault:
 			ret = -ESPIPE; /* linux sends a SIGBUS at access time */
 			goto out;
 		}
+		/* only count the first attempt, not the refault after we load */
+		if (first)
+			file_readahead(vmr->vm_file, f_idx, 1);
 		ret = pm_load_page_nowait(vmr->vm_file->f_mapping, f_idx, &a_page);
 		if (ret) {
 			if (ret != -EAGAIN)
 				goto out;
+			vmr->vm_file->f_ra.nr_misses++;
 			/* keep the file alive after we unlock */
 			kref_get(&vmr->vm_file->f_kref, 1);
 			spin_unlock(&p->vmr_lock);
@@ -1092,6 +1354,8 @@ refault:
 				return ret;
 			goto refault;
 		}
+		if (first)
+			vmr->vm_file->f_ra.nr_hits++;
 		/* If we want a private map, we'll preemptively give you a new page.  We
 		 * used to just care if it was private and writable, but were running
 		 * into issues with libc changing its mapping (map private, then
@@ -1109,8 +1373,6 @@ refault:
 	}
 	/* update the page table TODO: careful with MAP_PRIVATE etc.  might do this
 	 * separately (file, no file) */
-	int pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
-	               (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	ret = map_page_at_addr(p, a_page, va, pte_prot, page_is_pagemap(a_page));
 	/* fall through, even for errors */
 out_put_pg:
@@ -1159,7 +1421,8 @@ unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs)
 		           (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 		nr_pgs_this_vmr = MIN(nr_pgs, (vmr->vm_end - va) >> PGSHIFT);
 		if (!vmr->vm_file) {
-			if (populate_anon_va(p, va, nr_pgs_this_vmr, pte_prot)) {
+			if (populate_anon_va(p, va, nr_pgs_this_vmr, pte_prot,
+			                     vmr->vm_flags & MAP_JUMBO)) {
 				/* on any error, we can just bail.  we might be underestimating
 				 * nr_filled. */
 				break;
@@ -24,6 +24,7 @@
 #include <trap.h>
 #include <time.h>
 #include <percpu.h>
+#include <arsc_server.h>
 
 #include <ros/memlayout.h>
 #include <ros/event.h>
@@ -1140,6 +1141,7 @@ int mon_db(int argc, char **argv, struct hw_trapframe *hw_tf)
 		printk("Usage: db OPTION\n");
 		printk("\tsem [PID]: print all semaphore info\n");
 		printk("\taddr PID 0xADDR: for PID lookup ADDR's file/vmr info\n");
+		printk("\tarsc: print ARSC server stats\n");
 		return 1;
 	}
 	if (!strcmp(argv[1], "sem")) {
@@ -1152,6 +1154,8 @@ int mon_db(int argc, char **argv, struct hw_trapframe *hw_tf)
 			return 1;
 		}
 		debug_addr_pid(strtol(argv[2], 0, 10), strtol(argv[3], 0, 16));
+	} else if (!strcmp(argv[1], "arsc")) {
+		print_arsc_stats();
 	} else {
 		printk("Bad option\n");
 		return 1;
@@ -1339,6 +1339,18 @@ static void ttlctlmsg(struct conv *c, struct cmdbuf *cb)
 		c->ttl = atoi(cb->f[1]);
 }
 
+/* "zerocopy <event_queue>" makes large writes from the caller point at its
+ * pages instead of copying, see q_zerocopy().  "zerocopy off" stops. */
+static void zerocopyctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	if (cb->nf < 2)
+		error(EFAIL, "zerocopy needs an event_queue or 'off'");
+	if (strcmp(cb->f[1], "off") == 0)
+		q_zerocopy(c->wq, NULL);
+	else
+		q_zerocopy(c->wq, (struct event_queue*)strtoul(cb->f[1], 0, 0));
+}
+
 /* Binds a conversation, as if the user wrote "bind *" into ctl. */
 static void autobind(struct conv *cv)
 {
@@ -1420,6 +1432,8 @@ static long ipwrite(struct chan *ch, void *v, long n, int64_t off)
 				ttlctlmsg(c, cb);
 			else if (strcmp(cb->f[0], "tos") == 0)
 				tosctlmsg(c, cb);
+			else if (strcmp(cb->f[0], "zerocopy") == 0)
+				zerocopyctlmsg(c, cb);
 			else if (strcmp(cb->f[0], "ignoreadvice") == 0)
 				c->ignoreadvice = 1;
 			else if (strcmp(cb->f[0], "addmulti") == 0) {
@@ -72,6 +72,7 @@ static int multicastea(uint8_t * ea, uint8_t * ip);
 static void recvarpproc(void *);
 static void resolveaddr6(struct Ipifc *ifc, struct arpent *a);
 static void etherpref2addr(uint8_t * pref, uint8_t * ea);
+static int etherstats(struct Ipifc *ifc, char *buf, int len);
 
 struct medium ethermedium = {
 	.name = "ether",
@@ -87,6 +88,8 @@ struct medium ethermedium = {
 	.ares = arpenter,
 	.areg = sendgarp,
 	.pref2addr = etherpref2addr,
+	.stats = etherstats,
+	.gso = 1,
 };
 
 struct medium trexmedium = {
@@ -103,6 +106,28 @@ struct medium trexmedium = {
 	.ares = arpenter,
 	.areg = sendgarp,
 	.pref2addr = etherpref2addr,
+	.stats = etherstats,
+	.gso = 1,
+};
+
+/*
+ *  per-core receive queue.  etherread4 steers each v4 packet to one of these by
+ *  its flow hash, and the IP input path for the flow runs on 'core'.
+ */
+struct etherrxq {
+	struct Ipifc *ifc;
+	struct queue *q;
+	int core;
+	atomic_t scheduled;			/* drain kmsg sent, not yet finished */
+	uint64_t pkts;				/* only touched on 'core' */
+	uint64_t batches;			/* ditto */
+	uint64_t drops;				/* only touched by etherread4 */
+	struct ipgro gro;			/* only touched on 'core' */
+};
+
+enum {
+	Maxrxq = 64,
+	Etherrxqlimit = 256 * 1024,
 };
 
 typedef struct Etherrock Etherrock;
@@ -116,6 +141,8 @@ struct Etherrock {
 	struct chan *cchan4;		/* Control channel for v4 */
 	struct chan *mchan6;		/* Data channel for v6 */
 	struct chan *cchan6;		/* Control channel for v6 */
+	int nr_rxq;					/* 0 => etherread4 does all v4 input */
+	struct etherrxq *rxq;
 };
 
 /*
@@ -166,6 +193,32 @@ static unsigned int parsefeat(char *ptr)
 	return feat;
 }
 
+/*
+ *  the optional 'rxq core...' bind arguments: one receive queue per core
+ *  listed.  returns the number of queues, filling in 'cores'.
+ */
+static int parserxq(int argc, char **argv, int *cores, int max)
+{
+	int i, n;
+	char *end;
+
+	if (argc < 4)
+		return 0;
+	if (strcmp(argv[3], "rxq") != 0)
+		error(EINVAL, "unknown ether bind option %s", argv[3]);
+	n = argc - 4;
+	if (n == 0 || n > max)
+		error(EINVAL, "need 1 to %d rxq cores", max);
+	for (i = 0; i < n; i++) {
+		cores[i] = strtol(argv[4 + i], &end, 0);
+		if (*end || cores[i] < 0 || cores[i] >= num_cores)
+			error(EINVAL, "bad rxq core %s", argv[4 + i]);
+	}
+	return n;
+}
+
+static void etherrxq_kick(void *arg);
+
 /*
  *  called to bind an IP ifc to an ethernet device
  *  called with ifc wlock'd
@@ -175,12 +228,15 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	ERRSTACK(1);
 	struct chan *mchan4, *cchan4, *achan, *mchan6, *cchan6;
 	char *addr, *dir, *buf;
-	int fd, cfd, n;
+	int fd, cfd, n, nr_rxq;
+	int rxq_cores[Maxrxq];
 	char *ptr;
 	Etherrock *er;
+	struct etherrxq *rxq;
 
 	if (argc < 2)
 		error(EINVAL, ERROR_FIXME);
+	nr_rxq = parserxq(argc, argv, rxq_cores, ARRAY_SIZE(rxq_cores));
 
 	addr = kmalloc(Maxpath, MEM_WAIT);	//char addr[2*KNAMELEN];
 	dir = kmalloc(Maxpath, MEM_WAIT);	//char addr[2*KNAMELEN];
@@ -297,6 +353,17 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	er->mchan6 = mchan6;
 	er->cchan6 = cchan6;
 	er->f = ifc->conv->p->f;
+	er->nr_rxq = nr_rxq;
+	if (nr_rxq) {
+		er->rxq = kzmalloc(sizeof(struct etherrxq) * nr_rxq, MEM_WAIT);
+		for (int i = 0; i < nr_rxq; i++) {
+			rxq = &er->rxq[i];
+			rxq->ifc = ifc;
+			rxq->core = rxq_cores[i];
+			atomic_init(&rxq->scheduled, FALSE);
+			rxq->q = qopen(Etherrxqlimit, Qmsg, etherrxq_kick, rxq);
+		}
+	}
 	ifc->arg = er;
 
 	kfree(buf);
@@ -342,6 +409,11 @@ static void etherunbind(struct Ipifc *ifc)
 		cclose(er->mchan6);
 	if (er->cchan6 != NULL)
 		cclose(er->cchan6);
+	for (int i = 0; i < er->nr_rxq; i++) {
+		qfree(er->rxq[i].q);
+		freeb(er->rxq[i].gro.head);
+	}
+	kfree(er->rxq);
 
 	kfree(er);
 }
@@ -359,13 +431,125 @@ static inline void etherfilladdr(uint16_t *pkt, uint16_t *dst, uint16_t *src)
 	*pkt = *src;
 }
 
+/*
+ *  add the ether header and hand bp to the device
+ */
+static void etherxmit(struct Ipifc *ifc, struct block *bp, int version,
+                      uint8_t *mac)
+{
+	Etherhdr *eh;
+	Etherrock *er = ifc->arg;
+
+	/* make it a single block with space for the ether header */
+	bp = padblock(bp, ifc->m->hsize);
+	if (bp->next)
+		bp = concatblock(bp);
+	eh = (Etherhdr *) bp->rp;
+
+	/* copy in mac addresses and ether type */
+	etherfilladdr((uint16_t *)bp->rp, (uint16_t *)mac, (uint16_t *)ifc->mac);
+
+	switch (version) {
+		case V4:
+			eh->t[0] = 0x08;
+			eh->t[1] = 0x00;
+			devtab[er->mchan4->type].bwrite(er->mchan4, bp, 0);
+			break;
+		case V6:
+			eh->t[0] = 0x86;
+			eh->t[1] = 0xDD;
+			devtab[er->mchan6->type].bwrite(er->mchan6, bp, 0);
+			break;
+		default:
+			panic("etherbwrite2: version %d", version);
+	}
+	ifc->out++;
+}
+
+/*
+ *  software TSO, for devices without NETF_TSO: cut a v4 TCP Btso packet into
+ *  bp->mss sized segments.  each segment gets its own copy of the headers,
+ *  fixed up, and points at its slice of the payload through extra_data, so the
+ *  payload isn't copied.  the TCP checksum is left as the pseudo-header sum,
+ *  like tcp does, for the device or etheroq to finish.
+ */
+static void ethergso4(struct Ipifc *ifc, struct block *bp, uint8_t *mac)
+{
+	struct block *seg;
+	uint8_t *ip, *th;
+	int iphl, hl, len, off, seglen;
+	uint32_t seq, psum, sum;
+	uint16_t id;
+	uint8_t flags;
+	bool csum;
+
+	bp = pullupblock(bp, 20);
+	if (bp == NULL)
+		return;
+	iphl = (bp->rp[0] & 0x0f) << 2;
+	bp = pullupblock(bp, iphl + 20);
+	if (bp == NULL)
+		return;
+	hl = iphl + ((bp->rp[iphl + 12] >> 4) << 2);
+	bp = pullupblock(bp, hl);
+	if (bp == NULL)
+		return;
+	ip = bp->rp;
+	th = ip + iphl;
+	/* only tcp makes these */
+	if (ip[9] != TCP || !bp->mss) {
+		freeblist(bp);
+		return;
+	}
+	len = blocklen(bp) - hl;
+	id = nhgets(ip + 4);
+	seq = nhgetl(th + 4);
+	flags = th[13];
+	csum = bp->flag & Btcpck;
+	/* the pseudo-header sum, less the TCP length */
+	psum = ptclbsum(ip + 12, 8) + TCP;
+
+	for (off = 0; off < len; off += seglen) {
+		seglen = MIN(bp->mss, len - off);
+		seg = blist_clone(bp, hl, seglen, hl + off);
+		memcpy(seg->wp, ip, hl);
+		seg->wp += hl;
+		ip = seg->rp;
+		th = ip + iphl;
+
+		hnputs(ip + 2, hl + seglen);
+		hnputs(ip + 4, id++);
+		ip[10] = ip[11] = 0;
+		hnputs(ip + 10, ipcsum(ip));
+
+		hnputl(th + 4, seq + off);
+		th[13] = flags;
+		if (off)
+			th[13] &= ~0x80;		/* CWR on the first only */
+		if (off + seglen < len)
+			th[13] &= ~(0x08 | 0x01);	/* PSH and FIN on the last only */
+		if (csum) {
+			sum = psum + hl - iphl + seglen;
+			sum = (sum & 0xffff) + (sum >> 16);
+			sum = (sum & 0xffff) + (sum >> 16);
+			hnputs(th + 16, sum);
+			seg->flag |= Btcpck;
+			seg->checksum_start = iphl;
+			seg->checksum_offset = 16;
+		}
+		seg->transport_header_end = hl;
+		etherxmit(ifc, seg, V4, mac);
+		ip = bp->rp;
+	}
+	freeblist(bp);
+}
+
 /*
  *  called by ipoput with a single block to write with ifc rlock'd
  */
 static void
 etherbwrite(struct Ipifc *ifc, struct block *bp, int version, uint8_t * ip)
 {
-	Etherhdr *eh;
 	struct arpent *a;
 	uint8_t mac[6];
 	Etherrock *er = ifc->arg;
@@ -396,38 +580,204 @@ etherbwrite(struct Ipifc *ifc, struct block *bp, int version, uint8_t * ip)
 		}
 	}
 
-	/* make it a single block with space for the ether header */
-	bp = padblock(bp, ifc->m->hsize);
-	if (bp->next)
-		bp = concatblock(bp);
-	eh = (Etherhdr *) bp->rp;
+	if (version == V4 && (bp->flag & Btso) && !(ifc->feat & NETF_TSO))
+		ethergso4(ifc, bp, mac);
+	else
+		etherxmit(ifc, bp, version, mac);
+}
 
-	/* copy in mac addresses and ether type */
-	etherfilladdr((uint16_t *)bp->rp, (uint16_t *)mac, (uint16_t *)ifc->mac);
+/*
+ *  pass a v4 packet, still carrying its ether header, up to IP, through gro if
+ *  we have one.  drops it if the ifc is being changed.
+ */
+static void etherinput4(struct Ipifc *ifc, struct block *bp,
+                        struct ipgro *gro)
+{
+	ERRSTACK(1);
+	Etherrock *er = ifc->arg;
 
-	switch (version) {
-		case V4:
-			eh->t[0] = 0x08;
-			eh->t[1] = 0x00;
-			devtab[er->mchan4->type].bwrite(er->mchan4, bp, 0);
-			break;
-		case V6:
-			eh->t[0] = 0x86;
-			eh->t[1] = 0xDD;
-			devtab[er->mchan6->type].bwrite(er->mchan6, bp, 0);
-			break;
-		default:
-			panic("etherbwrite2: version %d", version);
+	if (!canrlock(&ifc->rwlock)) {
+		freeb(bp);
+		return;
 	}
-	ifc->out++;
+	if (waserror()) {
+		runlock(&ifc->rwlock);
+		nexterror();
+	}
+	ifc->in++;
+	bp->rp += ifc->m->hsize;
+	if (ifc->lifc == NULL) {
+		freeb(bp);
+	} else {
+		ipifc_trace_block(ifc, bp);
+		if (gro)
+			ipgro_receive(er->f, ifc, gro, bp);
+		else
+			ipiput4(er->f, ifc, bp);
+	}
+	runlock(&ifc->rwlock);
+	poperror();
+}
+
+/*
+ *  push up whatever gro is holding at the end of a batch.
+ */
+static void etherflush4(struct Ipifc *ifc, struct ipgro *gro)
+{
+	ERRSTACK(1);
+	Etherrock *er = ifc->arg;
+
+	if (!gro->head)
+		return;
+	if (!canrlock(&ifc->rwlock)) {
+		freeb(gro->head);
+		gro->head = NULL;
+		return;
+	}
+	if (waserror()) {
+		runlock(&ifc->rwlock);
+		nexterror();
+	}
+	ipgro_flush(er->f, ifc, gro);
+	runlock(&ifc->rwlock);
+	poperror();
+}
+
+/* Microsoft's RSS verification key, which is also what most NICs default to.
+ * Using the same key and hash as the hardware means a flow lands on the same
+ * queue whether or not the driver gave us a hash. */
+static const uint8_t rss_key[40] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/* Toeplitz hash of data[0..len), len <= sizeof(rss_key) - 4 */
+static uint32_t toeplitz_hash(const uint8_t *data, int len)
+{
+	uint32_t hash = 0;
+	uint32_t v = nhgetl((uint8_t*)rss_key);
+
+	for (int i = 0; i < len; i++) {
+		for (int b = 7; b >= 0; b--) {
+			if (data[i] & (1 << b))
+				hash ^= v;
+			v = (v << 1) | ((rss_key[i + 4] >> b) & 1);
+		}
+	}
+	return hash;
 }
 
 /*
- *  process to read from the ethernet
+ *  software RSS: hash the v4 addresses and, for unfragmented TCP and UDP, the
+ *  ports.  fragments only hash the addresses, so they all go to one queue.
+ */
+static uint32_t ether_flow_hash(struct block *bp)
+{
+	uint8_t tuple[12];
+	uint8_t *ip = bp->rp + sizeof(Etherhdr);
+	int len = BHLEN(bp) - sizeof(Etherhdr);
+	int hlen;
+
+	if (len < 20)
+		return 0;
+	memcpy(tuple, ip + 12, 8);
+	hlen = (ip[0] & 0x0f) << 2;
+	if ((ip[9] == TCP || ip[9] == UDP) && !(nhgets(ip + 6) & 0x3fff) &&
+	    len >= hlen + 4) {
+		memcpy(tuple + 8, ip + hlen, 4);
+		return toeplitz_hash(tuple, 12);
+	}
+	return toeplitz_hash(tuple, 8);
+}
+
+/*
+ *  input one packet from an rxq, or flush its gro if bp is nil.  errors stop
+ *  here: if one bad packet ended the drain, the rest would sit in the queue,
+ *  and qio only kicks us when it goes from empty to non-empty.
+ */
+static void etherrxq_input(struct etherrxq *rxq, struct block *bp,
+                           struct ipgro *gro)
+{
+	ERRSTACK(1);
+
+	if (waserror()) {
+		warn("etherrxq on core %d: %s", rxq->core, current_errstr());
+		poperror();
+		return;
+	}
+	if (bp)
+		etherinput4(rxq->ifc, bp, gro);
+	else
+		etherflush4(rxq->ifc, gro);
+	poperror();
+}
+
+/*
+ *  runs on rxq->core, as a routine kmsg, until the queue is empty.
+ */
+static void __etherrxq_drain(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct etherrxq *rxq = (struct etherrxq*)a0;
+	struct ipgro *gro = NULL;
+	struct block *bp;
+
+	/* hardware LRO already did the merging */
+	if (!(rxq->ifc->feat & NETF_LRO))
+		gro = &rxq->gro;
+	enable_irq();
+	do {
+		rxq->batches++;
+		while ((bp = qget(rxq->q))) {
+			rxq->pkts++;
+			etherrxq_input(rxq, bp, gro);
+		}
+		if (gro)
+			etherrxq_input(rxq, NULL, gro);
+		/* etherrxq_kick skips the kmsg while we're scheduled, so once we
+		 * clear it we need to look again for anything that raced in. */
+		atomic_set(&rxq->scheduled, FALSE);
+		mb();
+	} while (qlen(rxq->q) && !atomic_swap(&rxq->scheduled, TRUE));
+	disable_irq();
+}
+
+/*
+ *  called by qio when an rxq goes from empty to non-empty
+ */
+static void etherrxq_kick(void *arg)
+{
+	struct etherrxq *rxq = arg;
+
+	if (!atomic_swap(&rxq->scheduled, TRUE))
+		send_kernel_message(rxq->core, __etherrxq_drain, (long)rxq, 0, 0,
+		                    KMSG_ROUTINE);
+}
+
+static void etherrxq_steer(Etherrock *er, struct block *bp)
+{
+	struct etherrxq *rxq;
+	uint32_t hash;
+
+	if (bp->flag & Brxhash)
+		hash = bp->rx_hash;
+	else
+		hash = ether_flow_hash(bp);
+	rxq = &er->rxq[hash % er->nr_rxq];
+	/* qpass frees the block on overflow */
+	if (qpass(rxq->q, bp) < 0)
+		rxq->drops++;
+}
+
+/*
+ *  process to read from the ethernet.  with rxqs, we only steer packets; the
+ *  per-core rxqs do the protocol input.
  */
 static void etherread4(void *a)
 {
-	ERRSTACK(2);
+	ERRSTACK(1);
 	struct Ipifc *ifc;
 	struct block *bp;
 	Etherrock *er;
@@ -443,24 +793,10 @@ static void etherread4(void *a)
 	}
 	for (;;) {
 		bp = devtab[er->mchan4->type].bread(er->mchan4, 128 * 1024, 0);
-		if (!canrlock(&ifc->rwlock)) {
-			freeb(bp);
-			continue;
-		}
-		if (waserror()) {
-			runlock(&ifc->rwlock);
-			nexterror();
-		}
-		ifc->in++;
-		bp->rp += ifc->m->hsize;
-		if (ifc->lifc == NULL) {
-			freeb(bp);
-		} else {
-			ipifc_trace_block(ifc, bp);
-			ipiput4(er->f, ifc, bp);
-		}
-		runlock(&ifc->rwlock);
-		poperror();
+		if (er->nr_rxq)
+			etherrxq_steer(er, bp);
+		else
+			etherinput4(ifc, bp, NULL);
 	}
 	poperror();
 }
@@ -508,6 +844,22 @@ static void etherread6(void *a)
 	poperror();
 }
 
+static int etherstats(struct Ipifc *ifc, char *buf, int len)
+{
+	Etherrock *er = ifc->arg;
+	struct etherrxq *rxq;
+	char *p = buf, *e = buf + len;
+
+	for (int i = 0; i < er->nr_rxq; i++) {
+		rxq = &er->rxq[i];
+		p = seprintf(p, e,
+		             "%s rxq %d: core %d pkts %lu batches %lu drops %lu qlen %d\n",
+		             ifc->dev, i, rxq->core, rxq->pkts, rxq->batches,
+		             rxq->drops, qlen(rxq->q));
+	}
+	return p - buf;
+}
+
 static void etheraddmulti(struct Ipifc *ifc, uint8_t * a, uint8_t * unused)
 {
 	uint8_t mac[6];
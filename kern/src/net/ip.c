@@ -93,6 +93,8 @@ enum {
 	FragOKs,
 	FragFails,
 	FragCreates,
+	GroPkts,					/* not MIB II: merged packets sent up */
+	GroSegs,					/* segments in those packets */
 
 	Nstats,
 };
@@ -157,6 +159,8 @@ static char *statnames[] = {
 	[FragOKs] "FragOKs",
 	[FragFails] "FragFails",
 	[FragCreates] "FragCreates",
+	[GroPkts] "GroPkts",
+	[GroSegs] "GroSegs",
 };
 
 #define BLKIP(xp)	((struct Ip4hdr*)((xp)->rp))
@@ -561,6 +565,167 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 	freeblist(bp);
 }
 
+/*
+ *  receive offload.  we merge plain v4 TCP segments: no IP options or
+ *  fragments, only ACK (and PSH on the last one) set, the whole packet in one
+ *  kmalloc'd block.  each merged segment's block hangs off the head's
+ *  extra_data, with its off pointing at the payload, so nothing is copied.
+ */
+enum {
+	Gromaxsegs = 16,			/* segments per merged packet */
+	Gromaxusec = 50,			/* how long the head may wait for more */
+	Grotcpack = 0x10,
+	Grotcppsh = 0x08,
+};
+
+/*
+ *  returns the TCP header length if bp can be merged, 0 if not.  verifies the
+ *  checksums, and marks bp so that IP and TCP don't do it again.
+ */
+static int gro_tcp_hlen(struct block *bp)
+{
+	uint8_t *ip = bp->rp;
+	uint8_t *th = ip + IP4HDR;
+	int len, thlen;
+	uint8_t ttl, ck[2];
+
+	if (bp->next || bp->nr_extra_bufs || bp->free || BHLEN(bp) < IP4HDR + 20)
+		return 0;
+	if (ip[0] != (IP_VER4 | IP_HLEN4) || ip[9] != TCP ||
+	    (nhgets(ip + 6) & ~IP_DF))
+		return 0;
+	len = nhgets(ip + 2);
+	thlen = (th[12] >> 4) << 2;
+	if (len > BHLEN(bp) || thlen < 20 || IP4HDR + thlen >= len)
+		return 0;
+	if (th[13] & ~(Grotcpack | Grotcppsh) || !(th[13] & Grotcpack))
+		return 0;
+	if (!(bp->flag & Bipck)) {
+		if (ipcsum(ip))
+			return 0;
+		bp->flag |= Bipck;
+	}
+	if (!(bp->flag & Btcpck)) {
+		/* same pseudo-header trick as tcpiput, put back afterwards */
+		ttl = ip[8];
+		memcpy(ck, ip + 10, 2);
+		ip[8] = 0;
+		hnputs(ip + 10, len - IP4HDR);
+		if (ptclcsum(bp, 8, len - 8))
+			thlen = 0;
+		ip[8] = ttl;
+		memcpy(ip + 10, ck, 2);
+		if (!thlen)
+			return 0;
+		bp->flag |= Btcpck;
+	}
+	/* drop any ethernet padding, so extra_data follows the payload */
+	bp->wp = bp->rp + len;
+	return thlen;
+}
+
+/*
+ *  whether bp, whose TCP header is thlen long, is the next segment of the
+ *  flow gro->head is collecting.
+ */
+static bool gro_is_next(struct ipgro *gro, struct block *bp, int thlen)
+{
+	uint8_t *hip = gro->head->rp, *ip = bp->rp;
+	uint8_t *hth = hip + IP4HDR, *th = ip + IP4HDR;
+	int paylen = BLEN(bp) - IP4HDR - thlen;
+
+	if (paylen > gro->seg_len ||
+	    nhgets(hip + 2) + paylen >= IP_MAX ||
+	    (hth[12] >> 4) << 2 != thlen ||
+	    nhgetl(th + 4) != gro->next_seq)
+		return FALSE;
+	/* tos, ttl, addrs, ports, ack and window */
+	if (hip[1] != ip[1] || hip[8] != ip[8] || memcmp(hip + 12, ip + 12, 8) ||
+	    memcmp(hth, th, 4) || memcmp(hth + 8, th + 8, 4) ||
+	    memcmp(hth + 14, th + 14, 2))
+		return FALSE;
+	/* options (timestamps, usually) must match too */
+	return !memcmp(hth + 20, th + 20, thlen - 20);
+}
+
+/*
+ *  send whatever gro is holding up the stack.  called with the ifc rlocked,
+ *  at the end of each input batch, so nothing waits on the next packet.
+ */
+void ipgro_flush(struct Fs *f, struct Ipifc *ifc, struct ipgro *gro)
+{
+	struct block *bp = gro->head;
+	uint8_t *ip;
+
+	if (!bp)
+		return;
+	gro->head = NULL;
+	if (gro->nr_segs > 1) {
+		ip = bp->rp;
+		ip[10] = ip[11] = 0;
+		hnputs(ip + 10, ipcsum(ip));
+		f->ip->stats[GroPkts]++;
+		f->ip->stats[GroSegs] += gro->nr_segs;
+	}
+	ipiput4(f, ifc, bp);
+}
+
+/*
+ *  v4 input through gro.  anything that can't be merged flushes what we're
+ *  holding and goes straight up, so the stack never sees segments reordered.
+ */
+void ipgro_receive(struct Fs *f, struct Ipifc *ifc, struct ipgro *gro,
+                   struct block *bp)
+{
+	uint8_t v6dst[IPaddrlen];
+	uint8_t *ip, *th;
+	int thlen, paylen;
+
+	if (gro->head && read_tsc() - gro->start > usec2tsc(Gromaxusec))
+		ipgro_flush(f, ifc, gro);
+	thlen = gro_tcp_hlen(bp);
+	if (!thlen) {
+		ipgro_flush(f, ifc, gro);
+		ipiput4(f, ifc, bp);
+		return;
+	}
+	ip = bp->rp;
+	th = ip + IP4HDR;
+	paylen = BLEN(bp) - IP4HDR - thlen;
+	if (gro->head && gro_is_next(gro, bp, thlen)) {
+		bp->rp += IP4HDR + thlen;
+		if (block_append_extra(gro->head, (uintptr_t)bp,
+		                       bp->rp - (uint8_t*)bp, paylen, MEM_ATOMIC)) {
+			bp->rp = ip;
+			ipgro_flush(f, ifc, gro);
+			ipiput4(f, ifc, bp);
+			return;
+		}
+		/* bp is the head's now: freeing the head kfrees it */
+		ip = gro->head->rp;
+		hnputs(ip + 2, nhgets(ip + 2) + paylen);
+		ip[IP4HDR + 13] |= th[13] & Grotcppsh;
+		gro->next_seq += paylen;
+		gro->nr_segs++;
+		/* a short segment or a push ends the run */
+		if (paylen < gro->seg_len || th[13] & Grotcppsh ||
+		    gro->nr_segs == Gromaxsegs)
+			ipgro_flush(f, ifc, gro);
+		return;
+	}
+	ipgro_flush(f, ifc, gro);
+	v4tov6(v6dst, ip + 16);
+	if (th[13] & Grotcppsh || ipforme(f, v6dst) != Runi) {
+		ipiput4(f, ifc, bp);
+		return;
+	}
+	gro->head = bp;
+	gro->next_seq = nhgetl(th + 4) + paylen;
+	gro->seg_len = paylen;
+	gro->nr_segs = 1;
+	gro->start = read_tsc();
+}
+
 int ipstats(struct Fs *f, char *buf, int len)
 {
 	struct IP *ip;
@@ -795,42 +960,10 @@ struct fragment4 *ipfragallo4(struct IP *ip)
  */
 uint16_t ipchecksum(uint8_t *addr, int len)
 {
-	uint16_t sum = 0;
-
-	while (len > 0) {
-		sum += addr[0] << 8 | addr[1];
-		len -= 2;
-		addr += 2;
-	}
-
-	sum = (sum & 0xffff) + (sum >> 16);
-	sum = (sum & 0xffff) + (sum >> 16);
-
-	return (sum ^ 0xffff);
-
+	return ~ptclbsum(addr, len) & 0xffff;
 }
 
-/* change this to call ipchecksum later.
- * but we have to be sure we're not doing something bad
- * that violates some ip stack assumption (such as
- * boundaries etc.)
- */
 uint16_t ipcsum(uint8_t * addr)
 {
-	int len;
-	uint32_t sum;
-
-	sum = 0;
-	len = (addr[0] & 0xf) << 2;
-
-	while (len > 0) {
-		sum += addr[0] << 8 | addr[1];
-		len -= 2;
-		addr += 2;
-	}
-
-	sum = (sum & 0xffff) + (sum >> 16);
-	sum = (sum & 0xffff) + (sum >> 16);
-
-	return (sum ^ 0xffff);
+	return ipchecksum(addr, (addr[0] & 0xf) << 2);
 }
@@ -40,6 +40,7 @@
 #include <smp.h>
 #include <ip.h>
 #include <endian.h>
+#include <hash.h>
 
 /*
  *  well known IP addresses
@@ -595,63 +596,205 @@ int parsemac(uint8_t * to, char *from, int len)
 }
 
 /*
- *  hashing tcp, udp, ... connections
- *  gcc weirdness: it gave a bogus result until ron split the %= out.
+ *  hashing tcp, udp, ... connections.  every byte of both addresses goes in, so
+ *  lots of conversations with one peer or subnet still spread out.
  */
-uint32_t iphash(uint8_t * sa, uint16_t sp, uint8_t * da, uint16_t dp)
+static uint32_t iphash(uint8_t *sa, uint16_t sp, uint8_t *da, uint16_t dp)
 {
-	uint32_t ret;
-	ret = (sa[IPaddrlen - 1] << 24) ^ (sp << 16) ^ (da[IPaddrlen - 1] << 8)
-		^ dp;
-	ret %= Nhash;
-	return ret;
+	uint64_t h = ((uint64_t)sp << 16) | dp;
+	uint64_t a, b;
+
+	for (int i = 0; i < IPaddrlen; i += sizeof(uint64_t)) {
+		memcpy(&a, sa + i, sizeof(a));
+		memcpy(&b, da + i, sizeof(b));
+		h = (h ^ a) * GOLDEN_RATIO_64;
+		h ^= h >> 29;
+		h = (h ^ b) * GOLDEN_RATIO_64;
+		h ^= h >> 29;
+	}
+	return h >> 32;
 }
 
-void iphtadd(struct Ipht *ht, struct conv *c)
+static uint32_t iplistenhash(uint16_t lport)
 {
-	uint32_t hv;
-	struct Iphash *h;
+	return lport % Niplisten;
+}
 
-	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	h = kzmalloc(sizeof(*h), 0);
+static int iphtmatch(struct conv *c)
+{
 	if (ipcmp(c->raddr, IPnoaddr) != 0)
-		h->match = IPmatchexact;
-	else {
-		if (ipcmp(c->laddr, IPnoaddr) != 0) {
-			if (c->lport == 0)
-				h->match = IPmatchaddr;
-			else
-				h->match = IPmatchpa;
-		} else {
-			if (c->lport == 0)
-				h->match = IPmatchany;
-			else
-				h->match = IPmatchport;
+		return IPmatchexact;
+	if (ipcmp(c->laddr, IPnoaddr) != 0)
+		return c->lport == 0 ? IPmatchaddr : IPmatchpa;
+	return c->lport == 0 ? IPmatchany : IPmatchport;
+}
+
+/* How many buckets the exact table should have once we add one more conv.
+ * Tables only grow, so a racy peek is fine for deciding to allocate. */
+static uint32_t iphtab_want(struct Ipht *ht)
+{
+	struct Iphtab *t = READ_ONCE(ht->exact);
+	uint32_t nr;
+
+	if (t == NULL)
+		return Niphtmin;
+	nr = t->mask + 1;
+	if (ht->nr_exact + 1 > 2 * nr && nr < Niphtmax)
+		return 2 * nr;
+	return nr;
+}
+
+static struct Iphtab *iphtab_alloc(uint32_t nr_buckets)
+{
+	struct Iphtab *t;
+
+	t = kzmalloc(sizeof(struct Iphtab) + nr_buckets * sizeof(struct Iphash *),
+	             MEM_WAIT);
+	t->mask = nr_buckets - 1;
+	return t;
+}
+
+/* Moves every entry to 'new' and makes it the exact table.  Readers still in the
+ * old table may wander into the new one; they'll notice the seq ctr changed and
+ * retry.  That's also why we never free the old table. */
+static void iphtgrow(struct Ipht *ht, struct Iphtab *new)
+{
+	struct Iphtab *old = ht->exact;
+	struct Iphash *h, *next;
+
+	if (old != NULL) {
+		for (uint32_t i = 0; i <= old->mask; i++) {
+			for (h = old->tab[i]; h != NULL; h = next) {
+				next = h->next;
+				h->next = new->tab[h->hv & new->mask];
+				new->tab[h->hv & new->mask] = h;
+			}
 		}
+		new->retired = old;
 	}
-	h->c = c;
+	ht->exact = new;
+	ht->nr_grow++;
+}
+
+/* Unlinks h, with the write lock held.  h->next is left alone, since a reader
+ * could be sitting on h. */
+static void __iphtrem(struct Ipht *ht, struct Iphash *h)
+{
+	struct Iphash **l;
 
-	spin_lock(&ht->lock);
-	h->next = ht->tab[hv];
-	ht->tab[hv] = h;
-	spin_unlock(&ht->lock);
+	if (h->match == IPmatchexact) {
+		l = &ht->exact->tab[h->hv & ht->exact->mask];
+		ht->nr_exact--;
+	} else {
+		l = &ht->listen[h->hv];
+		ht->nr_listen--;
+	}
+	for (; *l != NULL; l = &(*l)->next) {
+		if (*l == h) {
+			*l = h->next;
+			break;
+		}
+	}
+	h->hashed = FALSE;
+}
+
+/* Adds c, or rehashes it if its addresses changed since it was added. */
+void iphtadd(struct Ipht *ht, struct conv *c)
+{
+	struct Iphash *h = &c->ht;
+	struct Iphash **l;
+	struct Iphtab *new = NULL;
+	int match = iphtmatch(c);
+
+	if (match == IPmatchexact) {
+		uint32_t want = iphtab_want(ht);
+
+		if (ht->exact == NULL || want != ht->exact->mask + 1)
+			new = iphtab_alloc(want);
+	}
+
+	write_seqlock(&ht->seq);
+	if (h->hashed)
+		__iphtrem(ht, h);
+	if (new != NULL && (ht->exact == NULL || new->mask > ht->exact->mask)) {
+		iphtgrow(ht, new);
+		new = NULL;
+	}
+	h->c = c;
+	h->match = match;
+	if (match == IPmatchexact) {
+		h->hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
+		l = &ht->exact->tab[h->hv & ht->exact->mask];
+		ht->nr_exact++;
+	} else {
+		h->hv = iplistenhash(c->lport);
+		l = &ht->listen[h->hv];
+		ht->nr_listen++;
+	}
+	h->next = *l;
+	/* write_sequnlock's wmb publishes h's fields before the readers' retry
+	 * check, but we still want h set up before it's reachable. */
+	wmb();
+	*l = h;
+	h->hashed = TRUE;
+	write_sequnlock(&ht->seq);
+	/* lost a race with another grower */
+	kfree(new);
 }
 
 void iphtrem(struct Ipht *ht, struct conv *c)
 {
-	uint32_t hv;
-	struct Iphash **l, *h;
-
-	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	spin_lock(&ht->lock);
-	for (l = &ht->tab[hv]; (*l) != NULL; l = &(*l)->next)
-		if ((*l)->c == c) {
-			h = *l;
-			(*l) = h->next;
-			kfree(h);
-			break;
+	write_seqlock(&ht->seq);
+	if (c->ht.hashed)
+		__iphtrem(ht, &c->ht);
+	write_sequnlock(&ht->seq);
+}
+
+static struct conv *__iphtlook(struct Ipht *ht, uint8_t *sa, uint16_t sp,
+                               uint8_t *da, uint16_t dp)
+{
+	struct Iphtab *t;
+	struct Iphash *h;
+	struct conv *c, *port = NULL, *any = NULL;
+
+	/* exact 4 pair match (connection) */
+	t = READ_ONCE(ht->exact);
+	if (t != NULL) {
+		h = READ_ONCE(t->tab[iphash(sa, sp, da, dp) & t->mask]);
+		for (; h != NULL; h = READ_ONCE(h->next)) {
+			if (h->match != IPmatchexact)
+				continue;
+			c = h->c;
+			if (sp == c->rport && dp == c->lport
+				&& ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0)
+				return c;
 		}
-	spin_unlock(&ht->lock);
+	}
+
+	/* match local address and port, else just port */
+	h = READ_ONCE(ht->listen[iplistenhash(dp)]);
+	for (; h != NULL; h = READ_ONCE(h->next)) {
+		c = h->c;
+		if (dp != c->lport)
+			continue;
+		if (h->match == IPmatchpa && ipcmp(da, c->laddr) == 0)
+			return c;
+		if (h->match == IPmatchport && port == NULL)
+			port = c;
+	}
+	if (port != NULL)
+		return port;
+
+	/* match local address, else anything.  these have no port. */
+	h = READ_ONCE(ht->listen[iplistenhash(0)]);
+	for (; h != NULL; h = READ_ONCE(h->next)) {
+		c = h->c;
+		if (h->match == IPmatchaddr && ipcmp(da, c->laddr) == 0)
+			return c;
+		if (h->match == IPmatchany && any == NULL)
+			any = c;
+	}
+	return any;
 }
 
 /* look for a matching conversation with the following precedence
@@ -664,85 +807,75 @@ void iphtrem(struct Ipht *ht, struct conv *c)
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 					  uint16_t dp)
 {
-	uint32_t hv;
-	struct Iphash *h;
+	seq_ctr_t seq;
 	struct conv *c;
 
-	/* exact 4 pair match (connection) */
-	hv = iphash(sa, sp, da, dp);
-	spin_lock(&ht->lock);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchexact)
-			continue;
-		c = h->c;
-		if (sp == c->rport && dp == c->lport
-			&& ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
+	do {
+		seq = read_seqbegin(&ht->seq);
+		c = __iphtlook(ht, sa, sp, da, dp);
+	} while (read_seqretry(&ht->seq, seq));
+	return c;
+}
 
-	/* match local address and port */
-	hv = iphash(IPnoaddr, 0, da, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchpa)
-			continue;
-		c = h->c;
-		if (dp == c->lport && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
+static unsigned int chainlen(struct Iphash *h)
+{
+	unsigned int n = 0;
 
-	/* match just port */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchport)
-			continue;
-		c = h->c;
-		if (dp == c->lport) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
+	for (; h != NULL; h = h->next)
+		n++;
+	return n;
+}
 
-	/* match local address */
-	hv = iphash(IPnoaddr, 0, da, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchaddr)
-			continue;
-		c = h->c;
-		if (ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
+/*
+ *  for a proto's stats file.  holds off writers, but not readers, while it
+ *  walks the tables.
+ */
+char *iphtstats(struct Ipht *ht, char *p, char *e)
+{
+	struct Iphtab *t;
+	unsigned int len, max = 0, used = 0, lmax = 0;
+
+	spin_lock(&ht->seq.w_lock);
+	t = ht->exact;
+	for (uint32_t i = 0; t != NULL && i <= t->mask; i++) {
+		len = chainlen(t->tab[i]);
+		if (len)
+			used++;
+		max = MAX(max, len);
 	}
+	for (int i = 0; i < Niplisten; i++)
+		lmax = MAX(lmax, chainlen(ht->listen[i]));
+	p = seprintf(p, e, "HtBuckets: %u\n", t != NULL ? t->mask + 1 : 0);
+	p = seprintf(p, e, "HtUsedBuckets: %u\n", used);
+	p = seprintf(p, e, "HtConns: %u\n", ht->nr_exact);
+	p = seprintf(p, e, "HtMaxChain: %u\n", max);
+	p = seprintf(p, e, "HtListens: %u\n", ht->nr_listen);
+	p = seprintf(p, e, "HtMaxListenChain: %u\n", lmax);
+	p = seprintf(p, e, "HtGrows: %u\n", ht->nr_grow);
+	spin_unlock(&ht->seq.w_lock);
+	return p;
+}
 
-	/* look for something that matches anything */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchany)
-			continue;
+static void dump_iphash(struct Iphash *h)
+{
+	struct conv *c;
+
+	for (; h != NULL; h = h->next) {
 		c = h->c;
-		spin_unlock(&ht->lock);
-		return c;
+		printk("Conv proto %s, idx %d: local %I:%d, remote %I:%d\n",
+		       c->p->name, c->x, c->laddr, c->lport, c->raddr, c->rport);
 	}
-	spin_unlock(&ht->lock);
-	return NULL;
 }
 
 void dump_ipht(struct Ipht *ht)
 {
-	struct Iphash *h;
-	struct conv *c;
-
-	spin_lock(&ht->lock);
-	for (int i = 0; i < Nipht; i++) {
-		for (h = ht->tab[i]; h != NULL; h = h->next) {
-			c = h->c;
-			printk("Conv proto %s, idx %d: local %I:%d, remote %I:%d\n",
-			       c->p->name, c->x, c->laddr, c->lport, c->raddr, c->rport);
-		}
-	}
-	spin_unlock(&ht->lock);
+	struct Iphtab *t;
+
+	spin_lock(&ht->seq.w_lock);
+	t = ht->exact;
+	for (uint32_t i = 0; t != NULL && i <= t->mask; i++)
+		dump_iphash(t->tab[i]);
+	for (int i = 0; i < Niplisten; i++)
+		dump_iphash(ht->listen[i]);
+	spin_unlock(&ht->seq.w_lock);
 }
@@ -843,7 +843,22 @@ static void ipifcctl(struct conv *c, char **argv, int argc)
 
 int ipifcstats(struct Proto *ipifc, char *buf, int len)
 {
-	return ipstats(ipifc->f, buf, len);
+	struct conv **cp, **e;
+	struct Ipifc *ifc;
+	int m;
+
+	m = ipstats(ipifc->f, buf, len);
+	e = &ipifc->conv[ipifc->nc];
+	for (cp = ipifc->conv; cp < e; cp++) {
+		if (*cp == NULL)
+			break;
+		ifc = (struct Ipifc *)(*cp)->ptcl;
+		rlock(&ifc->rwlock);
+		if (ifc->m != NULL && ifc->m->stats != NULL)
+			m += ifc->m->stats(ifc, buf + m, len - m);
+		runlock(&ifc->rwlock);
+	}
+	return m;
 }
 
 void ipifcinit(struct Fs *f)
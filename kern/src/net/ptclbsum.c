@@ -40,6 +40,7 @@
 #include <smp.h>
 #include <ip.h>
 #include <endian.h>
+#include <cpu_feat.h>
 
 static short endian = 1;
 static uint8_t *aendian = (uint8_t *) & endian;
@@ -48,175 +49,136 @@ static uint8_t *aendian = (uint8_t *) & endian;
 
 #ifdef CONFIG_X86
 
-/* $NetBSD: in_cksum.c,v 1.7 1997/09/02 13:18:15 thorpej Exp $ */
-
-/*-
- * Copyright (c) 1988, 1992, 1993
- *	The Regents of the University of California.  All rights reserved.
- * Copyright (c) 1996
- *	Matt Thomas <matt@3am-software.com>
- *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions
- * are met:
- * 1. Redistributions of source code must retain the above copyright
- *    notice, this list of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce the above copyright
- *    notice, this list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the distribution.
- * 3. All advertising materials mentioning features or use of this software
- *    must display the following acknowledgement:
- *	This product includes software developed by the University of
- *	California, Berkeley and its contributors.
- * 4. Neither the name of the University nor the names of its contributors
- *    may be used to endorse or promote products derived from this software
- *    without specific prior written permission.
- *
- * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
- * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
- * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
- * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
- * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
- * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
- * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
- * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
- * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
- * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
- * SUCH DAMAGE.
- *
- *	@(#)in_cksum.c	8.1 (Berkeley) 6/10/93
- */
-
 /*
- * Checksum routine for Internet Protocol family headers
- *    (Portable Alpha version).
+ * One's complement sums in 64 bit accumulators, folded down to 16 bits at the
+ * end.
  *
- * This routine is very heavily used in the network
- * code and should be modified for each CPU to be as fast as possible.
+ * We don't use SSE or AVX: the kernel is built without them, and we'd have to
+ * save the user's FPU state around every checksum, which costs more than
+ * summing a packet.  Instead we add 32 bit words into four 64 bit
+ * accumulators, which can't overflow for any length we'd sum and have no
+ * carry chain between them.  With ADX, adcx and adox run two 64 bit carry
+ * chains at once, which is a little faster still.  Loads are unaligned, so the
+ * words always line up with addr, and the sum never needs to be byte swapped
+ * for odd addresses.
  */
 
-#define ADDCARRY(x)  (x > 65535 ? x -= 65535 : x)
-#define REDUCE32							  \
-    {									  \
-	q_util.q = sum;							  \
-	sum = q_util.s[0] + q_util.s[1] + q_util.s[2] + q_util.s[3];	  \
-    }
-#define REDUCE16							  \
-    {									  \
-	q_util.q = sum;							  \
-	l_util.l = q_util.s[0] + q_util.s[1] + q_util.s[2] + q_util.s[3]; \
-	sum = l_util.s[0] + l_util.s[1];				  \
-	ADDCARRY(sum);							  \
-    }
-
-static const uint32_t in_masks[] = {
-	/*0 bytes*/ /*1 byte*/	/*2 bytes*/ /*3 bytes*/
-	0x00000000, 0x000000FF, 0x0000FFFF, 0x00FFFFFF,	/* offset 0 */
-	0x00000000, 0x0000FF00, 0x00FFFF00, 0xFFFFFF00,	/* offset 1 */
-	0x00000000, 0x00FF0000, 0xFFFF0000, 0xFFFF0000,	/* offset 2 */
-	0x00000000, 0xFF000000, 0xFF000000, 0xFF000000,	/* offset 3 */
-};
-
-union l_util {
-	uint16_t s[2];
-	uint32_t l;
-};
-union q_util {
-	uint16_t s[4];
-	uint32_t l[2];
-	uint64_t q;
-};
-
-static uint64_t
-in_cksumdata(const void *buf, int len)
+static inline uint64_t csum_add(uint64_t sum, uint64_t x)
 {
-	const uint32_t *lw = (const uint32_t *) buf;
-	uint64_t sum = 0;
-	uint64_t prefilled;
-	int offset;
-	union q_util q_util;
+	sum += x;
+	return sum + (sum < x);
+}
 
-	if ((3 & (long) lw) == 0 && len == 20) {
-	     sum = (uint64_t) lw[0] + lw[1] + lw[2] + lw[3] + lw[4];
-	     REDUCE32;
-	     return sum;
+/* Sums nr 64 byte chunks at p. */
+static uint64_t csum_64b(const uint64_t *p, size_t nr, uint64_t sum)
+{
+	const uint32_t *w = (const uint32_t *)p;
+	uint64_t s1 = 0, s2 = 0, s3 = 0;
+
+	for (; nr; nr--, w += 16) {
+		sum += (uint64_t)w[0] + w[4] + w[8] + w[12];
+		s1 += (uint64_t)w[1] + w[5] + w[9] + w[13];
+		s2 += (uint64_t)w[2] + w[6] + w[10] + w[14];
+		s3 += (uint64_t)w[3] + w[7] + w[11] + w[15];
 	}
+	return csum_add(csum_add(sum, s1), csum_add(s2, s3));
+}
 
-	if ((offset = 3 & (long) lw) != 0) {
-		const uint32_t *masks = in_masks + (offset << 2);
-		lw = (uint32_t *) (((long) lw) - offset);
-		sum = *lw++ & masks[len >= 3 ? 3 : len];
-		len -= 4 - offset;
-		if (len <= 0) {
-			REDUCE32;
-			return sum;
-		}
-	}
-#if 0
-	/*
-	 * Force to cache line boundary.
-	 */
-	offset = 32 - (0x1f & (long) lw);
-	if (offset < 32 && len > offset) {
-		len -= offset;
-		if (4 & offset) {
-			sum += (uint64_t) lw[0];
-			lw += 1;
-		}
-		if (8 & offset) {
-			sum += (uint64_t) lw[0] + lw[1];
-			lw += 2;
-		}
-		if (16 & offset) {
-			sum += (uint64_t) lw[0] + lw[1] + lw[2] + lw[3];
-			lw += 4;
-		}
-	}
-#endif
-	/*
-	 * access prefilling to start load of next cache line.
-	 * then add current cache line
-	 * save result of prefilling for loop iteration.
-	 */
-	prefilled = lw[0];
-	while ((len -= 32) >= 4) {
-		uint64_t prefilling = lw[8];
-		sum += prefilled + lw[1] + lw[2] + lw[3]
-			+ lw[4] + lw[5] + lw[6] + lw[7];
-		lw += 8;
-		prefilled = prefilling;
-	}
-	if (len >= 0) {
-		sum += prefilled + lw[1] + lw[2] + lw[3]
-			+ lw[4] + lw[5] + lw[6] + lw[7];
-		lw += 8;
-	} else {
-		len += 32;
+static uint64_t csum_64b_adx(const uint64_t *p, size_t nr, uint64_t sum)
+{
+	uint64_t odd = 0, zero;
+
+	for (; nr; nr--, p += 8) {
+		/* the xor clears CF and OF, for adcx and adox respectively */
+		asm ("xorl %k[z], %k[z]\n\t"
+		     "adcx 0(%[p]), %[e]\n\t"
+		     "adox 8(%[p]), %[o]\n\t"
+		     "adcx 16(%[p]), %[e]\n\t"
+		     "adox 24(%[p]), %[o]\n\t"
+		     "adcx 32(%[p]), %[e]\n\t"
+		     "adox 40(%[p]), %[o]\n\t"
+		     "adcx 48(%[p]), %[e]\n\t"
+		     "adox 56(%[p]), %[o]\n\t"
+		     "adcx %[z], %[e]\n\t"
+		     "adox %[z], %[o]"
+		     : [e] "+r"(sum), [o] "+r"(odd), [z] "=&r"(zero)
+		     : [p] "r"(p), "m"(*(const uint64_t (*)[8])p)
+		     : "cc");
 	}
-	while ((len -= 16) >= 0) {
-		sum += (uint64_t) lw[0] + lw[1] + lw[2] + lw[3];
-		lw += 4;
+	return csum_add(sum, odd);
+}
+
+/* The last len < 64 bytes, zero padded, as if they were a full word. */
+static uint64_t csum_tail(const uint8_t *p, int len, uint64_t sum)
+{
+	uint64_t x = 0;
+
+	for (; len >= 8; len -= 8, p += 8)
+		sum = csum_add(sum, *(const uint64_t *)p);
+	if (len & 4) {
+		x = *(const uint32_t *)p;
+		p += 4;
 	}
-	len += 16;
-	while ((len -= 4) >= 0) {
-		sum += (uint64_t) *lw++;
+	if (len & 2) {
+		x |= (uint64_t)*(const uint16_t *)p << ((len & 4) * 8);
+		p += 2;
 	}
-	len += 4;
-	if (len > 0)
-		sum += (uint64_t) (in_masks[len] & *lw);
-	REDUCE32;
-	return sum;
+	if (len & 1)
+		x |= (uint64_t)*p << ((len & 6) * 8);
+	return csum_add(sum, x);
 }
+
+static uint16_t csum_fold(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	/* we summed little endian words */
+	return be16_to_cpu(sum);
+}
+
 uint16_t ptclbsum(uint8_t * addr, int len)
 {
-	uint64_t sum = in_cksumdata(addr, len);
-	union q_util q_util;
-	union l_util l_util;
-	if ((uintptr_t)addr & 1)
-		sum <<= 8;
-	REDUCE16;
-	return cpu_to_be16(sum);
+	uint64_t sum = 0;
+	size_t nr = len / 64;
+
+	if (nr) {
+		if (cpu_has_feat(CPU_FEAT_X86_ADX))
+			sum = csum_64b_adx((const uint64_t *)addr, nr, sum);
+		else
+			sum = csum_64b((const uint64_t *)addr, nr, sum);
+		addr += nr * 64;
+		len -= nr * 64;
+	}
+	return csum_fold(csum_tail(addr, len, sum));
+}
+
+/* Copies len bytes from src to dst, and returns ptclbsum(src, len), in one
+ * pass over the data.  Unlike memcpy, this doesn't fall back to bytes when src
+ * and dst are misaligned with each other. */
+uint16_t ptclbsum_copy(uint8_t *dst, uint8_t *src, int len)
+{
+	const uint64_t *s = (const uint64_t *)src;
+	uint64_t *d = (uint64_t *)dst;
+	uint64_t a, b, sum = 0, s1 = 0, s2 = 0, s3 = 0;
+
+	for (; len >= 16; len -= 16, s += 2, d += 2) {
+		a = s[0];
+		b = s[1];
+		d[0] = a;
+		d[1] = b;
+		sum += (uint32_t)a;
+		s1 += a >> 32;
+		s2 += (uint32_t)b;
+		s3 += b >> 32;
+	}
+	memcpy(d, s, len);
+	sum = csum_add(csum_add(sum, s1), csum_add(s2, s3));
+	return csum_fold(csum_tail((const uint8_t *)s, len, sum));
 }
+
 #else
 uint16_t ptclbsum(uint8_t * addr, int len)
 {
@@ -284,4 +246,10 @@ uint16_t ptclbsum(uint8_t * addr, int len)
 
 	return losum & 0xffff;
 }
+
+uint16_t ptclbsum_copy(uint8_t *dst, uint8_t *src, int len)
+{
+	memcpy(dst, src, len);
+	return ptclbsum(dst, len);
+}
 #endif
@@ -53,6 +53,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <alarm.h>
 
 enum {
 	QMAX = 64 * 1024 - 1,
@@ -117,6 +118,13 @@ enum {
 	RTO_RETRANS_RECOVERY = 3,
 	CWIND_SCALE = 10,	/* initial CWIND will be MSS * this */
 
+	CUBIC_BETA = 7,		/* multiplicative decrease: 7/10 */
+	CUBIC_C = 4,		/* cubic scaling constant: 4/10 */
+	CUBIC_MAX_DELTA = 30000,	/* ms from K we bother computing */
+	PACE_GAIN_SS = 200,	/* percent of cwind / srtt to pace at, slow start */
+	PACE_GAIN_CA = 120,	/* percent of cwind / srtt to pace at, o/w */
+	TSO_MAX = 64 * 1024 - 128,	/* payload per TSO packet, fits in IP_MAX */
+
 	FORCE			= 1 << 0,
 	CLONE			= 1 << 1,
 	ACTIVE			= 1 << 2,
@@ -138,6 +146,7 @@ enum {
 	Time_wait,
 
 	Maxlimbo = 1000,	/* maximum procs waiting for response to SYN ACK */
+	NTIMERSLOTS = 4096,	/* timer wheel slots, one per tick, power of 2 */
 	NLHT = 256,	/* hash table size, must be a power of 2 */
 	LHTMASK = NLHT - 1,
 
@@ -158,7 +167,8 @@ struct Tcptimer {
 	Tcptimer *readynext;
 	int state;
 	uint64_t start;
-	uint64_t count;
+	uint64_t count;				/* ticks left, as of the last halt */
+	uint64_t expire;			/* tick it fires on, while ON */
 	void (*func) (void *);
 	void *arg;
 };
@@ -253,10 +263,36 @@ struct Reseq {
 	uint16_t length;
 };
 
+/* CUBIC's per-connection state (RFC 8312).  Windows are in bytes, times in
+ * ms. */
+struct cubic {
+	uint32_t w_max;				/* cwind at the last loss */
+	uint32_t origin;			/* plateau of the current curve */
+	uint32_t k;					/* time from epoch_start to the plateau */
+	uint64_t epoch_start;		/* start of this curve, 0 if none */
+	uint32_t w_est;				/* what Reno would have, TCP-friendly mode */
+	uint32_t est_acked;			/* acked bytes not yet counted in w_est */
+};
+
+typedef struct Tcpctl Tcpctl;
+
+/* Congestion control algorithms.  Slow start and the reaction to loss are
+ * common to all of them: the algorithm grows cwind outside of slow start and
+ * picks the new ssthresh after a loss.  init() sets up the algorithm's state,
+ * and must not change cwind, since we can switch algorithms on a live
+ * connection. */
+struct tcp_cc_ops {
+	char *name;
+	void (*init)(Tcpctl *tcb);
+	/* Returns how much to grow cwind, given acked bytes were just ACKed.  now
+	 * is in ms. */
+	uint32_t (*cong_avoid)(Tcpctl *tcb, uint32_t acked, uint64_t now);
+	uint32_t (*ssthresh)(Tcpctl *tcb);
+};
+
 /*
  *  the qlock in the Conv locks this structure
  */
-typedef struct Tcpctl Tcpctl;
 struct Tcpctl {
 	uint8_t state;				/* Connection state */
 	uint8_t type;				/* Listening or active connection */
@@ -317,6 +353,16 @@ struct Tcpctl {
 	uint32_t ts_recent;			/* timestamp received around last_ack_sent */
 	uint32_t last_ack_sent;		/* to determine when to update timestamp */
 	bool sack_ok;				/* Can use SACK for this connection */
+	bool rtt_sampled;			/* srtt is a measurement, not tcp_irtt */
+
+	struct tcp_cc_ops *cc;		/* Congestion control algorithm */
+	union {
+		struct cubic cubic;
+	} cc_state;
+	bool pacing;				/* Spread sends across the RTT */
+	uint64_t pace_next;			/* TSC time we can send again */
+	struct alarm_waiter pace_alarm;
+	struct timer_chain *pace_tchain;	/* where pace_alarm is set, if it is */
 
 	union {
 		Tcp4hdr tcp4hdr;
@@ -403,9 +449,11 @@ static char *statnames[] = {
 
 typedef struct Tcppriv Tcppriv;
 struct tcppriv {
-	/* List of active timers */
+	/* Wheel of active timers, hashed by the tick they expire on.  Timers more
+	 * than NTIMERSLOTS ticks out just get skipped until their round comes. */
 	qlock_t tl;
-	Tcptimer *timers;
+	uint64_t tick;				/* ticks run by tcpackproc */
+	Tcptimer *wheel[NTIMERSLOTS];
 
 	/* hash table for matching conversations */
 	struct Ipht ht;
@@ -451,6 +499,9 @@ void tcpsettimer(Tcpctl *);
 void tcpsynackrtt(struct conv *);
 void tcpsetscale(struct conv *, Tcpctl *, uint16_t, uint16_t);
 static void tcp_loss_event(struct conv *s, Tcpctl *tcb);
+static void tcp_pace_init(struct conv *s, Tcpctl *tcb);
+static void tcp_pace_cancel(Tcpctl *tcb);
+static struct tcp_cc_ops tcp_reno;
 static uint16_t derive_payload_mss(Tcpctl *tcb);
 static int seq_within(uint32_t x, uint32_t low, uint32_t high);
 static int seq_lt(uint32_t x, uint32_t y);
@@ -462,6 +513,7 @@ static uint32_t seq_min(uint32_t x, uint32_t y);
 static void set_in_flight(Tcpctl *tcb);
 
 static void limborexmit(struct Proto *);
+static uint64_t timerleft(struct tcppriv *priv, Tcptimer *t);
 static void limbo(struct conv *, uint8_t * unused_uint8_p_t, uint8_t *, Tcp *,
 				  int);
 
@@ -516,18 +568,22 @@ static void tcpconnect(struct conv *c, char **argv, int argc)
 static int tcpstate(struct conv *c, char *state, int n)
 {
 	Tcpctl *s;
+	struct tcppriv *tpriv = c->p->priv;
 
 	s = (Tcpctl *) (c->ptcl);
 
 	return snprintf(state, n,
-					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d\n",
+					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %llu cc %s%s\n",
 					tcpstates[s->state],
 					c->rq ? qlen(c->rq) : 0,
 					c->wq ? qlen(c->wq) : 0,
 					s->srtt, s->mdev,
 					s->cwind, s->snd.wnd, s->rcv.scale, s->rcv.wnd,
-					s->snd.scale, s->timer.start, s->timer.count, s->rerecv,
-					s->katimer.start, s->katimer.count);
+					s->snd.scale, s->timer.start, timerleft(tpriv, &s->timer),
+					s->rerecv, s->katimer.start,
+					timerleft(tpriv, &s->katimer),
+					s->cc ? s->cc->name : "none",
+					s->pacing ? " pacing" : "");
 }
 
 static int tcpinuse(struct conv *c)
@@ -707,44 +763,55 @@ static void tcpcreate(struct conv *c)
 	c->wq = qopen(8 * QMAX, Qkick, tcpkick, c);
 }
 
+static Tcptimer **timerslot(struct tcppriv *priv, Tcptimer *t)
+{
+	return &priv->wheel[t->expire & (NTIMERSLOTS - 1)];
+}
+
 static void timerstate(struct tcppriv *priv, Tcptimer * t, int newstate)
 {
-	if (newstate != TcptimerON) {
-		if (t->state == TcptimerON) {
-			// unchain
-			if (priv->timers == t) {
-				priv->timers = t->next;
-				if (t->prev != NULL)
-					panic("timerstate1");
-			}
-			if (t->next)
-				t->next->prev = t->prev;
-			if (t->prev)
-				t->prev->next = t->next;
-			t->next = t->prev = NULL;
-		}
-	} else {
-		if (t->state != TcptimerON) {
-			// chain
-			if (t->prev != NULL || t->next != NULL)
-				panic("timerstate2");
-			t->prev = NULL;
-			t->next = priv->timers;
-			if (t->next)
-				t->next->prev = t;
-			priv->timers = t;
+	Tcptimer **slot;
+
+	if (t->state == TcptimerON) {
+		// unchain
+		slot = timerslot(priv, t);
+		if (*slot == t) {
+			*slot = t->next;
+			if (t->prev != NULL)
+				panic("timerstate1");
 		}
+		if (t->next)
+			t->next->prev = t->prev;
+		if (t->prev)
+			t->prev->next = t->next;
+		t->next = t->prev = NULL;
+	}
+	if (newstate == TcptimerON) {
+		// chain, t->expire is already set
+		slot = timerslot(priv, t);
+		t->prev = NULL;
+		t->next = *slot;
+		if (t->next)
+			t->next->prev = t;
+		*slot = t;
 	}
 	t->state = newstate;
 }
 
+/* Ticks until t fires, or until it would have when it was halted. */
+static uint64_t timerleft(struct tcppriv *priv, Tcptimer *t)
+{
+	if (t->state == TcptimerON)
+		return t->expire - priv->tick;
+	return t->count;
+}
+
 void tcpackproc(void *a)
 {
 	ERRSTACK(1);
 	Tcptimer *t, *tp, *timeo;
 	struct Proto *tcp;
 	struct tcppriv *priv;
-	int loop;
 
 	tcp = a;
 	priv = tcp->priv;
@@ -752,28 +819,22 @@ void tcpackproc(void *a)
 	for (;;) {
 		kthread_usleep(MSPTICK * 1000);
 
+		/* Only this tick's slot can have anything that's due. */
 		qlock(&priv->tl);
+		priv->tick++;
 		timeo = NULL;
-		loop = 0;
-		for (t = priv->timers; t != NULL; t = tp) {
-			if (loop++ > 10000)
-				panic("tcpackproc1");
+		for (t = priv->wheel[priv->tick & (NTIMERSLOTS - 1)]; t; t = tp) {
 			tp = t->next;
-			if (t->state == TcptimerON) {
-				t->count--;
-				if (t->count == 0) {
-					timerstate(priv, t, TcptimerDONE);
-					t->readynext = timeo;
-					timeo = t;
-				}
-			}
+			if (t->expire != priv->tick)
+				continue;
+			t->count = 0;
+			timerstate(priv, t, TcptimerDONE);
+			t->readynext = timeo;
+			timeo = t;
 		}
 		qunlock(&priv->tl);
 
-		loop = 0;
 		for (t = timeo; t != NULL; t = t->readynext) {
-			if (loop++ > 10000)
-				panic("tcpackproc2");
 			if (t->state == TcptimerDONE && t->func != NULL) {
 				/* discard error style */
 				if (!waserror())
@@ -792,7 +853,9 @@ void tcpgo(struct tcppriv *priv, Tcptimer * t)
 		return;
 
 	qlock(&priv->tl);
-	t->count = t->start;
+	/* rechain, since a running timer moves to a new slot */
+	timerstate(priv, t, TcptimerOFF);
+	t->expire = priv->tick + t->start;
 	timerstate(priv, t, TcptimerON);
 	qunlock(&priv->tl);
 }
@@ -803,6 +866,8 @@ void tcphalt(struct tcppriv *priv, Tcptimer * t)
 		return;
 
 	qlock(&priv->tl);
+	if (t->state == TcptimerON)
+		t->count = t->expire - priv->tick;
 	timerstate(priv, t, TcptimerOFF);
 	qunlock(&priv->tl);
 }
@@ -827,6 +892,11 @@ void localclose(struct conv *s, char *reason)
 	tcphalt(tpriv, &tcb->rtt_timer);
 	tcphalt(tpriv, &tcb->acktimer);
 	tcphalt(tpriv, &tcb->katimer);
+	tcp_pace_cancel(tcb);
+	/* The next user of this conv gets the defaults.  cc and pacing only carry
+	 * over from before a connect, or from a listener to its calls. */
+	tcb->cc = &tcp_reno;
+	tcb->pacing = FALSE;
 
 	/* Flush reassembly queue; nothing more can arrive */
 	for (rp = tcb->reseq; rp != NULL; rp = rp1) {
@@ -870,8 +940,10 @@ int tcpmtu(struct Proto *tcp, uint8_t * addr, int version, int *scale,
 				mtu = ifc->maxtu - ifc->m->hsize - (TCP6_PKT + TCP6_HDRSIZE);
 			break;
 	}
+	/* The medium may segment v4 TSO packets in software (GSO), in which case
+	 * we send big packets even if the device can't. */
 	*flags &= ~TSO;
-	if (ifc && (ifc->feat & NETF_TSO))
+	if (ifc && ((ifc->feat & NETF_TSO) || (version == V4 && ifc->m->gso)))
 		*flags |= TSO;
 	*scale = HaveWS | 7;
 
@@ -884,10 +956,20 @@ void inittcpctl(struct conv *s, int mode)
 	Tcp4hdr *h4;
 	Tcp6hdr *h6;
 	int mss;
+	struct tcp_cc_ops *cc;
+	bool pacing;
 
 	tcb = (Tcpctl *) s->ptcl;
 
+	/* The congestion control settings can be set before we connect */
+	tcp_pace_cancel(tcb);
+	cc = tcb->cc ? tcb->cc : &tcp_reno;
+	pacing = tcb->pacing;
 	memset(tcb, 0, sizeof(Tcpctl));
+	tcb->cc = cc;
+	tcb->cc->init(tcb);
+	tcb->pacing = pacing;
+	tcp_pace_init(s, tcb);
 
 	tcb->ssthresh = UINT32_MAX;
 	tcb->srtt = tcp_irtt;
@@ -1825,6 +1907,9 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 	tcb->katimer.state = TcptimerOFF;
 	tcb->rtt_timer.arg = new;
 	tcb->rtt_timer.state = TcptimerOFF;
+	/* The listener's cc and pacing settings carry over, but not their state */
+	tcb->cc->init(tcb);
+	tcp_pace_init(new, tcb);
 
 	tcb->irs = lp->irs;
 	tcb->rcv.nxt = tcb->irs + 1;
@@ -2311,6 +2396,167 @@ static int expected_samples_ts(Tcpctl *tcb, uint32_t acked)
 	return MAX(DIV_ROUND_UP(tcb->snd.nxt - tcb->snd.una, acked), 1);
 }
 
+static void reno_init(Tcpctl *tcb)
+{
+}
+
+static uint32_t reno_cong_avoid(Tcpctl *tcb, uint32_t acked, uint64_t now)
+{
+	/* Every RTT, which consists of CWND bytes, we're supposed to expand by MSS
+	 * bytes.  The classic algorithm was
+	 * 		expand = (tcb->mss * tcb->mss) / tcb->cwind;
+	 * which assumes the ACK was for MSS bytes.  Instead, for every 'acked'
+	 * bytes, we increase the window by acked / CWND (in units of MSS). */
+	return MAX(acked, tcb->typical_mss) * tcb->typical_mss / tcb->cwind;
+}
+
+static uint32_t reno_ssthresh(Tcpctl *tcb)
+{
+	return tcb->cwind / 2;
+}
+
+static struct tcp_cc_ops tcp_reno = {
+	.name = "reno",
+	.init = reno_init,
+	.cong_avoid = reno_cong_avoid,
+	.ssthresh = reno_ssthresh,
+};
+
+/* Integer cube root, rounded down */
+static uint32_t cubic_root(uint64_t a)
+{
+	uint64_t x, y;
+
+	if (!a)
+		return 0;
+	/* Newton's method, starting from a power of two above the root */
+	x = 1ULL << DIV_ROUND_UP(64 - __builtin_clzll(a), 3);
+	while (1) {
+		y = (2 * x + a / (x * x)) / 3;
+		if (y >= x)
+			return x;
+		x = y;
+	}
+}
+
+static void cubic_init(Tcpctl *tcb)
+{
+	memset(&tcb->cc_state.cubic, 0, sizeof(struct cubic));
+}
+
+/* CUBIC grows cwind along W(t) = C * (t - K)^3 + W_max, where t is the time
+ * since the last loss and K is when the curve gets back to W_max.  We aim for
+ * where the curve will be an RTT from now.  If Reno would be doing better (low
+ * BDP paths), we use Reno's window instead. */
+static uint32_t cubic_cong_avoid(Tcpctl *tcb, uint32_t acked, uint64_t now)
+{
+	struct cubic *cu = &tcb->cc_state.cubic;
+	uint32_t mss = tcb->typical_mss;
+	uint32_t cwind = tcb->cwind;
+	uint32_t per_mss;
+	uint64_t t, d, delta, target, expand;
+
+	if (!cu->epoch_start) {
+		cu->epoch_start = now;
+		if (cwind < cu->w_max) {
+			/* K = cbrt((W_max - cwind) / C), in MSS and seconds.  This is in
+			 * ms, hence the 10^9. */
+			cu->k = cubic_root((uint64_t)(cu->w_max - cwind) *
+			                   (10 * 1000000000ULL / CUBIC_C) / mss);
+			cu->origin = cu->w_max;
+		} else {
+			cu->k = 0;
+			cu->origin = cwind;
+		}
+		cu->w_est = cwind;
+		cu->est_acked = 0;
+	}
+	t = now + tcb->srtt - cu->epoch_start;
+	d = MIN(t > cu->k ? t - cu->k : cu->k - t, CUBIC_MAX_DELTA);
+	delta = d * d * d * CUBIC_C / 10 * mss / 1000000000ULL;
+	if (t > cu->k)
+		target = cu->origin + delta;
+	else
+		target = cu->origin > delta + mss ? cu->origin - delta : mss;
+
+	/* Reno, with CUBIC's beta, grows by 3 * (1 - beta) / (1 + beta) MSS per
+	 * RTT, which is an MSS for every cwind * 17 / 9 bytes ACKed. */
+	cu->est_acked += acked;
+	per_mss = MAX((uint64_t)cwind * (10 + CUBIC_BETA) /
+	              (3 * (10 - CUBIC_BETA)), 1);
+	cu->w_est += cu->est_acked / per_mss * mss;
+	cu->est_acked %= per_mss;
+	target = MAX(target, cu->w_est);
+
+	/* Get to the target in an RTT.  Near the plateau, creep. */
+	if (target > cwind)
+		expand = (target - cwind) * acked / cwind;
+	else
+		expand = (uint64_t)mss * acked / (100 * cwind);
+	/* No faster than slow start */
+	return MIN(expand, acked);
+}
+
+static uint32_t cubic_ssthresh(Tcpctl *tcb)
+{
+	struct cubic *cu = &tcb->cc_state.cubic;
+	uint32_t cwind = tcb->cwind;
+
+	cu->epoch_start = 0;
+	/* Fast convergence: if we lost before getting back to the old W_max,
+	 * someone else probably wants the bandwidth, so back off further. */
+	if (cwind < cu->w_max)
+		cu->w_max = (uint64_t)cwind * (10 + CUBIC_BETA) / 20;
+	else
+		cu->w_max = cwind;
+	return MAX((uint64_t)cwind * CUBIC_BETA / 10, 2 * tcb->typical_mss);
+}
+
+static struct tcp_cc_ops tcp_cubic = {
+	.name = "cubic",
+	.init = cubic_init,
+	.cong_avoid = cubic_cong_avoid,
+	.ssthresh = cubic_ssthresh,
+};
+
+static struct tcp_cc_ops *tcp_ccs[] = {
+	&tcp_reno,
+	&tcp_cubic,
+};
+
+static struct tcp_cc_ops *tcp_cc_lookup(char *name)
+{
+	for (int i = 0; i < ARRAY_SIZE(tcp_ccs); i++) {
+		if (!strcmp(tcp_ccs[i]->name, name))
+			return tcp_ccs[i];
+	}
+	return NULL;
+}
+
+/* Grows cwind after acked bytes were ACKed: slow start below ssthresh, and
+ * whatever the cc wants above it.  now is in ms. */
+static void tcp_grow_cwnd(Tcpctl *tcb, uint32_t acked, uint64_t now)
+{
+	uint32_t expand;
+
+	if (tcb->cwind >= tcb->snd.wnd)
+		return;
+	if (tcb->cwind < tcb->ssthresh) {
+		/* We increase the cwind by every byte we receive.  We want to increase
+		 * the cwind by one MSS for every MSS that gets ACKed.  Note that
+		 * multiple MSSs can be ACKed in a single ACK.  If we had a remainder of
+		 * acked / MSS, we'd add just that remainder - not 0 or 1 MSS. */
+		expand = acked;
+	} else {
+		expand = tcb->cc->cong_avoid(tcb, acked, now);
+	}
+	if (tcb->cwind + expand < tcb->cwind)
+		expand = tcb->snd.wnd - tcb->cwind;
+	if (tcb->cwind + expand > tcb->snd.wnd)
+		expand = tcb->snd.wnd - tcb->cwind;
+	tcb->cwind += expand;
+}
+
 /* Updates the RTT, given the currently sampled RTT and the number samples per
  * cwnd.  For non-TS RTTM, that'll be 1. */
 static void update_rtt(Tcpctl *tcb, int rtt_sample, int expected_samples)
@@ -2319,6 +2565,7 @@ static void update_rtt(Tcpctl *tcb, int rtt_sample, int expected_samples)
 
 	tcb->backoff = 0;
 	tcb->backedoff = 0;
+	tcb->rtt_sampled = TRUE;
 	if (tcb->srtt == 0) {
 		tcb->srtt = rtt_sample;
 		tcb->mdev = rtt_sample / 2;
@@ -2339,7 +2586,7 @@ void update(struct conv *s, Tcp * seg)
 {
 	int rtt;
 	Tcpctl *tcb;
-	uint32_t acked, expand;
+	uint32_t acked;
 	struct tcppriv *tpriv;
 
 	tpriv = s->p->priv;
@@ -2417,32 +2664,9 @@ void update(struct conv *s, Tcp * seg)
 		goto done;
 	}
 
-	/* slow start as long as we're not recovering from lost packets */
-	if (tcb->cwind < tcb->snd.wnd && !tcb->snd.recovery) {
-		if (tcb->cwind < tcb->ssthresh) {
-			/* We increase the cwind by every byte we receive.  We want to
-			 * increase the cwind by one MSS for every MSS that gets ACKed.
-			 * Note that multiple MSSs can be ACKed in a single ACK.  If we had
-			 * a remainder of acked / MSS, we'd add just that remainder - not 0
-			 * or 1 MSS. */
-			expand = acked;
-		} else {
-			/* Every RTT, which consists of CWND bytes, we're supposed to expand
-			 * by MSS bytes.  The classic algorithm was
-			 * 		expand = (tcb->mss * tcb->mss) / tcb->cwind;
-			 * which assumes the ACK was for MSS bytes.  Instead, for every
-			 * 'acked' bytes, we increase the window by acked / CWND (in units
-			 * of MSS). */
-			expand = MAX(acked, tcb->typical_mss) * tcb->typical_mss
-			         / tcb->cwind;
-		}
-
-		if (tcb->cwind + expand < tcb->cwind)
-			expand = tcb->snd.wnd - tcb->cwind;
-		if (tcb->cwind + expand > tcb->snd.wnd)
-			expand = tcb->snd.wnd - tcb->cwind;
-		tcb->cwind += expand;
-	}
+	/* grow the window as long as we're not recovering from lost packets */
+	if (!tcb->snd.recovery)
+		tcp_grow_cwnd(tcb, acked, milliseconds());
 	adjust_tx_qio_limit(s);
 
 	if (tcb->ts_recent) {
@@ -3074,9 +3298,9 @@ static uint32_t throttle_for_mss(Tcpctl *tcb, uint32_t ssize,
 		if ((tcb->flags & TSO) == 0) {
 			ssize = payload_mss;
 		} else {
-			/* Don't send too much.  32K is arbitrary.. */
-			if (ssize > 32 * 1024)
-				ssize = 32 * 1024;
+			/* Don't send more than one IP packet's worth */
+			if (ssize > TSO_MAX)
+				ssize = TSO_MAX;
 			if (!retrans) {
 				/* Clamp xmit to an integral MSS to avoid ragged tail segments
 				 * causing poor link utilization. */
@@ -3283,6 +3507,82 @@ static bool get_xmit_segment(struct conv *s, Tcpctl *tcb, uint16_t payload_mss,
 	return TRUE;
 }
 
+static void __tcp_pace_kmsg(uint32_t srcid, long a0, long a1, long a2)
+{
+	ERRSTACK(1);
+	struct conv *s = (struct conv*)a0;
+
+	qlock(&s->qlock);
+	if (waserror()) {
+		qunlock(&s->qlock);
+		nexterror();
+	}
+	/* Could be a stale alarm from a previous connection on this conv.  That's
+	 * harmless: tcpoutput() only sends what the current connection allows. */
+	tcpoutput(s);
+	qunlock(&s->qlock);
+	poperror();
+}
+
+/* We can't qlock from IRQ context, so we punt to a routine message */
+static void tcp_pace_alarm(struct alarm_waiter *waiter,
+                           struct hw_trapframe *hw_tf)
+{
+	send_kernel_message(core_id(), __tcp_pace_kmsg, (long)waiter->data, 0, 0,
+	                    KMSG_ROUTINE);
+}
+
+static void tcp_pace_init(struct conv *s, Tcpctl *tcb)
+{
+	init_awaiter_irq(&tcb->pace_alarm, tcp_pace_alarm);
+	tcb->pace_alarm.data = s;
+	tcb->pace_tchain = NULL;
+	tcb->pace_next = 0;
+}
+
+/* IRQ alarms don't block on unset, so this is safe with the conv qlocked */
+static void tcp_pace_cancel(Tcpctl *tcb)
+{
+	if (!tcb->pace_tchain)
+		return;
+	unset_alarm(tcb->pace_tchain, &tcb->pace_alarm);
+	tcb->pace_tchain = NULL;
+}
+
+/* Returns TRUE if pacing says we should wait before sending, in which case
+ * we'll have an alarm to call tcpoutput() when it's time. */
+static bool tcp_pace_wait(Tcpctl *tcb)
+{
+	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
+
+	if (!tcb->pacing || (tcb->flags & FORCE))
+		return FALSE;
+	if (read_tsc() >= tcb->pace_next)
+		return FALSE;
+	tcp_pace_cancel(tcb);
+	set_awaiter_abs(&tcb->pace_alarm, tcb->pace_next);
+	set_alarm(tchain, &tcb->pace_alarm);
+	tcb->pace_tchain = tchain;
+	return TRUE;
+}
+
+/* Pushes back the next send by how long ssize bytes take at the pacing rate,
+ * which is a bit more than cwind per srtt.  Until we have measured the RTT,
+ * we'd be pacing at a guess, so we don't. */
+static void tcp_pace_sent(Tcpctl *tcb, uint32_t ssize)
+{
+	uint64_t now, gap_ns;
+	unsigned int gain;
+
+	if (!tcb->pacing || !tcb->rtt_sampled || !tcb->cwind)
+		return;
+	gain = tcb->cwind < tcb->ssthresh ? PACE_GAIN_SS : PACE_GAIN_CA;
+	gap_ns = (uint64_t)ssize * tcb->srtt * NSEC_PER_MSEC * 100 /
+	         ((uint64_t)tcb->cwind * gain);
+	now = read_tsc();
+	tcb->pace_next = MAX(tcb->pace_next, now) + nsec2tsc(gap_ns);
+}
+
 /*
  *  always enters and exits with the s locked.  We drop
  *  the lock to ipoput the packet so some care has to be
@@ -3325,6 +3625,9 @@ void tcpoutput(struct conv *s)
 		if (tcb->snd.nxt != tcb->iss && (tcb->flags & SYNACK) == 0)
 			break;
 
+		if (tcp_pace_wait(tcb))
+			break;
+
 		/* payload_mss is the actual amount of data in the packet, which is the
 		 * advertised (mss - header opts).  This varies from packet to packet,
 		 * based on the options that might be present (e.g. always timestamps,
@@ -3458,6 +3761,7 @@ void tcpoutput(struct conv *s)
 				panic("tcpoutput2: version %d", version);
 		}
 		if (ssize) {
+			tcp_pace_sent(tcb, ssize);
 			/* The outer loop thinks we sent one packet.  If we used TSO, we
 			 * might have sent several.  Minus one for the loop increment. */
 			msgs += DIV_ROUND_UP(ssize, payload_mss) - 1;
@@ -3605,8 +3909,7 @@ static void tcp_loss_event(struct conv *s, Tcpctl *tcb)
 {
 	uint32_t old_cwnd = tcb->cwind;
 
-	/* Reno */
-	tcb->ssthresh = tcb->cwind / 2;
+	tcb->ssthresh = tcb->cc->ssthresh(tcb);
 	tcb->cwind = tcb->ssthresh;
 	netlog(s->p->f, Logtcprxmt,
 	       "%I.%d -> %I.%d: loss event, cwnd was %d, now %d\n",
@@ -3949,6 +4252,41 @@ void tcpadvise(struct Proto *tcp, struct block *bp, char *msg)
 	freeblist(bp);
 }
 
+/* Picks the congestion control algorithm.  We can switch on a live connection;
+ * the new algorithm starts from the current cwind and ssthresh. */
+static void tcpsetcc(struct conv *s, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+	struct tcp_cc_ops *cc;
+
+	if (n != 2)
+		error(EINVAL, "usage: cc reno|cubic");
+	cc = tcp_cc_lookup(f[1]);
+	if (!cc)
+		error(EINVAL, "unknown congestion control %s", f[1]);
+	tcb->cc = cc;
+	cc->init(tcb);
+}
+
+static void tcpsetpacing(struct conv *s, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+
+	if (n != 2)
+		error(EINVAL, "usage: pacing on|off");
+	if (strcmp(f[1], "on") == 0) {
+		tcb->pacing = TRUE;
+	} else if (strcmp(f[1], "off") == 0) {
+		tcb->pacing = FALSE;
+		tcp_pace_cancel(tcb);
+		tcb->pace_next = 0;
+		/* We might have been waiting on the alarm to send */
+		tcpoutput(s);
+	} else {
+		error(EINVAL, "unknown value for pacing");
+	}
+}
+
 static void tcpporthogdefensectl(char *val)
 {
 	if (strcmp(val, "on") == 0)
@@ -3970,6 +4308,10 @@ static void tcpctl(struct conv *c, char **f, int n)
 		tcpsetchecksum(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "tcpporthogdefense") == 0)
 		tcpporthogdefensectl(f[1]);
+	else if (n >= 1 && strcmp(f[0], "cc") == 0)
+		tcpsetcc(c, f, n);
+	else if (n >= 1 && strcmp(f[0], "pacing") == 0)
+		tcpsetpacing(c, f, n);
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
@@ -3985,6 +4327,7 @@ int tcpstats(struct Proto *tcp, char *buf, int len)
 	e = p + len;
 	for (i = 0; i < Nstats; i++)
 		p = seprintf(p, e, "%s: %u\n", statnames[i], priv->stats[i]);
+	p = iphtstats(&priv->ht, p, e);
 	return p - buf;
 }
 
@@ -4039,6 +4382,78 @@ void tcpsettimer(Tcpctl * tcb)
 	tcb->timer.start = x;
 }
 
+/* A congestion control algorithm and the tcb state it works on, without a
+ * connection, for the cc ktest's simulated paths. */
+struct tcp_cc_sim {
+	Tcpctl tcb;
+};
+
+/* Returns 0 if there is no cc called cc_name. */
+struct tcp_cc_sim *tcp_cc_sim_alloc(char *cc_name, uint32_t mss,
+                                    uint32_t rtt_ms)
+{
+	struct tcp_cc_ops *cc = tcp_cc_lookup(cc_name);
+	struct tcp_cc_sim *sim;
+	Tcpctl *tcb;
+
+	if (!cc)
+		return NULL;
+	sim = kzmalloc(sizeof(struct tcp_cc_sim), MEM_WAIT);
+	tcb = &sim->tcb;
+	tcb->mss = mss;
+	tcb->typical_mss = mss;
+	tcb->cwind = mss * CWIND_SCALE;
+	tcb->ssthresh = UINT32_MAX;
+	tcb->snd.wnd = 1 << 30;
+	tcb->srtt = rtt_ms;
+	tcb->cc = cc;
+	cc->init(tcb);
+	return sim;
+}
+
+void tcp_cc_sim_free(struct tcp_cc_sim *sim)
+{
+	kfree(sim);
+}
+
+/* Bytes we can send in the next ms with in_flight outstanding: whatever cwind
+ * allows, and with pacing, no more than an ms worth of the pacing rate. */
+uint64_t tcp_cc_sim_sendable(struct tcp_cc_sim *sim, uint64_t in_flight,
+                             bool pacing)
+{
+	Tcpctl *tcb = &sim->tcb;
+	uint64_t sendable;
+	unsigned int gain;
+
+	sendable = tcb->cwind > in_flight ? tcb->cwind - in_flight : 0;
+	if (pacing) {
+		gain = tcb->cwind < tcb->ssthresh ? PACE_GAIN_SS : PACE_GAIN_CA;
+		sendable = MIN(sendable,
+		               (uint64_t)tcb->cwind * gain / 100 / tcb->srtt);
+	}
+	return sendable;
+}
+
+/* acked bytes were ACKed at now (ms) */
+void tcp_cc_sim_ack(struct tcp_cc_sim *sim, uint32_t acked, uint64_t now)
+{
+	tcp_grow_cwnd(&sim->tcb, acked, now);
+}
+
+/* A loss, once per round of loss recovery */
+void tcp_cc_sim_loss(struct tcp_cc_sim *sim)
+{
+	Tcpctl *tcb = &sim->tcb;
+
+	tcb->ssthresh = tcb->cc->ssthresh(tcb);
+	tcb->cwind = tcb->ssthresh;
+}
+
+void tcp_cc_sim_set_rtt(struct tcp_cc_sim *sim, uint32_t rtt_ms)
+{
+	sim->tcb.srtt = rtt_ms;
+}
+
 static struct tcppriv *debug_priv;
 
 /* Kfunc this */
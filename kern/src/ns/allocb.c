@@ -48,25 +48,56 @@ enum {
 	BLOCKALIGN = 32,	/* was the old BY2V in inferno, which was 8 */
 };
 
-/*
- *  allocate blocks (round data base address to 64 bit boundary).
- *  if mallocz gives us more than we asked for, leave room at the front
- *  for header.
- */
-struct block *block_alloc(size_t size, int mem_flags)
+/* Packet buffer size classes, by the size the caller asks for.  Small is for
+ * ACKs and other header-only packets.  The other two fit a 1500 and a 9000 MTU
+ * frame, including the padding drivers add to their RX buffers (e.g. igbe's
+ * 2048 and 82563's 9728 + slop).  Anything bigger comes from kmalloc.
+ *
+ * The blocks are kmalloc bufs (kmalloc_from_cache()), since the stack increfs
+ * and kfrees them.  Some drivers change lim, so we set up the block on every
+ * allocation, not in a ctor. */
+struct block_class {
+	size_t						size;
+	char						*name;
+	struct kmem_cache			*kc;
+};
+
+static struct block_class block_classes[] = {
+	{256, "block_small"},
+	{2048, "block_1500"},
+	{9728 + 64, "block_9000"},
+};
+
+/* The amount of memory a block and its buffer need, not counting the tag */
+static size_t block_alloc_amt(size_t size)
 {
-	struct block *b;
-	uintptr_t addr;
-	int n;
+	return sizeof(struct block) + size + Hdrspc + (BLOCKALIGN - 1);
+}
 
-	/* If Hdrspc is not block aligned it will cause issues. */
-	static_assert(Hdrspc % BLOCKALIGN == 0);
+void block_alloc_init(void)
+{
+	struct block_class *bc;
 
-	b = kmalloc(sizeof(struct block) + size + Hdrspc + (BLOCKALIGN - 1),
-				mem_flags);
-	if (b == NULL)
-		return NULL;
+	for (int i = 0; i < ARRAY_SIZE(block_classes); i++) {
+		bc = &block_classes[i];
+		bc->kc = kmem_cache_create(bc->name, sizeof(struct kmalloc_tag) +
+		                           block_alloc_amt(bc->size), ARCH_CL_SIZE, 0,
+		                           NULL, NULL, NULL, NULL);
+	}
+}
+
+static struct kmem_cache *size_to_block_cache(size_t size)
+{
+	for (int i = 0; i < ARRAY_SIZE(block_classes); i++) {
+		if (size <= block_classes[i].size)
+			return block_classes[i].kc;
+	}
+	return NULL;
+}
 
+/* Sets up a fresh block whose buffer, including b, is amt bytes long. */
+static void block_init_hdr(struct block *b, size_t amt)
+{
 	b->next = NULL;
 	b->list = NULL;
 	b->free = NULL;
@@ -75,37 +106,67 @@ struct block *block_alloc(size_t size, int mem_flags)
 	b->nr_extra_bufs = 0;
 	b->extra_data = 0;
 
-	addr = (uintptr_t) b;
-	addr = ROUNDUP(addr + sizeof(struct block), BLOCKALIGN);
-	b->base = (uint8_t *) addr;
-	/* TODO: support this */
-	/* interesting. We can ask the allocator, after allocating,
-	 * the *real* size of the block we got. Very nice.
-	 * Not on akaros yet.
-	 b->lim = ((uint8_t*)b) + msize(b);
-	 * See use of n in commented code below
-	 */
-	b->lim =
-		((uint8_t *) b) + sizeof(struct block) + size + Hdrspc + (BLOCKALIGN -
-																  1);
-	b->rp = b->base;
-	/* TODO: support this */
-	/* n is supposed to be Hdrspc + rear padding + extra reserved memory, but
-	 * since we don't currently support checking how much memory was actually
-	 * reserved, this is always Hdrspc + rear padding. After rounding that down
-	 * to BLOCKALIGN, it's always Hdrpsc since the padding is < BLOCKALIGN.
-	 n = b->lim - b->base - size;
-	 b->rp += n & ~(BLOCKALIGN - 1);
-	 */
-	b->rp += Hdrspc;
+	b->base = (uint8_t*)ROUNDUP((uintptr_t)(b + 1), BLOCKALIGN);
+	b->lim = (uint8_t*)b + amt;
+	/* Hdrspc is only for padblock, to the left of rp */
+	b->rp = b->base + Hdrspc;
 	b->wp = b->rp;
-	/* b->base is aligned, rounded up from b
-	 * b->lim is the upper bound on our malloc
-	 * b->rp is advanced by some aligned amount, based on how much extra we
-	 * received from kmalloc and the Hdrspc. */
+}
+
+/*
+ *  allocate blocks (round data base address to 64 bit boundary).
+ *  leave room at the front for header.
+ */
+struct block *block_alloc(size_t size, int mem_flags)
+{
+	struct kmem_cache *kc;
+	struct block *b;
+	size_t amt;
+
+	/* If Hdrspc is not block aligned it will cause issues. */
+	static_assert(Hdrspc % BLOCKALIGN == 0);
+
+	/* kc is 0 for big blocks, or if we're called before block_alloc_init() */
+	kc = size_to_block_cache(size);
+	if (kc) {
+		b = kmalloc_from_cache(kc, mem_flags);
+		/* Whatever the class has beyond size is ours too */
+		amt = kc->obj_size - sizeof(struct kmalloc_tag);
+	} else {
+		amt = block_alloc_amt(size);
+		b = kmalloc(amt, mem_flags);
+	}
+	if (b == NULL)
+		return NULL;
+	block_init_hdr(b, amt);
 	return b;
 }
 
+/* Allocates up to nr blocks of size into blocks, for drivers filling an RX
+ * ring.  Sizes with a block class come out of this core's magazines in one
+ * pass, so call this from the core that takes the NIC's interrupts.  Returns
+ * the number allocated. */
+size_t block_alloc_bulk(struct block **blocks, size_t nr, size_t size,
+                        int mem_flags)
+{
+	struct kmem_cache *kc;
+	size_t got;
+
+	kc = size_to_block_cache(size);
+	if (!kc) {
+		for (got = 0; got < nr; got++) {
+			blocks[got] = block_alloc(size, mem_flags);
+			if (!blocks[got])
+				break;
+		}
+		return got;
+	}
+	got = kmalloc_from_cache_bulk(kc, (void**)blocks, nr, mem_flags);
+	for (size_t i = 0; i < got; i++)
+		block_init_hdr(blocks[i], kc->obj_size - sizeof(struct kmalloc_tag));
+	return got;
+}
+
 /* Makes sure b has nr_bufs extra_data.  Will grow, but not shrink, an existing
  * extra_data array.  When growing, it'll copy over the old entries.  All new
  * entries will be zeroed.  mem_flags determines if we'll block on kmallocs.
@@ -151,10 +212,11 @@ static struct extra_bdata *next_unused_slot(struct block *b)
 }
 
 /* Append an extra data buffer @base with offset @off of length @len to block
- * @b.  Reuse an unused extra data slot if there's any.
+ * @b.  Reuse an unused extra data slot if there's any.  @base is a kmalloc'd
+ * buffer, unless @ref is set, in which case we take over the caller's @ref.
  * Return 0 on success or -1 on error. */
-int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
-                       uint32_t len, int mem_flags)
+int block_append_extra_ref(struct block *b, uintptr_t base, uint32_t off,
+                           uint32_t len, struct kref *ref, int mem_flags)
 {
 	unsigned int nr_bufs = b->nr_extra_bufs + 1;
 	struct extra_bdata *ebd;
@@ -169,20 +231,50 @@ int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
 	ebd->base = base;
 	ebd->off = off;
 	ebd->len = len;
+	ebd->ref = ref;
 	b->extra_len += ebd->len;
 	return 0;
 }
 
+int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
+                       uint32_t len, int mem_flags)
+{
+	return block_append_extra_ref(b, base, off, len, NULL, mem_flags);
+}
+
+/* Extra data buffers are usually kmalloc'd, and we share them with
+ * kmalloc_incref.  Buffers we don't own, such as the user pages of a zero-copy
+ * write, come with a kref for their release method instead.
+ *
+ * ebd_get() takes a ref for another ebd that points into the same buffer. */
+void ebd_get(struct extra_bdata *ebd)
+{
+	if (ebd->ref)
+		kref_get(ebd->ref, 1);
+	else
+		kmalloc_incref((void*)ebd->base);
+}
+
+/* Drops ebd's ref on its buffer and clears everything but its len. */
+void ebd_put(struct extra_bdata *ebd)
+{
+	if (ebd->ref)
+		kref_put(ebd->ref);
+	else
+		kfree((void*)ebd->base);
+	ebd->base = 0;
+	ebd->off = 0;
+	ebd->ref = NULL;
+}
+
 void free_block_extra(struct block *b)
 {
 	struct extra_bdata *ebd;
 
-	/* assuming our release method is kfree, which will change when we support
-	 * user buffers */
 	for (int i = 0; i < b->nr_extra_bufs; i++) {
 		ebd = &b->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			ebd_put(ebd);
 	}
 	b->extra_len = 0;
 	b->nr_extra_bufs = 0;
@@ -267,7 +359,8 @@ void checkb(struct block *b, char *msg)
 			panic("checkb %s: ebd %d has no base, but has off %d and len %d",
 			      msg, i, ebd->off, ebd->len);
 		if (ebd->base) {
-			if (!kmalloc_refcnt((void*)ebd->base))
+			if (ebd->ref ? !kref_refcnt(ebd->ref)
+			             : !kmalloc_refcnt((void*)ebd->base))
 				panic("checkb %s: buf %d, base %p has no refcnt!\n", msg, i,
 				      ebd->base);
 			extra_len += ebd->len;
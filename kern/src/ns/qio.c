@@ -39,6 +39,9 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <mm.h>
+#include <event.h>
+#include <umem.h>
 
 #define PANIC_EXTRA(b)							\
 {									\
@@ -88,10 +91,30 @@ struct queue {
 	void *wake_data;
 
 	char err[ERRMAX];
+
+	struct event_queue *zc_evq;	/* zero-copy writes, see q_zerocopy() */
+	pid_t zc_pid;
+	uint32_t zc_id;
+};
+
+/* A chunk of a zero-copy write.  Its blocks' extra_data point straight at the
+ * pinned user pages, and each ebd holds a ref on kref.  Once the last one lets
+ * go, e.g. after TCP got its ACK and the NIC is done, we unpin the pages and
+ * tell the user they can reuse the buffer. */
+struct zc_buf {
+	struct kref kref;
+	struct proc *proc;
+	struct event_queue *ev_q;
+	uint32_t id;
+	void *uva;
+	size_t len;
+	int nr_pgs;
+	struct page *pages[];
 };
 
 enum {
 	Maxatomic = 64 * 1024,
+	Zcminwrite = 16 * 1024,	/* smaller zero-copy writes just copy */
 	QIO_CAN_ERR_SLEEP = (1 << 0),	/* can throw errors or block/sleep */
 	QIO_LIMIT = (1 << 1),			/* respect q->limit */
 	QIO_DROP_OVERFLOW = (1 << 2),	/* alternative to setting qdropoverflow */
@@ -103,6 +126,9 @@ enum {
 unsigned int qiomaxatomic = Maxatomic;
 
 static size_t copy_to_block_body(struct block *to, void *from, size_t copy_amt);
+static uint32_t copy_to_block_body_csum(struct block *to, void *from,
+                                        size_t copy_amt, uint16_t start,
+                                        uint32_t sum);
 static ssize_t __qbwrite(struct queue *q, struct block *b, int flags);
 static struct block *__qbread(struct queue *q, size_t len, int qio_flags,
                               int mem_flags);
@@ -293,6 +319,39 @@ struct block *linearizeblock(struct block *b)
 	return newb;
 }
 
+/* Like linearizeblock, but also does the block's pending software checksum
+ * (see ptclcsum_finalize) while we copy, instead of in a second pass.  The
+ * returned block has no checksum flags left. */
+struct block *linearizeblock_csum(struct block *b)
+{
+	struct block *newb;
+	struct extra_bdata *ebd;
+	uint32_t sum = 0;
+	uint16_t start = b->checksum_start;
+
+	if (!b->extra_len || !(b->flag & BCKSUM_FLAGS) || (b->flag & Btso) ||
+	    start > BHLEN(b))
+		return linearizeblock(b);
+	newb = block_alloc(BLEN(b), MEM_WAIT);
+	copy_to_block_body(newb, b->rp, start);
+	sum = copy_to_block_body_csum(newb, b->rp + start, BHLEN(b) - start, start,
+	                              sum);
+	for (int i = 0; i < b->nr_extra_bufs; i++) {
+		ebd = &b->extra_data[i];
+		if (!ebd->base || !ebd->len)
+			continue;
+		sum = copy_to_block_body_csum(newb, (void*)ebd->base + ebd->off,
+		                              ebd->len, start, sum);
+	}
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	/* the pseudo-header sum was already at csum_store, and is in sum now */
+	hnputs(newb->rp + start + b->checksum_offset, ~sum & 0xffff);
+	copyblockcnt++;
+	freeb(b);
+	return newb;
+}
+
 /* Make sure the first block has at least n bytes in its main body.  Pulls up
  * data from the *list* of blocks.  Returns 0 if there is not enough data in the
  * block list. */
@@ -338,11 +397,8 @@ struct block *pullupblock(struct block *bp, int n)
 			ebd->len -= seglen;
 			ebd->off += seglen;
 			bp->extra_len -= seglen;
-			if (ebd->len == 0) {
-				kfree((void *)ebd->base);
-				ebd->off = 0;
-				ebd->base = 0;
-			}
+			if (ebd->len == 0)
+				ebd_put(ebd);
 		}
 		/* maybe just call pullupblock recursively here */
 		if (len)
@@ -426,11 +482,8 @@ static int pullext(struct block *bp, int count)
 		bytes += rem;
 		ed->off += rem;
 		ed->len -= rem;
-		if (ed->len == 0) {
-			kfree((void *)ed->base);
-			ed->base = 0;
-			ed->off = 0;
-		}
+		if (ed->len == 0)
+			ebd_put(ed);
 	}
 	return bytes;
 }
@@ -452,11 +505,8 @@ static int dropext(struct block *bp, int count)
 		count -= rem;
 		bytes += rem;
 		ed->len -= rem;
-		if (ed->len == 0) {
-			kfree((void *)ed->base);
-			ed->base = 0;
-			ed->off = 0;
-		}
+		if (ed->len == 0)
+			ebd_put(ed);
 	}
 	return bytes;
 }
@@ -602,8 +652,8 @@ struct block *adjustblock(struct block *bp, int len)
 	for (; i < bp->nr_extra_bufs; i++) {
 		ebd = &bp->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
-		ebd->base = ebd->off = ebd->len = 0;
+			ebd_put(ebd);
+		ebd->len = 0;
 	}
 	QDEBUG checkb(bp, "adjustblock 4");
 	return bp;
@@ -630,6 +680,24 @@ static size_t copy_to_block_body(struct block *to, void *from, size_t copy_amt)
 	return copy_amt;
 }
 
+/* Helper: copy_to_block_body, adding the ptclbsum of what we copied to sum.
+ * start is where the checksum starts in to's body; bytes at odd offsets from
+ * it are the low bytes of their words. */
+static uint32_t copy_to_block_body_csum(struct block *to, void *from,
+                                        size_t copy_amt, uint16_t start,
+                                        uint32_t sum)
+{
+	uint16_t csum;
+	bool odd = (to->wp - to->rp - start) & 1;
+
+	copy_amt = MIN(to->lim - to->wp, copy_amt);
+	csum = ptclbsum_copy(to->wp, from, copy_amt);
+	to->wp += copy_amt;
+	if (odd)
+		csum = (csum << 8) | (csum >> 8);
+	return sum + csum;
+}
+
 /* Accounting helper.  Block b in q lost amt extra_data */
 static void block_and_q_lost_extra(struct block *b, struct queue *q, size_t amt)
 {
@@ -647,10 +715,12 @@ static size_t move_ebd(struct extra_bdata *ebd, struct block *to,
 {
 	size_t ret = ebd->len;
 
-	if (block_append_extra(to, ebd->base, ebd->off, ebd->len, MEM_ATOMIC))
+	if (block_append_extra_ref(to, ebd->base, ebd->off, ebd->len, ebd->ref,
+	                           MEM_ATOMIC))
 		return 0;
 	block_and_q_lost_extra(from, from_q, ebd->len);
 	ebd->base = ebd->len = ebd->off = 0;
+	ebd->ref = NULL;
 	return ret;
 }
 
@@ -962,8 +1032,7 @@ struct block *packblock(struct block *bp)
 /* Add an extra_data entry to newb at newb_idx pointing to b's body, starting at
  * body_rp, for up to len.  Returns the len consumed.
  *
- * The base is 'b', so that we can kfree it later.  This currently ties us to
- * using kfree for the release method for all extra_data.
+ * The base is 'b', so that we can kfree it later.
  *
  * It is possible to have a body size that is 0, if there is no offset, and
  * b->wp == b->rp.  This will have an extra data entry of 0 length. */
@@ -977,6 +1046,7 @@ static size_t point_to_body(struct block *b, uint8_t *body_rp,
 
 	kmalloc_incref(b);
 	ebd->base = (uintptr_t)b;
+	ebd->ref = NULL;
 	ebd->off = (uint32_t)(body_rp - (uint8_t*)b);
 	ebd->len = MIN(b->wp - body_rp, len);	/* think of body_rp as b->rp */
 	assert((int)ebd->len >= 0);
@@ -999,8 +1069,9 @@ static size_t point_to_buf(struct block *b, unsigned int b_idx, uint32_t b_off,
 	assert(b_idx < b->nr_extra_bufs);
 	assert(newb_idx < newb->nr_extra_bufs);
 
-	kmalloc_incref((void*)b_ebd->base);
+	ebd_get(b_ebd);
 	n_ebd->base = b_ebd->base;
+	n_ebd->ref = b_ebd->ref;
 	n_ebd->off = b_ebd->off + b_off;
 	n_ebd->len = MIN(b_ebd->len - b_off, len);
 	newb->extra_len += n_ebd->len;
@@ -1314,12 +1385,10 @@ static size_t read_from_block(struct block *b, uint8_t *to, size_t amt)
 		ebd->len -= copy_amt;
 		ebd->off += copy_amt;
 		b->extra_len -= copy_amt;
-		if (!ebd->len) {
-			/* we don't actually have to decref here.  it's also done in
-			 * freeb().  this is the earliest we can free. */
-			kfree((void*)ebd->base);
-			ebd->base = ebd->off = 0;
-		}
+		/* we don't actually have to decref here.  it's also done in freeb().
+		 * this is the earliest we can free. */
+		if (!ebd->len)
+			ebd_put(ebd);
 		to += copy_amt;
 		amt -= copy_amt;
 		retval += copy_amt;
@@ -1644,6 +1713,145 @@ static struct block *build_block(void *from, size_t len, int mem_flags)
 	return b;
 }
 
+static void __zc_buf_release(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct zc_buf *zcb = (struct zc_buf*)a0;
+	struct event_msg msg = {0};
+
+	for (int i = 0; i < zcb->nr_pgs; i++)
+		page_unpin(zcb->pages[i]);
+	if (zcb->ev_q) {
+		msg.ev_type = EV_ZEROCOPY;
+		msg.ev_arg2 = zcb->id;
+		msg.ev_arg3 = zcb->uva;
+		msg.ev_arg4 = zcb->len;
+		send_event(zcb->proc, zcb->ev_q, &msg, 0);
+	}
+	proc_decref(zcb->proc);
+	kfree(zcb);
+}
+
+/* Blocks are freed from all sorts of contexts, including IRQ handlers, but
+ * sending events needs a process context. */
+static void zc_buf_release(struct kref *kref)
+{
+	struct zc_buf *zcb = container_of(kref, struct zc_buf, kref);
+
+	send_kernel_message(core_id(), __zc_buf_release, (long)zcb, 0, 0,
+	                    KMSG_ROUTINE);
+}
+
+/* Zero-copy blocks only work with the extra_data-aware qclone(). */
+static bool q_wants_zc(struct queue *q)
+{
+#ifdef CONFIG_BLOCK_EXTRAS
+	return READ_ONCE(q->zc_evq) && current && (current->pid == q->zc_pid);
+#else
+	return FALSE;
+#endif
+}
+
+/* Copied-chunk completions for one __qwrite(), sent with send_events() so a
+ * large write that couldn't pin its pages alerts the user once per batch, not
+ * once per chunk. */
+#define ZC_BATCH_MSGS 8
+
+struct zc_batch {
+	struct event_queue *ev_q;
+	int nr;
+	struct event_msg msgs[ZC_BATCH_MSGS];
+};
+
+static void zc_flush_copied(struct zc_batch *zb)
+{
+	if (!zb->nr)
+		return;
+	send_events(current, zb->ev_q, zb->msgs, zb->nr, 0);
+	zb->nr = 0;
+}
+
+/* Every chunk of a zero-copy write gets a completion, even if we ended up
+ * copying it.  Those are sent as soon as the chunk is queued, with arg1 set,
+ * batched in zb.  The caller flushes zb with zc_flush_copied(). */
+static void zc_send_copied(struct queue *q, struct zc_batch *zb, void *uva,
+                           size_t len)
+{
+	struct event_msg *msg;
+	struct event_queue *ev_q;
+	uint32_t id;
+
+	spin_lock_irqsave(&q->lock);
+	ev_q = q->zc_evq;
+	id = q->zc_id++;
+	spin_unlock_irqsave(&q->lock);
+	if (!ev_q)
+		return;
+	if (zb->nr && ((zb->ev_q != ev_q) || (zb->nr == ZC_BATCH_MSGS)))
+		zc_flush_copied(zb);
+	zb->ev_q = ev_q;
+	msg = &zb->msgs[zb->nr++];
+	memset(msg, 0, sizeof(struct event_msg));
+	msg->ev_type = EV_ZEROCOPY;
+	msg->ev_arg1 = 1;
+	msg->ev_arg2 = id;
+	msg->ev_arg3 = uva;
+	msg->ev_arg4 = len;
+}
+
+/* Builds a block whose extra_data point at the user's pages for [from, from +
+ * len), one ebd per page, without copying.  Returns 0 if len is too small to
+ * bother or the user's memory can't be pinned (see pin_user_pages()), and the
+ * caller should copy. */
+static struct block *build_zc_block(struct queue *q, void *from, size_t len,
+                                    int mem_flags)
+{
+	uintptr_t va = (uintptr_t)from;
+	int nr_pgs = (ROUNDUP(va + len, PGSIZE) - ROUNDDOWN(va, PGSIZE)) >> PGSHIFT;
+	struct zc_buf *zcb;
+	struct block *b;
+	struct extra_bdata *ebd;
+
+	if (len < Zcminwrite)
+		return 0;
+	zcb = kmalloc(sizeof(struct zc_buf) + nr_pgs * sizeof(struct page*),
+	              mem_flags);
+	if (!zcb)
+		return 0;
+	b = block_alloc(64, mem_flags);
+	if (!b)
+		goto out_zcb;
+	if (block_add_extd(b, nr_pgs, mem_flags))
+		goto out_b;
+	if (pin_user_pages(current, from, len, zcb->pages) != nr_pgs)
+		goto out_b;
+	kref_init(&zcb->kref, zc_buf_release, nr_pgs);
+	proc_incref(current, 1);
+	zcb->proc = current;
+	zcb->uva = from;
+	zcb->len = len;
+	zcb->nr_pgs = nr_pgs;
+	spin_lock_irqsave(&q->lock);
+	zcb->ev_q = q->zc_evq;
+	zcb->id = q->zc_id++;
+	spin_unlock_irqsave(&q->lock);
+	for (int i = 0; i < nr_pgs; i++) {
+		ebd = &b->extra_data[i];
+		ebd->base = (uintptr_t)page2kva(zcb->pages[i]);
+		ebd->off = PGOFF(va);
+		ebd->len = MIN(PGSIZE - ebd->off, len);
+		ebd->ref = &zcb->kref;
+		b->extra_len += ebd->len;
+		va += ebd->len;
+		len -= ebd->len;
+	}
+	return b;
+out_b:
+	freeb(b);
+out_zcb:
+	kfree(zcb);
+	return 0;
+}
+
 static ssize_t __qwrite(struct queue *q, void *vp, size_t len, int mem_flags,
                         int qio_flags)
 {
@@ -1653,6 +1861,8 @@ static ssize_t __qwrite(struct queue *q, void *vp, size_t len, int mem_flags,
 	struct block *b;
 	uint8_t *p = vp;
 	void *ext_buf;
+	bool zc, copied;
+	struct zc_batch zb = {0};
 
 	/* Only some callers can throw.  Others might be in a context where waserror
 	 * isn't safe. */
@@ -1668,14 +1878,25 @@ static ssize_t __qwrite(struct queue *q, void *vp, size_t len, int mem_flags,
 		/* This is 64K, the max amount per single block.  Still a good value? */
 		if (n > Maxatomic)
 			n = Maxatomic;
-		b = build_block(p + sofar, n, mem_flags);
-		if (!b)
-			break;
+		zc = q_wants_zc(q);
+		b = zc ? build_zc_block(q, p + sofar, n, mem_flags) : 0;
+		copied = !b;
+		if (copied) {
+			b = build_block(p + sofar, n, mem_flags);
+			if (!b)
+				break;
+		}
 		if (__qbwrite(q, b, qio_flags) < 0)
 			break;
+		/* Only once the chunk is in: if __qbwrite() failed or threw, the
+		 * chunk isn't part of the write and gets no completion. */
+		if (zc && copied)
+			zc_send_copied(q, &zb, p + sofar, n);
 		sofar += n;
 	} while ((sofar < len) && (q->state & Qmsg) == 0);
 out_ok:
+	/* Nothing is batched if we throw: that's only when sofar == 0. */
+	zc_flush_copied(&zb);
 	if (qio_flags & QIO_CAN_ERR_SLEEP)
 		poperror();
 	return sofar;
@@ -1779,6 +2000,10 @@ void qreopen(struct queue *q)
 	q->limit = q->inilim;
 	q->wake_cb = 0;
 	q->wake_data = 0;
+	/* Whoever reuses the q (e.g. a new IP conv) didn't ask for zero-copy */
+	q->zc_evq = 0;
+	q->zc_pid = 0;
+	q->zc_id = 0;
 	spin_unlock_irqsave(&q->lock);
 }
 
@@ -1870,6 +2095,25 @@ void q_toggle_qmsg(struct queue *q, bool onoff)
 	spin_unlock_irqsave(&q->lock);
 }
 
+/* Turns on zero-copy writes for the calling process.  Its large qwrites will
+ * point at its pages instead of copying them, and once the queue and whoever
+ * reads it are done with a chunk, we send an EV_ZEROCOPY to ev_q.  The user
+ * must not change the buffer until then.  Chunks that we copied anyway (small
+ * or unpinnable) get their EV_ZEROCOPY right away.  Writes from other processes
+ * just copy.  A 0 ev_q turns it off. */
+void q_zerocopy(struct queue *q, struct event_queue *ev_q)
+{
+#ifndef CONFIG_BLOCK_EXTRAS
+	error(ENOTSUP, "zero-copy needs CONFIG_BLOCK_EXTRAS");
+#endif
+	if (ev_q && !is_user_rwaddr(ev_q, sizeof(struct event_queue)))
+		error(EINVAL, "zero-copy with bad event_queue %p", ev_q);
+	spin_lock_irqsave(&q->lock);
+	q->zc_evq = ev_q;
+	q->zc_pid = ev_q ? current->pid : 0;
+	spin_unlock_irqsave(&q->lock);
+}
+
 /* Be careful: this can affect concurrent reads/writes and code that might have
  * built-in expectations of the q's type. */
 void q_toggle_qcoalesce(struct queue *q, bool onoff)
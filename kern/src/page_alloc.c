@@ -9,6 +9,11 @@
 #include <pmap.h>
 #include <kmalloc.h>
 #include <arena.h>
+#include <smp.h>
+#include <arch/topology.h>
+
+struct numa_node numa_nodes[MAX_NUMA_NODES];
+int nr_numa_nodes;	/* 0 until numa_arenas_init() sets up the arenas */
 
 /* Helper, allocates a free page. */
 static struct page *get_a_free_page(void)
@@ -73,16 +78,160 @@ void *kpage_zalloc_addr(void)
 	return retval;
 }
 
-/* Helper function for allocating from the kpages_arena.  This may be useful
- * later since we might send the caller to a different NUMA domain. */
+/* Tells us that [start, end) of physical memory belongs to node.  Call this
+ * before numa_arenas_init(). */
+void numa_add_mem_range(int node, physaddr_t start, physaddr_t end)
+{
+	struct numa_node *nn;
+
+	if ((node < 0) || (node >= MAX_NUMA_NODES)) {
+		warn("NUMA node %d out of range, ignoring its memory", node);
+		return;
+	}
+	nn = &numa_nodes[node];
+	/* base_arena only tracks memory below max_paddr */
+	end = MIN(end, max_paddr);
+	if (start >= end)
+		return;
+	if (nn->nr_ranges == MAX_NUMA_RANGES) {
+		warn("Too many memory ranges for NUMA node %d", node);
+		return;
+	}
+	nn->ranges[nn->nr_ranges].start = start;
+	nn->ranges[nn->nr_ranges].end = end;
+	nn->nr_ranges++;
+	nn->amt_present += end - start;
+}
+
+/* Imports a span for node's arena from the parts of base_arena in node's
+ * memory ranges. */
+static void *numa_import(int node, size_t size, int flags)
+{
+	struct numa_node *nn = &numa_nodes[node];
+	void *ret;
+
+	for (int i = 0; i < nn->nr_ranges; i++) {
+		ret = arena_xalloc(base_arena, size, PGSIZE, 0, 0,
+		                   KADDR_NOCHECK(nn->ranges[i].start),
+		                   KADDR_NOCHECK(nn->ranges[i].end), flags);
+		if (ret)
+			return ret;
+	}
+	return NULL;
+}
+
+/* Arena import functions only get the source arena, so each node needs its own
+ * function to tell numa_import() which node it is for. */
+#define NUMA_IMPORT_FUNC(n)                                                    \
+static void *numa_import_##n(struct arena *source, size_t size, int flags)     \
+{                                                                              \
+	return numa_import(n, size, flags);                                        \
+}
+
+NUMA_IMPORT_FUNC(0)
+NUMA_IMPORT_FUNC(1)
+NUMA_IMPORT_FUNC(2)
+NUMA_IMPORT_FUNC(3)
+NUMA_IMPORT_FUNC(4)
+NUMA_IMPORT_FUNC(5)
+NUMA_IMPORT_FUNC(6)
+NUMA_IMPORT_FUNC(7)
+
+static void *(*numa_import_funcs[MAX_NUMA_NODES])(struct arena *, size_t,
+                                                  int) = {
+	numa_import_0, numa_import_1, numa_import_2, numa_import_3,
+	numa_import_4, numa_import_5, numa_import_6, numa_import_7,
+};
+
+/* Builds a kpages arena for each node that has memory.  Until this runs (or if
+ * there's only one node), every page comes from kpages_arena. */
+void numa_arenas_init(void)
+{
+	struct numa_node *nn;
+	char name[ARENA_NAME_SZ];
+	int nr_with_mem = 0, max_node = -1;
+
+	for (int i = 0; i < MAX_NUMA_NODES; i++) {
+		if (numa_nodes[i].nr_ranges) {
+			nr_with_mem++;
+			max_node = i;
+		}
+	}
+	if (nr_with_mem < 2)
+		return;
+	for (int i = 0; i <= max_node; i++) {
+		nn = &numa_nodes[i];
+		if (!nn->nr_ranges)
+			continue;
+		snprintf(name, sizeof(name), "kpages_node%d", i);
+		nn->kpages = arena_create(name, NULL, 0, PGSIZE, numa_import_funcs[i],
+		                          arena_xfree, base_arena, 8 * PGSIZE,
+		                          MEM_WAIT);
+		printk("NUMA node %d: %lu MB of memory\n", i,
+		       nn->amt_present >> 20);
+	}
+	wmb();	/* arenas are set up before anyone sees nr_numa_nodes */
+	nr_numa_nodes = max_node + 1;
+}
+
+/* Tries to get pages from node's arena, then from the other nodes.  We don't
+ * let a node's arena block: there's always somewhere else to get memory. */
+static void *numa_kpages_alloc(int node, size_t size, int flags)
+{
+	int my_node = cpu_topology_info.core_list[core_id()].numa_id;
+	struct numa_node *nn;
+	void *ret;
+	int n;
+
+	flags = (flags & ~(MEM_WAIT | MEM_ERROR)) | MEM_ATOMIC;
+	for (int i = 0; i < nr_numa_nodes; i++) {
+		n = (node + i) % nr_numa_nodes;
+		nn = &numa_nodes[n];
+		if (!nn->kpages)
+			continue;
+		ret = arena_alloc(nn->kpages, size, flags);
+		if (!ret)
+			continue;
+		kva2page(ret)->pg_numa_src = n + 1;
+		/* racy, but these are just stats */
+		if (n == my_node)
+			nn->nr_local_allocs++;
+		else
+			nn->nr_remote_allocs++;
+		if (i)
+			numa_nodes[node].nr_fallbacks++;
+		return ret;
+	}
+	return NULL;
+}
+
+/* Helper function for allocating from the kpages_arena.  We try the caller's
+ * NUMA node first (or the node from MEM_NODE()), then any other node, then
+ * kpages_arena, which also has the memory that isn't in any node. */
 void *kpages_alloc(size_t size, int flags)
 {
-	return arena_alloc(kpages_arena, size, flags);
+	int node = ((flags & MEM_NODE_MASK) >> MEM_NODE_SHIFT) - 1;
+	void *ret;
+
+	flags &= ~MEM_NODE_MASK;
+	if (nr_numa_nodes) {
+		if (node < 0)
+			node = cpu_topology_info.core_list[core_id()].numa_id;
+		if ((node < 0) || (node >= nr_numa_nodes))
+			node = 0;
+		ret = numa_kpages_alloc(node, size, flags);
+		if (ret)
+			return ret;
+	}
+	ret = arena_alloc(kpages_arena, size, flags);
+	if (ret)
+		kva2page(ret)->pg_numa_src = 0;
+	return ret;
 }
 
 void *kpages_zalloc(size_t size, int flags)
 {
-	void *ret = arena_alloc(kpages_arena, size, flags);
+	void *ret = kpages_alloc(size, flags);
 
 	if (!ret)
 		return NULL;
@@ -90,8 +239,18 @@ void *kpages_zalloc(size_t size, int flags)
 	return ret;
 }
 
+/* Pages go back to the arena they came from, which kpages_alloc() noted in
+ * the first page. */
 void kpages_free(void *addr, size_t size)
 {
+	struct page *pg = kva2page(addr);
+	int src = pg->pg_numa_src;
+
+	if (src) {
+		pg->pg_numa_src = 0;
+		arena_free(numa_nodes[src - 1].kpages, addr, size);
+		return;
+	}
 	arena_free(kpages_arena, addr, size);
 }
 
@@ -109,9 +268,102 @@ void free_cont_pages(void *buf, size_t order)
 	arena_xfree(kpages_arena, buf, PGSIZE << order);
 }
 
-/* Frees the page */
+/* Allocates a JPGSIZE-aligned jumbo page for user memory, preferring the local
+ * NUMA node.  This never blocks: if memory is too fragmented, the caller should
+ * fall back to regular pages.  The jumbo starts with one ref, for the jumbo
+ * PTE that will map it.  Every page in the jumbo is PG_JUMBO, so that
+ * page_decref() can find the head once the jumbo is split. */
+struct page *jumbo_page_alloc(void)
+{
+	struct arena *arena;
+	struct page *head;
+	void *kva = NULL;
+	int node, src = 0;
+
+	if (nr_numa_nodes) {
+		node = cpu_topology_info.core_list[core_id()].numa_id;
+		for (int i = 0; i < nr_numa_nodes; i++) {
+			arena = numa_nodes[(node + i) % nr_numa_nodes].kpages;
+			if (!arena)
+				continue;
+			kva = arena_xalloc(arena, JPGSIZE, JPGSIZE, 0, 0, NULL, NULL,
+			                   MEM_ATOMIC);
+			if (kva) {
+				src = (node + i) % nr_numa_nodes + 1;
+				break;
+			}
+		}
+	}
+	if (!kva)
+		kva = arena_xalloc(kpages_arena, JPGSIZE, JPGSIZE, 0, 0, NULL, NULL,
+		                   MEM_ATOMIC);
+	if (!kva)
+		return NULL;
+	head = kva2page(kva);
+	for (int i = 0; i < NR_PGS_PER_JPG; i++)
+		atomic_or(&head[i].pg_flags, PG_JUMBO);
+	head->pg_numa_src = src;
+	atomic_set(&head->pg_jumbo_refs, 1);
+	return head;
+}
+
+/* The jumbo at head is now mapped by regular PTEs, each holding a ref. */
+void jumbo_page_split(struct page *head)
+{
+	atomic_set(&head->pg_jumbo_refs, NR_PGS_PER_JPG);
+}
+
+static void jumbo_page_free(struct page *head)
+{
+	int src = head->pg_numa_src;
+
+	for (int i = 0; i < NR_PGS_PER_JPG; i++)
+		atomic_and(&head[i].pg_flags, ~PG_JUMBO);
+	head->pg_numa_src = 0;
+	arena_xfree(src ? numa_nodes[src - 1].kpages : kpages_arena,
+	            page2kva(head), JPGSIZE);
+}
+
+/* Frees the page.  A page in a jumbo drops a ref on the whole jumbo, which is
+ * freed when its last PTE goes away.  A pinned page is orphaned instead, and
+ * the last page_unpin() frees it. */
 void page_decref(page_t *page)
 {
+	struct page *head;
+	long pins;
+
+	if (atomic_read(&page->pg_flags) & PG_JUMBO) {
+		head = pa2page(ROUNDDOWN(page2pa(page), JPGSIZE));
+		if (atomic_sub_and_test(&head->pg_jumbo_refs, 1))
+			jumbo_page_free(head);
+		return;
+	}
+	do {
+		pins = atomic_read(&page->pg_pins);
+		if (!pins) {
+			kpages_free(page2kva(page), PGSIZE);
+			return;
+		}
+	} while (!atomic_cas(&page->pg_pins, pins, pins | PG_PINS_ORPHAN));
+}
+
+/* Pins keep a page around for IO that points straight at it, such as a
+ * zero-copy write lending a user page to a queue, without taking over the
+ * owner's reference.  The owner can still page_decref() it, e.g. on munmap.
+ *
+ * The caller must sync with the owner's decref while pinning, e.g. by holding
+ * the proc's pte_lock while the page is mapped.  Jumbo pages can't be pinned. */
+void page_pin(struct page *page)
+{
+	assert(!(atomic_read(&page->pg_flags) & PG_JUMBO));
+	atomic_inc(&page->pg_pins);
+}
+
+void page_unpin(struct page *page)
+{
+	if (atomic_fetch_and_add(&page->pg_pins, -1) != (PG_PINS_ORPHAN | 1))
+		return;
+	atomic_set(&page->pg_pins, 0);
 	kpages_free(page2kva(page), PGSIZE);
 }
 
@@ -172,11 +172,25 @@ static int pm_insert_page(struct page_map *pm, unsigned long index,
 		return ret;
 	}
 	page->pg_tree_slot = tree_slot;
+	if (atomic_read(&page->pg_flags) & PG_DIRTY)
+		radix_tag_set(&pm->pm_tree, index, PM_TAG_DIRTY);
 	pm->pm_num_pages++;
 	spin_unlock(&pm->pm_lock);
 	return 0;
 }
 
+/* Marks a PM page dirty.  Use this instead of setting PG_DIRTY directly, so
+ * that writeback can find the page by its tag. */
+void pm_page_dirty(struct page *page)
+{
+	struct page_map *pm = page->pg_mapping;
+
+	atomic_or(&page->pg_flags, PG_DIRTY);
+	spin_lock(&pm->pm_lock);
+	radix_tag_set(&pm->pm_tree, page->pg_index, PM_TAG_DIRTY);
+	spin_unlock(&pm->pm_lock);
+}
+
 /* Decrefs the PM slot ref (usage of a PM page).  The PM's page ref remains. */
 void pm_put_page(struct page *page)
 {
@@ -331,8 +345,12 @@ static int __pm_mark_dirty_pgs_unmap(struct proc *p, pte_t pte, void *va,
 	page = pa2page(pte_get_paddr(pte));
 	/* need to check for removal again, just like in mark_not_present */
 	if (atomic_read(&page->pg_flags) & PG_REMOVAL) {
-		if (pte_is_dirty(pte))
+		if (pte_is_dirty(pte)) {
 			atomic_or(&page->pg_flags, PG_DIRTY);
+			/* the remover holds the PM lock */
+			radix_tag_set(&page->pg_mapping->pm_tree, page->pg_index,
+			              PM_TAG_DIRTY);
+		}
 		pte_clear(pte);
 	}
 	return 0;
@@ -356,6 +374,149 @@ static void shootdown_and_reset_ptrstore(void *proc_ptrs[], int *arr_idx)
 	*arr_idx = 0;
 }
 
+static bool pm_idx_is_pinned(struct page_map *pm, unsigned long idx)
+{
+	struct vm_region *vmr_i;
+
+	TAILQ_FOREACH(vmr_i, &pm->pm_vmrs, vm_pm_link) {
+		if ((vmr_i->vm_flags & MAP_LOCKED) && vmr_has_page_idx(vmr_i, idx))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* How many slots we grab from the radix tree at a time */
+#define PM_GANG_BATCH 16
+
+/* Writes back every dirty page in the PM, without removing them.  Only looks at
+ * pages tagged dirty.  Returns 0 on success, -1 if any writepage() failed.
+ * Pages that failed to write stay dirty. */
+int pm_writeback_pages(struct page_map *pm)
+{
+	void **slots[PM_GANG_BATCH];
+	unsigned long keys[PM_GANG_BATCH];
+	struct page *wb_pages[PM_GANG_BATCH];
+	bool wb_failed[PM_GANG_BATCH];
+	void *old_slot_val, *slot_val;
+	struct page *page;
+	unsigned long idx = 0;
+	int nr, nr_wb, ret = 0;
+
+	spin_lock(&pm->pm_lock);
+	while ((nr = radix_tag_gang_lookup_slot(&pm->pm_tree, slots, keys, idx,
+	                                        PM_GANG_BATCH, PM_TAG_DIRTY))) {
+		nr_wb = 0;
+		for (int i = 0; i < nr; i++) {
+			/* Grab a slot ref, just like pm_find_page(), so the page isn't
+			 * removed while we write it. */
+			do {
+				old_slot_val = ACCESS_ONCE(*slots[i]);
+				slot_val = old_slot_val;
+				page = pm_slot_get_page(slot_val);
+				if (!page)
+					break;
+				slot_val = pm_slot_clear_removal(slot_val);
+				slot_val = pm_slot_inc_refcnt(slot_val);
+			} while (!atomic_cas_ptr(slots[i], old_slot_val, slot_val));
+			if (!page)
+				continue;
+			radix_tag_clear(&pm->pm_tree, keys[i], PM_TAG_DIRTY);
+			/* Clear dirty before writing, so we don't miss new writes */
+			atomic_and(&page->pg_flags, ~PG_DIRTY);
+			radix_tag_set(&pm->pm_tree, keys[i], PM_TAG_WRITEBACK);
+			wb_pages[nr_wb++] = page;
+		}
+		idx = keys[nr - 1] + 1;
+		spin_unlock(&pm->pm_lock);
+		for (int i = 0; i < nr_wb; i++)
+			wb_failed[i] = pm->pm_op->writepage(pm, wb_pages[i]) != 0;
+		spin_lock(&pm->pm_lock);
+		for (int i = 0; i < nr_wb; i++) {
+			radix_tag_clear(&pm->pm_tree, wb_pages[i]->pg_index,
+			                PM_TAG_WRITEBACK);
+			/* idx is already past it, so we won't retry it in this call */
+			if (wb_failed[i]) {
+				atomic_or(&wb_pages[i]->pg_flags, PG_DIRTY);
+				radix_tag_set(&pm->pm_tree, wb_pages[i]->pg_index,
+				              PM_TAG_DIRTY);
+				ret = -1;
+			}
+			pm_put_page(wb_pages[i]);
+		}
+	}
+	spin_unlock(&pm->pm_lock);
+	return ret;
+}
+
+/* Helper for removal: flags the page in tree_slot for removal, if no one is
+ * using it. */
+static void pm_mark_slot_removal(void **tree_slot)
+{
+	void *old_slot_val, *slot_val;
+	struct page *page;
+
+	old_slot_val = ACCESS_ONCE(*tree_slot);
+	slot_val = old_slot_val;
+	page = pm_slot_get_page(slot_val);
+	if (!page)
+		return;
+	/* syncing with lookups, writebacks, etc.  only one remover per pm in
+	 * general.  any new ref-getter (WB, lookup, etc) will clear removal,
+	 * causing us to abort later. */
+	if (pm_slot_check_refcnt(slot_val))
+		return;
+	/* it's possible that removal is already set, if we happened to repeat a
+	 * loop (due to running out of space in the proc arr) */
+	slot_val = pm_slot_set_removal(slot_val);
+	if (!atomic_cas_ptr(tree_slot, old_slot_val, slot_val))
+		return;
+	/* mark the page itself.  this isn't used for syncing - just out of
+	 * convenience for ourselves (memwalk callbacks are easier).  need the
+	 * atomic in case a new user comes in and tries mucking with the flags*/
+	atomic_or(&page->pg_flags, PG_REMOVAL);
+}
+
+/* Helper for removal: removes the page in tree_slot (for key) from the PM, if
+ * we still own it.  Returns 1 if we removed it. */
+static int pm_remove_slot(struct page_map *pm, void **tree_slot,
+                          unsigned long key)
+{
+	void *old_slot_val, *slot_val;
+	struct page *page;
+
+	old_slot_val = ACCESS_ONCE(*tree_slot);
+	slot_val = old_slot_val;
+	page = pm_slot_get_page(slot_val);
+	if (!page)
+		return 0;
+	if (!(atomic_read(&page->pg_flags) & PG_REMOVAL))
+		return 0;
+	/* syncing with lookups, writebacks, etc.  if someone has used it since
+	 * we started removing, they would have cleared the slot's REMOVAL (but
+	 * not PG_REMOVAL), though the refcnt could be back down to 0 again. */
+	if (!pm_slot_check_removal(slot_val)) {
+		/* since we set PG_REMOVAL, we're the ones to clear it */
+		atomic_and(&page->pg_flags, ~PG_REMOVAL);
+		return 0;
+	}
+	if (pm_slot_check_refcnt(slot_val))
+		warn("Unexpected refcnt in PM remove!");
+	/* Note that we keep slot REMOVAL set, so the radix tree thinks it's
+	 * still an item (artifact of that implementation). */
+	slot_val = pm_slot_set_page(slot_val, 0);
+	if (!atomic_cas_ptr(tree_slot, old_slot_val, slot_val)) {
+		atomic_and(&page->pg_flags, ~PG_REMOVAL);
+		return 0;
+	}
+	/* at this point, we're free at last!  When we update the radix tree, it
+	 * still thinks it has an item.  This is fine.  Lookups will now fail
+	 * (since the page is 0), and insertions will block on the write lock.*/
+	atomic_set(&page->pg_flags, 0);	/* cause/catch bugs */
+	page_decref(page);
+	radix_delete(&pm->pm_tree, key);
+	return 1;
+}
+
 /* Attempts to remove pages from the pm, from [index, index + nr_pgs).  Returns
  * the number of pages removed.  There can only be one remover at a time per PM
  * - others will return 0. */
@@ -363,9 +524,10 @@ int pm_remove_contig(struct page_map *pm, unsigned long index,
                      unsigned long nr_pgs)
 {
 	unsigned long i;
-	int nr_removed = 0;
+	int nr_removed = 0, nr, j;
 	void **tree_slot;
-	void *old_slot_val, *slot_val;
+	void **slots[PM_GANG_BATCH];
+	unsigned long keys[PM_GANG_BATCH];
 	struct vm_region *vmr_i;
 	bool pm_has_pinned_vmrs = FALSE;
 	/* using this for both procs and later WBs */
@@ -396,47 +558,21 @@ int pm_remove_contig(struct page_map *pm, unsigned long index,
 		if (vmr_i->vm_flags & MAP_LOCKED)
 			pm_has_pinned_vmrs = TRUE;
 	}
-	/* this pass, we mark pages for removal */
-	for (i = index; i < index + nr_pgs; i++) {
-		if (pm_has_pinned_vmrs) {
+	/* this pass, we mark pages for removal.  we only look at the pages that
+	 * are in the PM, a batch at a time. */
+	for (i = index; i < index + nr_pgs; i = keys[nr - 1] + 1) {
+		nr = radix_gang_lookup_slot(&pm->pm_tree, slots, keys, i,
+		                            PM_GANG_BATCH);
+		if (!nr)
+			break;
+		for (j = 0; j < nr; j++) {
+			if (keys[j] >= index + nr_pgs)
+				break;
 			/* for pinned pages, we don't even want to attempt to remove them */
-			TAILQ_FOREACH(vmr_i, &pm->pm_vmrs, vm_pm_link) {
-				/* once we've found a pinned page, we can skip over the rest of
-				 * the range of pages mapped by this vmr - even if the vmr
-				 * hasn't actually faulted them in yet. */
-				if ((vmr_i->vm_flags & MAP_LOCKED) &&
-				    (vmr_has_page_idx(vmr_i, i))) {
-					i = vmr_get_end_idx(vmr_i) - 1;	/* loop will +1 */
-					goto next_loop_mark_rm;
-				}
-			}
+			if (pm_has_pinned_vmrs && pm_idx_is_pinned(pm, keys[j]))
+				continue;
+			pm_mark_slot_removal(slots[j]);
 		}
-		/* TODO: would like a radix_next_slot() iterator (careful with skipping
-		 * chunks of the loop) */
-		tree_slot = radix_lookup_slot(&pm->pm_tree, i);
-		if (!tree_slot)
-			continue;
-		old_slot_val = ACCESS_ONCE(*tree_slot);
-		slot_val = old_slot_val;
-		page = pm_slot_get_page(slot_val);
-		if (!page)
-			continue;
-		/* syncing with lookups, writebacks, etc.  only one remover per pm in
-		 * general.  any new ref-getter (WB, lookup, etc) will clear removal,
-		 * causing us to abort later. */
-		if (pm_slot_check_refcnt(slot_val))
-			continue;
-		/* it's possible that removal is already set, if we happened to repeat a
-		 * loop (due to running out of space in the proc arr) */
-		slot_val = pm_slot_set_removal(slot_val);
-		if (!atomic_cas_ptr(tree_slot, old_slot_val, slot_val))
-			continue;
-		/* mark the page itself.  this isn't used for syncing - just out of
-		 * convenience for ourselves (memwalk callbacks are easier).  need the
-		 * atomic in case a new user comes in and tries mucking with the flags*/
-		atomic_or(&page->pg_flags, PG_REMOVAL);
-next_loop_mark_rm:
-		;
 	}
 	/* second pass, over VMRs instead of pages.  we remove the marked pages from
 	 * all VMRs, collecting the procs for batch shootdowns.  not sure how often
@@ -500,92 +636,87 @@ next_loop_mark_rm:
 			vmr_for_each(vmr_i, index, nr_pgs, __pm_mark_unmap);
 		spin_unlock(&vmr_i->vm_proc->pte_lock);
 	}
-	/* Now we'll go through from the PM again and deal with pages are dirty. */
+	/* Now we'll go through from the PM again and deal with pages are dirty.
+	 * Only the pages tagged dirty can need WB, so that's all we look at. */
 	i = index;
 handle_dirty:
-	for (/* i set already */; i < index + nr_pgs; i++) {
+	while (i < index + nr_pgs) {
 		/* TODO: consider putting in the pinned check & advance again.  Careful,
 		 * since we could unlock on a handle_dirty loop, and skipping could skip
 		 * over a new VMR, but those pages would still be marked for removal.
 		 * It's not wrong, currently, to have spurious REMOVALs. */
-		tree_slot = radix_lookup_slot(&pm->pm_tree, i);
-		if (!tree_slot)
-			continue;
-		page = pm_slot_get_page(*tree_slot);
-		if (!page)
-			continue;
-		/* only operate on pages we marked earlier */
-		if (!(atomic_read(&page->pg_flags) & PG_REMOVAL))
-			continue;
-		/* if someone has used it since we grabbed it, we lost the race and
-		 * won't remove it later.  no sense writing it back now either. */
-		if (!pm_slot_check_removal(*tree_slot)) {
-			/* since we set PG_REMOVAL, we're the ones to clear it */
-			atomic_and(&page->pg_flags, ~PG_REMOVAL);
-			continue;
-		}
-		/* this dirty flag could also be set by write()s, not just VMRs */
-		if (atomic_read(&page->pg_flags) & PG_DIRTY) {
-			/* need to bail out.  after we WB, we'll restart this big loop where
-			 * we left off ('i' is still set) */
-			if (ptr_free_idx == PTR_ARR_LEN)
+		nr = radix_tag_gang_lookup_slot(&pm->pm_tree, slots, keys, i,
+		                                PM_GANG_BATCH, PM_TAG_DIRTY);
+		for (j = 0; j < nr; j++) {
+			if (keys[j] >= index + nr_pgs)
 				break;
-			ptr_store[ptr_free_idx++] = page;
-			/* once we've decided to WB, we can clear the dirty flag.  might
-			 * have an extra WB later, but we won't miss new data */
-			atomic_and(&page->pg_flags, ~PG_DIRTY);
+			tree_slot = slots[j];
+			page = pm_slot_get_page(*tree_slot);
+			if (!page)
+				continue;
+			/* only operate on pages we marked earlier */
+			if (!(atomic_read(&page->pg_flags) & PG_REMOVAL))
+				continue;
+			/* if someone has used it since we grabbed it, we lost the race and
+			 * won't remove it later.  no sense writing it back now either. */
+			if (!pm_slot_check_removal(*tree_slot)) {
+				/* since we set PG_REMOVAL, we're the ones to clear it */
+				atomic_and(&page->pg_flags, ~PG_REMOVAL);
+				continue;
+			}
+			/* this dirty flag could also be set by write()s, not just VMRs */
+			if (atomic_read(&page->pg_flags) & PG_DIRTY) {
+				/* need to bail out.  after we WB, we'll restart this big loop
+				 * where we left off ('i' is set to this page) */
+				if (ptr_free_idx == PTR_ARR_LEN) {
+					i = keys[j];
+					goto write_dirty;
+				}
+				ptr_store[ptr_free_idx++] = page;
+				/* once we've decided to WB, we can clear the dirty flag.  might
+				 * have an extra WB later, but we won't miss new data */
+				atomic_and(&page->pg_flags, ~PG_DIRTY);
+				radix_tag_set(&pm->pm_tree, keys[j], PM_TAG_WRITEBACK);
+			}
+			radix_tag_clear(&pm->pm_tree, keys[j], PM_TAG_DIRTY);
 		}
+		/* either we ran out of tagged pages, or we passed the end of our range */
+		if (j < nr || !nr)
+			i = index + nr_pgs;
+		else
+			i = keys[nr - 1] + 1;
 	}
+write_dirty:
 	/* we're unlocking, meaning VMRs and the radix tree can be changed, but we
 	 * are still the only remover. still can have new refs that clear REMOVAL */
 	spin_unlock(&pm->pm_lock);
 	/* could batch these up, etc. */
-	for (int j = 0; j < ptr_free_idx; j++)
+	for (j = 0; j < ptr_free_idx; j++)
 		pm->pm_op->writepage(pm, (struct page*)ptr_store[j]);
-	ptr_free_idx = 0;
 	spin_lock(&pm->pm_lock);
+	for (j = 0; j < ptr_free_idx; j++) {
+		page = (struct page*)ptr_store[j];
+		radix_tag_clear(&pm->pm_tree, page->pg_index, PM_TAG_WRITEBACK);
+	}
+	ptr_free_idx = 0;
 	/* bailed out of the dirty check loop earlier, need to finish and WB.  i is
 	 * still set to where we failed and left off in the big loop. */
 	if (i < index + nr_pgs)
 		goto handle_dirty;
 	/* TODO: RCU - we need a write lock here (the current spinlock is fine) */
-	/* All dirty pages were WB, anything left as REMOVAL can be removed */
-	for (i = index; i < index + nr_pgs; i++) {
-		/* TODO: consider putting in the pinned check & advance again */
-		tree_slot = radix_lookup_slot(&pm->pm_tree, i);
-		if (!tree_slot)
-			continue;
-		old_slot_val = ACCESS_ONCE(*tree_slot);
-		slot_val = old_slot_val;
-		page = pm_slot_get_page(*tree_slot);
-		if (!page)
-			continue;
-		if (!(atomic_read(&page->pg_flags) & PG_REMOVAL))
-			continue;
-		/* syncing with lookups, writebacks, etc.  if someone has used it since
-		 * we started removing, they would have cleared the slot's REMOVAL (but
-		 * not PG_REMOVAL), though the refcnt could be back down to 0 again. */
-		if (!pm_slot_check_removal(slot_val)) {
-			/* since we set PG_REMOVAL, we're the ones to clear it */
-			atomic_and(&page->pg_flags, ~PG_REMOVAL);
-			continue;
-		}
-		if (pm_slot_check_refcnt(slot_val))
-			warn("Unexpected refcnt in PM remove!");
-		/* Note that we keep slot REMOVAL set, so the radix tree thinks it's
-		 * still an item (artifact of that implementation). */
-		slot_val = pm_slot_set_page(slot_val, 0);
-		if (!atomic_cas_ptr(tree_slot, old_slot_val, slot_val)) {
-			atomic_and(&page->pg_flags, ~PG_REMOVAL);
-			continue;
+	/* All dirty pages were WB, anything left as REMOVAL can be removed.  Our
+	 * batch of slots stays valid while we delete: removing a key only frees
+	 * nodes that have no other items, and the batch is in key order. */
+	for (i = index; i < index + nr_pgs; i = keys[nr - 1] + 1) {
+		nr = radix_gang_lookup_slot(&pm->pm_tree, slots, keys, i,
+		                            PM_GANG_BATCH);
+		if (!nr)
+			break;
+		for (j = 0; j < nr; j++) {
+			if (keys[j] >= index + nr_pgs)
+				break;
+			nr_removed += pm_remove_slot(pm, slots[j], keys[j]);
 		}
-		/* at this point, we're free at last!  When we update the radix tree, it
-		 * still thinks it has an item.  This is fine.  Lookups will now fail
-		 * (since the page is 0), and insertions will block on the write lock.*/
-		atomic_set(&page->pg_flags, 0);	/* cause/catch bugs */
-		page_decref(page);
-		nr_removed++;
-		radix_delete(&pm->pm_tree, i);
 	}
 	pm->pm_num_pages -= nr_removed;
 	spin_unlock(&pm->pm_lock);
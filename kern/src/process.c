@@ -38,44 +38,110 @@ static bool scp_is_vcctx_ready(struct preempt_data *vcpd);
 static void save_vc_fp_state(struct preempt_data *vcpd);
 static void restore_vc_fp_state(struct preempt_data *vcpd);
 
-/* PID management. */
+/* PID management.
+ *
+ * Free PIDs are kept in a FIFO, linked through pid_free_next, so getting and
+ * putting a PID is O(1), and we go through the whole PID space before reusing
+ * a PID.  PID 0 is reserved, and doubles as the end of the list.
+ *
+ * The PID table maps PIDs to procs.  It's a two-level radix tree: an array of
+ * pointers to chunks of slots.  We allocate a chunk the first time one of its
+ * PIDs is handed out, and never free it, so readers can walk the table without
+ * a lock.  Writers (__proc_ready() and __proc_free()) serialize on
+ * pid_table_lock.  See pid2proc() for how lookups deal with procs being freed
+ * underneath them. */
 #define PID_MAX 32767 // goes from 0 to 32767, with 0 reserved
-static DECL_BITMASK(pid_bmask, PID_MAX + 1);
-spinlock_t pid_bmask_lock = SPINLOCK_INITIALIZER;
-struct hashtable *pid_hash;
-spinlock_t pid_hash_lock; // initialized in proc_init
-
-/* Finds the next free entry (zero) entry in the pid_bitmask.  Set means busy.
- * PID 0 is reserved (in proc_init).  A return value of 0 is a failure (and
- * you'll also see a warning, for now).  Consider doing this with atomics. */
+#define PID_CHUNK_SHIFT 9
+#define PID_CHUNK_SZ (1 << PID_CHUNK_SHIFT)
+#define NR_PID_CHUNKS ((PID_MAX + 1) / PID_CHUNK_SZ)
+
+static uint16_t pid_free_next[PID_MAX + 1];
+static pid_t pid_free_head, pid_free_tail;
+static spinlock_t pid_free_lock = SPINLOCK_INITIALIZER;
+static struct proc **pid_table[NR_PID_CHUNKS];
+static spinlock_t pid_table_lock = SPINLOCK_INITIALIZER;
+
+/* Pops the oldest free PID.  A return value of 0 is a failure (and you'll also
+ * see a warning, for now). */
 static pid_t get_free_pid(void)
 {
-	static pid_t next_free_pid = 1;
-	pid_t my_pid = 0;
-
-	spin_lock(&pid_bmask_lock);
-	// atomically (can lock for now, then change to atomic_and_return
-	FOR_CIRC_BUFFER(next_free_pid, PID_MAX + 1, i) {
-		// always points to the next to test
-		next_free_pid = (next_free_pid + 1) % (PID_MAX + 1);
-		if (!GET_BITMASK_BIT(pid_bmask, i)) {
-			SET_BITMASK_BIT(pid_bmask, i);
-			my_pid = i;
-			break;
-		}
+	pid_t my_pid;
+
+	spin_lock(&pid_free_lock);
+	my_pid = pid_free_head;
+	if (my_pid) {
+		pid_free_head = pid_free_next[my_pid];
+		if (!pid_free_head)
+			pid_free_tail = 0;
 	}
-	spin_unlock(&pid_bmask_lock);
+	spin_unlock(&pid_free_lock);
 	if (!my_pid)
 		warn("Shazbot!  Unable to find a PID!  You need to deal with this!\n");
 	return my_pid;
 }
 
-/* Return a pid to the pid bitmask */
+/* Return a pid to the tail of the free list */
 static void put_free_pid(pid_t pid)
 {
-	spin_lock(&pid_bmask_lock);
-	CLR_BITMASK_BIT(pid_bmask, pid);
-	spin_unlock(&pid_bmask_lock);
+	spin_lock(&pid_free_lock);
+	pid_free_next[pid] = 0;
+	if (pid_free_tail)
+		pid_free_next[pid_free_tail] = pid;
+	else
+		pid_free_head = pid;
+	pid_free_tail = pid;
+	spin_unlock(&pid_free_lock);
+}
+
+/* Makes sure the table has a chunk for pid.  This can block. */
+static void pid_table_grow(pid_t pid)
+{
+	struct proc ***chunk_p = &pid_table[pid >> PID_CHUNK_SHIFT];
+	struct proc **new_chunk;
+
+	if (READ_ONCE(*chunk_p))
+		return;
+	new_chunk = kzmalloc(PID_CHUNK_SZ * sizeof(struct proc*), MEM_WAIT);
+	spin_lock(&pid_table_lock);
+	if (!*chunk_p) {
+		WRITE_ONCE(*chunk_p, new_chunk);
+		new_chunk = NULL;
+	}
+	spin_unlock(&pid_table_lock);
+	kfree(new_chunk);
+}
+
+/* Returns the table slot for pid, or NULL if its chunk doesn't exist yet. */
+static struct proc **pid_table_slot(pid_t pid)
+{
+	struct proc **chunk;
+
+	if ((pid <= 0) || (pid > PID_MAX))
+		return NULL;
+	chunk = READ_ONCE(pid_table[pid >> PID_CHUNK_SHIFT]);
+	if (!chunk)
+		return NULL;
+	return &chunk[pid & (PID_CHUNK_SZ - 1)];
+}
+
+/* Runs func on every proc in the PID table.  func runs with the table locked,
+ * so the procs can't be freed, but you need to incref them to keep them. */
+void pid_for_each(void (*func)(struct proc *p, void *arg), void *arg)
+{
+	struct proc **chunk, *p;
+
+	spin_lock(&pid_table_lock);
+	for (int i = 0; i < NR_PID_CHUNKS; i++) {
+		chunk = pid_table[i];
+		if (!chunk)
+			continue;
+		for (int j = 0; j < PID_CHUNK_SZ; j++) {
+			p = chunk[j];
+			if (p)
+				func(p, arg);
+		}
+	}
+	spin_unlock(&pid_table_lock);
 }
 
 /* 'resume' is the time int ticks of the most recent onlining.  'total' is the
@@ -177,63 +243,64 @@ int __proc_set_state(struct proc *p, uint32_t state)
 
 /* Returns a pointer to the proc with the given pid, or 0 if there is none.
  * This uses get_not_zero, since it is possible the refcnt is 0, which means the
- * process is dying and we should not have the ref (and thus return 0).  We need
- * to lock to protect us from getting p, (someone else removes and frees p),
- * then get_not_zero() on p.
- * Don't push the locking into the hashtable without dealing with this. */
+ * process is dying and we should not have the ref (and thus return 0).
+ *
+ * We don't lock.  Between reading the slot and getting the ref, p could be
+ * freed and its memory reused for another proc.  That memory is still a struct
+ * proc (the proc_cache is KMC_TYPESAFE, so it never goes back to the arena),
+ * and freed procs have a refcnt of 0, so get_not_zero fails on them.  If we get
+ * a ref, we just need to make sure p is still the proc in the slot.  If it
+ * isn't, our ref is on a proc that was never ours, so we put it and retry. */
 struct proc *pid2proc(pid_t pid)
 {
-	spin_lock(&pid_hash_lock);
-	struct proc *p = hashtable_search(pid_hash, (void*)(long)pid);
-	if (p)
+	struct proc **slot = pid_table_slot(pid);
+	struct proc *p;
+
+	if (!slot)
+		return NULL;
+	while (1) {
+		p = READ_ONCE(*slot);
+		if (!p)
+			return NULL;
 		if (!kref_get_not_zero(&p->p_kref, 1))
-			p = 0;
-	spin_unlock(&pid_hash_lock);
-	return p;
+			return NULL;
+		/* the atomic in get_not_zero orders this read after the ref */
+		if (READ_ONCE(*slot) == p)
+			return p;
+		proc_decref(p);
+	}
 }
 
 /* Used by devproc for successive reads of the proc table.
  * Returns a pointer to the nth proc, or 0 if there is none.
  * This uses get_not_zero, since it is possible the refcnt is 0, which means the
- * process is dying and we should not have the ref (and thus return 0).  We need
- * to lock to protect us from getting p, (someone else removes and frees p),
- * then get_not_zero() on p.
- * Don't push the locking into the hashtable without dealing with this. */
+ * process is dying and we should not have the ref (and thus return 0).  We hold
+ * the table lock, so procs can't be freed out from under us. */
 struct proc *pid_nth(unsigned int n)
 {
-	struct proc *p;
-	spin_lock(&pid_hash_lock);
-	if (!hashtable_count(pid_hash)) {
-		spin_unlock(&pid_hash_lock);
-		return NULL;
-	}
-	struct hashtable_itr *iter = hashtable_iterator(pid_hash);
-	p = hashtable_iterator_value(iter);
+	struct proc **chunk, *p;
 
-	while (p) {
-		/* if this process is not valid, it doesn't count,
-		 * so continue
-		 */
-
-		if (kref_get_not_zero(&p->p_kref, 1)) {
-			/* this one counts */
-			if (! n){
+	spin_lock(&pid_table_lock);
+	for (int i = 0; i < NR_PID_CHUNKS; i++) {
+		chunk = pid_table[i];
+		if (!chunk)
+			continue;
+		for (int j = 0; j < PID_CHUNK_SZ; j++) {
+			p = chunk[j];
+			/* if this process is not valid, it doesn't count */
+			if (!p || !kref_get_not_zero(&p->p_kref, 1))
+				continue;
+			if (!n) {
 				printd("pid_nth: at end, p %p\n", p);
-				break;
+				spin_unlock(&pid_table_lock);
+				return p;
 			}
 			kref_put(&p->p_kref);
 			n--;
 		}
-		if (!hashtable_iterator_advance(iter)) {
-			p = NULL;
-			break;
-		}
-		p = hashtable_iterator_value(iter);
 	}
-
-	spin_unlock(&pid_hash_lock);
-	kfree(iter);
-	return p;
+	spin_unlock(&pid_table_lock);
+	return NULL;
 }
 
 /* Performs any initialization related to processes, such as create the proc
@@ -243,16 +310,14 @@ void proc_init(void)
 {
 	/* Catch issues with the vcoremap and TAILQ_ENTRY sizes */
 	static_assert(sizeof(TAILQ_ENTRY(vcore)) == sizeof(void*) * 2);
+	/* pid2proc() needs the proc memory to stay procs */
 	proc_cache = kmem_cache_create("proc", sizeof(struct proc),
 				       MAX(ARCH_CL_SIZE,
-				       __alignof__(struct proc)), 0, NULL, 0,
-				       0, NULL);
-	/* Init PID mask and hash.  pid 0 is reserved. */
-	SET_BITMASK_BIT(pid_bmask, 0);
-	spinlock_init(&pid_hash_lock);
-	spin_lock(&pid_hash_lock);
-	pid_hash = create_hashtable(100, __generic_hash, __generic_eq);
-	spin_unlock(&pid_hash_lock);
+				       __alignof__(struct proc)), KMC_TYPESAFE, NULL,
+				       0, 0, NULL);
+	/* Init the PID free list.  pid 0 is reserved. */
+	for (pid_t i = 1; i <= PID_MAX; i++)
+		put_free_pid(i);
 	schedule_init();
 
 	atomic_init(&num_envs, 0);
@@ -364,9 +429,6 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	/* zero everything by default, other specific items are set below */
 	memset(p, 0, sizeof(*p));
 
-	/* only one ref, which we pass back.  the old 'existence' ref is managed by
-	 * the ksched */
-	kref_init(&p->p_kref, __proc_free, 1);
 	/* Initialize the address space */
 	if ((r = env_setup_vm(p)) < 0) {
 		kmem_cache_free(proc_cache, p);
@@ -376,6 +438,11 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 		kmem_cache_free(proc_cache, p);
 		return -ENOFREEPID;
 	}
+	pid_table_grow(p->pid);
+	/* only one ref, which we pass back.  the old 'existence' ref is managed by
+	 * the ksched.  We only free p with a refcnt of 0 (see pid2proc()), so we
+	 * can't set this until we're past the errors above. */
+	kref_init(&p->p_kref, __proc_free, 1);
 	if (parent && parent->binary_path)
 		kstrdup(&p->binary_path, parent->binary_path);
 	/* Set the basic status variables. */
@@ -405,7 +472,11 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	spinlock_init(&p->vmr_lock);
 	spinlock_init(&p->pte_lock);
 	TAILQ_INIT(&p->vm_regions); /* could init this in the slab */
+	p->vm_root = RB_ROOT;
+	memset(p->vmr_hint, 0, sizeof(p->vmr_hint));
 	p->vmr_history = 0;
+	p->nr_jumbo_maps = 0;
+	p->nr_jumbo_fallbacks = 0;
 	/* Initialize the vcore lists, we'll build the inactive list so that it
 	 * includes all vcores when we initialize procinfo.  Do this before initing
 	 * procinfo. */
@@ -469,11 +540,13 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 void __proc_ready(struct proc *p)
 {
 	/* Tell the ksched about us.  TODO: do we need to worry about the ksched
-	 * doing stuff to us before we're added to the pid_hash? */
+	 * doing stuff to us before we're added to the pid table? */
 	__sched_proc_register(p);
-	spin_lock(&pid_hash_lock);
-	hashtable_insert(pid_hash, (void*)(long)p->pid, p);
-	spin_unlock(&pid_hash_lock);
+	spin_lock(&pid_table_lock);
+	/* pid2proc() doesn't lock: p must be set up before anyone can see it */
+	wmb();
+	WRITE_ONCE(*pid_table_slot(p->pid), p);
+	spin_unlock(&pid_table_lock);
 }
 
 /* Creates a process from the specified file, argvs, and envps. */
@@ -504,7 +577,8 @@ static int __cb_assert_no_pg(struct proc *p, pte_t pte, void *va, void *arg)
 static void __proc_free(struct kref *kref)
 {
 	struct proc *p = container_of(kref, struct proc, p_kref);
-	void *hash_ret;
+	struct proc **slot;
+	bool in_table;
 	physaddr_t pa;
 
 	printd("[PID %d] freeing proc: %d\n", current ? current->pid : 0, p->pid);
@@ -526,15 +600,18 @@ static void __proc_free(struct kref *kref)
 	kref_put(&p->fs_env.pwd->d_kref);
 	/* now we'll finally decref files for the file-backed vmrs */
 	unmap_and_destroy_vmrs(p);
-	/* Remove us from the pid_hash and give our PID back (in that order). */
-	spin_lock(&pid_hash_lock);
-	hash_ret = hashtable_remove(pid_hash, (void*)(long)p->pid);
-	spin_unlock(&pid_hash_lock);
-	/* might not be in the hash/ready, if we failed during proc creation */
-	if (hash_ret)
+	/* Remove us from the pid table and give our PID back (in that order). */
+	slot = pid_table_slot(p->pid);
+	spin_lock(&pid_table_lock);
+	in_table = *slot == p;
+	if (in_table)
+		WRITE_ONCE(*slot, NULL);
+	spin_unlock(&pid_table_lock);
+	/* might not be in the table/ready, if we failed during proc creation */
+	if (in_table)
 		put_free_pid(p->pid);
 	else
-		printd("[kernel] pid %d not in the PID hash in %s\n", p->pid,
+		printd("[kernel] pid %d not in the PID table in %s\n", p->pid,
 		       __FUNCTION__);
 	/* All memory below UMAPTOP should have been freed via the VMRs.  The stuff
 	 * above is the global info/page and procinfo/procdata.  We free procinfo
@@ -2305,9 +2382,8 @@ void __tlbshootdown(uint32_t srcid, long a0, long a1, long a2)
 
 void print_allpids(void)
 {
-	void print_proc_state(void *item, void *opaque)
+	void print_proc_state(struct proc *p, void *opaque)
 	{
-		struct proc *p = (struct proc*)item;
 		assert(p);
 		/* this actually adds an extra space, since no progname is ever
 		 * PROGNAME_SZ bytes, due to the \0 counted in PROGNAME. */
@@ -2321,16 +2397,13 @@ void print_allpids(void)
 	printk("     PID Name %-*s State      Parent    \n",
 	       PROC_PROGNAME_SZ - 5, "");
 	printk("------------------------------%s\n", dashes);
-	spin_lock(&pid_hash_lock);
-	hash_for_each(pid_hash, print_proc_state, NULL);
-	spin_unlock(&pid_hash_lock);
+	pid_for_each(print_proc_state, NULL);
 }
 
 void proc_get_set(struct process_set *pset)
 {
-	void enum_proc(void *item, void *opaque)
+	void enum_proc(struct proc *p, void *opaque)
 	{
-		struct proc *p = (struct proc*) item;
 		struct process_set *pset = (struct process_set *) opaque;
 
 		if (pset->num_processes < pset->size) {
@@ -2354,9 +2427,7 @@ void proc_get_set(struct process_set *pset)
 		if (!pset->procs)
 			error(-ENOMEM, ERROR_FIXME);
 
-		spin_lock(&pid_hash_lock);
-		hash_for_each(pid_hash, enum_proc, pset);
-		spin_unlock(&pid_hash_lock);
+		pid_for_each(enum_proc, pset);
 
 	} while (pset->num_processes == pset->size);
 }
@@ -2440,8 +2511,10 @@ void print_proc_info(pid_t pid, int verbosity)
 		if (GET_BITMASK_BIT(files->open_fds->fds_bits, i)) {
 			printk("\tFD: %02d, ", i);
 			if (files->fd[i].fd_file) {
-				printk("File: %p, File name: %s\n", files->fd[i].fd_file,
-				       file_name(files->fd[i].fd_file));
+				printk("File: %p, File name: %s, RA hits: %lu, misses: %lu\n",
+				       files->fd[i].fd_file, file_name(files->fd[i].fd_file),
+				       files->fd[i].fd_file->f_ra.nr_hits,
+				       files->fd[i].fd_file->f_ra.nr_misses);
 			} else {
 				assert(files->fd[i].fd_chan);
 				print_chaninfo(files->fd[i].fd_chan);
@@ -2462,9 +2535,8 @@ void print_proc_info(pid_t pid, int verbosity)
 void check_my_owner(void)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
-	void shazbot(void *item, void *opaque)
+	void shazbot(struct proc *p, void *opaque)
 	{
-		struct proc *p = (struct proc*)item;
 		struct vcore *vc_i;
 		assert(p);
 		spin_lock(&p->proc_lock);
@@ -2479,7 +2551,7 @@ void check_my_owner(void)
 				printk("Owned pcore (%d) has no owner, by %p, vc %d!\n",
 				       core_id(), p, vcore2vcoreid(p, vc_i));
 				spin_unlock(&p->proc_lock);
-				spin_unlock(&pid_hash_lock);
+				spin_unlock(&pid_table_lock);
 				monitor(0);
 			}
 		}
@@ -2487,8 +2559,6 @@ void check_my_owner(void)
 	}
 	assert(!irq_is_enabled());
 	if (!booting && !pcpui->owning_proc) {
-		spin_lock(&pid_hash_lock);
-		hash_for_each(pid_hash, shazbot, NULL);
-		spin_unlock(&pid_hash_lock);
+		pid_for_each(shazbot, NULL);
 	}
 }
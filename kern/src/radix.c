@@ -2,13 +2,14 @@
  * Barret Rhoden <brho@cs.berkeley.edu>
  * See LICENSE for details.
  *
- * Radix Trees!  Just the basics, doesn't do tagging or anything fancy. */
+ * Radix Trees!  The basics, plus gang lookups and tagging. */
 
 #include <ros/errno.h>
 #include <radix.h>
 #include <slab.h>
 #include <string.h>
 #include <stdio.h>
+#include <smp.h>
 
 struct kmem_cache *radix_kcache;
 static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
@@ -16,6 +17,13 @@ static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
                                               bool extend);
 static void __radix_remove_slot(struct radix_node *r_node, struct radix_node **slot);
 
+/* Nodes set aside by radix_preload(), used when an allocation fails */
+struct radix_preload {
+	int							nr;
+	struct radix_node			*nodes[RADIX_MAX_DEPTH];
+};
+static struct radix_preload radix_preloads[MAX_NUM_CORES];
+
 /* Initializes the radix tree system, mostly just builds the kcache */
 void radix_init(void)
 {
@@ -25,6 +33,91 @@ void radix_init(void)
 					 NULL, 0, 0, NULL);
 }
 
+/* Allocates a zeroed node, falling back to this core's preloaded nodes. */
+static struct radix_node *radix_alloc_node(void)
+{
+	struct radix_preload *rp;
+	struct radix_node *r_node = kmem_cache_alloc(radix_kcache, 0);
+
+	if (!r_node) {
+		rp = &radix_preloads[core_id()];
+		if (rp->nr)
+			r_node = rp->nodes[--rp->nr];
+	}
+	if (r_node)
+		memset(r_node, 0, sizeof(struct radix_node));
+	return r_node;
+}
+
+/* Returns the index of r_node's slot in its parent */
+static unsigned int radix_parent_idx(struct radix_node *r_node)
+{
+	return (void**)r_node->my_slot - r_node->parent->items;
+}
+
+/* Sets the tag for idx in r_node, and for every ancestor that doesn't have it
+ * yet. */
+static void __radix_tag_set_up(struct radix_node *r_node, unsigned int idx,
+                               int tag)
+{
+	while (r_node) {
+		if (r_node->tags[tag] & (1ULL << idx))
+			return;
+		r_node->tags[tag] |= 1ULL << idx;
+		if (!r_node->parent)
+			return;
+		idx = radix_parent_idx(r_node);
+		r_node = r_node->parent;
+	}
+}
+
+/* Clears the tag for idx in r_node, and for every ancestor that no longer has
+ * a tagged item below it. */
+static void __radix_tag_clear_up(struct radix_node *r_node, unsigned int idx,
+                                 int tag)
+{
+	while (r_node) {
+		r_node->tags[tag] &= ~(1ULL << idx);
+		if (r_node->tags[tag] || !r_node->parent)
+			return;
+		idx = radix_parent_idx(r_node);
+		r_node = r_node->parent;
+	}
+}
+
+/* Grows the tree, one level at a time, until it can hold key. */
+static int __radix_grow(struct radix_tree *tree, unsigned long key)
+{
+	struct radix_node *r_node;
+
+	/* This will also create the initial node (upper bound starts at 0). */
+	while (key >= tree->upper_bound) {
+		r_node = radix_alloc_node();
+		if (!r_node)
+			return -ENOMEM;
+		if (tree->root) {
+			/* tree->root is the old root, now a child of the future root */
+			r_node->items[0] = tree->root;
+			tree->root->parent = r_node;
+			tree->root->my_slot = (struct radix_node**)&r_node->items[0];
+			r_node->num_items = 1;
+			for (int i = 0; i < RADIX_NR_TAGS; i++) {
+				if (tree->root->tags[i])
+					r_node->tags[i] = 1;
+			}
+		} else {
+			/* if there was no root before, we're both the root and a leaf */
+			r_node->leaf = TRUE;
+			r_node->parent = 0;
+		}
+		tree->root = r_node;
+		r_node->my_slot = &tree->root;
+		tree->depth++;
+		tree->upper_bound = 1ULL << (LOG_RNODE_SLOTS * tree->depth);
+	}
+	return 0;
+}
+
 /* Initializes a tree dynamically */
 void radix_tree_init(struct radix_tree *tree)
 {
@@ -53,29 +146,9 @@ int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
 	printd("RADIX: insert %p at %d\n", item, key);
 	struct radix_node *r_node;
 	void **slot;
-	/* Is the tree tall enough?  if not, it needs to grow a level.  This will
-	 * also create the initial node (upper bound starts at 0). */
-	while (key >= tree->upper_bound) {
-		r_node = kmem_cache_alloc(radix_kcache, 0);
-		if (!r_node)
-			return -ENOMEM;
-		memset(r_node, 0, sizeof(struct radix_node));
-		if (tree->root) {
-			/* tree->root is the old root, now a child of the future root */
-			r_node->items[0] = tree->root;
-			tree->root->parent = r_node;
-			tree->root->my_slot = (struct radix_node**)&r_node->items[0];
-			r_node->num_items = 1;
-		} else {
-			/* if there was no root before, we're both the root and a leaf */
-			r_node->leaf = TRUE;
-			r_node->parent = 0;
-		}
-		tree->root = r_node;
-		r_node->my_slot = &tree->root;
-		tree->depth++;
-		tree->upper_bound = 1ULL << (LOG_RNODE_SLOTS * tree->depth);
-	}
+	/* Is the tree tall enough?  if not, it needs to grow a level. */
+	if (__radix_grow(tree, key))
+		return -ENOMEM;
 	assert(tree->root);
 	/* the tree now thinks it is tall enough, so find the last node, insert in
 	 * it, etc */
@@ -95,7 +168,13 @@ int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
  * nothing left, potentially recursively. */
 static void __radix_remove_slot(struct radix_node *r_node, struct radix_node **slot)
 {
+	unsigned int idx = (void**)slot - r_node->items;
+
 	assert(*slot);		/* make sure there is something there */
+	for (int i = 0; i < RADIX_NR_TAGS; i++) {
+		if (r_node->tags[i] & (1ULL << idx))
+			__radix_tag_clear_up(r_node, idx, i);
+	}
 	*slot = 0;
 	r_node->num_items--;
 	/* this check excludes the root, but the if else handles it.  For now, once
@@ -171,11 +250,10 @@ static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
 				return 0;
 			} else {
 				/* so build one, possibly returning 0 if we couldn't */
-				child_node = kmem_cache_alloc(radix_kcache, 0);
+				child_node = radix_alloc_node();
 				if (!child_node)
 					return 0;
 				r_node->items[idx] = child_node;
-				memset(child_node, 0, sizeof(struct radix_node));
 				/* when we are on the last iteration (i == 2), the child will be
 				 * a leaf. */
 				child_node->leaf = (i == 2) ? TRUE : FALSE;
@@ -203,56 +281,153 @@ void **radix_lookup_slot(struct radix_tree *tree, unsigned long key)
 	return &r_node->items[key];
 }
 
+/* Helper: walks the subtree under r_node, which is height levels tall (1 is a
+ * leaf) and whose first key is base, collecting items with keys >= first.  Only
+ * looks at tagged items, if tag >= 0.  Returns the new number of results. */
+static unsigned int __radix_gang_walk(struct radix_node *r_node,
+                                      unsigned int height, unsigned long base,
+                                      unsigned long first, void **results,
+                                      void ***slots, unsigned long *keys,
+                                      unsigned int nr, unsigned int max_items,
+                                      int tag)
+{
+	unsigned int shift = LOG_RNODE_SLOTS * (height - 1);
+	unsigned int idx = 0;
+	unsigned long key;
+
+	if (first > base)
+		idx = (first - base) >> shift;
+	for (; (idx < NR_RNODE_SLOTS) && (nr < max_items); idx++) {
+		if (!r_node->items[idx])
+			continue;
+		if ((tag >= 0) && !(r_node->tags[tag] & (1ULL << idx)))
+			continue;
+		key = base + ((unsigned long)idx << shift);
+		if (height > 1) {
+			nr = __radix_gang_walk(r_node->items[idx], height - 1, key, first,
+			                       results, slots, keys, nr, max_items, tag);
+			continue;
+		}
+		if (results)
+			results[nr] = r_node->items[idx];
+		if (slots)
+			slots[nr] = &r_node->items[idx];
+		if (keys)
+			keys[nr] = key;
+		nr++;
+	}
+	return nr;
+}
+
+static int __radix_gang_lookup(struct radix_tree *tree, void **results,
+                               void ***slots, unsigned long *keys,
+                               unsigned long first, unsigned int max_items,
+                               int tag)
+{
+	if (!tree->root || (first >= tree->upper_bound) || !max_items)
+		return 0;
+	return __radix_gang_walk(tree->root, tree->depth, 0, first, results, slots,
+	                         keys, 0, max_items, tag);
+}
+
+/* Finds up to max_items items with keys >= first, in key order, returning the
+ * number found. */
 int radix_gang_lookup(struct radix_tree *tree, void **results,
                       unsigned long first, unsigned int max_items)
 {
-	panic("Not implemented");
-	return -1; /* TODO! */
+	return __radix_gang_lookup(tree, results, 0, 0, first, max_items, -1);
 }
 
+/* Same as radix_gang_lookup(), but returns the slots and their keys.  keys can
+ * be 0. */
+int radix_gang_lookup_slot(struct radix_tree *tree, void ***slots,
+                           unsigned long *keys, unsigned long first,
+                           unsigned int max_items)
+{
+	return __radix_gang_lookup(tree, 0, slots, keys, first, max_items, -1);
+}
 
+/* Makes sure the tree can hold keys up to and including max. */
 int radix_grow(struct radix_tree *tree, unsigned long max)
 {
-	panic("Not implemented");
-	return -1; /* TODO! */
+	return __radix_grow(tree, max);
 }
 
+/* Sets aside enough nodes on this core for any one insertion, so that a
+ * following radix_insert() won't fail for lack of memory (if we don't
+ * migrate).  flags are passed to the allocator, e.g. MEM_WAIT. */
 int radix_preload(struct radix_tree *tree, int flags)
 {
-	panic("Not implemented");
-	return -1; /* TODO! */
-}
+	struct radix_preload *rp = &radix_preloads[core_id()];
+	struct radix_node *r_node;
 
+	while (rp->nr < RADIX_MAX_DEPTH) {
+		r_node = kmem_cache_alloc(radix_kcache, flags);
+		if (!r_node)
+			return -ENOMEM;
+		/* We could have blocked and migrated */
+		rp = &radix_preloads[core_id()];
+		if (rp->nr == RADIX_MAX_DEPTH) {
+			kmem_cache_free(radix_kcache, r_node);
+			break;
+		}
+		rp->nodes[rp->nr++] = r_node;
+	}
+	return 0;
+}
 
+/* Tags the item at key, returning the item, or 0 if there is no item. */
 void *radix_tag_set(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return (void*)-1; /* TODO! */
+	struct radix_node *r_node = __radix_lookup_node(tree, key, FALSE);
+	unsigned int idx = key & (NR_RNODE_SLOTS - 1);
+
+	if (!r_node || !r_node->items[idx])
+		return 0;
+	__radix_tag_set_up(r_node, idx, tag);
+	return r_node->items[idx];
 }
 
+/* Untags the item at key, returning the item, or 0 if there is no item. */
 void *radix_tag_clear(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return (void*)-1; /* TODO! */
+	struct radix_node *r_node = __radix_lookup_node(tree, key, FALSE);
+	unsigned int idx = key & (NR_RNODE_SLOTS - 1);
+
+	if (!r_node || !r_node->items[idx])
+		return 0;
+	if (r_node->tags[tag] & (1ULL << idx))
+		__radix_tag_clear_up(r_node, idx, tag);
+	return r_node->items[idx];
 }
 
 int radix_tag_get(struct radix_tree *tree, unsigned long key, int tag)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	struct radix_node *r_node = __radix_lookup_node(tree, key, FALSE);
+	unsigned int idx = key & (NR_RNODE_SLOTS - 1);
+
+	if (!r_node)
+		return 0;
+	return r_node->tags[tag] & (1ULL << idx) ? 1 : 0;
 }
 
+/* Returns whether any item in the tree has the tag. */
 int radix_tree_tagged(struct radix_tree *tree, int tag)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	return tree->root && tree->root->tags[tag] ? 1 : 0;
 }
 
 int radix_tag_gang_lookup(struct radix_tree *tree, void **results,
                           unsigned long first, unsigned int max_items, int tag)
 {
-	panic("Tagging not implemented!");
-	return -1; /* TODO! */
+	return __radix_gang_lookup(tree, results, 0, 0, first, max_items, tag);
+}
+
+int radix_tag_gang_lookup_slot(struct radix_tree *tree, void ***slots,
+                               unsigned long *keys, unsigned long first,
+                               unsigned int max_items, int tag)
+{
+	return __radix_gang_lookup(tree, 0, slots, keys, first, max_items, tag);
 }
 
 void print_radix_tree(struct radix_tree *tree)
@@ -111,10 +111,7 @@ void schedule_init(void)
 	spin_unlock(&sched_lock);
 
 #ifdef CONFIG_ARSC_SERVER
-	int arsc_coreid = get_any_idle_core();
-	assert(arsc_coreid >= 0);
-	send_kernel_message(arsc_coreid, arsc_server, 0, 0, 0, KMSG_ROUTINE);
-	printk("Using core %d for the ARSC server\n", arsc_coreid);
+	arsc_server_init(CONFIG_ARSC_NR_SERVERS);
 #endif /* CONFIG_ARSC_SERVER */
 }
 
@@ -702,18 +699,17 @@ void print_resources(struct proc *p)
 	for (int i = 0; i < MAX_NUM_RESOURCES; i++)
 		printk("Res type: %02d, amt wanted: %08d, amt granted: %08d\n", i,
 		       p->procdata->res_req[i].amt_wanted, p->procinfo->res_grant[i]);
+	print_proc_core_placement(p);
 }
 
 void print_all_resources(void)
 {
-	/* Hash helper */
-	void __print_resources(void *item, void *opaque)
+	/* PID table helper */
+	void __print_resources(struct proc *p, void *opaque)
 	{
-		print_resources((struct proc*)item);
+		print_resources(p);
 	}
-	spin_lock(&pid_hash_lock);
-	hash_for_each(pid_hash, __print_resources, NULL);
-	spin_unlock(&pid_hash_lock);
+	pid_for_each(__print_resources, NULL);
 }
 
 void next_core_to_alloc(uint32_t pcoreid)
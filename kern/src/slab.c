@@ -69,13 +69,20 @@
  *   the depot during free.  Either approach doesn't require someone else to
  *   grab a pcc lock.
  *
+ * - How does reclaim work?  Each depot tracks the min and max of its not-empty
+ *   and empty magazine counts between reclaims.  The min is the number of mags
+ *   that sat in the depot for the entire interval, unused, so those are excess
+ *   (section 3.6 of the paper).  A ktask wakes up periodically, gives the
+ *   excess mags' rounds back to the slab layer, and frees empty slabs to the
+ *   source arena.  When a base arena drops below its low-water mark, it pokes
+ *   the ktask, which then empties the depots entirely.
+ *
  * TODO:
- * - Add reclaim function.
  * - When resizing, do we want to go through the depot and consolidate
  *   magazines?  (probably not a big deal.  maybe we'd deal with it when we
  *   clean up our excess mags.)
- * - Could do some working set tracking.  Like max/min over an interval, with
- *   resetting (in the depot, used for reclaim and maybe aggressive freeing).
+ * - Reaping frees all of a cache's empty slabs, which could thrash if the cache
+ *   immediately needs them again.  Could track a working set of slabs too.
  * - Debugging info
  */
 
@@ -86,6 +93,7 @@
 #include <kmalloc.h>
 #include <hash.h>
 #include <arena.h>
+#include <rendez.h>
 
 #define SLAB_POISON ((void*)0xdead1111)
 
@@ -93,6 +101,16 @@
  * runtime.  Though once a mag increases, it'll never decrease. */
 uint64_t resize_timeout_ns = 1000000000;
 unsigned int resize_threshold = 1;
+/* How often the reclaim ktask trims the depots, absent memory pressure.  This
+ * is also the interval over which we track each depot's working set. */
+uint64_t kmem_reclaim_interval_usec = 15000000;
+/* After a reclaim for memory pressure, wait at least this long before the
+ * next one, in case the pressure doesn't let up. */
+uint64_t kmem_reclaim_min_gap_usec = 100000;
+
+static struct rendez kmem_reclaim_rv;
+static atomic_t kmem_reclaim_pressure;
+static bool kmem_reclaim_ready;
 
 /* Protected by the arenas_and_slabs_lock. */
 struct kmem_cache_tailq all_kmem_caches =
@@ -195,6 +213,29 @@ static void depot_init(struct kmem_depot *depot)
 	depot->nr_empty = 0;
 	depot->busy_count = 0;
 	depot->busy_start = 0;
+	depot->min_empty = 0;
+	depot->max_empty = 0;
+	depot->min_not_empty = 0;
+	depot->max_not_empty = 0;
+}
+
+/* Helper, updates the depot's working set after a change in the number of
+ * mags.  Hold the depot lock. */
+static void __depot_track_ws(struct kmem_depot *depot)
+{
+	depot->min_empty = MIN(depot->min_empty, depot->nr_empty);
+	depot->max_empty = MAX(depot->max_empty, depot->nr_empty);
+	depot->min_not_empty = MIN(depot->min_not_empty, depot->nr_not_empty);
+	depot->max_not_empty = MAX(depot->max_not_empty, depot->nr_not_empty);
+}
+
+/* Helper, starts a new working set interval.  Hold the depot lock. */
+static void __depot_reset_ws(struct kmem_depot *depot)
+{
+	depot->min_empty = depot->nr_empty;
+	depot->max_empty = depot->nr_empty;
+	depot->min_not_empty = depot->nr_not_empty;
+	depot->max_not_empty = depot->nr_not_empty;
 }
 
 static bool mag_is_empty(struct kmem_magazine *mag)
@@ -224,6 +265,7 @@ static void __return_to_depot(struct kmem_cache *kc, struct kmem_magazine *mag)
 		SLIST_INSERT_HEAD(&depot->not_empty, mag, link);
 		depot->nr_not_empty++;
 	}
+	__depot_track_ws(depot);
 }
 
 /* Helper, removes the contents of the magazine, giving them back to the slab
@@ -275,7 +317,7 @@ void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 		panic("Cache %s object alignment is actually MIN(PGSIZE, align (%p))",
 		      name, align);
 	kc->flags = flags;
-	/* We might want some sort of per-call site NUMA-awareness in the future. */
+	/* The default source is NUMA-aware, see kmc_import(). */
 	kc->source = source ? source : kpages_arena;
 	TAILQ_INIT(&kc->full_slab_list);
 	TAILQ_INIT(&kc->partial_slab_list);
@@ -285,6 +327,7 @@ void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	kc->priv = priv;
 	kc->nr_cur_alloc = 0;
 	kc->nr_direct_allocs_ever = 0;
+	kc->nr_reclaimed_bytes = 0;
 	kc->alloc_hash = kc->static_hash;
 	hash_init_hh(&kc->hh);
 	for (int i = 0; i < kc->hh.nr_hash_lists; i++)
@@ -292,8 +335,11 @@ void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	/* No touch must use bufctls, even for small objects, so that it does not
 	 * use the object as memory.  Note that if we have an arbitrary source,
 	 * small objects, and we're 'pro-touch', the small allocation path will
-	 * assume we're importing from a PGSIZE-aligned source arena. */
-	if ((obj_size > SLAB_LARGE_CUTOFF) || (flags & KMC_NOTOUCH))
+	 * assume we're importing from a PGSIZE-aligned source arena.  Type-safe
+	 * objects can be read after they are freed, so they can't hold the
+	 * freelist either. */
+	if ((obj_size > SLAB_LARGE_CUTOFF) ||
+	    (flags & (KMC_NOTOUCH | KMC_TYPESAFE)))
 		kc->flags |= __KMC_USE_BUFCTL;
 	depot_init(&kc->depot);
 	/* We do this last, since this will all into the magazine cache - which we
@@ -386,10 +432,28 @@ static void depot_destroy(struct kmem_cache *kc)
 	unlock_depot(depot);
 }
 
+/* Caches on the default kpages_arena source import through kpages_alloc(), so
+ * their slabs come from the caller's NUMA node arena, like any other page
+ * allocation.  Other sources are used as is. */
+static void *kmc_import(struct kmem_cache *cp, size_t size, int flags)
+{
+	if (cp->source == kpages_arena)
+		return kpages_alloc(size, flags);
+	return arena_alloc(cp->source, size, flags);
+}
+
+static void kmc_release(struct kmem_cache *cp, void *buf, size_t size)
+{
+	if (cp->source == kpages_arena)
+		kpages_free(buf, size);
+	else
+		arena_free(cp->source, buf, size);
+}
+
 static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 {
 	if (!__use_bufctls(cp)) {
-		arena_free(cp->source, ROUNDDOWN(a_slab, PGSIZE), PGSIZE);
+		kmc_release(cp, ROUNDDOWN(a_slab, PGSIZE), PGSIZE);
 	} else {
 		struct kmem_bufctl *i, *temp;
 		void *buf_start = (void*)SIZE_MAX;
@@ -401,7 +465,7 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 			 * init the freelist when we reuse the slab. */
 			kmem_cache_free(kmem_bufctl_cache, i);
 		}
-		arena_free(cp->source, buf_start, cp->import_amt);
+		kmc_release(cp, buf_start, cp->import_amt);
 		kmem_cache_free(kmem_slab_cache, a_slab);
 	}
 }
@@ -581,6 +645,7 @@ try_alloc:
 	if (mag) {
 		SLIST_REMOVE_HEAD(&depot->not_empty, link);
 		depot->nr_not_empty--;
+		__depot_track_ws(depot);
 		__return_to_depot(kc, pcc->prev);
 		unlock_depot(depot);
 		pcc->prev = pcc->loaded;
@@ -592,6 +657,54 @@ try_alloc:
 	return __kmem_alloc_from_slab(kc, flags);
 }
 
+/* Allocates up to nr objects into objs, taking the pcpu cache lock once and
+ * draining the loaded and prev magazines before going to the depot or the
+ * slab layer.  Returns the number allocated, which is less than nr only if the
+ * slab layer ran out. */
+size_t kmem_cache_alloc_bulk(struct kmem_cache *kc, void **objs, size_t nr,
+                             int flags)
+{
+	struct kmem_pcpu_cache *pcc = get_my_pcpu_cache(kc);
+	struct kmem_depot *depot = &kc->depot;
+	struct kmem_magazine *mag;
+	size_t i = 0;
+
+	lock_pcu_cache(pcc);
+	while (i < nr) {
+		while (i < nr && pcc->loaded->nr_rounds) {
+			objs[i++] = pcc->loaded->rounds[pcc->loaded->nr_rounds - 1];
+			pcc->loaded->nr_rounds--;
+			pcc->nr_allocs_ever++;
+		}
+		if (i == nr)
+			break;
+		if (!mag_is_empty(pcc->prev)) {
+			__swap_mags(pcc);
+			continue;
+		}
+		lock_depot(depot);
+		mag = SLIST_FIRST(&depot->not_empty);
+		if (!mag) {
+			unlock_depot(depot);
+			break;
+		}
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
+		depot->nr_not_empty--;
+		__depot_track_ws(depot);
+		__return_to_depot(kc, pcc->prev);
+		unlock_depot(depot);
+		pcc->prev = pcc->loaded;
+		pcc->loaded = mag;
+	}
+	unlock_pcu_cache(pcc);
+	for (; i < nr; i++) {
+		objs[i] = __kmem_alloc_from_slab(kc, flags);
+		if (!objs[i])
+			break;
+	}
+	return i;
+}
+
 /* Returns an object to the slab layer.  Caller must deconstruct the objects.
  * Note that objects in the slabs are unconstructed. */
 static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
@@ -657,6 +770,7 @@ try_free:
 	if (mag) {
 		SLIST_REMOVE_HEAD(&depot->empty, link);
 		depot->nr_empty--;
+		__depot_track_ws(depot);
 		__return_to_depot(kc, pcc->prev);
 		unlock_depot(depot);
 		pcc->prev = pcc->loaded;
@@ -674,6 +788,7 @@ try_free:
 		lock_depot(depot);
 		SLIST_INSERT_HEAD(&depot->empty, mag, link);
 		depot->nr_empty++;
+		__depot_track_ws(depot);
 		unlock_depot(depot);
 		lock_pcu_cache(pcc);
 		goto try_free;
@@ -702,7 +817,7 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		/* Careful, this assumes our source is a PGSIZE-aligned allocator.  We
 		 * could use xalloc to enforce the alignment, but that'll bypass the
 		 * qcaches, which we don't want.  Caller beware. */
-		a_page = arena_alloc(cp->source, PGSIZE, MEM_ATOMIC);
+		a_page = kmc_import(cp, PGSIZE, MEM_ATOMIC);
 		if (!a_page)
 			return FALSE;
 		// the slab struct is stored at the end of the page
@@ -727,7 +842,7 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 		a_slab = kmem_cache_alloc(kmem_slab_cache, 0);
 		if (!a_slab)
 			return FALSE;
-		buf = arena_alloc(cp->source, cp->import_amt, MEM_ATOMIC);
+		buf = kmc_import(cp, cp->import_amt, MEM_ATOMIC);
 		if (!buf) {
 			kmem_cache_free(kmem_slab_cache, a_slab);
 			return FALSE;
@@ -750,20 +865,125 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 	return TRUE;
 }
 
-/* This deallocs every slab from the empty list.  TODO: think a bit more about
- * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
-void kmem_cache_reap(struct kmem_cache *cp)
+/* This deallocs every slab from the empty list, returning the number of bytes
+ * given back to the source arena.  We pull the slabs off the list first, so we
+ * don't hold the cache lock while calling into the arena.  KMC_TYPESAFE caches
+ * never give their memory back: someone could still be reading a freed obj. */
+size_t kmem_cache_reap(struct kmem_cache *cp)
 {
+	struct kmem_slab_list empty = TAILQ_HEAD_INITIALIZER(empty);
 	struct kmem_slab *a_slab, *next;
+	size_t amt = 0;
 
-	// Destroy all empty slabs.  Refer to the notes about the while loop
+	if (cp->flags & KMC_TYPESAFE)
+		return 0;
 	spin_lock_irqsave(&cp->cache_lock);
-	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
+	TAILQ_CONCAT(&empty, &cp->empty_slab_list, link);
+	spin_unlock_irqsave(&cp->cache_lock);
+	/* Refer to the notes about the while loop in kmem_cache_destroy() */
+	a_slab = TAILQ_FIRST(&empty);
 	while (a_slab) {
 		next = TAILQ_NEXT(a_slab, link);
 		kmem_slab_destroy(cp, a_slab);
+		amt += __use_bufctls(cp) ? cp->import_amt : PGSIZE;
 		a_slab = next;
 	}
-	spin_unlock_irqsave(&cp->cache_lock);
+	return amt;
+}
+
+/* Gives back the depot's excess magazines, then reaps the empty slabs.  Excess
+ * mags are the ones that weren't needed since the last reclaim.  If @all, we
+ * are low on memory, and we give back every mag in the depot.  The pcpu caches
+ * keep their mags either way.  Returns the number of bytes reclaimed. */
+size_t kmem_cache_reclaim(struct kmem_cache *kc, bool all)
+{
+	struct kmem_depot *depot = &kc->depot;
+	struct kmem_mag_slist not_empty = SLIST_HEAD_INITIALIZER(not_empty);
+	struct kmem_mag_slist empty = SLIST_HEAD_INITIALIZER(empty);
+	struct kmem_magazine *mag;
+	unsigned int nr_not_empty, nr_empty;
+	size_t amt;
+
+	lock_depot(depot);
+	nr_not_empty = all ? depot->nr_not_empty : depot->min_not_empty;
+	nr_empty = all ? depot->nr_empty : depot->min_empty;
+	for (int i = 0; i < nr_not_empty; i++) {
+		mag = SLIST_FIRST(&depot->not_empty);
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
+		SLIST_INSERT_HEAD(&not_empty, mag, link);
+	}
+	depot->nr_not_empty -= nr_not_empty;
+	for (int i = 0; i < nr_empty; i++) {
+		mag = SLIST_FIRST(&depot->empty);
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		SLIST_INSERT_HEAD(&empty, mag, link);
+	}
+	depot->nr_empty -= nr_empty;
+	__depot_reset_ws(depot);
+	unlock_depot(depot);
+	while ((mag = SLIST_FIRST(&not_empty))) {
+		SLIST_REMOVE_HEAD(&not_empty, link);
+		drain_mag(kc, mag);
+		kmem_cache_free(kmem_magazine_cache, mag);
+	}
+	while ((mag = SLIST_FIRST(&empty))) {
+		SLIST_REMOVE_HEAD(&empty, link);
+		kmem_cache_free(kmem_magazine_cache, mag);
+	}
+	amt = kmem_cache_reap(kc);
+	spin_lock_irqsave(&kc->cache_lock);
+	kc->nr_reclaimed_bytes += amt;
+	spin_unlock_irqsave(&kc->cache_lock);
+	return amt;
+}
+
+static void kmem_reclaim_all(bool all)
+{
+	struct kmem_cache *kc_i;
+
+	/* Backwards, since caches tend to import from arenas whose qcaches were
+	 * created before them.  The qcaches then get to reclaim the slabs that the
+	 * later caches just freed. */
+	qlock(&arenas_and_slabs_lock);
+	TAILQ_FOREACH_REVERSE(kc_i, &all_kmem_caches, kmem_cache_tailq,
+	                      all_kmc_link)
+		kmem_cache_reclaim(kc_i, all);
+	qunlock(&arenas_and_slabs_lock);
+}
+
+static int kmem_reclaim_under_pressure(void *arg)
+{
+	return atomic_read(&kmem_reclaim_pressure);
+}
+
+static void kmem_reclaim_ktask(void *arg)
+{
+	bool pressure;
+
+	while (1) {
+		rendez_sleep_timeout(&kmem_reclaim_rv, kmem_reclaim_under_pressure,
+		                     NULL, kmem_reclaim_interval_usec);
+		pressure = atomic_swap(&kmem_reclaim_pressure, 0);
+		kmem_reclaim_all(pressure);
+		if (pressure)
+			kthread_usleep(kmem_reclaim_min_gap_usec);
+	}
+}
+
+void kmem_reclaim_init(void)
+{
+	rendez_init(&kmem_reclaim_rv);
+	ktask("kmem_reclaim", kmem_reclaim_ktask, NULL);
+	kmem_reclaim_ready = TRUE;
+}
+
+/* Tells the reclaimer that memory is low.  Safe to call from IRQ context, and
+ * from within the allocator: only the first poke wakes the ktask. */
+void kmem_reclaim_poke(void)
+{
+	if (!kmem_reclaim_ready)
+		return;
+	if (atomic_swap(&kmem_reclaim_pressure, 1))
+		return;
+	rendez_wakeup(&kmem_reclaim_rv);
 }
@@ -1881,8 +1881,12 @@ intreg_t sys_fcntl(struct proc *p, int fd, int cmd, unsigned long arg1,
 			file->f_flags = (file->f_flags & ~O_FCNTL_SET_FLAGS) | arg1;
 			break;
 		case (F_SYNC):
-			/* TODO (if we keep the VFS) */
-			retval = 0;
+			/* Files without an fsync (pipes, devices) have nothing to flush */
+			if (file->f_op->fsync &&
+			    file->f_op->fsync(file, file->f_dentry, 0)) {
+				set_errno(EIO);
+				retval = -1;
+			}
 			break;
 		case (F_ADVISE):
 			/* TODO  (if we keep the VFS)*/
@@ -2760,9 +2764,25 @@ void run_local_syscall(struct syscall *sysc)
 	pcpui->cur_kthread->sysc = NULL;	/* No longer working on sysc */
 }
 
+/* Helper: fails a batched syscall without running it. */
+static void fail_batched_syscall(struct proc *p, struct syscall *sysc, int err)
+{
+	sysc->retval = -1;
+	sysc->err = err;
+	finish_sysc(sysc, p);
+}
+
 /* A process can trap and call this function, which will set up the core to
- * handle all the syscalls.  a.k.a. "sys_debutante(needs, wants)".  If there is
- * at least one, it will run it directly. */
+ * handle all the syscalls.  a.k.a. "sys_debutante(needs, wants)".
+ *
+ * We run the calls in order, in this kthread.  If one blocks, the process gets
+ * its core back, and the rest of the batch runs when we wake up.  Each call
+ * completes (and signals) on its own, so userspace can't tell the difference
+ * between a batch and a bunch of individual async calls.
+ *
+ * Calls that operate on the calling context (!sysc_can_block()) may not return,
+ * and they assume they are running right after the trap, so they must be
+ * issued on their own.  In a batch, we fail them with EINVAL. */
 void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_syscs)
 {
 	/* Careful with pcpui here, we could have migrated */
@@ -2770,12 +2790,22 @@ void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_syscs)
 		printk("[kernel] No nr_sysc, probably a bug, user!\n");
 		return;
 	}
-	/* For all after the first call, send ourselves a KMSG (TODO). */
-	if (nr_syscs != 1)
-		warn("Only one supported (Debutante calls: %d)\n", nr_syscs);
-	/* Call the first one directly.  (we already checked to make sure there is
-	 * 1) */
-	run_local_syscall(sysc);
+	if (!is_user_rwaddr(sysc, nr_syscs * sizeof(struct syscall))) {
+		printk("[kernel] bad user addr %p (+%p) in %s (user bug)\n", sysc,
+		       nr_syscs * sizeof(struct syscall), __FUNCTION__);
+		return;
+	}
+	if (nr_syscs == 1) {
+		run_local_syscall(sysc);
+		return;
+	}
+	for (int i = 0; i < nr_syscs; i++) {
+		if (!sysc_can_block(sysc[i].num)) {
+			fail_batched_syscall(p, &sysc[i], EINVAL);
+			continue;
+		}
+		run_local_syscall(&sysc[i]);
+	}
 }
 
 /* Call this when something happens on the syscall where userspace might want to
@@ -10,13 +10,35 @@
 #include <mm.h>
 #include <atomic.h>
 
+/* Helper: writes msg to my_slot, which we have reserved.  Returns FALSE if the
+ * slot isn't user RW memory. */
+static bool ucq_fill_slot(uintptr_t my_slot, struct event_msg *msg)
+{
+	struct msg_container *my_msg;
+
+	/* Sanity check on our slot. */
+	assert(slot_is_good(my_slot));
+	/* Convert slot to actual msg_container.  Note we never actually deref
+	 * my_slot here (o/w we'd need a rw_addr check). */
+	my_msg = slot2msg(my_slot);
+	/* Make sure our msg is user RW */
+	if (!is_user_rwaddr(my_msg, sizeof(struct msg_container)))
+		return FALSE;
+	/* Finally write the message */
+	my_msg->ev_msg = *msg;
+	wmb();
+	/* Now that the write is done, signal to the consumer that they can consume
+	 * our message (they could have been spinning on it) */
+	my_msg->ready = TRUE;
+	return TRUE;
+}
+
 /* Proc p needs to be current, and you should have checked that ucq is valid
  * memory.  We'll assert it here, to catch any of your bugs.  =) */
 void send_ucq_msg(struct ucq *ucq, struct proc *p, struct event_msg *msg)
 {
 	uintptr_t my_slot = 0;
 	struct ucq_page *new_page, *old_page;
-	struct msg_container *my_msg;
 
 	assert(is_user_rwaddr(ucq, sizeof(struct ucq)));
 	/* So we can try to send ucqs to _Ss before they initialize */
@@ -97,20 +119,8 @@ unlock_lock:
 	hash_unlock_irqsave(p->ucq_hashlock, (long)ucq);
 	/* Fall through to having a slot */
 have_slot:
-	/* Sanity check on our slot. */
-	assert(slot_is_good(my_slot));
-	/* Convert slot to actual msg_container.  Note we never actually deref
-	 * my_slot here (o/w we'd need a rw_addr check). */
-	my_msg = slot2msg(my_slot);
-	/* Make sure our msg is user RW */
-	if (!is_user_rwaddr(my_msg, sizeof(struct msg_container)))
+	if (!ucq_fill_slot(my_slot, msg))
 		goto error_addr;
-	/* Finally write the message */
-	my_msg->ev_msg = *msg;
-	wmb();
-	/* Now that the write is done, signal to the consumer that they can consume
-	 * our message (they could have been spinning on it) */
-	my_msg->ready = TRUE;
 	return;
 error_addr_unlock:
 	/* Had a bad addr while holding the lock.  This is a bit more serious */
@@ -127,6 +137,63 @@ error_addr:
 	return;
 }
 
+/* Most slots a batch reserves with one fetch_and_add */
+#define UCQ_PROD_BATCH			8
+
+/* Sends nr msgs to the ucq.  Instead of a fetch_and_add per message, we reserve
+ * a run of up to UCQ_PROD_BATCH slots on the producer's current page at once.
+ * Once the page is half full, we send one at a time, like send_ucq_msg().  That
+ * way, concurrent batches can only push the 12-bit counter UCQ_PROD_BATCH
+ * slots per producer past the middle of the page, and never into the page
+ * bits.  If we still lose a race and overflow the page, we fill the good slots
+ * we got and send the rest one at a time, which deals with getting a new page.
+ *
+ * Same rules as send_ucq_msg(): p is current and ucq was checked. */
+void send_ucq_msgs(struct ucq *ucq, struct proc *p, struct event_msg *msgs,
+                   size_t nr)
+{
+	uintptr_t prod_idx, my_slot;
+	size_t nr_want, nr_good;
+	bool bad_addr = FALSE;
+
+	assert(is_user_rwaddr(ucq, sizeof(struct ucq)));
+	if (!ucq->ucq_ready) {
+		if (__proc_is_mcp(p))
+			warn("proc %d is _M with an uninitialized ucq %p\n", p->pid, ucq);
+		return;
+	}
+	while (nr > 1 && !ucq->prod_overflow) {
+		prod_idx = atomic_read(&ucq->prod_idx);
+		if (!slot_is_good(prod_idx) ||
+		    (PGOFF(prod_idx) >= NR_MSG_PER_PAGE / 2))
+			break;
+		nr_want = MIN(nr, UCQ_PROD_BATCH);
+		my_slot = (uintptr_t)atomic_fetch_and_add(&ucq->prod_idx, nr_want);
+		nr_good = 0;
+		if (slot_is_good(my_slot))
+			nr_good = MIN(nr_want, NR_MSG_PER_PAGE - PGOFF(my_slot));
+		/* Warn others to not bother with the fetch_and_add */
+		if (nr_good < nr_want)
+			ucq->prod_overflow = TRUE;
+		/* Fill every slot we claimed, even after a bad one, so the consumer
+		 * isn't left spinning on a slot we could have written. */
+		for (size_t i = 0; i < nr_good; i++) {
+			if (!ucq_fill_slot(my_slot + i, &msgs[i]))
+				bad_addr = TRUE;
+		}
+		if (bad_addr) {
+			warn("Invalid user address, not sending a message");
+			return;
+		}
+		msgs += nr_good;
+		nr -= nr_good;
+		if (nr_good < nr_want)
+			break;
+	}
+	for (; nr; nr--, msgs++)
+		send_ucq_msg(ucq, p, msgs);
+}
+
 /* Debugging */
 #include <smp.h>
 #include <pmap.h>
@@ -1249,9 +1249,15 @@ ssize_t generic_file_read(struct file *file, char *buf, size_t count,
 	buf_end = buf + count;
 	/* For each file page, make sure it's in the page cache, then copy it out.
 	 * TODO: will probably need to consider concurrently truncated files here.*/
+	file_readahead(file, first_idx, last_idx - first_idx + 1);
 	for (int i = first_idx; i <= last_idx; i++) {
-		error = pm_load_page(file->f_mapping, i, &page);
-		assert(!error);	/* TODO: handle ENOMEM and friends */
+		if (!pm_load_page_nowait(file->f_mapping, i, &page)) {
+			file->f_ra.nr_hits++;
+		} else {
+			file->f_ra.nr_misses++;
+			error = pm_load_page(file->f_mapping, i, &page);
+			assert(!error);	/* TODO: handle ENOMEM and friends */
+		}
 		copy_amt = MIN(PGSIZE - page_off, buf_end - buf);
 		/* TODO: (KFOP) Probably shouldn't do this.  Either memcpy directly, or
 		 * split out the is_user_r(w)addr from copy_{to,from}_user() */
@@ -1329,7 +1335,7 @@ ssize_t generic_file_write(struct file *file, const char *buf, size_t count,
 			memcpy(page2kva(page) + page_off, buf, copy_amt);
 		buf += copy_amt;
 		page_off = 0;
-		atomic_or(&page->pg_flags, PG_DIRTY);
+		pm_page_dirty(page);
 		pm_put_page(page);	/* it's still in the cache, we just don't need it */
 	}
 	assert(buf == buf_end);
@@ -1337,6 +1343,80 @@ ssize_t generic_file_write(struct file *file, const char *buf, size_t count,
 	return count;
 }
 
+/* Writes back the file's dirty pages, which generic_file_write() left in the
+ * page cache.  Most filesystems will use this for their f_op->fsync.  Doesn't
+ * touch the inode's metadata, so datasync doesn't matter yet. */
+int generic_file_fsync(struct file *file, struct dentry *dentry, int datasync)
+{
+	return pm_writeback_pages(file->f_mapping);
+}
+
+/* Loads one readahead page.  Runs as a routine kmsg, so it can block on the
+ * IO, and it holds a file ref (which pins the PM). */
+static void __file_ra_page(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct file *file = (struct file*)a0;
+	unsigned long idx = a1;
+	struct page *page;
+
+	/* the file might have shrunk since we decided to read ahead */
+	if (idx < nr_pages(file->f_dentry->d_inode->i_size)) {
+		if (!pm_load_page(file->f_mapping, idx, &page))
+			pm_put_page(page);
+	}
+	kref_put(&file->f_kref);
+}
+
+/* Tells the readahead code the reader wants [idx, idx + nr_pgs).  If this looks
+ * sequential and the reader is getting close to the end of the current window,
+ * we start loading the next window in the background.  Each page gets its own
+ * kmsg, so their IOs overlap with each other and with the reader.  The window
+ * doubles for each sequential window, up to FILE_RA_MAX_PGS, and halves when
+ * the reader jumps around. */
+void file_readahead(struct file *file, unsigned long idx, unsigned long nr_pgs)
+{
+	struct file_ra_state *ra = &file->f_ra;
+	unsigned long end = idx + nr_pgs;
+	unsigned long nr_file_pgs, start, size;
+	bool sequential;
+
+	if (!file->f_mapping || !nr_pgs)
+		return;
+	sequential = (idx == ra->prev_idx + 1) || (idx == ra->prev_idx) ||
+	             ((ra->start <= idx) && (idx < ra->start + ra->size));
+	ra->prev_idx = end - 1;
+	if (!sequential) {
+		/* The next window starts from here.  Setting async_size to the whole
+		 * window means the next sequential access will trigger it. */
+		ra->size /= 2;
+		ra->start = end;
+		ra->async_size = ra->size;
+		return;
+	}
+	if (ra->size && (end < ra->start + ra->size - ra->async_size))
+		return;
+	if (ra->size) {
+		start = MAX(ra->start + ra->size, idx);
+		size = MIN(ra->size * 2, FILE_RA_MAX_PGS);
+	} else {
+		start = idx;
+		size = FILE_RA_INIT_PGS;
+	}
+	/* Make sure the window covers the rest of a large request */
+	size = MIN(MAX(size, end - start), FILE_RA_MAX_PGS);
+	nr_file_pgs = nr_pages(file->f_dentry->d_inode->i_size);
+	if (start >= nr_file_pgs)
+		return;
+	size = MIN(size, nr_file_pgs - start);
+	ra->start = start;
+	ra->size = size;
+	ra->async_size = size / 2;
+	kref_get(&file->f_kref, size);
+	for (unsigned long i = start; i < start + size; i++)
+		send_kernel_message(core_id(), __file_ra_page, (long)file, i, 0,
+		                    KMSG_ROUTINE);
+}
+
 /* Directories usually use this for their read method, which is the way glibc
  * currently expects us to do a readdir (short of doing linux's getdents).  Will
  * probably need work, based on whatever real programs want. */
@@ -2256,6 +2336,8 @@ struct file *alloc_file(void)
 	}
 	/* one for the ref passed out*/
 	kref_init(&file->f_kref, file_release, 1);
+	memset(&file->f_ra, 0, sizeof(struct file_ra_state));
+	file->f_ra.prev_idx = -1;	/* reading page 0 first is sequential */
 	return file;
 }
 
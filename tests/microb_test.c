@@ -71,6 +71,23 @@ void set_tlsdesc_test(unsigned long nr_loops)
 #endif
 }
 
+/* Batch size for sys_null_batch_test, set by microb_test() */
+unsigned int null_batch_sz = 1;
+
+void sys_null_batch_test(unsigned long nr_loops)
+{
+	struct syscall syscs[64];
+
+	for (int i = 0; i < nr_loops / null_batch_sz; i++) {
+		for (int j = 0; j < null_batch_sz; j++) {
+			syscs[j].num = SYS_null;
+			atomic_set(&syscs[j].flags, 0);
+			syscs[j].ev_q = 0;
+		}
+		syscall_batch(syscs, null_batch_sz);
+	}
+}
+
 /* Internal test infrastructure */
 
 void loop_overhead(unsigned long nr_loops)
@@ -133,6 +150,14 @@ static void microb_test(void)
 
 	/* Add your tests here.  Func name, number of loops */
 	test_time_ns(set_tlsdesc_test , 100000);
+
+	for (null_batch_sz = 1; null_batch_sz <= 64; null_batch_sz *= 2) {
+		unsigned long long nsec;
+
+		nsec = __test_time_ns(sys_null_batch_test, 64000);
+		printf("SYS_null, batch of %2u: %llu syscalls/sec\n", null_batch_sz,
+		       nsec ? 64000ULL * 1000000000 / nsec : 0);
+	}
 }
 
 void *worker_thread(void* arg)
@@ -45,10 +45,25 @@
 #include <sys/time.h>
 #include <iplib/iplib.h>
 #include <parlib/timing.h>
+#include <parlib/event.h>
+#include <parlib/uthread.h>
+#include <sys/mman.h>
 
 long ncalls;
 char scale;
 
+/* Zero-copy sends lend the kernel our buffers, so we rotate through a few of
+ * them and only reuse one once the kernel says it is done with it. */
+#define NR_ZCBUFS 8
+struct zcbuf {
+	char *buf;
+	long outstanding;
+};
+struct zcbuf zcbufs[NR_ZCBUFS];
+struct event_queue *zc_evq;
+long nzcdone;
+int zerocopy;
+
 static void sysfatal(char *msg)
 {
 	perror(msg);
@@ -179,30 +194,97 @@ void reader(int udp, char *addr, char *port, int buflen, int nbuf, int sink)
 	        nbytes, elapsed, rate(nbytes, elapsed), unit);
 }
 
+void zc_setup(int cfd, int buflen, int src)
+{
+	char cmd[64];
+	int n;
+
+	zc_evq = get_eventq(EV_MBOX_UCQ);
+	zc_evq->ev_flags |= EVENT_INDIR | EVENT_SPAM_INDIR | EVENT_WAKEUP;
+	evq_attach_wakeup_ctlr(zc_evq);
+	n = snprintf(cmd, sizeof(cmd), "zerocopy %p", zc_evq);
+	if (write(cfd, cmd, n) != n)
+		sysfatal("zerocopy ctl");
+	for (int i = 0; i < NR_ZCBUFS; i++) {
+		zcbufs[i].buf = mmap(0, buflen, PROT_READ | PROT_WRITE,
+		                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if (zcbufs[i].buf == MAP_FAILED)
+			sysfatal("mmap");
+		if (src)
+			pattern(zcbufs[i].buf, buflen);
+	}
+}
+
+void zc_complete(struct event_msg *msg, int buflen)
+{
+	char *uva = msg->ev_arg3;
+
+	for (int i = 0; i < NR_ZCBUFS; i++) {
+		if (zcbufs[i].buf <= uva && uva < zcbufs[i].buf + buflen) {
+			zcbufs[i].outstanding -= msg->ev_arg4;
+			nzcdone++;
+			return;
+		}
+	}
+}
+
+/* Returns buffer i, once the kernel is done with it */
+char *zc_get(int i, int buflen)
+{
+	struct event_msg msg;
+
+	while (uth_check_evqs(&msg, NULL, 1, zc_evq))
+		zc_complete(&msg, buflen);
+	while (zcbufs[i].outstanding) {
+		uth_blockon_evqs(&msg, NULL, 1, zc_evq);
+		zc_complete(&msg, buflen);
+	}
+	return zcbufs[i].buf;
+}
+
 void writer(int udp, char *addr, char *port, int buflen, int nbuf, int src)
 {
 	char *buf;
-	int fd, cnt;
+	int fd, cfd, cnt, zci = 0;
 	long nbytes = 0;
 	long now;
 	double elapsed;
 	char netaddr[128];
 
-	fprintf(stderr, "ttcp-t: buflen=%d, nbuf=%d, port=%s %s -> %s\n",
-		    buflen, nbuf, port, udp ? "udp" : "tcp", addr);
+	fprintf(stderr, "ttcp-t: buflen=%d, nbuf=%d, port=%s %s%s -> %s\n",
+		    buflen, nbuf, port, udp ? "udp" : "tcp",
+		    zerocopy ? " zerocopy" : "", addr);
 
 	buf = malloc(buflen);
 	snprintf(netaddr, sizeof(netaddr), "%s!%s!%s",
 		 udp ? "udp" : "tcp", addr, port);
 	fprintf(stderr, "dialing %s\n", netaddr);
-	fd = dial9(netaddr, 0, 0, 0, 0);
+	fd = dial9(netaddr, 0, 0, &cfd, 0);
 	if (fd < 0)
 		sysfatal("dial: %r");
+	if (zerocopy)
+		zc_setup(cfd, buflen, src);
 
 	fprintf(stderr, "ttcp-t: connect\n");
 
 	now = nsec();
-	if (src) {
+	if (zerocopy) {
+		for (;;) {
+			buf = zc_get(zci, buflen);
+			if (src) {
+				if (!nbuf--)
+					break;
+				cnt = buflen;
+			} else if ((cnt = read(0, buf, buflen)) <= 0) {
+				break;
+			}
+			zcbufs[zci].outstanding += cnt;
+			if (nwrite(fd, buf, cnt) != cnt)
+				break;
+			nbytes += cnt;
+			zci = (zci + 1) % NR_ZCBUFS;
+		}
+	} else if (src) {
 		pattern(buf, buflen);
 		while (nbuf-- && nwrite(fd, buf, buflen) == buflen)
 			nbytes += buflen;
@@ -214,6 +296,8 @@ void writer(int udp, char *addr, char *port, int buflen, int nbuf, int src)
 
 	fprintf(stderr, "ttcp-t: %lld bytes in %.2f real seconds = %.2f %s/sec\n",
 	        nbytes, elapsed, rate(nbytes, elapsed), unit);
+	if (zerocopy)
+		fprintf(stderr, "ttcp-t: %ld zero-copy completions\n", nzcdone);
 }
 
 void usage(void)
@@ -227,6 +311,7 @@ void usage(void)
 	      "  -n num\tnumber of bufs written (default 2048)\n"
 	      "  -s\t\t-t: source a pattern to network\n"
 	      "\t\t-r: sink (discard) all data from network\n"
+	      "  -z\t\t-t: zero-copy sends (needs -l of 16K or more)\n"
 	      );
 	exit(0);
 }
@@ -241,7 +326,7 @@ void main(int argc, char *argv[])
 	enum { none, recv, xmit } mode = none;
 	char c;
 
-	while ((c = getopt(argc, argv, "rstuf:l:n:p:")) != -1) {
+	while ((c = getopt(argc, argv, "rstuzf:l:n:p:")) != -1) {
 		switch (c) {
 		case 'f':
 			fmt = *optarg;
@@ -267,6 +352,9 @@ void main(int argc, char *argv[])
 		case 'u':
 			udp = 1;
 			break;
+		case 'z':
+			zerocopy = 1;
+			break;
 		default:
 			usage();
 		}
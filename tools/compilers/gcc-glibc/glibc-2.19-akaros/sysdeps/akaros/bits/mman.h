@@ -64,6 +64,7 @@
 # define MAP_POPULATE	0x08000		/* Populate (prefault) pagetables.  */
 # define MAP_NONBLOCK	0x10000		/* Do not block on IO.  */
 # define MAP_STACK	0x20000		/* Allocation is for a stack.  */
+# define MAP_JUMBO	0x40000		/* Back with jumbo pages if possible.  */
 #endif
 
 /* Flags to `msync'.  */
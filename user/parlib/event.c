@@ -347,7 +347,10 @@ int handle_mbox(struct event_mbox *ev_mbox)
 	printd("[event] handling ev_mbox %08p on vcore %d\n", ev_mbox, vcore_id());
 	/* Some stack-smashing bugs cause this to fail */
 	assert(ev_mbox);
-	/* Handle all full messages, tracking if we do at least one. */
+	/* Handle all full messages, tracking if we do at least one.  We pull them
+	 * off one at a time, not in a batch with get_ucq_msgs(): some handlers
+	 * don't return (EV_CHECK_MSGS, preemption), and any messages we'd claimed
+	 * but not handled yet would be lost. */
 	while (handle_one_mbox_msg(ev_mbox))
 		retval = 1;
 	return retval;
@@ -61,6 +61,8 @@ int         sys_tap_fds(struct fd_tap_req *tap_reqs, size_t nr_reqs);
 void		syscall_async(struct syscall *sysc, unsigned long num, ...);
 void        syscall_async_evq(struct syscall *sysc, struct event_queue *evq,
                               unsigned long num, ...);
+void        syscall_async_batch(struct syscall *syscs, unsigned int nr_syscs);
+void        syscall_batch(struct syscall *syscs, unsigned int nr_syscs);
 
 /* Control variables */
 extern bool parlib_wants_to_be_mcp;	/* instructs the 2LS to be an MCP */
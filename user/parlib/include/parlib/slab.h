@@ -19,6 +19,12 @@
  * address of the next free item.  The slab structure is stored at the end of
  * the page.  There is only one page per slab.
  *
+ * In front of the slab layer, each cache has per-vcore magazines of constructed
+ * objects and a depot of full and empty magazines, as in the kernel (and the
+ * Vmem/magazines paper).  The per-vcore layer is only touched by its vcore,
+ * with notifs disabled, so it needs no lock.  The depot is protected by a PDR
+ * lock, which is safe if its holder gets preempted.
+ *
  * TODO: Note, that this is a minor pain in the ass, and worth thinking about
  * before implementing.  To keep the constructor's state valid, we can't just
  * overwrite things, so we need to add an extra 4-8 bytes per object for the
@@ -33,6 +39,7 @@
 #include <ros/arch/mmu.h>
 #include <sys/queue.h>
 #include <parlib/arch/atomic.h>
+#include <parlib/arch/arch.h>
 #include <parlib/spinlock.h>
 
 __BEGIN_DECLS
@@ -42,6 +49,34 @@ __BEGIN_DECLS
 #define NUM_BUF_PER_SLAB 8
 #define SLAB_LARGE_CUTOFF (PGSIZE / NUM_BUF_PER_SLAB)
 
+#define KMC_MAG_MIN_SZ			8
+#define KMC_MAG_MAX_SZ			62		/* chosen for mag size and caching */
+
+struct kmem_magazine {
+	SLIST_ENTRY(kmem_magazine)	link;
+	unsigned int				nr_rounds;
+	void						*rounds[KMC_MAG_MAX_SZ];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+SLIST_HEAD(kmem_mag_slist, kmem_magazine);
+
+struct kmem_pcpu_cache {
+	unsigned int				magsize;
+	struct kmem_magazine		*loaded;
+	struct kmem_magazine		*prev;
+	size_t						nr_allocs_ever;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct kmem_depot {
+	struct spin_pdr_lock		lock;
+	struct kmem_mag_slist		not_empty;
+	struct kmem_mag_slist		empty;
+	unsigned int				magsize;
+	unsigned int				nr_empty;
+	unsigned int				nr_not_empty;
+	unsigned int				busy_count;
+	uint64_t					busy_start;
+};
+
 struct kmem_slab;
 
 /* Control block for buffers for large-object slabs */
@@ -71,6 +106,8 @@ TAILQ_HEAD(kmem_slab_list, kmem_slab);
 /* Actual cache */
 struct kmem_cache {
 	SLIST_ENTRY(kmem_cache) link;
+	struct kmem_pcpu_cache *pcpu_caches;
+	struct kmem_depot depot;
 	struct spin_pdr_lock cache_lock;
 	const char *name;
 	size_t obj_size;
@@ -55,6 +55,7 @@ void ensure_vcore_runs(uint32_t vcoreid);
 void cpu_relax_vc(uint32_t vcoreid);
 uint32_t get_vcoreid(void);
 bool check_vcoreid(const char *str, uint32_t vcoreid);
+void __attribute__((noreturn)) vcore_restart(void);
 void __attribute__((noreturn)) vcore_yield_or_restart(void);
 
 /* This works so long as we don't dlopen parlib (which we never do) */
@@ -0,0 +1,39 @@
+/* See LICENSE for details.
+ *
+ * Adaptive idling for 2LS vcores.
+ *
+ * When a 2LS has nothing to run, yielding the vcore is expensive: we pay for
+ * the syscall, and if work shows up shortly after, we pay again to get the core
+ * back.  Instead, the 2LS can spin for a little while, polling for events and
+ * for work, before it yields.
+ *
+ * The spin window is learned per vcore.  When work shows up while we spin, the
+ * window grows; when we spin for the whole window and find nothing, it shrinks.
+ * parlib_idle_spin_max_usec bounds the window, and 0 turns off spinning.
+ *
+ * In the 2LS sched_entry(), when there is nothing to run:
+ *
+ *		if (vcore_idle_spin(has_work, arg))
+ *			try_again();
+ *		vcore_yield(FALSE);
+ *
+ * 2LSs that restart vcore context instead of looping can use
+ * vcore_idle_or_restart(has_work, arg) in place of vcore_yield_or_restart().
+ *
+ * has_work() is called in vcore context, after each round of handle_events(),
+ * and should be a cheap, racy peek at the 2LS's queues. */
+
+#pragma once
+
+#include <parlib/common.h>
+
+__BEGIN_DECLS
+
+extern uint64_t parlib_idle_spin_max_usec;
+
+bool vcore_idle_spin(bool (*has_work)(void *arg), void *arg);
+void __attribute__((noreturn)) vcore_idle_or_restart(bool (*has_work)(void *),
+                                                     void *arg);
+void vcore_idle_print_stats(void);
+
+__END_DECLS
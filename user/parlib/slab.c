@@ -17,20 +17,156 @@
 #include <parlib/assert.h>
 #include <parlib/parlib.h>
 #include <parlib/stdio.h>
+#include <parlib/vcore.h>
+#include <parlib/uthread.h>
+#include <parlib/tsc-compat.h>
+#include <parlib/timing.h>
 #include <sys/mman.h>
 #include <sys/param.h>
 
 struct kmem_cache_list kmem_caches;
 struct spin_pdr_lock kmem_caches_lock;
 
+/* Tunables for growing the magazines when the depot lock is contended.  More
+ * than resize_threshold contended acquisitions within resize_timeout_usec
+ * grows the magazines by one round. */
+static uint64_t resize_timeout_usec = 1000000;
+static unsigned int resize_threshold = 1;
+
 /* Backend/internal functions, defined later.  Grab the lock before calling
  * these. */
 static void kmem_cache_grow(struct kmem_cache *cp);
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags);
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf);
 
 /* Cache of the kmem_cache objects, needed for bootstrapping */
 struct kmem_cache kmem_cache_cache;
+struct kmem_cache kmem_magazine_cache;
 struct kmem_cache *kmem_slab_cache, *kmem_bufctl_cache;
 
+/* One pcpu cache per vcore.  A vcore only touches its own, and only with notifs
+ * disabled, which keeps us on the vcore.  If the vcore is preempted, the
+ * uthread can't be migrated, so no one else will touch it.  This is the same
+ * as the kernel disabling IRQs for its pcpu caches. */
+static struct kmem_pcpu_cache *lock_my_pcpu_cache(struct kmem_cache *kc)
+{
+	uth_disable_notifs();
+	return &kc->pcpu_caches[vcore_id()];
+}
+
+static void unlock_pcu_cache(struct kmem_pcpu_cache *pcc)
+{
+	uth_enable_notifs();
+}
+
+static void lock_depot(struct kmem_depot *depot)
+{
+	uint64_t time;
+
+	if (spin_pdr_trylock(&depot->lock))
+		return;
+	/* The lock is contended.  See the kernel's slab allocator for the details:
+	 * bursts of contention mean the magazines are too small, so we grow them.
+	 * We read the time before locking so that a long wait doesn't hide the
+	 * burst. */
+	time = read_tsc();
+	spin_pdr_lock(&depot->lock);
+	/* If there are no not-empty mags, we're probably fighting for the lock not
+	 * because the magazines aren't big enough, but because there aren't enough
+	 * mags yet. */
+	if (!depot->nr_not_empty)
+		return;
+	if (time - depot->busy_start > usec2tsc(resize_timeout_usec)) {
+		depot->busy_count = 0;
+		depot->busy_start = time;
+	}
+	depot->busy_count++;
+	if (depot->busy_count > resize_threshold) {
+		depot->busy_count = 0;
+		depot->magsize = MIN(KMC_MAG_MAX_SZ, depot->magsize + 1);
+		/* The pccs will eventually notice and up their magazine sizes. */
+	}
+}
+
+static void unlock_depot(struct kmem_depot *depot)
+{
+	spin_pdr_unlock(&depot->lock);
+}
+
+static void depot_init(struct kmem_depot *depot)
+{
+	spin_pdr_init(&depot->lock);
+	SLIST_INIT(&depot->not_empty);
+	SLIST_INIT(&depot->empty);
+	depot->magsize = KMC_MAG_MIN_SZ;
+	depot->nr_not_empty = 0;
+	depot->nr_empty = 0;
+	depot->busy_count = 0;
+	depot->busy_start = 0;
+}
+
+static bool mag_is_empty(struct kmem_magazine *mag)
+{
+	return mag->nr_rounds == 0;
+}
+
+/* Helper, swaps the loaded and previous mags.  Hold the pcc lock. */
+static void __swap_mags(struct kmem_pcpu_cache *pcc)
+{
+	struct kmem_magazine *temp;
+
+	temp = pcc->prev;
+	pcc->prev = pcc->loaded;
+	pcc->loaded = temp;
+}
+
+/* Helper, returns a magazine to the depot.  Hold the depot lock. */
+static void __return_to_depot(struct kmem_cache *kc, struct kmem_magazine *mag)
+{
+	struct kmem_depot *depot = &kc->depot;
+
+	if (mag_is_empty(mag)) {
+		SLIST_INSERT_HEAD(&depot->empty, mag, link);
+		depot->nr_empty++;
+	} else {
+		SLIST_INSERT_HEAD(&depot->not_empty, mag, link);
+		depot->nr_not_empty++;
+	}
+}
+
+/* Helper, removes the contents of the magazine, giving them back to the slab
+ * layer.  Unlike the kernel, our slabs hold constructed objects, so there is no
+ * dtor to run. */
+static void drain_mag(struct kmem_cache *kc, struct kmem_magazine *mag)
+{
+	for (int i = 0; i < mag->nr_rounds; i++)
+		__kmem_free_to_slab(kc, mag->rounds[i]);
+	mag->nr_rounds = 0;
+}
+
+static struct kmem_pcpu_cache *build_pcpu_caches(void)
+{
+	struct kmem_pcpu_cache *pcc;
+	size_t sz = ROUNDUP(sizeof(struct kmem_pcpu_cache) * max_vcores(), PGSIZE);
+
+	pcc = mmap(0, sz, PROT_READ | PROT_WRITE,
+	           MAP_POPULATE | MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	assert(pcc != MAP_FAILED);
+	for (int i = 0; i < max_vcores(); i++) {
+		pcc[i].magsize = KMC_MAG_MIN_SZ;
+		pcc[i].loaded = __kmem_alloc_from_slab(&kmem_magazine_cache, 0);
+		pcc[i].prev = __kmem_alloc_from_slab(&kmem_magazine_cache, 0);
+		pcc[i].nr_allocs_ever = 0;
+	}
+	return pcc;
+}
+
+static void destroy_pcpu_caches(struct kmem_pcpu_cache *pcc)
+{
+	munmap(pcc, ROUNDUP(sizeof(struct kmem_pcpu_cache) * max_vcores(),
+	                    PGSIZE));
+}
+
 static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
                                 size_t obj_size, int align, int flags,
                                 int (*ctor)(void *, void *, int),
@@ -51,7 +187,11 @@ static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	kc->dtor = dtor;
 	kc->priv = priv;
 	kc->nr_cur_alloc = 0;
-	
+	depot_init(&kc->depot);
+	/* Note that the magazine cache's pcpu caches are built from its own slab
+	 * layer. */
+	kc->pcpu_caches = build_pcpu_caches();
+
 	/* put in cache list based on it's size */
 	struct kmem_cache *i, *prev = NULL;
 	spin_pdr_lock(&kmem_caches_lock);
@@ -69,12 +209,26 @@ static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	spin_pdr_unlock(&kmem_caches_lock);
 }
 
+static int __mag_ctor(void *obj, void *priv, int flags)
+{
+	struct kmem_magazine *mag = (struct kmem_magazine*)obj;
+
+	mag->nr_rounds = 0;
+	return 0;
+}
+
 static void kmem_cache_init(void *arg)
 {
 	spin_pdr_init(&kmem_caches_lock);
 	SLIST_INIT(&kmem_caches);
-	/* We need to call the __ version directly to bootstrap the global
-	 * kmem_cache_cache. */
+	/* magazine must be first - all caches, including mags, will do a slab alloc
+	 * from the mag cache.  We need to call the __ version directly to bootstrap
+	 * the global caches. */
+	parlib_static_assert(sizeof(struct kmem_magazine) <= SLAB_LARGE_CUTOFF);
+	__kmem_cache_create(&kmem_magazine_cache, "kmem_magazine",
+	                    sizeof(struct kmem_magazine),
+	                    __alignof__(struct kmem_magazine), 0, __mag_ctor, NULL,
+	                    NULL);
 	__kmem_cache_create(&kmem_cache_cache, "kmem_cache",
 	                    sizeof(struct kmem_cache),
 	                    __alignof__(struct kmem_cache), 0, NULL, NULL, NULL);
@@ -137,12 +291,53 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 	}
 }
 
+/* Helper during destruction.  No one should be touching the allocator anymore.
+ * We just need to hand objects back to the depot, which will hand them to the
+ * slab.  Locking is just a formality here. */
+static void drain_pcpu_caches(struct kmem_cache *kc)
+{
+	struct kmem_pcpu_cache *pcc;
+
+	lock_depot(&kc->depot);
+	for (int i = 0; i < max_vcores(); i++) {
+		pcc = &kc->pcpu_caches[i];
+		__return_to_depot(kc, pcc->loaded);
+		__return_to_depot(kc, pcc->prev);
+		pcc->loaded = NULL;
+		pcc->prev = NULL;
+	}
+	unlock_depot(&kc->depot);
+}
+
+static void depot_destroy(struct kmem_cache *kc)
+{
+	struct kmem_magazine *mag_i;
+	struct kmem_depot *depot = &kc->depot;
+
+	lock_depot(depot);
+	while ((mag_i = SLIST_FIRST(&depot->not_empty))) {
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
+		drain_mag(kc, mag_i);
+		kmem_cache_free(&kmem_magazine_cache, mag_i);
+	}
+	while ((mag_i = SLIST_FIRST(&depot->empty))) {
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		kmem_cache_free(&kmem_magazine_cache, mag_i);
+	}
+	depot->nr_not_empty = 0;
+	depot->nr_empty = 0;
+	unlock_depot(depot);
+}
+
 /* Once you call destroy, never use this cache again... o/w there may be weird
  * races, and other serious issues.  */
 void kmem_cache_destroy(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
 
+	drain_pcpu_caches(cp);
+	depot_destroy(cp);
+	destroy_pcpu_caches(cp->pcpu_caches);
 	spin_pdr_lock(&cp->cache_lock);
 	assert(TAILQ_EMPTY(&cp->full_slab_list));
 	assert(TAILQ_EMPTY(&cp->partial_slab_list));
@@ -162,8 +357,9 @@ void kmem_cache_destroy(struct kmem_cache *cp)
 	spin_pdr_unlock(&cp->cache_lock);
 }
 
-/* Front end: clients of caches use these */
-void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+/* Gets an object from the slab layer.  Note that objects in our slabs are
+ * constructed when the slab grows. */
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags)
 {
 	void *retval = NULL;
 	spin_pdr_lock(&cp->cache_lock);
@@ -209,7 +405,45 @@ static inline struct kmem_bufctl *buf2bufctl(void *buf, size_t offset)
 	return *((struct kmem_bufctl**)(buf + offset));
 }
 
-void kmem_cache_free(struct kmem_cache *cp, void *buf)
+/* Front end: clients of caches use these */
+void *kmem_cache_alloc(struct kmem_cache *kc, int flags)
+{
+	struct kmem_pcpu_cache *pcc = lock_my_pcpu_cache(kc);
+	struct kmem_depot *depot = &kc->depot;
+	struct kmem_magazine *mag;
+	void *ret;
+
+try_alloc:
+	if (pcc->loaded->nr_rounds) {
+		ret = pcc->loaded->rounds[pcc->loaded->nr_rounds - 1];
+		pcc->loaded->nr_rounds--;
+		pcc->nr_allocs_ever++;
+		unlock_pcu_cache(pcc);
+		return ret;
+	}
+	if (!mag_is_empty(pcc->prev)) {
+		__swap_mags(pcc);
+		goto try_alloc;
+	}
+	/* Note the lock ordering: pcc -> depot */
+	lock_depot(depot);
+	mag = SLIST_FIRST(&depot->not_empty);
+	if (mag) {
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
+		depot->nr_not_empty--;
+		__return_to_depot(kc, pcc->prev);
+		unlock_depot(depot);
+		pcc->prev = pcc->loaded;
+		pcc->loaded = mag;
+		goto try_alloc;
+	}
+	unlock_depot(depot);
+	unlock_pcu_cache(pcc);
+	return __kmem_alloc_from_slab(kc, flags);
+}
+
+/* Returns an object to the slab layer.  The object stays constructed. */
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
 {
 	struct kmem_slab *a_slab;
 	struct kmem_bufctl *a_bufctl;
@@ -244,6 +478,53 @@ void kmem_cache_free(struct kmem_cache *cp, void *buf)
 	spin_pdr_unlock(&cp->cache_lock);
 }
 
+void kmem_cache_free(struct kmem_cache *kc, void *buf)
+{
+	struct kmem_pcpu_cache *pcc = lock_my_pcpu_cache(kc);
+	struct kmem_depot *depot = &kc->depot;
+	struct kmem_magazine *mag;
+
+try_free:
+	if (pcc->loaded->nr_rounds < pcc->magsize) {
+		pcc->loaded->rounds[pcc->loaded->nr_rounds] = buf;
+		pcc->loaded->nr_rounds++;
+		unlock_pcu_cache(pcc);
+		return;
+	}
+	/* We just care if prev has room left, not that it is completely empty.
+	 * This could be the case due to magazine resize. */
+	if (pcc->prev->nr_rounds < pcc->magsize) {
+		__swap_mags(pcc);
+		goto try_free;
+	}
+	lock_depot(depot);
+	/* Here's where the resize magic happens.  We'll start using it for the next
+	 * magazine. */
+	pcc->magsize = depot->magsize;
+	mag = SLIST_FIRST(&depot->empty);
+	if (mag) {
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		depot->nr_empty--;
+		__return_to_depot(kc, pcc->prev);
+		unlock_depot(depot);
+		pcc->prev = pcc->loaded;
+		pcc->loaded = mag;
+		goto try_free;
+	}
+	unlock_depot(depot);
+	/* Need to unlock, since we call back into the allocator for the mag.  We
+	 * might be on another vcore when we come back. */
+	unlock_pcu_cache(pcc);
+	mag = kmem_cache_alloc(&kmem_magazine_cache, 0);
+	assert(mag->nr_rounds == 0);
+	lock_depot(depot);
+	SLIST_INSERT_HEAD(&depot->empty, mag, link);
+	depot->nr_empty++;
+	unlock_depot(depot);
+	pcc = lock_my_pcpu_cache(kc);
+	goto try_free;
+}
+
 /* Back end: internal functions */
 /* When this returns, the cache has at least one slab in the empty list.  If
  * page_alloc fails, there are some serious issues.  This only grows by one slab
@@ -360,6 +641,17 @@ void print_kmem_cache(struct kmem_cache *cp)
 	printf("Slab Empty: 0x%08x\n", cp->empty_slab_list);
 	printf("Current Allocations: %d\n", cp->nr_cur_alloc);
 	spin_pdr_unlock(&cp->cache_lock);
+	lock_depot(&cp->depot);
+	printf("Magsize: %d\n", cp->depot.magsize);
+	printf("Depot full mags: %d, empty mags: %d\n", cp->depot.nr_not_empty,
+	       cp->depot.nr_empty);
+	unlock_depot(&cp->depot);
+	for (int i = 0; i < max_vcores(); i++) {
+		if (!cp->pcpu_caches[i].nr_allocs_ever)
+			continue;
+		printf("VC %3d: allocs from magazines: %lu\n", i,
+		       cp->pcpu_caches[i].nr_allocs_ever);
+	}
 }
 
 void print_kmem_slab(struct kmem_slab *slab)
@@ -218,3 +218,27 @@ void syscall_async_evq(struct syscall *sysc, struct event_queue *evq,
 	va_end(args);
 	__ros_arch_syscall((long)sysc, 1);
 }
+
+/* Submits nr_syscs syscalls in one trap.  The caller fills in each sysc (num,
+ * args, flags, and ev_q if it wants SC_UEVENT).  The kernel runs them in order,
+ * and each one completes on its own, just like syscall_async().  Calls that
+ * operate on the calling vcore (e.g. yield, change_vcore) can't be batched. */
+void syscall_async_batch(struct syscall *syscs, unsigned int nr_syscs)
+{
+	if (!nr_syscs)
+		return;
+	__ros_arch_syscall((long)syscs, nr_syscs);
+}
+
+/* Like syscall_async_batch(), but blocks until every call is done. */
+void syscall_batch(struct syscall *syscs, unsigned int nr_syscs)
+{
+	syscall_async_batch(syscs, nr_syscs);
+	for (int i = 0; i < nr_syscs; i++) {
+		while (!(atomic_read(&syscs[i].flags) & SC_DONE))
+			ros_syscall_blockon(&syscs[i]);
+		/* It's not really done until SC_DONE & !SC_K_LOCK. */
+		while (atomic_read(&syscs[i].flags) & SC_K_LOCK)
+			cpu_relax();
+	}
+}
@@ -63,24 +63,40 @@ void ucq_free_pgs(struct ucq *ucq)
 	munmap((void*)pg2, PGSIZE);
 }
 
-/* Consumer side, returns TRUE on success and fills *msg with the ev_msg.  If
- * the ucq appears empty, it will return FALSE.  Messages may have arrived after
- * we started getting that we do not receive. */
-bool get_ucq_msg(struct ucq *ucq, struct event_msg *msg)
+/* Helper: the number of slots we can claim at cons_idx, from my_idx up to the
+ * producer or the end of the page, whichever comes first.  If the producer has
+ * moved on to another page, every slot left on our page has been reserved. */
+static size_t ucq_nr_claimable(uintptr_t my_idx, uintptr_t prod_idx)
 {
-	uintptr_t my_idx;
+	if (PTE_ADDR(my_idx) == PTE_ADDR(prod_idx))
+		return MIN(prod_idx, PTE_ADDR(my_idx) + NR_MSG_PER_PAGE) - my_idx;
+	return NR_MSG_PER_PAGE - PGOFF(my_idx);
+}
+
+/* Consumer side, claims up to max messages, copying them to msgs, and returns
+ * how many we got.  The messages come from a run of slots on one page, so we
+ * pay for claiming them and for releasing the page once per batch.  Returns 0
+ * if the ucq appears empty.  Messages may have arrived after we started
+ * getting that we do not receive. */
+size_t get_ucq_msgs(struct ucq *ucq, struct event_msg *msgs, size_t max)
+{
+	uintptr_t my_idx, prod_idx;
+	size_t nr;
 	struct ucq_page *old_page, *other_page;
 	struct msg_container *my_msg;
 	struct spin_pdr_lock *ucq_lock = (struct spin_pdr_lock*)(&ucq->u_lock);
 
+	if (!max)
+		return 0;
 	do {
 loop_top:
 		cmb();
 		my_idx = atomic_read(&ucq->cons_idx);
+		prod_idx = atomic_read(&ucq->prod_idx);
 		/* The ucq is empty if the consumer and producer are on the same 'next'
 		 * slot. */
-		if (my_idx == atomic_read(&ucq->prod_idx))
-			return FALSE;
+		if (my_idx == prod_idx)
+			return 0;
 		/* Is the slot we want good?  If not, we're going to need to try and
 		 * move on to the next page.  If it is, we bypass all of this and try to
 		 * CAS on us getting my_idx. */
@@ -95,8 +111,9 @@ loop_top:
 			/* Someone else fixed it already, let's just try to get out */
 			spin_pdr_unlock(ucq_lock);
 			/* Make sure this new slot has a producer (ucq isn't empty) */
-			if (my_idx == atomic_read(&ucq->prod_idx))
-				return FALSE;
+			prod_idx = atomic_read(&ucq->prod_idx);
+			if (my_idx == prod_idx)
+				return 0;
 			goto claim_slot;
 		}
 		/* At this point, the slot is bad, and all other possible consumers are
@@ -140,25 +157,39 @@ loop_top:
 		goto loop_top;
 claim_slot:
 		cmb();	/* so we can goto claim_slot */
-		/* If we're still here, my_idx is good, and we'll try to claim it.  If
-		 * we fail, we need to repeat the whole process. */
-	} while (!atomic_cas(&ucq->cons_idx, my_idx, my_idx + 1));
+		/* If we're still here, my_idx is good, and we'll try to claim it and
+		 * as many after it as we can.  If we fail, we need to repeat the whole
+		 * process. */
+		nr = MIN(max, ucq_nr_claimable(my_idx, prod_idx));
+	} while (!atomic_cas(&ucq->cons_idx, my_idx, my_idx + nr));
 	assert(slot_is_good(my_idx));
-	/* Now we have a good slot that we can consume */
-	my_msg = slot2msg(my_idx);
-	/* linux would put an rmb_depends() here */
-	/* Wait til the msg is ready (kernel sets this flag) */
-	while (!my_msg->ready)
-		cpu_relax();
-	rmb();	/* order the ready read before the contents */
-	/* Copy out */
-	*msg = my_msg->ev_msg;
-	/* Unset this for the next usage of the container */
-	my_msg->ready = FALSE;
-	wmb();	/* post the ready write before incrementing */
+	assert(slot_is_good(my_idx + nr - 1));
+	/* Now we have good slots that we can consume */
+	for (size_t i = 0; i < nr; i++) {
+		my_msg = slot2msg(my_idx + i);
+		/* linux would put an rmb_depends() here */
+		/* Wait til the msg is ready (kernel sets this flag) */
+		while (!my_msg->ready)
+			cpu_relax();
+		rmb();	/* order the ready read before the contents */
+		/* Copy out */
+		msgs[i] = my_msg->ev_msg;
+		/* Unset this for the next usage of the container */
+		my_msg->ready = FALSE;
+	}
+	wmb();	/* post the ready writes before incrementing */
 	/* Increment nr_cons, showing we're done */
-	atomic_inc(&((struct ucq_page*)PTE_ADDR(my_idx))->header.nr_cons);
-	return TRUE;
+	atomic_fetch_and_add(&((struct ucq_page*)PTE_ADDR(my_idx))->header.nr_cons,
+	                     nr);
+	return nr;
+}
+
+/* Consumer side, returns TRUE on success and fills *msg with the ev_msg.  If
+ * the ucq appears empty, it will return FALSE.  Messages may have arrived after
+ * we started getting that we do not receive. */
+bool get_ucq_msg(struct ucq *ucq, struct event_msg *msg)
+{
+	return get_ucq_msgs(ucq, msg, 1) == 1;
 }
 
 bool ucq_is_empty(struct ucq *ucq)
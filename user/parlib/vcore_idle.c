@@ -0,0 +1,113 @@
+/* See LICENSE for details.
+ *
+ * Adaptive idling for 2LS vcores.  See vcore_idle.h.
+ *
+ * We can't use monitor/mwait to wait for the event mbox to change: those are
+ * privileged on x86, so we just poll with cpu_relax(). */
+
+#include <parlib/vcore.h>
+#include <parlib/uthread.h>
+#include <parlib/event.h>
+#include <parlib/assert.h>
+#include <parlib/arch/arch.h>
+#include <parlib/tsc-compat.h>
+#include <parlib/timing.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore_idle.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The floor on the learned window, so that a vcore that has been idle for a
+ * long time can still learn that work is arriving again. */
+#define IDLE_SPIN_MIN_USEC			1
+
+uint64_t parlib_idle_spin_max_usec = 50;
+
+struct vcore_idle {
+	uint64_t					window;			/* tsc ticks */
+	uint64_t					nr_spins;
+	uint64_t					nr_hits;
+	uint64_t					nr_misses;
+	uint64_t					spin_ticks;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct vcore_idle *__vc_idles;
+
+static void __attribute__((constructor)) vcore_idle_lib_ctor(void)
+{
+	if (__in_fake_parlib())
+		return;
+	__vc_idles = calloc(max_vcores(), sizeof(struct vcore_idle));
+	assert(__vc_idles);
+}
+
+/* Spins for up to this vcore's learned window, handling events and checking
+ * has_work().  Returns TRUE if there is work to do, in which case the caller
+ * should look for it instead of yielding.  Returns FALSE if the caller should
+ * yield.  Only call this from vcore context. */
+bool vcore_idle_spin(bool (*has_work)(void *arg), void *arg)
+{
+	uint32_t vcoreid = vcore_id();
+	struct vcore_idle *vci = &__vc_idles[vcoreid];
+	uint64_t max_ticks, min_ticks, start, elapsed;
+	bool found = FALSE;
+
+	/* Spinning is pointless if vcore_yield() won't yield */
+	if (!parlib_idle_spin_max_usec || parlib_never_yield)
+		return FALSE;
+	max_ticks = usec2tsc(parlib_idle_spin_max_usec);
+	min_ticks = MIN(usec2tsc(IDLE_SPIN_MIN_USEC), max_ticks);
+	if (!vci->window)
+		vci->window = max_ticks;
+	vci->window = MIN(MAX(vci->window, min_ticks), max_ticks);
+	start = read_tsc();
+	do {
+		if (handle_events(vcoreid) || has_work(arg)) {
+			found = TRUE;
+			break;
+		}
+		/* The kernel wants the core back; let the caller deal with it */
+		if (__preempt_is_pending(vcoreid))
+			break;
+		cpu_relax();
+	} while (read_tsc() - start < vci->window);
+	elapsed = read_tsc() - start;
+	vci->nr_spins++;
+	vci->spin_ticks += elapsed;
+	if (found) {
+		vci->nr_hits++;
+		/* Work showed up within the window; be willing to wait longer */
+		vci->window = MIN(vci->window * 2, max_ticks);
+	} else {
+		vci->nr_misses++;
+		vci->window = MAX(vci->window / 2, min_ticks);
+	}
+	return found;
+}
+
+/* Like vcore_yield_or_restart(), but spins before yielding.  Either way, we
+ * restart vcore context, so the 2LS gets another look at its queues. */
+void __attribute__((noreturn)) vcore_idle_or_restart(bool (*has_work)(void *),
+                                                     void *arg)
+{
+	if (vcore_idle_spin(has_work, arg))
+		vcore_restart();
+	vcore_yield_or_restart();
+}
+
+/* Racy peek at the idle stats */
+void vcore_idle_print_stats(void)
+{
+	struct vcore_idle *vci;
+
+	printf("Idle spin max: %llu usec\n", parlib_idle_spin_max_usec);
+	for (int i = 0; i < max_vcores(); i++) {
+		vci = &__vc_idles[i];
+		if (!vci->nr_spins)
+			continue;
+		printf("VC %3d: spins %8llu, found work %8llu, yielded %8llu\n", i,
+		       vci->nr_spins, vci->nr_hits, vci->nr_misses);
+		printf("\tspun %llu usec, window %llu usec\n",
+		       tsc2usec(vci->spin_ticks), tsc2usec(vci->window));
+	}
+}
@@ -1,6 +1,7 @@
 #include <ros/trapframe.h>
 #include "pthread.h"
 #include <parlib/vcore.h>
+#include <parlib/vcore_idle.h>
 #include <parlib/mcs.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,11 +32,9 @@
  * pthread.c.  After that, we can have a signal handling thread (even for
  * 'thread0'), which allows us to close() or do other vcore-ctx-unsafe ops. */
 
-struct pthread_queue ready_queue = TAILQ_HEAD_INITIALIZER(ready_queue);
-struct pthread_queue active_queue = TAILQ_HEAD_INITIALIZER(active_queue);
-struct mcs_pdr_lock queue_lock;
-int threads_ready = 0;
-int threads_active = 0;
+/* Array of per-vcore run queues.  Init'd in pth_sched_init(). */
+struct pth_vcore_sched *pth_vc_sched;
+atomic_t threads_ready;
 atomic_t threads_total;
 bool need_tls = TRUE;
 
@@ -84,6 +83,104 @@ static void __pthread_free_stack(struct pthread_tcb *pt);
 static int __pthread_allocate_stack(struct pthread_tcb *pt);
 static void __pth_yield_cb(struct uthread *uthread, void *junk);
 
+static struct pth_vcore_sched *pvs_of(uint32_t vcoreid)
+{
+	return &pth_vc_sched[vcoreid];
+}
+
+/* xorshift, so idle vcores don't all pick the same victims */
+static uint32_t pth_rand(struct pth_vcore_sched *pvs)
+{
+	uint32_t x = pvs->rand_state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	pvs->rand_state = x;
+	return x;
+}
+
+/* Helper, puts pthread on the active queue of vcoreid, which is about to run
+ * it. */
+static void __pth_make_active(uint32_t vcoreid, struct pthread_tcb *pthread)
+{
+	struct pth_vcore_sched *pvs = pvs_of(vcoreid);
+
+	assert(pthread->state == PTH_RUNNABLE);
+	pthread->state = PTH_RUNNING;
+	if (pthread->vcoreid != vcoreid) {
+		pvs->nr_migrations++;
+		pthread->vcoreid = vcoreid;
+	}
+	spin_pdr_lock(&pvs->lock);
+	TAILQ_INSERT_TAIL(&pvs->active_queue, pthread, tq_next);
+	pvs->nr_active++;
+	spin_pdr_unlock(&pvs->lock);
+}
+
+/* Helper, pulls the first thread off pvs's ready queue, if any. */
+static struct pthread_tcb *__pth_dequeue(struct pth_vcore_sched *pvs)
+{
+	struct pthread_tcb *pthread;
+
+	spin_pdr_lock(&pvs->lock);
+	pthread = TAILQ_FIRST(&pvs->ready_queue);
+	if (pthread) {
+		TAILQ_REMOVE(&pvs->ready_queue, pthread, tq_next);
+		pvs->nr_ready--;
+	}
+	spin_pdr_unlock(&pvs->lock);
+	return pthread;
+}
+
+/* Steals a thread from another vcore's ready queue, starting at a random vcore
+ * and checking every vcore, online or not.  A vcore can yield right after a
+ * thread was put on its queue, so stealing is the only way some threads will
+ * run.  We take the thread at the head, which has waited the longest. */
+static struct pthread_tcb *pth_steal_thread(uint32_t vcoreid)
+{
+	struct pth_vcore_sched *pvs = pvs_of(vcoreid);
+	struct pth_vcore_sched *victim;
+	struct pthread_tcb *pthread;
+	uint32_t nr_vcores = max_vcores();
+	uint32_t start;
+
+	if (!atomic_read(&threads_ready))
+		return NULL;
+	start = pth_rand(pvs) % nr_vcores;
+	for (int i = 0; i < nr_vcores; i++) {
+		victim = pvs_of((start + i) % nr_vcores);
+		if (victim == pvs || !READ_ONCE(victim->nr_ready))
+			continue;
+		pthread = __pth_dequeue(victim);
+		if (pthread) {
+			pvs->nr_steals++;
+			return pthread;
+		}
+	}
+	return NULL;
+}
+
+/* Picks the vcore whose ready queue gets pthread: the one that last ran it, for
+ * cache locality.  If that vcore is offline, the thread would wait to be stolen,
+ * so we use our own vcore instead. */
+static uint32_t pth_pick_vcore(struct pthread_tcb *pthread)
+{
+	uint32_t vcoreid = pthread->vcoreid;
+
+	if (vcoreid == vcore_id() || vcore_is_mapped(vcoreid))
+		return vcoreid;
+	return vcore_id();
+}
+
+/* Idle-spin callback: racy check for anything we could run, ours or stolen */
+static bool pth_has_work(void *arg)
+{
+	struct pth_vcore_sched *pvs = arg;
+
+	return READ_ONCE(pvs->nr_ready) || atomic_read(&threads_ready);
+}
+
 /* Called from vcore entry.  Options usually include restarting whoever was
  * running there before or running a new thread.  Events are handled out of
  * event.c (table of function pointers, stuff like that). */
@@ -106,16 +203,12 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 	do {
 		handle_events(vcoreid);
 		__check_preempt_pending(vcoreid);
-		mcs_pdr_lock(&queue_lock);
-		new_thread = TAILQ_FIRST(&ready_queue);
+		new_thread = __pth_dequeue(pvs_of(vcoreid));
+		if (!new_thread)
+			new_thread = pth_steal_thread(vcoreid);
 		if (new_thread) {
-			TAILQ_REMOVE(&ready_queue, new_thread, tq_next);
-			assert(new_thread->state == PTH_RUNNABLE);
-			new_thread->state = PTH_RUNNING;
-			TAILQ_INSERT_TAIL(&active_queue, new_thread, tq_next);
-			threads_active++;
-			threads_ready--;
-			mcs_pdr_unlock(&queue_lock);
+			atomic_dec(&threads_ready);
+			__pth_make_active(vcoreid, new_thread);
 			/* If you see what looks like the same uthread running in multiple
 			 * places, your list might be jacked up.  Turn this on. */
 			printd("[P] got uthread %08p on vc %d state %08p flags %08p\n",
@@ -124,11 +217,12 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 			       ((struct uthread*)new_thread)->flags);
 			break;
 		}
-		mcs_pdr_unlock(&queue_lock);
+		/* Work often shows up shortly after we run dry, so spin a bit before
+		 * paying for the yield. */
+		if (vcore_idle_spin(pth_has_work, pvs_of(vcoreid)))
+			continue;
 		/* no new thread, try to yield */
 		printd("[P] No threads, vcore %d is yielding\n", vcore_id());
-		/* TODO: you can imagine having something smarter here, like spin for a
-		 * bit before yielding. */
 		vcore_yield(FALSE);
 	} while (1);
 	/* Prep the pthread to run any pending posix signal handlers registered
@@ -151,6 +245,7 @@ static void __pthread_run(void)
 static void pth_thread_runnable(struct uthread *uthread)
 {
 	struct pthread_tcb *pthread = (struct pthread_tcb*)uthread;
+	struct pth_vcore_sched *pvs;
 	/* At this point, the 2LS can see why the thread blocked and was woken up in
 	 * the first place (coupling these things together).  On the yield path, the
 	 * 2LS was involved and was able to set the state.  Now when we get the
@@ -169,16 +264,17 @@ static void pth_thread_runnable(struct uthread *uthread)
 			panic("Odd state %d for pthread %08p\n", pthread->state, pthread);
 	}
 	pthread->state = PTH_RUNNABLE;
-	/* Insert the newly created thread into the ready queue of threads.
-	 * It will be removed from this queue later when vcore_entry() comes up */
-	mcs_pdr_lock(&queue_lock);
+	/* Insert the thread into a vcore's ready queue.  It will be removed from
+	 * this queue later when vcore_entry() comes up */
+	pvs = pvs_of(pth_pick_vcore(pthread));
+	spin_pdr_lock(&pvs->lock);
 	/* Again, GIANT WARNING: if you change this, change batch wakeup code */
-	TAILQ_INSERT_TAIL(&ready_queue, pthread, tq_next);
-	threads_ready++;
-	mcs_pdr_unlock(&queue_lock);
+	TAILQ_INSERT_TAIL(&pvs->ready_queue, pthread, tq_next);
+	pvs->nr_ready++;
+	spin_pdr_unlock(&pvs->lock);
 	/* Smarter schedulers should look at the num_vcores() and how much work is
 	 * going on to make a decision about how many vcores to request. */
-	vcore_request_more(threads_ready);
+	vcore_request_more(atomic_fetch_and_add(&threads_ready, 1) + 1);
 }
 
 /* For some reason not under its control, the uthread stopped running (compared
@@ -388,21 +484,57 @@ static struct uthread *pth_thread_create(void *(*func)(void *), void *arg)
 	return ret == 0 ? (struct uthread*)pth : NULL;
 }
 
+/* Spreads the wakees across the online vcores, starting with our own, in equal
+ * chunks.  A broadcast usually wakes threads that will want to run at the same
+ * time, so we don't send them back to their old vcores. */
 static void pth_thread_bulk_runnable(uth_sync_t *wakees)
 {
+	struct pthread_queue batch = TAILQ_HEAD_INITIALIZER(batch);
 	struct uthread *uth_i;
 	struct pthread_tcb *pth_i;
+	struct pth_vcore_sched *pvs;
+	uint32_t vcoreid = vcore_id();
+	unsigned int nr_wakees = 0;
+	unsigned int per_vcore;
 
-	/* Amortize the lock grabbing over all restartees */
-	mcs_pdr_lock(&queue_lock);
 	while ((uth_i = __uth_sync_get_next(wakees))) {
 		pth_i = (struct pthread_tcb*)uth_i;
 		pth_i->state = PTH_RUNNABLE;
-		TAILQ_INSERT_TAIL(&ready_queue, pth_i, tq_next);
-		threads_ready++;
+		TAILQ_INSERT_TAIL(&batch, pth_i, tq_next);
+		nr_wakees++;
+	}
+	if (!nr_wakees)
+		return;
+	per_vcore = DIV_ROUND_UP(nr_wakees, MAX(num_vcores(), 1));
+	for (int i = 0; i < max_vcores() && !TAILQ_EMPTY(&batch); i++) {
+		if (i && !vcore_is_mapped(vcoreid))
+			goto next_vcore;
+		pvs = pvs_of(vcoreid);
+		/* Amortize the lock grabbing over the vcore's chunk */
+		spin_pdr_lock(&pvs->lock);
+		for (int j = 0; j < per_vcore && !TAILQ_EMPTY(&batch); j++) {
+			pth_i = TAILQ_FIRST(&batch);
+			TAILQ_REMOVE(&batch, pth_i, tq_next);
+			TAILQ_INSERT_TAIL(&pvs->ready_queue, pth_i, tq_next);
+			pvs->nr_ready++;
+		}
+		spin_pdr_unlock(&pvs->lock);
+next_vcore:
+		vcoreid = (vcoreid + 1) % max_vcores();
 	}
-	mcs_pdr_unlock(&queue_lock);
-	vcore_request_more(threads_ready);
+	/* The vcores we counted went offline.  Our own vcore gets the rest. */
+	if (!TAILQ_EMPTY(&batch)) {
+		pvs = pvs_of(vcore_id());
+		spin_pdr_lock(&pvs->lock);
+		while ((pth_i = TAILQ_FIRST(&batch))) {
+			TAILQ_REMOVE(&batch, pth_i, tq_next);
+			TAILQ_INSERT_TAIL(&pvs->ready_queue, pth_i, tq_next);
+			pvs->nr_ready++;
+		}
+		spin_pdr_unlock(&pvs->lock);
+	}
+	vcore_request_more(atomic_fetch_and_add(&threads_ready, nr_wakees) +
+	                   nr_wakees);
 }
 
 /* Akaros pthread extensions / hacks */
@@ -414,6 +546,25 @@ void pthread_need_tls(bool need)
 	need_tls = need;
 }
 
+/* Racy peek at the per-vcore scheduler state */
+void pthread_print_sched_stats(void)
+{
+	struct pth_vcore_sched *pvs;
+
+	printf("Threads ready: %ld, total: %ld\n", atomic_read(&threads_ready),
+	       atomic_read(&threads_total));
+	for (int i = 0; i < max_vcores(); i++) {
+		pvs = pvs_of(i);
+		if (!pvs->nr_steals && !pvs->nr_migrations && !pvs->nr_ready &&
+		    !pvs->nr_active)
+			continue;
+		printf("VC %3d: ready %4u, active %4u, steals %8lu, migrations %8lu\n",
+		       i, pvs->nr_ready, pvs->nr_active, pvs->nr_steals,
+		       pvs->nr_migrations);
+	}
+	vcore_idle_print_stats();
+}
+
 /* Pthread interface stuff and helpers */
 
 int pthread_attr_init(pthread_attr_t *a)
@@ -515,7 +666,18 @@ void pth_sched_init(void)
 	struct pthread_tcb *t;
 	int ret;
 
-	mcs_pdr_init(&queue_lock);
+	/* Set up the per-vcore run queues */
+	ret = posix_memalign((void**)&pth_vc_sched, ARCH_CL_SIZE,
+	                     sizeof(struct pth_vcore_sched) * max_vcores());
+	assert(!ret);
+	memset(pth_vc_sched, 0, sizeof(struct pth_vcore_sched) * max_vcores());
+	for (int i = 0; i < max_vcores(); i++) {
+		spin_pdr_init(&pth_vc_sched[i].lock);
+		TAILQ_INIT(&pth_vc_sched[i].ready_queue);
+		TAILQ_INIT(&pth_vc_sched[i].active_queue);
+		pth_vc_sched[i].rand_state = i + 1;		/* xorshift needs nonzero */
+	}
+	atomic_init(&threads_ready, 0);
 	/* Create a pthread_tcb for the main thread */
 	ret = posix_memalign((void**)&t, __alignof__(struct pthread_tcb),
 	                     sizeof(struct pthread_tcb));
@@ -528,11 +690,12 @@ void pth_sched_init(void)
 	/* implies that sigmasks are longs, which they are. */
 	assert(t->id == 0);
 	SLIST_INIT(&t->cr_stack);
-	/* Put the new pthread (thread0) on the active queue */
-	mcs_pdr_lock(&queue_lock);
-	threads_active++;
-	TAILQ_INSERT_TAIL(&active_queue, t, tq_next);
-	mcs_pdr_unlock(&queue_lock);
+	/* Put the new pthread (thread0) on vcore 0's active queue */
+	t->vcoreid = 0;
+	spin_pdr_lock(&pvs_of(0)->lock);
+	pvs_of(0)->nr_active++;
+	TAILQ_INSERT_TAIL(&pvs_of(0)->active_queue, t, tq_next);
+	spin_pdr_unlock(&pvs_of(0)->lock);
 	/* Tell the kernel where and how we want to receive events.  This is just an
 	 * example of what to do to have a notification turned on.  We're turning on
 	 * USER_IPIs, posting events to vcore 0's vcpd, and telling the kernel to
@@ -622,6 +785,8 @@ int __pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 	pthread->stacksize = PTHREAD_STACK_SIZE;	/* default */
 	pthread->state = PTH_CREATED;
 	pthread->id = get_next_pid();
+	/* New threads start out on their creator's vcore */
+	pthread->vcoreid = vcore_id();
 	SLIST_INIT(&pthread->cr_stack);
 	/* Respect the attributes */
 	if (attr) {
@@ -662,10 +827,12 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
  * active queue is keeping us honest.  Need to export for sem and friends. */
 void __pthread_generic_yield(struct pthread_tcb *pthread)
 {
-	mcs_pdr_lock(&queue_lock);
-	threads_active--;
-	TAILQ_REMOVE(&active_queue, pthread, tq_next);
-	mcs_pdr_unlock(&queue_lock);
+	struct pth_vcore_sched *pvs = pvs_of(pthread->vcoreid);
+
+	spin_pdr_lock(&pvs->lock);
+	pvs->nr_active--;
+	TAILQ_REMOVE(&pvs->active_queue, pthread, tq_next);
+	spin_pdr_unlock(&pvs->lock);
 }
 
 int pthread_join(struct pthread_tcb *join_target, void **retval)
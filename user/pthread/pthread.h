@@ -46,10 +46,27 @@ struct pthread_tcb {
 	void *(*start_routine)(void*);
 	void *arg;
 	struct pthread_cleanup_stack cr_stack;
+	uint32_t vcoreid;			/* last ran on, or is running on */
 };
 typedef struct pthread_tcb* pthread_t;
 TAILQ_HEAD(pthread_queue, pthread_tcb);
 
+/* Per-vcore run queues.  Runnable threads go on the ready queue of the vcore
+ * that last ran them, and running threads are on the active queue of their
+ * vcore.  Vcores that run out of threads steal from other vcores' ready queues.
+ * The lock protects the queues and counts.  The stats are only written by the
+ * vcore that owns the struct. */
+struct pth_vcore_sched {
+	struct spin_pdr_lock		lock;
+	struct pthread_queue		ready_queue;
+	struct pthread_queue		active_queue;
+	unsigned int				nr_ready;
+	unsigned int				nr_active;
+	uint32_t					rand_state;
+	unsigned long				nr_steals;		/* threads we stole */
+	unsigned long				nr_migrations;	/* ran threads from elsewhere */
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 /* Per-vcore data structures to manage syscalls.  The ev_q is where we tell the
  * kernel to signal us.  We don't need a lock since this is per-vcore and
  * accessed in vcore context. */
@@ -136,6 +153,7 @@ typedef dtls_key_t pthread_key_t;
 void pthread_need_tls(bool need);			/* default is TRUE */
 void pthread_mcp_init(void);
 void __pthread_generic_yield(struct pthread_tcb *pthread);
+void pthread_print_sched_stats(void);
 
 /* Profiling alarms for pthreads.  (profalarm.c) */
 void enable_profalarm(uint64_t usecs);
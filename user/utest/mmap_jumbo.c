@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <utest/utest.h>
+#include <parlib/parlib.h>
+
+TEST_SUITE("MMAP JUMBO");
+
+/* <--- Begin definition of test cases ---> */
+
+/* These only check that MAP_JUMBO memory behaves like memory.  The mmap_jumbo
+ * ktest checks that it is actually mapped with jumbo PTEs. */
+
+/* Enough for at least two aligned jumbos, wherever the mmap lands */
+#define JUMBO_MAP_SZ			(3 * JPGSIZE)
+
+static void fill_pattern(char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i += PGSIZE)
+		*(unsigned long*)(buf + i) = i;
+}
+
+static bool check_pattern(char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i += PGSIZE) {
+		if (*(unsigned long*)(buf + i) != i)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static char *map_jumbo(int extra_flags)
+{
+	char *buf = mmap(0, JUMBO_MAP_SZ, PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_JUMBO | extra_flags,
+	                 -1, 0);
+
+	return buf == MAP_FAILED ? NULL : buf;
+}
+
+bool test_fault(void)
+{
+	char *buf = map_jumbo(0);
+
+	UT_ASSERT(buf);
+	/* Fresh memory is zeroed, jumbo or not */
+	for (size_t i = 0; i < JUMBO_MAP_SZ; i += PGSIZE)
+		UT_ASSERT(buf[i] == 0);
+	fill_pattern(buf, JUMBO_MAP_SZ);
+	UT_ASSERT(check_pattern(buf, JUMBO_MAP_SZ));
+	UT_ASSERT(!munmap(buf, JUMBO_MAP_SZ));
+	return TRUE;
+}
+
+bool test_populate(void)
+{
+	char *buf = map_jumbo(MAP_POPULATE);
+
+	UT_ASSERT(buf);
+	fill_pattern(buf, JUMBO_MAP_SZ);
+	UT_ASSERT(check_pattern(buf, JUMBO_MAP_SZ));
+	UT_ASSERT(!munmap(buf, JUMBO_MAP_SZ));
+	return TRUE;
+}
+
+/* Unmapping and mprotecting part of a jumbo splits it.  The rest of the jumbo
+ * must keep its contents. */
+bool test_split(void)
+{
+	char *buf = map_jumbo(MAP_POPULATE);
+	char *jumbo;
+	size_t off;
+
+	UT_ASSERT(buf);
+	fill_pattern(buf, JUMBO_MAP_SZ);
+	jumbo = (char*)ROUNDUP((uintptr_t)buf, JPGSIZE);
+	off = jumbo - buf;
+	UT_ASSERT(!munmap(jumbo + PGSIZE, PGSIZE));
+	UT_ASSERT(!mprotect(jumbo + 2 * PGSIZE, PGSIZE, PROT_READ));
+	UT_ASSERT(*(unsigned long*)jumbo == off);
+	UT_ASSERT(*(unsigned long*)(jumbo + 2 * PGSIZE) == off + 2 * PGSIZE);
+	UT_ASSERT(check_pattern(buf, off));
+	for (size_t i = off + 3 * PGSIZE; i < JUMBO_MAP_SZ; i += PGSIZE)
+		UT_ASSERT(*(unsigned long*)(buf + i) == i);
+	UT_ASSERT(!munmap(buf, JUMBO_MAP_SZ));
+	return TRUE;
+}
+
+bool test_fork(void)
+{
+	char *buf = map_jumbo(MAP_POPULATE);
+	pid_t pid;
+	int status;
+
+	UT_ASSERT(buf);
+	fill_pattern(buf, JUMBO_MAP_SZ);
+	pid = fork();
+	UT_ASSERT(pid >= 0);
+	if (!pid) {
+		if (!check_pattern(buf, JUMBO_MAP_SZ))
+			exit(1);
+		/* The child's copy is its own */
+		memset(buf, 0xff, JUMBO_MAP_SZ);
+		exit(0);
+	}
+	UT_ASSERT(waitpid(pid, &status, 0) == pid);
+	UT_ASSERT(WIFEXITED(status) && !WEXITSTATUS(status));
+	UT_ASSERT(check_pattern(buf, JUMBO_MAP_SZ));
+	UT_ASSERT(!munmap(buf, JUMBO_MAP_SZ));
+	return TRUE;
+}
+
+/* <--- End definition of test cases ---> */
+
+struct utest utests[] = {
+	UTEST_REG(fault),
+	UTEST_REG(populate),
+	UTEST_REG(split),
+	UTEST_REG(fork),
+};
+int num_utests = sizeof(utests) / sizeof(struct utest);
+
+int main(int argc, char *argv[])
+{
+	char **whitelist = &argv[1];
+	int whitelist_len = argc - 1;
+
+	/* Stay an SCP, so we can fork */
+	RUN_TEST_SUITE(utests, num_utests, whitelist, whitelist_len);
+}
@@ -5,11 +5,16 @@
 #define _GNU_SOURCE
 #include <utest/utest.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
+#include <parlib/event.h>
+#include <parlib/uthread.h>
+#include <iplib/iplib.h>
 
 
 TEST_SUITE("QIO");
@@ -69,11 +74,194 @@ bool test_partial_write_to_full_queue(void)
 	return TRUE;
 }
 
+/* Bigger than the kernel's Zcminwrite, smaller than a pipe's limit */
+#define ZC_BUF_SZ			(32 * 1024)
+
+struct zc_pipe {
+	int data_fd;
+	int data1_fd;
+	struct event_queue *ev_q;
+};
+
+static bool zc_pipe_open(struct zc_pipe *zp)
+{
+	char cmd[64];
+	int dir_fd, ctl_fd, ret;
+
+	zp->ev_q = get_eventq(EV_MBOX_UCQ);
+	dir_fd = open("#pipe", O_PATH);
+	UT_ASSERT_FMT("open #pipe failed", dir_fd >= 0);
+	ctl_fd = openat(dir_fd, "ctl", O_RDWR);
+	UT_ASSERT_FMT("open ctl failed", ctl_fd >= 0);
+	ret = snprintf(cmd, sizeof(cmd), "zerocopy %p", zp->ev_q);
+	UT_ASSERT_FMT("zerocopy ctl failed, errno %d",
+	              write(ctl_fd, cmd, ret) == ret, errno);
+	close(ctl_fd);
+	zp->data_fd = openat(dir_fd, "data", O_RDWR);
+	zp->data1_fd = openat(dir_fd, "data1", O_RDWR);
+	UT_ASSERT_FMT("open data failed", zp->data_fd >= 0 && zp->data1_fd >= 0);
+	close(dir_fd);
+	return TRUE;
+}
+
+static void zc_pipe_close(struct zc_pipe *zp)
+{
+	close(zp->data_fd);
+	close(zp->data1_fd);
+	put_eventq(zp->ev_q);
+}
+
+/* Completions are sent shortly after the kernel lets go of the buffer */
+static bool zc_wait_msg(struct event_queue *ev_q, struct event_msg *msg)
+{
+	for (int i = 0; i < 1000; i++) {
+		if (extract_one_mbox_msg(ev_q->ev_mbox, msg))
+			return TRUE;
+		uthread_usleep(1000);
+	}
+	return FALSE;
+}
+
+static char *zc_buf_alloc(void)
+{
+	char *buf = mmap(0, ZC_BUF_SZ, PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+	if (buf == MAP_FAILED)
+		return NULL;
+	for (int i = 0; i < ZC_BUF_SZ; i++)
+		buf[i] = i * 7;
+	return buf;
+}
+
+static bool zc_check_read(int fd)
+{
+	char rbuf[ZC_BUF_SZ];
+	ssize_t ret, sofar = 0;
+
+	while (sofar < ZC_BUF_SZ) {
+		ret = read(fd, rbuf + sofar, ZC_BUF_SZ - sofar);
+		if (ret <= 0)
+			return FALSE;
+		sofar += ret;
+	}
+	for (int i = 0; i < ZC_BUF_SZ; i++) {
+		if (rbuf[i] != (char)(i * 7))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* The pipe holds on to the writer's pages until the reader is done, and then
+ * tells us the buffer is ours again. */
+bool test_zerocopy_pipe(void)
+{
+	struct zc_pipe zp;
+	struct event_msg msg;
+	char *buf = zc_buf_alloc();
+
+	UT_ASSERT_FMT("buf alloc failed", buf);
+	UT_ASSERT(zc_pipe_open(&zp));
+	UT_ASSERT_FMT("write failed, errno %d",
+	              write(zp.data1_fd, buf, ZC_BUF_SZ) == ZC_BUF_SZ, errno);
+	UT_ASSERT_FMT("Got a completion before the read",
+	              !extract_one_mbox_msg(zp.ev_q->ev_mbox, &msg));
+	UT_ASSERT_FMT("Read back the wrong data", zc_check_read(zp.data_fd));
+	UT_ASSERT_FMT("No completion", zc_wait_msg(zp.ev_q, &msg));
+	UT_ASSERT_FMT("Bad completion type %d", msg.ev_type == EV_ZEROCOPY,
+	              msg.ev_type);
+	UT_ASSERT_FMT("Completion for %p, %llu bytes",
+	              msg.ev_arg3 == buf && msg.ev_arg4 == ZC_BUF_SZ,
+	              msg.ev_arg3, msg.ev_arg4);
+	UT_ASSERT_FMT("The kernel copied the buffer", !msg.ev_arg1);
+	zc_pipe_close(&zp);
+	munmap(buf, ZC_BUF_SZ);
+	return TRUE;
+}
+
+/* Unmapping a lent buffer doesn't free the pages out from under the reader. */
+bool test_zerocopy_munmap(void)
+{
+	struct zc_pipe zp;
+	struct event_msg msg;
+	char *buf = zc_buf_alloc();
+	char *churn;
+
+	UT_ASSERT_FMT("buf alloc failed", buf);
+	UT_ASSERT(zc_pipe_open(&zp));
+	UT_ASSERT_FMT("write failed, errno %d",
+	              write(zp.data1_fd, buf, ZC_BUF_SZ) == ZC_BUF_SZ, errno);
+	UT_ASSERT(!munmap(buf, ZC_BUF_SZ));
+	/* Churn through some memory, in case the pages were freed */
+	churn = zc_buf_alloc();
+	memset(churn, 0xff, ZC_BUF_SZ);
+	munmap(churn, ZC_BUF_SZ);
+	UT_ASSERT_FMT("Read back the wrong data", zc_check_read(zp.data_fd));
+	UT_ASSERT_FMT("No completion", zc_wait_msg(zp.ev_q, &msg));
+	zc_pipe_close(&zp);
+	return TRUE;
+}
+
+/* Zero-copy is set on a conversation's write queue.  A closed conversation is
+ * reused by the next clone, which must not inherit zero-copy: the new user
+ * didn't ask for it and may reuse its buffers right away. */
+bool test_zerocopy_conv_reuse(void)
+{
+	struct event_queue *ev_q = get_eventq(EV_MBOX_UCQ);
+	struct event_msg msg;
+	char adir[NETPATHLEN], ldir[NETPATHLEN], ddir[NETPATHLEN];
+	char dialstr[64], cmd[64], conv_nr[16];
+	char *buf = zc_buf_alloc();
+	int afd, lcfd, lfd, cfd, dfd, ctl_fd, ret;
+	uint16_t port;
+
+	UT_ASSERT_FMT("buf alloc failed", buf);
+	afd = announce9("tcp!*!0", adir, 0);
+	UT_ASSERT_FMT("announce failed, errno %d", afd >= 0, errno);
+	UT_ASSERT_FMT("No port for %s", get_port9(adir, "local", &port), adir);
+	/* Turn on zero-copy for a conv, then close it without using it */
+	ctl_fd = open("/net/tcp/clone", O_RDWR);
+	UT_ASSERT_FMT("clone failed, errno %d", ctl_fd >= 0, errno);
+	ret = read(ctl_fd, conv_nr, sizeof(conv_nr) - 1);
+	UT_ASSERT_FMT("read conv nr failed, errno %d", ret > 0, errno);
+	conv_nr[ret] = 0;
+	ret = snprintf(cmd, sizeof(cmd), "zerocopy %p", ev_q);
+	UT_ASSERT_FMT("zerocopy ctl failed, errno %d",
+	              write(ctl_fd, cmd, ret) == ret, errno);
+	close(ctl_fd);
+	/* The dial gets the lowest free conv, which is the one we just closed */
+	snprintf(dialstr, sizeof(dialstr), "tcp!127.0.0.1!%d", port);
+	dfd = dial9(dialstr, 0, ddir, &cfd, 0);
+	UT_ASSERT_FMT("dial failed, errno %d", dfd >= 0, errno);
+	UT_ASSERT_FMT("Dialed %s, not conv %s", !strcmp(strrchr(ddir, '/') + 1,
+	                                                conv_nr), ddir, conv_nr);
+	lcfd = listen9(adir, ldir, 0);
+	UT_ASSERT_FMT("listen failed, errno %d", lcfd >= 0, errno);
+	lfd = accept9(lcfd, ldir);
+	UT_ASSERT_FMT("accept failed, errno %d", lfd >= 0, errno);
+	UT_ASSERT_FMT("write failed, errno %d",
+	              write(dfd, buf, ZC_BUF_SZ) == ZC_BUF_SZ, errno);
+	UT_ASSERT_FMT("Read back the wrong data", zc_check_read(lfd));
+	/* By now, a zero-copy write would have been ACKed and completed */
+	UT_ASSERT_FMT("Reused conv was still zero-copy",
+	              !zc_wait_msg(ev_q, &msg));
+	close(lfd);
+	close(lcfd);
+	close(dfd);
+	close(cfd);
+	close(afd);
+	put_eventq(ev_q);
+	munmap(buf, ZC_BUF_SZ);
+	return TRUE;
+}
 
 /* <--- End definition of test cases ---> */
 
 struct utest utests[] = {
 	UTEST_REG(partial_write_to_full_queue),
+	UTEST_REG(zerocopy_pipe),
+	UTEST_REG(zerocopy_munmap),
+	UTEST_REG(zerocopy_conv_reuse),
 };
 int num_utests = sizeof(utests) / sizeof(struct utest);
 
@@ -0,0 +1,194 @@
+#include <utest/utest.h>
+#include <parlib/slab.h>
+#include <parlib/uthread.h>
+#include <parlib/timing.h>
+#include <parlib/tsc-compat.h>
+#include <pthread.h>
+#include <stdio.h>
+
+TEST_SUITE("SLAB");
+
+/* <--- Begin definition of test cases ---> */
+
+#define OBJ_MAGIC			0xcafebabe
+/* Enough to go through several magazines and the depot */
+#define NR_OBJS				(4 * KMC_MAG_MAX_SZ)
+#define NR_THREADS			8
+#define BENCH_LOOPS			100000
+#define BENCH_BATCH			16
+
+struct test_obj {
+	unsigned long				magic;
+	unsigned long				owner;
+	char						pad[48];
+};
+
+static atomic_t nr_ctors;
+
+static int test_obj_ctor(void *obj, void *priv, int flags)
+{
+	struct test_obj *to = obj;
+
+	to->magic = OBJ_MAGIC;
+	to->owner = 0;
+	atomic_inc(&nr_ctors);
+	return 0;
+}
+
+static struct kmem_cache *test_cache_create(void)
+{
+	atomic_init(&nr_ctors, 0);
+	return kmem_cache_create("test_objs", sizeof(struct test_obj),
+	                         __alignof__(struct test_obj), 0, test_obj_ctor,
+	                         NULL, NULL);
+}
+
+/* Objects come back constructed, and freed objects are reused from the
+ * magazines instead of being constructed again. */
+bool test_alloc_free(void)
+{
+	struct kmem_cache *kc = test_cache_create();
+	struct test_obj *objs[NR_OBJS];
+	long ctors;
+
+	/* Stay on this vcore, so the freed objects are in our magazines */
+	uth_disable_notifs();
+	for (int i = 0; i < NR_OBJS; i++) {
+		objs[i] = kmem_cache_alloc(kc, 0);
+		UT_ASSERT(objs[i], uth_enable_notifs());
+		UT_ASSERT(objs[i]->magic == OBJ_MAGIC, uth_enable_notifs());
+		for (int j = 0; j < i; j++)
+			UT_ASSERT(objs[i] != objs[j], uth_enable_notifs());
+	}
+	ctors = atomic_read(&nr_ctors);
+	for (int i = 0; i < NR_OBJS; i++)
+		kmem_cache_free(kc, objs[i]);
+	for (int i = 0; i < NR_OBJS; i++) {
+		objs[i] = kmem_cache_alloc(kc, 0);
+		UT_ASSERT(objs[i]->magic == OBJ_MAGIC, uth_enable_notifs());
+	}
+	uth_enable_notifs();
+	UT_ASSERT(atomic_read(&nr_ctors) == ctors);
+	for (int i = 0; i < NR_OBJS; i++)
+		kmem_cache_free(kc, objs[i]);
+	kmem_cache_destroy(kc);
+	return TRUE;
+}
+
+struct slab_thread_args {
+	struct kmem_cache			*kc;
+	unsigned long				id;
+	unsigned int				nr_loops;
+	bool						check;
+	uint64_t					nsec;
+};
+
+static volatile bool go;
+
+static void *slab_thread(void *arg)
+{
+	struct slab_thread_args *args = arg;
+	struct test_obj *objs[BENCH_BATCH];
+	uint64_t start;
+	bool ok = TRUE;
+
+	while (!go)
+		cpu_relax();
+	start = read_tsc();
+	for (int i = 0; i < args->nr_loops; i++) {
+		for (int j = 0; j < BENCH_BATCH; j++) {
+			objs[j] = kmem_cache_alloc(args->kc, 0);
+			if (args->check) {
+				ok &= objs[j]->magic == OBJ_MAGIC && !objs[j]->owner;
+				objs[j]->owner = args->id;
+			}
+		}
+		for (int j = 0; j < BENCH_BATCH; j++) {
+			if (args->check) {
+				ok &= objs[j]->owner == args->id;
+				objs[j]->owner = 0;
+			}
+			kmem_cache_free(args->kc, objs[j]);
+		}
+		/* Mix things up, so that threads move between vcores */
+		if (!(i % 64))
+			pthread_yield();
+	}
+	args->nsec = tsc2nsec(read_tsc() - start);
+	return ok ? (void*)1 : NULL;
+}
+
+static bool run_slab_threads(struct kmem_cache *kc, int nr_threads,
+                             unsigned int nr_loops, bool check,
+                             uint64_t *max_nsec)
+{
+	pthread_t threads[nr_threads];
+	struct slab_thread_args args[nr_threads];
+	void *ret;
+	bool ok = TRUE;
+
+	go = FALSE;
+	for (int i = 0; i < nr_threads; i++) {
+		args[i].kc = kc;
+		args[i].id = i + 1;
+		args[i].nr_loops = nr_loops;
+		args[i].check = check;
+		if (pthread_create(&threads[i], NULL, slab_thread, &args[i]))
+			return FALSE;
+	}
+	go = TRUE;
+	*max_nsec = 0;
+	for (int i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], &ret);
+		ok &= ret != NULL;
+		*max_nsec = MAX(*max_nsec, args[i].nsec);
+	}
+	return ok;
+}
+
+/* No object is handed to two threads at once, even as threads and objects move
+ * between vcores. */
+bool test_many_vcores(void)
+{
+	struct kmem_cache *kc = test_cache_create();
+	uint64_t nsec;
+
+	UT_ASSERT(run_slab_threads(kc, NR_THREADS, BENCH_LOOPS / 10, TRUE, &nsec));
+	UT_ASSERT(kc->nr_cur_alloc <= atomic_read(&nr_ctors));
+	kmem_cache_destroy(kc);
+	return TRUE;
+}
+
+/* Not much of a test: reports alloc/free throughput as we add threads. */
+bool test_bench(void)
+{
+	struct kmem_cache *kc = test_cache_create();
+	uint64_t nsec, nr_ops;
+
+	for (int i = 1; i <= NR_THREADS; i *= 2) {
+		UT_ASSERT(run_slab_threads(kc, i, BENCH_LOOPS, FALSE, &nsec));
+		nr_ops = (uint64_t)i * BENCH_LOOPS * BENCH_BATCH * 2;
+		printf("\t%d threads, %d vcores: %llu nsec, %llu Mops/sec\n", i,
+		       num_vcores(), nsec, nsec ? nr_ops * 1000 / nsec : 0);
+	}
+	kmem_cache_destroy(kc);
+	return TRUE;
+}
+
+/* <--- End definition of test cases ---> */
+
+struct utest utests[] = {
+	UTEST_REG(alloc_free),
+	UTEST_REG(many_vcores),
+	UTEST_REG(bench),
+};
+int num_utests = sizeof(utests) / sizeof(struct utest);
+
+int main(int argc, char *argv[])
+{
+	char **whitelist = &argv[1];
+	int whitelist_len = argc - 1;
+
+	pthread_mcp_init();
+	RUN_TEST_SUITE(utests, num_utests, whitelist, whitelist_len);
+}
@@ -16,6 +16,7 @@
 #include <parlib/arch/trap.h>
 #include <parlib/ros_debug.h>
 #include <parlib/vcore_tick.h>
+#include <parlib/vcore_idle.h>
 #include <parlib/slab.h>
 
 int vmm_sched_period_usec = 1000;
@@ -293,6 +294,12 @@ static struct vmm_thread *sched_pick_thread_nice(void)
 	return vth;
 }
 
+/* Idle-spin callback: racy peek at the runnable queues */
+static bool vmm_has_work(void *arg)
+{
+	return !TAILQ_EMPTY(&rnbl_tasks) || !TAILQ_EMPTY(&rnbl_guests);
+}
+
 static void __attribute__((noreturn)) vmm_sched_entry(void)
 {
 	struct vmm_thread *vth;
@@ -302,7 +309,7 @@ static void __attribute__((noreturn)) vmm_sched_entry(void)
 	else
 		vth = sched_pick_thread_nice();
 	if (!vth)
-		vcore_yield_or_restart();
+		vcore_idle_or_restart(vmm_has_work, NULL);
 	stats_run_vth(vth);
 	run_uthread((struct uthread*)vth);
 }